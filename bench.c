@@ -0,0 +1,906 @@
+/*
+    _                _      _  _____  ____   __  __  ____        _____
+   / \    _ __  ___ | |__  (_)|_   _|/ ___| |  \/  || __ )   ___|_   _|
+  / _ \  | '__|/ __|| '_ \ | |  | |  \___ \ | |\/| ||  _ \  / _ \ | |
+ / ___ \ | |  | (__ | | | || |  | |   ___) || |  | || |_) || (_) || |
+/_/   \_\|_|   \___||_| |_||_|  |_|  |____/ |_|  |_||____/  \___/ |_|
+
+Copyright 2015 Łukasz "JustArchi" Domeradzki
+Contact: JustArchi@JustArchi.net
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Standalone benchmark harness for ArchiTSMBot, built by bench.sh
+ *
+ * plugin.c is linked directly into this binary and driven through the regular ts3plugin_* entry points,
+ * with a stub TS3Functions table that captures every sent message in memory instead of a live TS3 client.
+ * The same binary acts as a fake "mpc" when invoked under that name, serving a synthetic library
+ * of configurable size, so no MPD, audio or network is required.
+ * With -m, real mpc is used instead, talking to mock MPD daemon (mpdmock.c) started on a socket inside the sandbox.
+ *
+ * Usage: ./architsmbot_bench [-t tracks] [-n iterations] [-m architsmbot_mpdmock] [-k] [-r] [-v] [-c "!command"]...
+ * With -k the sandbox (plugin path with favs, metrics.prom, trace.json...) is kept for inspection.
+ * With -r the plugin is restarted at the end, to see how long it takes to come back with everything it saved.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "public_definitions.h"
+#include "public_rare_definitions.h"
+#include "public_errors.h"
+#include "public_errors_rare.h"
+#include "ts3_functions.h"
+#include "plugin.h"
+
+#define BENCH_SERVER_CONNECTION_HANDLER_ID 1
+#define BENCH_CHANNEL_ID 1
+#define BENCH_BOT_ID 1
+#define BENCH_USER_ID 2
+#define BENCH_USER_NAME "BenchUser"
+#define BENCH_USER_UID "BenchUserUniqueIdentifier00="
+#define BENCH_ROOT_GROUP "90521" // Must match rootGroup in plugin.c
+
+#define BENCH_DEFAULT_TRACKS 10000
+#define BENCH_DEFAULT_ITERATIONS 20
+#define BENCH_WARMUP_TIMEOUT 120 // Seconds to wait for plugin's cache warm-up
+
+// Commands that are safe to repeat against the synthetic library, in the same order as in ts3plugin_onTextMessageEvent()
+static const char* defaultCommands[] = {
+	"!artist Kor", "!artists", "!artists Kor", "!fav", "!favs", "!file", "!file Title 1",
+	"!files", "!files Title 1", "!fixfavs", "!guess Kor", "!next", "!pause", "!perf", "!play", "!play 1",
+	"!playfavs", "!playfile Title 1", "!playsong Title 1", "!playtheme chill", "!prev", "!random",
+	"!randomfav", "!reset", "!shuffle", "!song", "!song Title 1", "!songs", "!songs Title 1",
+	"!stats", "!status", "!theme", "!themes", "!version", "!vol-", "!vol+", "!unfav",
+	NULL
+};
+
+/*********************************** Counters ************************************/
+
+static bool benchCounting = false;
+static unsigned long benchAllocations = 0;
+static unsigned long benchForks = 0;
+static unsigned long benchMessages = 0;
+static unsigned long benchMessageBytes = 0;
+static bool benchVerbose = false;
+static bool benchWarmedUp = false;
+static char benchWarmupMessage[256];
+
+static inline void benchCount(unsigned long* counter) {
+	if (__atomic_load_n(&benchCounting, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Allocations are interposed for the whole process, so libc internals (getline(), popen() streams) are counted too
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+	benchCount(&benchAllocations);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+	benchCount(&benchAllocations);
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	benchCount(&benchAllocations);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+	__libc_free(ptr);
+}
+
+// Plugin's threads create processes in parallel, so the cached dlsym() result is shared with atomics
+static void* benchReal(void** cached, const char* name) {
+	void* real = __atomic_load_n(cached, __ATOMIC_ACQUIRE);
+	if (!real) {
+		real = dlsym(RTLD_NEXT, name);
+		__atomic_store_n(cached, real, __ATOMIC_RELEASE);
+	}
+	return real;
+}
+
+// Process creation is interposed by name, plugin.o is linked into this binary so its calls resolve here first
+FILE* popen(const char* command, const char* type) {
+	static void* realPopenCached = NULL;
+	FILE* (*realPopen)(const char*, const char*);
+	*(void**) &realPopen = benchReal(&realPopenCached, "popen"); // POSIX-blessed way of converting dlsym() result
+	benchCount(&benchForks);
+	if (benchVerbose) {
+		fprintf(stderr, "  popen: %s\n", command);
+	}
+	return realPopen(command, type);
+}
+
+pid_t fork(void) {
+	static void* realForkCached = NULL;
+	pid_t (*realFork)(void);
+	*(void**) &realFork = benchReal(&realForkCached, "fork");
+	benchCount(&benchForks);
+	return realFork();
+}
+
+int posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* fileActions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]) {
+	static void* realPosixSpawnCached = NULL;
+	int (*realPosixSpawn)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char* const[], char* const[]);
+	*(void**) &realPosixSpawn = benchReal(&realPosixSpawnCached, "posix_spawn");
+	benchCount(&benchForks);
+	return realPosixSpawn(pid, path, fileActions, attrp, argv, envp);
+}
+
+int posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* fileActions, const posix_spawnattr_t* attrp, char* const argv[], char* const envp[]) {
+	static void* realPosixSpawnpCached = NULL;
+	int (*realPosixSpawnp)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char* const[], char* const[]);
+	*(void**) &realPosixSpawnp = benchReal(&realPosixSpawnpCached, "posix_spawnp");
+	benchCount(&benchForks);
+	return realPosixSpawnp(pid, file, fileActions, attrp, argv, envp);
+}
+
+// Syscalls are counted with the raw_syscalls:sys_enter tracepoint, inherited by children, if the kernel lets us
+static int openSyscallCounter(void) {
+	static const char* idPaths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+		NULL
+	};
+	unsigned long long id = 0;
+	bool found = false;
+	for (unsigned int i = 0; idPaths[i] && !found; ++i) {
+		FILE* stream = fopen(idPaths[i], "r");
+		if (stream) {
+			found = fscanf(stream, "%llu", &id) == 1;
+			fclose(stream);
+		}
+	}
+	if (!found) {
+		return -1;
+	}
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*********************************** Stub TS3Functions ************************************/
+
+static char benchPluginPath[PATH_MAX];
+
+static unsigned int stubFreeMemory(void* pointer) {
+	free(pointer);
+	return ERROR_ok;
+}
+
+static unsigned int stubLogMessage(const char* logMessage, enum LogLevel severity, const char* channel, uint64 logID) {
+	if (benchVerbose) {
+		fprintf(stderr, "  log: %s\n", logMessage);
+	}
+	if (strncmp(logMessage, "Warm-up done", 12) == 0) {
+		snprintf(benchWarmupMessage, sizeof(benchWarmupMessage), "%s", logMessage);
+		__atomic_store_n(&benchWarmedUp, true, __ATOMIC_RELEASE);
+	}
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientID(uint64 serverConnectionHandlerID, anyID* result) {
+	*result = BENCH_BOT_ID;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetChannelOfClient(uint64 serverConnectionHandlerID, anyID clientID, uint64* result) {
+	*result = BENCH_CHANNEL_ID;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientList(uint64 serverConnectionHandlerID, anyID** result) {
+	anyID* clients = (anyID*) malloc(3 * sizeof(anyID));
+	if (!clients) {
+		return ERROR_undefined;
+	}
+	clients[0] = BENCH_BOT_ID;
+	clients[1] = BENCH_USER_ID;
+	clients[2] = 0;
+	*result = clients;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientVariableAsString(uint64 serverConnectionHandlerID, anyID clientID, size_t flag, char** result) {
+	if (flag == CLIENT_SERVERGROUPS) {
+		*result = strdup(BENCH_ROOT_GROUP);
+	} else if (flag == CLIENT_NICKNAME) {
+		*result = strdup(clientID == BENCH_BOT_ID ? "ArchiTSMBot" : BENCH_USER_NAME);
+	} else if (flag == CLIENT_UNIQUE_IDENTIFIER) {
+		*result = strdup(clientID == BENCH_BOT_ID ? "" : BENCH_USER_UID);
+	} else {
+		*result = strdup("");
+	}
+	return *result ? ERROR_ok : ERROR_undefined;
+}
+
+static unsigned int stubGetClientVariableAsInt(uint64 serverConnectionHandlerID, anyID clientID, size_t flag, int* result) {
+	*result = 0;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientSelfVariableAsString(uint64 serverConnectionHandlerID, size_t flag, char** result) {
+	return stubGetClientVariableAsString(serverConnectionHandlerID, BENCH_BOT_ID, flag, result);
+}
+
+static unsigned int stubSetClientSelfVariableAsInt(uint64 serverConnectionHandlerID, size_t flag, int value) {
+	return ERROR_ok;
+}
+
+static unsigned int stubSetClientSelfVariableAsString(uint64 serverConnectionHandlerID, size_t flag, const char* value) {
+	return ERROR_ok;
+}
+
+static unsigned int stubFlushClientSelfUpdates(uint64 serverConnectionHandlerID, const char* returnCode) {
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestClientPoke(uint64 serverConnectionHandlerID, anyID clientID, const char* message, const char* returnCode) {
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestSendChannelTextMsg(uint64 serverConnectionHandlerID, const char* message, uint64 targetChannelID, const char* returnCode) {
+	__atomic_add_fetch(&benchMessages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&benchMessageBytes, strlen(message), __ATOMIC_RELAXED);
+	if (benchVerbose) {
+		fprintf(stderr, "  channel: %s\n", message);
+	}
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestSendPrivateTextMsg(uint64 serverConnectionHandlerID, const char* message, anyID targetClientID, const char* returnCode) {
+	return stubRequestSendChannelTextMsg(serverConnectionHandlerID, message, 0, returnCode);
+}
+
+static void stubGetPluginPath(char* path, size_t maxLen) {
+	snprintf(path, maxLen, "%s", benchPluginPath);
+}
+
+static struct TS3Functions stubFunctions(void) {
+	struct TS3Functions funcs;
+	memset(&funcs, 0, sizeof(funcs));
+	funcs.freeMemory = stubFreeMemory;
+	funcs.logMessage = stubLogMessage;
+	funcs.getClientID = stubGetClientID;
+	funcs.getChannelOfClient = stubGetChannelOfClient;
+	funcs.getClientList = stubGetClientList;
+	funcs.getClientVariableAsString = stubGetClientVariableAsString;
+	funcs.getClientVariableAsInt = stubGetClientVariableAsInt;
+	funcs.getClientSelfVariableAsString = stubGetClientSelfVariableAsString;
+	funcs.setClientSelfVariableAsInt = stubSetClientSelfVariableAsInt;
+	funcs.setClientSelfVariableAsString = stubSetClientSelfVariableAsString;
+	funcs.flushClientSelfUpdates = stubFlushClientSelfUpdates;
+	funcs.requestClientPoke = stubRequestClientPoke;
+	funcs.requestSendChannelTextMsg = stubRequestSendChannelTextMsg;
+	funcs.requestSendPrivateTextMsg = stubRequestSendPrivateTextMsg;
+	funcs.getPluginPath = stubGetPluginPath;
+	return funcs;
+}
+
+/*********************************** Fake mpc ************************************/
+
+/*
+ * Synthetic library, generated deterministically from the track number, so every fake mpc process sees the same one.
+ * Tracks of one artist are contiguous, which keeps "mpc add <directory>" a simple range scan.
+ */
+
+#define FAKE_TRACKS_PER_ARTIST 120
+#define FAKE_TRACKS_PER_ALBUM 12
+#define FAKE_QUEUE_FILE "queue"
+
+static const char* fakeWords[] = {
+	"Kor", "Łódź", "Metal", "Zażółć", "Night", "Gęślą", "River", "Jaźń", "Storm", "Echo",
+	"Blue", "Północ", "Fire", "Sen", "Glass", "Wiatr"
+};
+#define FAKE_WORDS (sizeof(fakeWords) / sizeof(fakeWords[0]))
+
+static const char* fakeThemes[] = { "chill", "rock", "party", "sad", "workout" };
+#define FAKE_THEMES (sizeof(fakeThemes) / sizeof(fakeThemes[0]))
+
+struct fakeTrack {
+	char file[256];
+	char artist[64];
+	char album[64];
+	char title[64];
+	char comment[32];
+	char time[8];
+};
+
+struct fakeState {
+	unsigned long pos;
+	bool playing, random, repeat, single, consume;
+	int volume;
+	unsigned long* queue;
+	unsigned long queueLength, queueCapacity;
+};
+
+static unsigned long fakeTracks = BENCH_DEFAULT_TRACKS;
+static char fakeStatePath[PATH_MAX];
+
+static void fakeArtistName(char* buffer, size_t size, const unsigned long artist) {
+	snprintf(buffer, size, "%s %s %lu", fakeWords[artist % FAKE_WORDS], fakeWords[(artist / FAKE_WORDS) % FAKE_WORDS], artist);
+}
+
+static void fakeTrackInfo(struct fakeTrack* track, const unsigned long i) {
+	const unsigned long artist = i / FAKE_TRACKS_PER_ARTIST;
+	const unsigned long album = (i % FAKE_TRACKS_PER_ARTIST) / FAKE_TRACKS_PER_ALBUM;
+	const unsigned long number = i % FAKE_TRACKS_PER_ALBUM + 1;
+	fakeArtistName(track->artist, sizeof(track->artist), artist);
+	snprintf(track->album, sizeof(track->album), "%s %lu", fakeWords[(artist + album) % FAKE_WORDS], album + 1);
+	snprintf(track->title, sizeof(track->title), "%s Title %lu", fakeWords[(i * 7) % FAKE_WORDS], i);
+	if (i % 7 == 0) {
+		snprintf(track->comment, sizeof(track->comment), "Theme:%s", fakeThemes[(i / 7) % FAKE_THEMES]);
+	} else {
+		track->comment[0] = '\0';
+	}
+	const unsigned long seconds = 120 + (i * 37) % 240;
+	snprintf(track->time, sizeof(track->time), "%lu:%02lu", seconds / 60, seconds % 60);
+	snprintf(track->file, sizeof(track->file), "%s/%s/%02lu - %s.mp3", track->artist, track->album, number, track->title);
+}
+
+static void fakePrintFormatted(const char* format, const struct fakeTrack* track) {
+	for (const char* p = format; *p; ++p) {
+		if (*p == '%') {
+			const char* end = strchr(p + 1, '%');
+			if (end) {
+				const size_t len = end - p - 1;
+				const char* value = NULL;
+				if (len == 4 && strncmp(p + 1, "file", len) == 0) {
+					value = track->file;
+				} else if (len == 6 && strncmp(p + 1, "artist", len) == 0) {
+					value = track->artist;
+				} else if (len == 5 && strncmp(p + 1, "album", len) == 0) {
+					value = track->album;
+				} else if (len == 5 && strncmp(p + 1, "title", len) == 0) {
+					value = track->title;
+				} else if (len == 7 && strncmp(p + 1, "comment", len) == 0) {
+					value = track->comment;
+				} else if (len == 4 && strncmp(p + 1, "time", len) == 0) {
+					value = track->time;
+				}
+				if (value) {
+					fputs(value, stdout);
+				}
+				p = end;
+				continue;
+			}
+		}
+		putchar(*p);
+	}
+	putchar('\n');
+}
+
+static void fakeQueuePush(struct fakeState* state, const unsigned long track) {
+	if (state->queueLength == state->queueCapacity) {
+		state->queueCapacity = state->queueCapacity ? state->queueCapacity * 2 : 256;
+		state->queue = (unsigned long*) realloc(state->queue, state->queueCapacity * sizeof(unsigned long));
+		if (!state->queue) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	state->queue[state->queueLength++] = track;
+}
+
+static void fakeLoadState(struct fakeState* state) {
+	memset(state, 0, sizeof(*state));
+	state->volume = 50;
+	FILE* stream = fopen(fakeStatePath, "r");
+	if (!stream) {
+		return;
+	}
+	int playing = 0, random = 0, repeat = 0, single = 0, consume = 0;
+	if (fscanf(stream, "%lu %d %d %d %d %d %d", &state->pos, &playing, &random, &repeat, &single, &consume, &state->volume) == 7) {
+		state->playing = playing;
+		state->random = random;
+		state->repeat = repeat;
+		state->single = single;
+		state->consume = consume;
+		unsigned long track;
+		while (fscanf(stream, "%lu", &track) == 1) {
+			fakeQueuePush(state, track);
+		}
+	}
+	fclose(stream);
+}
+
+static void fakeSaveState(const struct fakeState* state) {
+	FILE* stream = fopen(fakeStatePath, "w");
+	if (!stream) {
+		perror("fopen");
+		exit(1);
+	}
+	fprintf(stream, "%lu %d %d %d %d %d %d\n", state->pos, state->playing, state->random, state->repeat, state->single, state->consume, state->volume);
+	for (unsigned long i = 0; i < state->queueLength; ++i) {
+		fprintf(stream, "%lu\n", state->queue[i]);
+	}
+	fclose(stream);
+}
+
+static void fakePrintStatus(const struct fakeState* state) {
+	if (state->queueLength > 0 && state->pos < state->queueLength) {
+		struct fakeTrack track;
+		fakeTrackInfo(&track, state->queue[state->pos]);
+		printf("%s - %s\n", track.artist, track.title);
+		printf("[%s] #%lu/%lu   0:00/%s (0%%)\n", state->playing ? "playing" : "paused", state->pos + 1, state->queueLength, track.time);
+	}
+	printf("volume:%3d%%   repeat: %s   random: %s   single: %s   consume: %s\n", state->volume,
+		state->repeat ? "on " : "off", state->random ? "on " : "off", state->single ? "on " : "off", state->consume ? "on " : "off");
+}
+
+static void fakeAdd(struct fakeState* state, const char* path, const bool insert) {
+	const size_t len = strlen(path);
+	unsigned long insertAt = state->queueLength ? state->pos + 1 : 0;
+	unsigned long first = 0, last = fakeTracks;
+	if (len > 0) { // Artist number is the last word of the top-level directory, no need to scan other artists
+		const char* slash = strchr(path, '/');
+		const size_t dirLen = slash ? (size_t) (slash - path) : len;
+		const char* space = memrchr(path, ' ', dirLen);
+		if (space) {
+			first = strtoul(space + 1, NULL, 10) * FAKE_TRACKS_PER_ARTIST;
+			last = first + FAKE_TRACKS_PER_ARTIST < fakeTracks ? first + FAKE_TRACKS_PER_ARTIST : fakeTracks;
+		}
+	}
+	struct fakeTrack track;
+	for (unsigned long i = first; i < last; ++i) {
+		fakeTrackInfo(&track, i);
+		if (len == 0 || (strncmp(track.file, path, len) == 0 && (track.file[len] == '\0' || track.file[len] == '/'))) {
+			fakeQueuePush(state, i);
+			if (insert && insertAt < state->queueLength - 1) {
+				memmove(&state->queue[insertAt + 1], &state->queue[insertAt], (state->queueLength - 1 - insertAt) * sizeof(unsigned long));
+				state->queue[insertAt] = i;
+			}
+			++insertAt;
+		}
+	}
+}
+
+static int fakeMpcMain(int argc, char* argv[]) {
+	const char* format = NULL;
+	int arg = 1;
+	while (arg + 1 < argc && (strcmp(argv[arg], "-f") == 0 || strcmp(argv[arg], "--format") == 0)) {
+		format = argv[arg + 1];
+		arg += 2;
+	}
+	const char* command = arg < argc ? argv[arg++] : "status";
+	// mpc accepts options after the command as well
+	if (arg + 1 < argc && strcmp(argv[arg], "-f") == 0) {
+		format = argv[arg + 1];
+		arg += 2;
+	}
+
+	struct fakeState state;
+	fakeLoadState(&state);
+	struct fakeTrack track;
+	bool save = false;
+	bool status = false;
+
+	if (strcmp(command, "listall") == 0) {
+		for (unsigned long i = 0; i < fakeTracks; ++i) {
+			fakeTrackInfo(&track, i);
+			fakePrintFormatted(format ? format : "%file%", &track);
+		}
+	} else if (strcmp(command, "ls") == 0) {
+		char artist[64];
+		for (unsigned long i = 0; i < fakeTracks; i += FAKE_TRACKS_PER_ARTIST) {
+			fakeArtistName(artist, sizeof(artist), i / FAKE_TRACKS_PER_ARTIST);
+			puts(artist);
+		}
+	} else if (strcmp(command, "add") == 0 || strcmp(command, "insert") == 0) {
+		const bool insert = strcmp(command, "insert") == 0;
+		if (arg < argc) {
+			for (; arg < argc; ++arg) {
+				fakeAdd(&state, argv[arg], insert);
+			}
+		} else {
+			char* line = NULL;
+			size_t len = 0;
+			while (getline(&line, &len, stdin) != -1) {
+				line[strcspn(line, "\r\n")] = 0;
+				if (line[0]) {
+					fakeAdd(&state, line, insert);
+				}
+			}
+			free(line);
+		}
+		save = true;
+	} else if (strcmp(command, "clear") == 0) {
+		state.queueLength = 0;
+		state.pos = 0;
+		state.playing = false;
+		save = status = true;
+	} else if (strcmp(command, "play") == 0) {
+		if (arg < argc) {
+			const unsigned long number = strtoul(argv[arg], NULL, 10);
+			if (number == 0 || number > state.queueLength) {
+				fprintf(stdout, "error: Bad song index\n");
+				return 1;
+			}
+			state.pos = number - 1;
+		}
+		state.playing = state.queueLength > 0;
+		save = status = true;
+	} else if (strcmp(command, "next") == 0 || strcmp(command, "prev") == 0) {
+		if (state.queueLength > 0) {
+			if (strcmp(command, "next") == 0) {
+				state.pos = (state.pos + 1) % state.queueLength;
+			} else {
+				state.pos = state.pos ? state.pos - 1 : state.queueLength - 1;
+			}
+		}
+		save = status = true;
+	} else if (strcmp(command, "toggle") == 0) {
+		state.playing = !state.playing;
+		save = status = true;
+	} else if (strcmp(command, "stop") == 0) {
+		state.playing = false;
+		save = status = true;
+	} else if (strcmp(command, "random") == 0 || strcmp(command, "repeat") == 0 || strcmp(command, "single") == 0 || strcmp(command, "consume") == 0) {
+		bool* flag = command[1] == 'a' ? &state.random : command[2] == 'p' ? &state.repeat : command[0] == 's' ? &state.single : &state.consume;
+		*flag = arg < argc ? strcmp(argv[arg], "on") == 0 : !*flag;
+		save = status = true;
+	} else if (strcmp(command, "shuffle") == 0) {
+		srand(time(NULL));
+		for (unsigned long i = state.queueLength; i > 1; --i) {
+			const unsigned long j = rand() % i;
+			const unsigned long tmp = state.queue[i - 1];
+			state.queue[i - 1] = state.queue[j];
+			state.queue[j] = tmp;
+		}
+		save = status = true;
+	} else if (strcmp(command, "volume") == 0) {
+		if (arg < argc) {
+			const int value = atoi(argv[arg]);
+			state.volume = (argv[arg][0] == '+' || argv[arg][0] == '-') ? state.volume + value : value;
+			state.volume = state.volume < 0 ? 0 : state.volume > 100 ? 100 : state.volume;
+			save = true;
+		}
+		status = true;
+	} else if (strcmp(command, "playlist") == 0) {
+		for (unsigned long i = 0; i < state.queueLength; ++i) {
+			fakeTrackInfo(&track, state.queue[i]);
+			fakePrintFormatted(format ? format : "%artist% - %title%", &track);
+		}
+	} else if (strcmp(command, "current") == 0) {
+		if (arg < argc && strcmp(argv[arg], "--wait") == 0) {
+			sleep(1);
+		}
+		if (state.queueLength > 0 && state.pos < state.queueLength) {
+			fakeTrackInfo(&track, state.queue[state.pos]);
+			fakePrintFormatted(format ? format : "%artist% - %title%", &track);
+		}
+	} else if (strcmp(command, "update") == 0) {
+		printf("Updating DB (#1) ...\n");
+		status = true;
+	} else if (strcmp(command, "stats") == 0) {
+		printf("Artists: %6lu\nAlbums:  %6lu\nSongs:   %6lu\n\nPlay Time:    0 days, 0:00:00\nUptime:       0 days, 0:00:00\nDB Updated:   Thu Jan  1 00:00:00 1970\nDB Play Time: %lu days, 0:00:00\n",
+			(fakeTracks + FAKE_TRACKS_PER_ARTIST - 1) / FAKE_TRACKS_PER_ARTIST, (fakeTracks + FAKE_TRACKS_PER_ALBUM - 1) / FAKE_TRACKS_PER_ALBUM, fakeTracks, fakeTracks * 240 / 86400);
+	} else if (strcmp(command, "version") == 0) {
+		printf("mpd version: 0.19.0\n");
+	} else if (strcmp(command, "status") == 0) {
+		status = true;
+	} else {
+		fprintf(stdout, "error: unknown command \"%s\"\n", command);
+		return 1;
+	}
+
+	if (save) {
+		fakeSaveState(&state);
+	}
+	if (status) {
+		fakePrintStatus(&state);
+	}
+	free(state.queue);
+	return 0;
+}
+
+/*********************************** Harness ************************************/
+
+struct benchResult {
+	const char* command;
+	double p50, p99;
+	double syscalls, forks, allocations, messages;
+	bool syscallsKnown;
+};
+
+static int compareDouble(const void* a, const void* b) {
+	const double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static inline double nowMicroseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void loopDrain(void); // From plugin.c, built with ARCHITSMBOT_BENCH
+
+// Commands run on plugin's event loop, so we wait for it to finish, same as user waits for the reply
+static inline void sendCommand(const char* command) {
+	ts3plugin_onTextMessageEvent(BENCH_SERVER_CONNECTION_HANDLER_ID, TextMessageTarget_CHANNEL, BENCH_CHANNEL_ID, BENCH_USER_ID, BENCH_USER_NAME, BENCH_USER_UID, command, 0);
+	loopDrain();
+}
+
+static void runCommand(struct benchResult* result, const char* command, const unsigned int iterations, const int syscallCounter) {
+	double samples[iterations];
+	unsigned long long syscalls = 0;
+
+	sendCommand(command); // Warm-up, not measured
+
+	__atomic_store_n(&benchAllocations, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&benchForks, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&benchMessages, 0, __ATOMIC_RELAXED);
+	if (syscallCounter != -1) {
+		ioctl(syscallCounter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(syscallCounter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	__atomic_store_n(&benchCounting, true, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < iterations; ++i) {
+		const double start = nowMicroseconds();
+		sendCommand(command);
+		samples[i] = nowMicroseconds() - start;
+	}
+	__atomic_store_n(&benchCounting, false, __ATOMIC_RELAXED);
+	if (syscallCounter != -1) {
+		ioctl(syscallCounter, PERF_EVENT_IOC_DISABLE, 0);
+		result->syscallsKnown = read(syscallCounter, &syscalls, sizeof(syscalls)) == sizeof(syscalls);
+	}
+
+	qsort(samples, iterations, sizeof(double), compareDouble);
+	result->command = command;
+	result->p50 = samples[(iterations - 1) * 50 / 100];
+	result->p99 = samples[(iterations - 1) * 99 / 100];
+	result->syscalls = (double) syscalls / iterations;
+	result->forks = (double) __atomic_load_n(&benchForks, __ATOMIC_RELAXED) / iterations;
+	result->allocations = (double) __atomic_load_n(&benchAllocations, __ATOMIC_RELAXED) / iterations;
+	result->messages = (double) __atomic_load_n(&benchMessages, __ATOMIC_RELAXED) / iterations;
+}
+
+// Starts mock MPD on a unix socket and waits until it accepts connections, library generation takes a while
+static pid_t startMock(const char* mock, const char* socketPath) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	memcpy(addr.sun_path, socketPath, strlen(socketPath) + 1);
+	char tracks[32];
+	snprintf(tracks, sizeof(tracks), "%lu", fakeTracks);
+	const pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		execl(mock, mock, "-S", socketPath, "-t", tracks, (char*) NULL);
+		perror("execl");
+		_exit(127);
+	}
+	for (unsigned int attempt = 0; attempt < 600; ++attempt) {
+		const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1) {
+			const bool connected = connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+			close(fd);
+			if (connected) {
+				return pid;
+			}
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			break;
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "Mock MPD did not come up\n");
+	kill(pid, SIGTERM);
+	return -1;
+}
+
+static int removeEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+	return remove(path);
+}
+
+static void waitForWarmup(void) {
+	for (unsigned int i = 0; i < BENCH_WARMUP_TIMEOUT * 1000 && !__atomic_load_n(&benchWarmedUp, __ATOMIC_ACQUIRE); ++i) {
+		usleep(1000);
+	}
+}
+
+static void usage(const char* self) {
+	fprintf(stderr, "Usage: %s [-t tracks] [-n iterations] [-m architsmbot_mpdmock] [-k] [-r] [-v] [-c \"!command\"]...\n", self);
+}
+
+int main(int argc, char* argv[]) {
+	const char* self = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+	const char* tracksEnv = getenv("ARCHITSMBOT_BENCH_TRACKS");
+	if (tracksEnv) {
+		fakeTracks = strtoul(tracksEnv, NULL, 10);
+	}
+	const char* benchDir = getenv("ARCHITSMBOT_BENCH_DIR");
+	if (strcmp(self, "mpc") == 0) {
+		if (!benchDir) {
+			fprintf(stderr, "ARCHITSMBOT_BENCH_DIR is not set\n");
+			return 1;
+		}
+		snprintf(fakeStatePath, sizeof(fakeStatePath), "%s/%s", benchDir, FAKE_QUEUE_FILE);
+		return fakeMpcMain(argc, argv);
+	}
+
+	unsigned int iterations = BENCH_DEFAULT_ITERATIONS;
+	const char* mock = NULL;
+	bool keep = false;
+	bool restart = false;
+	const char* commands[argc + 1];
+	unsigned int commandCount = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:m:c:krvh")) != -1) {
+		switch (opt) {
+			case 't':
+				fakeTracks = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				iterations = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				mock = optarg;
+				break;
+			case 'c':
+				commands[commandCount++] = optarg;
+				break;
+			case 'k':
+				keep = true;
+				break;
+			case 'r':
+				restart = true;
+				break;
+			case 'v':
+				benchVerbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (iterations == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	commands[commandCount] = NULL;
+	const char** toRun = commandCount ? commands : defaultCommands;
+
+	// Sandbox: plugin path, fake mpc first in PATH, shared state for fake mpc processes
+	char sandbox[] = "/tmp/architsmbot-bench.XXXXXX";
+	if (!mkdtemp(sandbox)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char exe[PATH_MAX], link[PATH_MAX], path[PATH_MAX * 2], tracks[32];
+	const ssize_t exeLen = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (exeLen == -1) {
+		perror("readlink");
+		return 1;
+	}
+	exe[exeLen] = '\0';
+	pid_t mockPid = -1;
+	if (mock) {
+		snprintf(link, sizeof(link), "%s/mpd.sock", sandbox);
+		if ((mockPid = startMock(mock, link)) == -1) {
+			return 1;
+		}
+		setenv("MPD_HOST", link, 1);
+		snprintf(path, sizeof(path), "%s", getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+	} else {
+		snprintf(link, sizeof(link), "%s/mpc", sandbox);
+		if (symlink(exe, link)) {
+			perror("symlink");
+			return 1;
+		}
+		snprintf(path, sizeof(path), "%s:%s", sandbox, getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+	}
+	snprintf(tracks, sizeof(tracks), "%lu", fakeTracks);
+	setenv("PATH", path, 1);
+	setenv("ARCHITSMBOT_BENCH_DIR", sandbox, 1);
+	setenv("ARCHITSMBOT_BENCH_TRACKS", tracks, 1);
+	snprintf(benchPluginPath, sizeof(benchPluginPath), "%s/", sandbox);
+
+	// Bring the plugin up the same way TS3 client does
+	ts3plugin_setFunctionPointers(stubFunctions());
+	if (ts3plugin_init()) {
+		fprintf(stderr, "ts3plugin_init() failed\n");
+		return 1;
+	}
+	ts3plugin_onConnectStatusChangeEvent(BENCH_SERVER_CONNECTION_HANDLER_ID, STATUS_CONNECTION_ESTABLISHED, ERROR_ok);
+	waitForWarmup(); // Measure steady state, not the race with background warm-up
+	sendCommand("!reset");
+	sendCommand("!addtheme chill");
+
+	const int syscallCounter = openSyscallCounter();
+	printf("Library: %lu tracks (%s), %u iterations per command%s\n", fakeTracks, mock ? "mock MPD" : "fake mpc", iterations, syscallCounter == -1 ? ", syscall counting unavailable" : "");
+	printf("%-20s %12s %12s %10s %8s %10s %10s\n", "command", "p50 (us)", "p99 (us)", "syscalls", "forks", "allocs", "messages");
+	for (unsigned int i = 0; toRun[i]; ++i) {
+		struct benchResult result;
+		memset(&result, 0, sizeof(result));
+		runCommand(&result, toRun[i], iterations, syscallCounter);
+		char syscalls[16];
+		if (result.syscallsKnown) {
+			snprintf(syscalls, sizeof(syscalls), "%.0f", result.syscalls);
+		} else {
+			snprintf(syscalls, sizeof(syscalls), "-");
+		}
+		printf("%-20s %12.1f %12.1f %10s %8.1f %10.1f %10.1f\n", result.command, result.p50, result.p99, syscalls, result.forks, result.allocations, result.messages);
+	}
+
+	if (syscallCounter != -1) {
+		close(syscallCounter);
+	}
+	if (restart) {
+		ts3plugin_shutdown();
+		__atomic_store_n(&benchWarmedUp, false, __ATOMIC_RELAXED);
+		const double start = nowMicroseconds();
+		ts3plugin_init();
+		const double initialized = nowMicroseconds();
+		ts3plugin_onConnectStatusChangeEvent(BENCH_SERVER_CONNECTION_HANDLER_ID, STATUS_CONNECTION_ESTABLISHED, ERROR_ok);
+		waitForWarmup();
+		printf("Restart: init %.1f ms, connected and warmed up after %.1f ms\n%s\n", (initialized - start) / 1000, (nowMicroseconds() - start) / 1000, benchWarmupMessage);
+	}
+	ts3plugin_shutdown();
+	if (mockPid != -1) {
+		kill(mockPid, SIGTERM);
+		waitpid(mockPid, NULL, 0);
+	}
+	if (keep) {
+		printf("Sandbox kept in %s\n", sandbox);
+	} else {
+		nftw(sandbox, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+set -eu
+
+# Builds standalone benchmark harness and mock MPD daemon, see bench.c and mpdmock.c for details
+BENCH="architsmbot_bench"
+MOCK="architsmbot_mpdmock"
+
+CFLAGS=(-O2 -g -std=gnu11 -pedantic -Wall -fno-omit-frame-pointer)
+LDFLAGS=(-Wl,--as-needed)
+SRCFLAGS=(-DLINUX -DPIC -DARCHITSMBOT_BENCH -I${TS3_SDK_INCLUDE:-../include} -pthread)
+LIBS=(-ldl)
+
+TARGET="$(readlink "$0" || true)"
+if [[ -z "$TARGET" ]]; then
+	TARGET="$0"
+fi
+
+cd "$(dirname "$TARGET")"
+
+gcc "${SRCFLAGS[@]}" "${CFLAGS[@]}" "${LDFLAGS[@]}" -o "$BENCH" plugin.c bench.c "${LIBS[@]}"
+gcc "${CFLAGS[@]}" "${LDFLAGS[@]}" -o "$MOCK" mpdmock.c
+
+if [[ "${1:-}" == "run" ]]; then
+	shift
+	exec "./$BENCH" "$@"
+fi
+exit 0
@@ -0,0 +1,1641 @@
+/*
+    _                _      _  _____  ____   __  __  ____        _____
+   / \    _ __  ___ | |__  (_)|_   _|/ ___| |  \/  || __ )   ___|_   _|
+  / _ \  | '__|/ __|| '_ \ | |  | |  \___ \ | |\/| ||  _ \  / _ \ | |
+ / ___ \ | |  | (__ | | | || |  | |   ___) || |  | || |_) || (_) || |
+/_/   \_\|_|   \___||_| |_||_|  |_|  |____/ |_|  |_||____/  \___/ |_|
+
+Copyright 2015 Łukasz "JustArchi" Domeradzki
+Contact: JustArchi@JustArchi.net
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Mock MPD daemon for ArchiTSMBot, built by bench.sh
+ *
+ * Speaks the subset of MPD protocol used by the bot and by mpc, on a unix socket or on loopback,
+ * backed by a generated library (no audio, no real files). Library is deterministic for given seed and size,
+ * with skewed artist sizes, multi-disc albums, compilations, diacritics and "Theme:" comments on part of tracks.
+ * Latency can be injected per round trip, and every "update" can touch some directories to exercise sync paths.
+ *
+ * Usage: ./architsmbot_mpdmock [-S socket | -p port] [-t tracks] [-s seed] [-l latencyMs] [-j jitterMs] [-u updateMs] [-M dirsPerUpdate] [-v]
+ * Point mpc (and the plugin) at it with MPD_HOST=<socket> or MPD_PORT=<port>.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_VERSION "0.21.0"
+#define MOCK_DEFAULT_TRACKS 100000
+#define MOCK_DEFAULT_PORT 6600
+#define MOCK_MAX_CLIENTS 64
+#define MOCK_MAX_ARGS 16
+
+#define ACK_ERROR_ARG 2
+#define ACK_ERROR_UNKNOWN 5
+#define ACK_ERROR_NO_EXIST 50
+
+// Idle subsystems
+#define IDLE_DATABASE (1 << 0)
+#define IDLE_UPDATE (1 << 1)
+#define IDLE_STORED_PLAYLIST (1 << 2)
+#define IDLE_PLAYLIST (1 << 3)
+#define IDLE_PLAYER (1 << 4)
+#define IDLE_MIXER (1 << 5)
+#define IDLE_OPTIONS (1 << 6)
+#define IDLE_ALL 0x7F
+
+static const char* idleNames[] = { "database", "update", "stored_playlist", "playlist", "player", "mixer", "options", NULL };
+
+/*********************************** Library ************************************/
+
+struct mockSong {
+	char* file;
+	char* artist;
+	char* album;
+	char* title;
+	char* comment;
+	unsigned int track;
+	unsigned int duration;
+	time_t mtime;
+};
+
+struct mockDirectory {
+	char* path;
+	time_t mtime;
+};
+
+static struct mockSong* songs = NULL;
+static size_t songCount = 0, songCapacity = 0;
+static struct mockDirectory* directories = NULL;
+static size_t directoryCount = 0, directoryCapacity = 0;
+static time_t dbUpdate = 0;
+
+static uint64_t rngState = 0x853c49e6748fea9bULL;
+
+static uint64_t rng(void) { // xorshift64*
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+static inline unsigned int rngBelow(const unsigned int n) {
+	return n ? rng() % n : 0;
+}
+
+static void* xmalloc(size_t size) {
+	void* ret = malloc(size);
+	if (!ret) {
+		perror("malloc");
+		exit(1);
+	}
+	return ret;
+}
+
+static char* xstrdup(const char* s) {
+	char* ret = strdup(s);
+	if (!ret) {
+		perror("strdup");
+		exit(1);
+	}
+	return ret;
+}
+
+static void* growArray(void* array, size_t* capacity, const size_t count, const size_t elementSize) {
+	if (count < *capacity) {
+		return array;
+	}
+	*capacity = *capacity ? *capacity * 2 : 1024;
+	array = realloc(array, *capacity * elementSize);
+	if (!array) {
+		perror("realloc");
+		exit(1);
+	}
+	return array;
+}
+
+static const char* syllables[] = {
+	"ka", "lo", "mi", "ra", "zen", "tor", "vel", "ish", "an", "dre", "ło", "ść", "ża", "ró", "gę", "ńi",
+	"sto", "bur", "el", "qu", "ax", "ny", "po", "lę", "cki", "wa", "or", "ta", "me", "sun", "dark", "ice"
+};
+static const char* words[] = {
+	"Love", "Night", "Fire", "Dream", "Road", "Heart", "Storm", "River", "Ghost", "Light", "Summer", "Rain",
+	"Zażółć", "Gęślą", "Jaźń", "Łódź", "Miłość", "Północ", "Wiatr", "Serce", "Żal", "Cień", "Niebo", "Świat",
+	"Blue", "Golden", "Broken", "Wild", "Silent", "Electric", "Lost", "Forever", "Again", "Tonight", "Home", "Echo"
+};
+static const char* albumWords[] = { "Greatest Hits", "Live", "Demo", "Unplugged", "Sessions", "Remastered", "Part II", "EP" };
+static const char* themes[] = { "chill", "rock", "party", "sad", "workout", "focus", "retro", "metal" };
+
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+static void capitalizedName(char* buffer, const size_t size, const unsigned int parts) {
+	size_t len = 0;
+	buffer[0] = '\0';
+	for (unsigned int i = 0; i < parts && len + 8 < size; ++i) {
+		len += snprintf(buffer + len, size - len, "%s", syllables[rngBelow(COUNT(syllables))]);
+	}
+	if ((unsigned char) buffer[0] < 0x80) {
+		buffer[0] = (char) (buffer[0] - 'a' + 'A');
+	}
+}
+
+static void randomTitle(char* buffer, const size_t size) {
+	const unsigned int count = 1 + rngBelow(4);
+	size_t len = 0;
+	buffer[0] = '\0';
+	for (unsigned int i = 0; i < count && len + 16 < size; ++i) {
+		len += snprintf(buffer + len, size - len, "%s%s", i ? " " : "", words[rngBelow(COUNT(words))]);
+	}
+	if (rngBelow(10) == 0) {
+		snprintf(buffer + len, size - len, " (%s)", rngBelow(2) ? "Live" : "Remix");
+	}
+}
+
+static void addDirectory(const char* path, const time_t mtime) {
+	directories = growArray(directories, &directoryCapacity, directoryCount, sizeof(*directories));
+	directories[directoryCount].path = xstrdup(path);
+	directories[directoryCount].mtime = mtime;
+	++directoryCount;
+}
+
+static void addSong(const char* file, const char* artist, const char* album, const char* title, const unsigned int track, const time_t mtime) {
+	songs = growArray(songs, &songCapacity, songCount, sizeof(*songs));
+	struct mockSong* song = &songs[songCount++];
+	song->file = xstrdup(file);
+	song->artist = xstrdup(artist);
+	song->album = xstrdup(album);
+	song->title = xstrdup(title);
+	if (rngBelow(100) < 15) { // Roughly like real bot libraries, most tracks are not classified
+		char comment[64];
+		const unsigned int theme = rngBelow(3) ? rngBelow(3) : rngBelow(COUNT(themes)); // Few themes dominate
+		snprintf(comment, sizeof(comment), "Theme:%s", themes[theme]);
+		song->comment = xstrdup(comment);
+	} else {
+		song->comment = NULL;
+	}
+	song->track = track;
+	song->duration = 90 + rngBelow(300) + (rngBelow(20) == 0 ? rngBelow(900) : 0);
+	song->mtime = mtime;
+}
+
+static int compareSongs(const void* a, const void* b) {
+	return strcmp(((const struct mockSong*) a)->file, ((const struct mockSong*) b)->file);
+}
+
+static int compareDirectories(const void* a, const void* b) {
+	return strcmp(((const struct mockDirectory*) a)->path, ((const struct mockDirectory*) b)->path);
+}
+
+/*
+ * Artist sizes follow a rough power law: few artists with dozens of albums, long tail of single-album ones.
+ * Layouts vary between "Artist/Album/NN - Title", "Artist/Year - Album/CDn/NN - Title" and loose "Artist/Title" files,
+ * plus a "Various Artists" compilations tree.
+ */
+static void generateLibrary(const size_t tracks) {
+	const time_t base = 1420070400; // 2015-01-01
+	char artist[64], album[128], title[128], dir[256], albumDir[512], file[1024];
+	unsigned int artistNumber = 0;
+	while (songCount < tracks) {
+		const bool compilation = rngBelow(50) == 0;
+		if (compilation) {
+			snprintf(artist, sizeof(artist), "Various Artists");
+		} else {
+			capitalizedName(artist, sizeof(artist), 2 + rngBelow(2));
+			if (rngBelow(8) == 0) {
+				char name[sizeof(artist) + 4];
+				snprintf(name, sizeof(name), "The %s", artist);
+				snprintf(artist, sizeof(artist), "%.*s", (int) sizeof(artist) - 1, name);
+			}
+		}
+		snprintf(dir, sizeof(dir), "%s %u", artist, ++artistNumber);
+		const time_t artistTime = base + rngBelow(86400 * 365);
+		addDirectory(dir, artistTime);
+		const unsigned int rank = 1 + rngBelow(64);
+		const unsigned int albums = 1 + 24 / rank; // Power-law-ish
+		for (unsigned int a = 0; a < albums && songCount < tracks; ++a) {
+			randomTitle(album, sizeof(album));
+			if (rngBelow(4) == 0) {
+				char combined[sizeof(album) + 16];
+				snprintf(combined, sizeof(combined), "%s %s", album, albumWords[rngBelow(COUNT(albumWords))]);
+				snprintf(album, sizeof(album), "%.*s", (int) sizeof(album) - 1, combined);
+			}
+			const time_t albumTime = artistTime + rngBelow(86400 * 30);
+			const bool dated = rngBelow(3) == 0;
+			if (dated) {
+				snprintf(albumDir, sizeof(albumDir), "%s/%u - %s", dir, 1970 + rngBelow(50), album);
+			} else {
+				snprintf(albumDir, sizeof(albumDir), "%s/%s", dir, album);
+			}
+			addDirectory(albumDir, albumTime);
+			const unsigned int discs = rngBelow(12) == 0 ? 2 : 1;
+			for (unsigned int d = 1; d <= discs && songCount < tracks; ++d) {
+				char discDir[600];
+				if (discs > 1) {
+					snprintf(discDir, sizeof(discDir), "%s/CD%u", albumDir, d);
+					addDirectory(discDir, albumTime);
+				} else {
+					snprintf(discDir, sizeof(discDir), "%s", albumDir);
+				}
+				const unsigned int trackCount = 6 + rngBelow(12);
+				for (unsigned int t = 1; t <= trackCount && songCount < tracks; ++t) {
+					char trackArtist[64];
+					if (compilation) {
+						capitalizedName(trackArtist, sizeof(trackArtist), 2 + rngBelow(2));
+					} else {
+						snprintf(trackArtist, sizeof(trackArtist), "%s", artist);
+					}
+					randomTitle(title, sizeof(title));
+					if (compilation) {
+						snprintf(file, sizeof(file), "%s/%02u - %s - %s.mp3", discDir, t, trackArtist, title);
+					} else {
+						snprintf(file, sizeof(file), "%s/%02u - %s.%s", discDir, t, title, rngBelow(5) ? "mp3" : "flac");
+					}
+					addSong(file, trackArtist, album, title, t, albumTime + t);
+				}
+			}
+		}
+		// Loose singles directly in artist directory
+		for (unsigned int s = rngBelow(3); s > 0 && songCount < tracks; --s) {
+			randomTitle(title, sizeof(title));
+			snprintf(file, sizeof(file), "%s/%s - %s.mp3", dir, artist, title);
+			addSong(file, artist, "", title, 0, artistTime);
+		}
+	}
+	qsort(songs, songCount, sizeof(*songs), compareSongs);
+	qsort(directories, directoryCount, sizeof(*directories), compareDirectories);
+	dbUpdate = time(NULL);
+}
+
+// First song with path >= prefix, songs are sorted so directory contents are contiguous
+static size_t songLowerBound(const char* prefix) {
+	size_t lo = 0, hi = songCount;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(songs[mid].file, prefix) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool isInside(const char* path, const char* dir, const size_t dirLen) {
+	return dirLen == 0 || (strncmp(path, dir, dirLen) == 0 && path[dirLen] == '/');
+}
+
+static long findSong(const char* file) {
+	const size_t i = songLowerBound(file);
+	return (i < songCount && strcmp(songs[i].file, file) == 0) ? (long) i : -1;
+}
+
+static long findDirectory(const char* path) {
+	size_t lo = 0, hi = directoryCount;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(directories[mid].path, path);
+		if (cmp == 0) {
+			return mid;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+static int compareStrings(const void* a, const void* b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static size_t countDistinct(const size_t offset) {
+	char** values = xmalloc(songCount * sizeof(char*));
+	size_t count = 0;
+	for (size_t i = 0; i < songCount; ++i) {
+		values[i] = *(char**) ((char*) &songs[i] + offset);
+	}
+	qsort(values, songCount, sizeof(char*), compareStrings);
+	for (size_t i = 0; i < songCount; ++i) {
+		if (i == 0 || strcmp(values[i], values[i - 1]) != 0) {
+			++count;
+		}
+	}
+	free(values);
+	return count;
+}
+
+/*********************************** Queue and player ************************************/
+
+struct mockQueueEntry {
+	size_t song;
+	unsigned int id;
+	unsigned int version;
+};
+
+static struct mockQueueEntry* queue = NULL;
+static size_t queueLength = 0, queueCapacity = 0;
+static unsigned int queueVersion = 1;
+static unsigned int nextSongId = 1;
+
+typedef enum {STATE_STOP, STATE_PLAY, STATE_PAUSE} playerState;
+static playerState state = STATE_STOP;
+static long current = -1; // Queue position
+static bool optRandom = false, optRepeat = false, optSingle = false, optConsume = false;
+static int volume = 50;
+static unsigned int updateJob = 0;
+static bool updating = false;
+static time_t startTime = 0;
+
+static inline void touchQueue(const size_t from) {
+	++queueVersion;
+	for (size_t i = from; i < queueLength; ++i) {
+		queue[i].version = queueVersion;
+	}
+}
+
+static unsigned int queueInsert(const size_t song, size_t pos) {
+	queue = growArray(queue, &queueCapacity, queueLength, sizeof(*queue));
+	if (pos > queueLength) {
+		pos = queueLength;
+	}
+	memmove(&queue[pos + 1], &queue[pos], (queueLength - pos) * sizeof(*queue));
+	queue[pos].song = song;
+	queue[pos].id = nextSongId++;
+	++queueLength;
+	if (current >= (long) pos && queueLength > 1) {
+		++current;
+	}
+	return queue[pos].id;
+}
+
+static void queueDelete(const size_t pos) {
+	memmove(&queue[pos], &queue[pos + 1], (queueLength - pos - 1) * sizeof(*queue));
+	--queueLength;
+	if (current == (long) pos) {
+		if (pos >= queueLength) {
+			current = -1;
+			state = STATE_STOP;
+		}
+	} else if (current > (long) pos) {
+		--current;
+	}
+}
+
+static long queueFindId(const unsigned int id) {
+	for (size_t i = 0; i < queueLength; ++i) {
+		if (queue[i].id == id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*********************************** Stored playlists ************************************/
+
+// Songs are kept by path, same as MPD's .m3u files, so library mutations don't shift them
+struct mockPlaylist {
+	char* name;
+	char** files;
+	size_t length, capacity;
+	time_t mtime;
+};
+
+static struct mockPlaylist* playlists = NULL;
+static size_t playlistCount = 0, playlistCapacity = 0;
+
+static struct mockPlaylist* findPlaylist(const char* name, const bool create) {
+	for (size_t i = 0; i < playlistCount; ++i) {
+		if (strcmp(playlists[i].name, name) == 0) {
+			return &playlists[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	playlists = growArray(playlists, &playlistCapacity, playlistCount, sizeof(*playlists));
+	struct mockPlaylist* playlist = &playlists[playlistCount++];
+	memset(playlist, 0, sizeof(*playlist));
+	playlist->name = xstrdup(name);
+	playlist->mtime = time(NULL);
+	return playlist;
+}
+
+static void playlistAppend(struct mockPlaylist* playlist, const char* file) {
+	playlist->files = growArray(playlist->files, &playlist->capacity, playlist->length, sizeof(char*));
+	playlist->files[playlist->length++] = xstrdup(file);
+	playlist->mtime = time(NULL);
+}
+
+static void playlistClear(struct mockPlaylist* playlist) {
+	for (size_t i = 0; i < playlist->length; ++i) {
+		free(playlist->files[i]);
+	}
+	playlist->length = 0;
+	playlist->mtime = time(NULL);
+}
+
+/*********************************** Clients ************************************/
+
+struct mockClient {
+	int fd;
+	char* in;
+	size_t inLength, inCapacity;
+	char* out;
+	size_t outLength, outCapacity;
+	bool idle;
+	unsigned int idleMask;
+	unsigned int pending;
+	bool inList, listOk;
+	char** list;
+	size_t listLength, listCapacity;
+	unsigned int listIndex;
+	const char* commandName;
+};
+
+static struct mockClient clients[MOCK_MAX_CLIENTS];
+static bool verbose = false;
+static unsigned int latencyMs = 0, jitterMs = 0, updateMs = 0, mutateDirs = 0;
+static int64_t updateDoneAt = -1;
+static volatile sig_atomic_t running = 1;
+
+static void out(struct mockClient* client, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+static void out(struct mockClient* client, const char* format, ...) {
+	va_list args;
+	for (;;) {
+		va_start(args, format);
+		const int len = vsnprintf(client->out + client->outLength, client->outCapacity - client->outLength, format, args);
+		va_end(args);
+		if (len < 0) {
+			return;
+		}
+		if (client->outLength + len < client->outCapacity) {
+			client->outLength += len;
+			return;
+		}
+		client->outCapacity = (client->outCapacity + len + 1) * 2;
+		client->out = realloc(client->out, client->outCapacity);
+		if (!client->out) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+}
+
+static void flushClient(struct mockClient* client) {
+	size_t written = 0;
+	while (written < client->outLength) {
+		const ssize_t r = write(client->fd, client->out + written, client->outLength - written);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break; // Client went away, it will be reaped on next poll()
+		}
+		written += r;
+	}
+	client->outLength = 0;
+}
+
+static void ack(struct mockClient* client, const int code, const char* format, ...) __attribute__ ((format (printf, 3, 4)));
+static void ack(struct mockClient* client, const int code, const char* format, ...) {
+	char message[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	out(client, "ACK [%d@%u] {%s} %s\n", code, client->listIndex, client->commandName, message);
+}
+
+static void sendIdleChanges(struct mockClient* client) {
+	const unsigned int changes = client->pending & client->idleMask;
+	for (unsigned int i = 0; idleNames[i]; ++i) {
+		if (changes & (1U << i)) {
+			out(client, "changed: %s\n", idleNames[i]);
+		}
+	}
+	client->pending &= ~changes;
+	out(client, "OK\n");
+	client->idle = false;
+	flushClient(client);
+}
+
+static void emitEvent(const unsigned int mask) {
+	for (unsigned int i = 0; i < MOCK_MAX_CLIENTS; ++i) {
+		struct mockClient* client = &clients[i];
+		if (client->fd == -1) {
+			continue;
+		}
+		client->pending |= mask;
+		if (client->idle && (client->pending & client->idleMask)) {
+			sendIdleChanges(client);
+		}
+	}
+}
+
+/*********************************** Commands ************************************/
+
+static void formatTime(char* buffer, const size_t size, const time_t t) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void printSong(struct mockClient* client, const size_t i) {
+	const struct mockSong* song = &songs[i];
+	char mtime[32];
+	formatTime(mtime, sizeof(mtime), song->mtime);
+	out(client, "file: %s\nLast-Modified: %s\nTime: %u\nduration: %u.000\nArtist: %s\nTitle: %s\n", song->file, mtime, song->duration, song->duration, song->artist, song->title);
+	if (song->album[0]) {
+		out(client, "Album: %s\n", song->album);
+	}
+	if (song->track) {
+		out(client, "Track: %u\n", song->track);
+	}
+	if (song->comment) {
+		out(client, "Comment: %s\n", song->comment);
+	}
+}
+
+static void printQueueEntry(struct mockClient* client, const size_t pos) {
+	printSong(client, queue[pos].song);
+	out(client, "Pos: %zu\nId: %u\n", pos, queue[pos].id);
+}
+
+static void printDirectory(struct mockClient* client, const size_t i) {
+	char mtime[32];
+	formatTime(mtime, sizeof(mtime), directories[i].mtime);
+	out(client, "directory: %s\nLast-Modified: %s\n", directories[i].path, mtime);
+}
+
+static bool parseRange(const char* arg, size_t* start, size_t* end) {
+	char* p;
+	*start = strtoul(arg, &p, 10);
+	if (p == arg) {
+		return false;
+	}
+	if (*p == ':') {
+		*end = p[1] ? strtoul(p + 1, NULL, 10) : queueLength;
+	} else if (*p == '\0') {
+		*end = *start + 1;
+	} else {
+		return false;
+	}
+	if (*end > queueLength) {
+		*end = queueLength;
+	}
+	return *start < *end;
+}
+
+static bool parseBool(struct mockClient* client, const char* arg, bool* value) {
+	if (strcmp(arg, "0") == 0 || strcmp(arg, "1") == 0) {
+		*value = arg[0] == '1';
+		return true;
+	}
+	ack(client, ACK_ERROR_ARG, "Boolean (0/1) expected: %s", arg);
+	return false;
+}
+
+// Walks directories and songs below "uri" in path order, which is also MPD's tree order
+static bool listTree(struct mockClient* client, const char* uri, const bool info) {
+	const size_t len = strlen(uri);
+	if (len && findDirectory(uri) == -1) {
+		const long song = findSong(uri);
+		if (song == -1) {
+			ack(client, ACK_ERROR_NO_EXIST, "No such directory");
+			return false;
+		}
+		if (info) {
+			printSong(client, song);
+		} else {
+			out(client, "file: %s\n", songs[song].file);
+		}
+		return true;
+	}
+	size_t d = 0, s = len ? songLowerBound(uri) : 0;
+	while (d < directoryCount && !isInside(directories[d].path, uri, len)) {
+		++d;
+	}
+	for (;;) {
+		const bool haveDir = d < directoryCount && isInside(directories[d].path, uri, len);
+		const bool haveSong = s < songCount && isInside(songs[s].file, uri, len);
+		if (!haveDir && !haveSong) {
+			break;
+		}
+		if (haveDir && (!haveSong || strcmp(directories[d].path, songs[s].file) < 0)) {
+			if (info) {
+				printDirectory(client, d);
+			} else {
+				out(client, "directory: %s\n", directories[d].path);
+			}
+			++d;
+		} else {
+			if (info) {
+				printSong(client, s);
+			} else {
+				out(client, "file: %s\n", songs[s].file);
+			}
+			++s;
+		}
+	}
+	return true;
+}
+
+static bool cmdListall(struct mockClient* client, int argc, char** argv) {
+	return listTree(client, argc > 1 ? argv[1] : "", false);
+}
+
+static bool cmdListallinfo(struct mockClient* client, int argc, char** argv) {
+	return listTree(client, argc > 1 ? argv[1] : "", true);
+}
+
+static time_t parseTime(const char* arg) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	const char* end = strptime(arg, "%Y-%m-%dT%H:%M:%SZ", &tm);
+	return end && !*end ? timegm(&tm) : (time_t) strtoll(arg, NULL, 10);
+}
+
+// Legacy "find TYPE VALUE..." form, exact and case sensitive the same as MPD, all pairs must match
+static bool cmdFind(struct mockClient* client, int argc, char** argv) {
+	if (argc % 2 == 0) {
+		ack(client, ACK_ERROR_ARG, "Incorrect number of filter arguments");
+		return false;
+	}
+	for (int i = 1; i < argc; i += 2) {
+		if (strcmp(argv[i], "modified-since") && strcmp(argv[i], "file") && strcmp(argv[i], "artist") && strcmp(argv[i], "album") && strcmp(argv[i], "title") && strcmp(argv[i], "comment")) {
+			ack(client, ACK_ERROR_ARG, "Unknown filter type: %s", argv[i]);
+			return false;
+		}
+	}
+	for (size_t s = 0; s < songCount; ++s) {
+		const struct mockSong* song = &songs[s];
+		bool match = true;
+		for (int i = 1; i < argc && match; i += 2) {
+			const char* type = argv[i];
+			const char* value = argv[i + 1];
+			if (strcmp(type, "modified-since") == 0) {
+				match = song->mtime >= parseTime(value);
+			} else if (strcmp(type, "file") == 0) {
+				match = strcmp(song->file, value) == 0;
+			} else if (strcmp(type, "artist") == 0) {
+				match = strcmp(song->artist, value) == 0;
+			} else if (strcmp(type, "album") == 0) {
+				match = strcmp(song->album, value) == 0;
+			} else if (strcmp(type, "title") == 0) {
+				match = strcmp(song->title, value) == 0;
+			} else {
+				match = song->comment && strcmp(song->comment, value) == 0;
+			}
+		}
+		if (match) {
+			printSong(client, s);
+		}
+	}
+	return true;
+}
+
+static bool cmdLsinfo(struct mockClient* client, int argc, char** argv) {
+	const char* uri = argc > 1 ? argv[1] : "";
+	if (strcmp(uri, "/") == 0) {
+		uri = "";
+	}
+	const size_t len = strlen(uri);
+	if (len && findDirectory(uri) == -1) {
+		const long song = findSong(uri);
+		if (song == -1) {
+			ack(client, ACK_ERROR_NO_EXIST, "No such directory");
+			return false;
+		}
+		printSong(client, song);
+		return true;
+	}
+	for (size_t d = 0; d < directoryCount; ++d) {
+		const char* path = directories[d].path;
+		if (isInside(path, uri, len) && !strchr(path + (len ? len + 1 : 0), '/')) {
+			printDirectory(client, d);
+		}
+	}
+	for (size_t s = len ? songLowerBound(uri) : 0; s < songCount && isInside(songs[s].file, uri, len); ++s) {
+		if (!strchr(songs[s].file + (len ? len + 1 : 0), '/')) {
+			printSong(client, s);
+		}
+	}
+	return true;
+}
+
+static bool cmdPlaylistinfo(struct mockClient* client, int argc, char** argv) {
+	size_t start = 0, end = queueLength;
+	if (argc > 1 && !parseRange(argv[1], &start, &end)) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	for (size_t i = start; i < end; ++i) {
+		printQueueEntry(client, i);
+	}
+	return true;
+}
+
+// Only the "playlistfind TAG VALUE" form, exact and case sensitive, enough to find copies of a song in the queue
+static bool cmdPlaylistfind(struct mockClient* client, int argc, char** argv) {
+	static const char* types[] = { "file", "artist", "album", "title" };
+	static const size_t offsets[] = { offsetof(struct mockSong, file), offsetof(struct mockSong, artist), offsetof(struct mockSong, album), offsetof(struct mockSong, title) };
+	unsigned int type = 0;
+	while (type < sizeof(types) / sizeof(types[0]) && strcmp(types[type], argv[1]) != 0) {
+		++type;
+	}
+	if (type == sizeof(types) / sizeof(types[0])) {
+		ack(client, ACK_ERROR_ARG, "Unknown filter type: %s", argv[1]);
+		return false;
+	}
+	for (size_t i = 0; i < queueLength; ++i) {
+		if (strcmp(*(char**) ((char*) &songs[queue[i].song] + offsets[type]), argv[2]) == 0) {
+			printQueueEntry(client, i);
+		}
+	}
+	return true;
+}
+
+static bool cmdPlchanges(struct mockClient* client, int argc, char** argv) {
+	const unsigned long version = strtoul(argv[1], NULL, 10);
+	for (size_t i = 0; i < queueLength; ++i) {
+		if (queue[i].version > version) {
+			printQueueEntry(client, i);
+		}
+	}
+	return true;
+}
+
+static bool cmdPlchangesposid(struct mockClient* client, int argc, char** argv) {
+	const unsigned long version = strtoul(argv[1], NULL, 10);
+	for (size_t i = 0; i < queueLength; ++i) {
+		if (queue[i].version > version) {
+			out(client, "cpos: %zu\nId: %u\n", i, queue[i].id);
+		}
+	}
+	return true;
+}
+
+static bool cmdListplaylist(struct mockClient* client, int argc, char** argv) {
+	const struct mockPlaylist* playlist = findPlaylist(argv[1], false);
+	if (!playlist) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such playlist");
+		return false;
+	}
+	for (size_t i = 0; i < playlist->length; ++i) {
+		out(client, "file: %s\n", playlist->files[i]);
+	}
+	return true;
+}
+
+static bool cmdListplaylists(struct mockClient* client, int argc, char** argv) {
+	for (size_t i = 0; i < playlistCount; ++i) {
+		char mtime[32];
+		formatTime(mtime, sizeof(mtime), playlists[i].mtime);
+		out(client, "playlist: %s\nLast-Modified: %s\n", playlists[i].name, mtime);
+	}
+	return true;
+}
+
+static bool cmdLoad(struct mockClient* client, int argc, char** argv) {
+	const struct mockPlaylist* playlist = findPlaylist(argv[1], false);
+	if (!playlist) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such playlist");
+		return false;
+	}
+	const size_t firstChanged = queueLength;
+	for (size_t i = 0; i < playlist->length; ++i) {
+		const long song = findSong(playlist->files[i]);
+		if (song != -1) { // MPD skips what isn't in the database anymore too
+			queueInsert(song, queueLength);
+		}
+	}
+	touchQueue(firstChanged);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdPlaylistadd(struct mockClient* client, int argc, char** argv) {
+	const size_t len = strlen(argv[2]);
+	const long song = len ? findSong(argv[2]) : -1;
+	if (song == -1 && len && findDirectory(argv[2]) == -1) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such directory");
+		return false;
+	}
+	struct mockPlaylist* playlist = findPlaylist(argv[1], true);
+	if (song != -1) {
+		playlistAppend(playlist, songs[song].file);
+	} else {
+		for (size_t s = len ? songLowerBound(argv[2]) : 0; s < songCount && isInside(songs[s].file, argv[2], len); ++s) {
+			playlistAppend(playlist, songs[s].file);
+		}
+	}
+	emitEvent(IDLE_STORED_PLAYLIST);
+	return true;
+}
+
+static bool cmdPlaylistdelete(struct mockClient* client, int argc, char** argv) {
+	struct mockPlaylist* playlist = findPlaylist(argv[1], false);
+	if (!playlist) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such playlist");
+		return false;
+	}
+	const size_t pos = strtoul(argv[2], NULL, 10);
+	if (pos >= playlist->length) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	free(playlist->files[pos]);
+	memmove(&playlist->files[pos], &playlist->files[pos + 1], (playlist->length - pos - 1) * sizeof(char*));
+	--playlist->length;
+	playlist->mtime = time(NULL);
+	emitEvent(IDLE_STORED_PLAYLIST);
+	return true;
+}
+
+static bool cmdPlaylistclear(struct mockClient* client, int argc, char** argv) {
+	playlistClear(findPlaylist(argv[1], true));
+	emitEvent(IDLE_STORED_PLAYLIST);
+	return true;
+}
+
+static bool cmdRm(struct mockClient* client, int argc, char** argv) {
+	struct mockPlaylist* playlist = findPlaylist(argv[1], false);
+	if (!playlist) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such playlist");
+		return false;
+	}
+	playlistClear(playlist);
+	free(playlist->files);
+	free(playlist->name);
+	*playlist = playlists[--playlistCount];
+	emitEvent(IDLE_STORED_PLAYLIST);
+	return true;
+}
+
+static bool addUri(struct mockClient* client, const char* uri, const long pos, unsigned int* id) {
+	const size_t len = strlen(uri);
+	const size_t firstChanged = pos >= 0 ? (size_t) pos : queueLength;
+	size_t at = firstChanged;
+	const long song = len ? findSong(uri) : -1;
+	if (song != -1) {
+		const unsigned int newId = queueInsert(song, at);
+		if (id) {
+			*id = newId;
+		}
+	} else {
+		if (len && findDirectory(uri) == -1) {
+			ack(client, ACK_ERROR_NO_EXIST, "No such directory");
+			return false;
+		}
+		if (id) {
+			ack(client, ACK_ERROR_ARG, "Unsupported URI scheme");
+			return false;
+		}
+		for (size_t s = len ? songLowerBound(uri) : 0; s < songCount && isInside(songs[s].file, uri, len); ++s) {
+			queueInsert(s, at++);
+		}
+	}
+	touchQueue(firstChanged);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdAdd(struct mockClient* client, int argc, char** argv) {
+	return addUri(client, argv[1], -1, NULL);
+}
+
+static bool cmdAddid(struct mockClient* client, int argc, char** argv) {
+	unsigned int id = 0;
+	if (!addUri(client, argv[1], argc > 2 ? (long) strtoul(argv[2], NULL, 10) : -1, &id)) {
+		return false;
+	}
+	out(client, "Id: %u\n", id);
+	return true;
+}
+
+static bool cmdDelete(struct mockClient* client, int argc, char** argv) {
+	size_t start, end;
+	if (!parseRange(argv[1], &start, &end)) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	for (size_t i = end; i > start; --i) {
+		queueDelete(i - 1);
+	}
+	touchQueue(start);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdDeleteid(struct mockClient* client, int argc, char** argv) {
+	const long pos = queueFindId(strtoul(argv[1], NULL, 10));
+	if (pos == -1) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such song");
+		return false;
+	}
+	queueDelete(pos);
+	touchQueue(pos);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdClear(struct mockClient* client, int argc, char** argv) {
+	queueLength = 0;
+	current = -1;
+	state = STATE_STOP;
+	touchQueue(0);
+	emitEvent(IDLE_PLAYLIST | IDLE_PLAYER);
+	return true;
+}
+
+static void moveEntry(const size_t from, const size_t to) {
+	const struct mockQueueEntry entry = queue[from];
+	if (from < to) {
+		memmove(&queue[from], &queue[from + 1], (to - from) * sizeof(*queue));
+	} else {
+		memmove(&queue[to + 1], &queue[to], (from - to) * sizeof(*queue));
+	}
+	queue[to] = entry;
+	if (current == (long) from) {
+		current = to;
+	} else if (from < to && current > (long) from && current <= (long) to) {
+		--current;
+	} else if (from > to && current >= (long) to && current < (long) from) {
+		++current;
+	}
+	touchQueue(from < to ? from : to);
+}
+
+static bool cmdMove(struct mockClient* client, int argc, char** argv) {
+	const size_t from = strtoul(argv[1], NULL, 10), to = strtoul(argv[2], NULL, 10);
+	if (from >= queueLength || to >= queueLength) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	moveEntry(from, to);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdMoveid(struct mockClient* client, int argc, char** argv) {
+	const long from = queueFindId(strtoul(argv[1], NULL, 10));
+	const size_t to = strtoul(argv[2], NULL, 10);
+	if (from == -1 || to >= queueLength) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such song");
+		return false;
+	}
+	moveEntry(from, to);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool cmdShuffle(struct mockClient* client, int argc, char** argv) {
+	size_t start = 0, end = queueLength;
+	if (argc > 1 && !parseRange(argv[1], &start, &end)) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	if (state != STATE_STOP && current >= (long) start && current < (long) end) { // MPD puts song that's playing first
+		const struct mockQueueEntry tmp = queue[start];
+		queue[start] = queue[current];
+		queue[current] = tmp;
+		current = start++;
+	}
+	for (size_t i = end; i > start + 1; --i) {
+		const size_t j = start + rng() % (i - start);
+		const struct mockQueueEntry tmp = queue[i - 1];
+		queue[i - 1] = queue[j];
+		queue[j] = tmp;
+		if (current == (long) j) {
+			current = i - 1;
+		} else if (current == (long) i - 1) {
+			current = j;
+		}
+	}
+	touchQueue(start);
+	emitEvent(IDLE_PLAYLIST);
+	return true;
+}
+
+static bool playPosition(struct mockClient* client, const long pos) {
+	if (pos >= (long) queueLength) {
+		ack(client, ACK_ERROR_ARG, "Bad song index");
+		return false;
+	}
+	if (pos >= 0) {
+		current = pos;
+	} else if (current == -1) {
+		current = queueLength ? 0 : -1;
+	}
+	state = current == -1 ? STATE_STOP : STATE_PLAY;
+	emitEvent(IDLE_PLAYER);
+	return true;
+}
+
+static bool cmdPlay(struct mockClient* client, int argc, char** argv) {
+	return playPosition(client, argc > 1 ? (long) strtoul(argv[1], NULL, 10) : -1);
+}
+
+static bool cmdPlayid(struct mockClient* client, int argc, char** argv) {
+	if (argc < 2) {
+		return playPosition(client, -1);
+	}
+	const long pos = queueFindId(strtoul(argv[1], NULL, 10));
+	if (pos == -1) {
+		ack(client, ACK_ERROR_NO_EXIST, "No such song");
+		return false;
+	}
+	return playPosition(client, pos);
+}
+
+static bool cmdPause(struct mockClient* client, int argc, char** argv) {
+	if (state != STATE_STOP) {
+		bool pause = state == STATE_PLAY;
+		if (argc > 1 && !parseBool(client, argv[1], &pause)) {
+			return false;
+		}
+		state = pause ? STATE_PAUSE : STATE_PLAY;
+		emitEvent(IDLE_PLAYER);
+	}
+	return true;
+}
+
+static bool cmdStop(struct mockClient* client, int argc, char** argv) {
+	state = STATE_STOP;
+	emitEvent(IDLE_PLAYER);
+	return true;
+}
+
+static bool cmdNext(struct mockClient* client, int argc, char** argv) {
+	if (current != -1) {
+		if (optConsume) {
+			queueDelete(current);
+			touchQueue(current == -1 ? 0 : current);
+			emitEvent(IDLE_PLAYLIST);
+		} else {
+			++current;
+		}
+		if (current >= (long) queueLength || current == -1) {
+			current = (optRepeat && queueLength) ? 0 : -1;
+		}
+		if (current == -1) {
+			state = STATE_STOP;
+		}
+		emitEvent(IDLE_PLAYER);
+	}
+	return true;
+}
+
+static bool cmdPrevious(struct mockClient* client, int argc, char** argv) {
+	if (current > 0) {
+		--current;
+		emitEvent(IDLE_PLAYER);
+	}
+	return true;
+}
+
+static bool setOption(struct mockClient* client, const char* arg, bool* option) {
+	if (!parseBool(client, arg, option)) {
+		return false;
+	}
+	emitEvent(IDLE_OPTIONS);
+	return true;
+}
+
+static bool cmdRandom(struct mockClient* client, int argc, char** argv) {
+	return setOption(client, argv[1], &optRandom);
+}
+
+static bool cmdRepeat(struct mockClient* client, int argc, char** argv) {
+	return setOption(client, argv[1], &optRepeat);
+}
+
+static bool cmdSingle(struct mockClient* client, int argc, char** argv) {
+	return setOption(client, argv[1], &optSingle);
+}
+
+static bool cmdConsume(struct mockClient* client, int argc, char** argv) {
+	return setOption(client, argv[1], &optConsume);
+}
+
+static bool cmdSetvol(struct mockClient* client, int argc, char** argv) {
+	const int value = atoi(argv[1]);
+	if (value < 0 || value > 100) {
+		ack(client, ACK_ERROR_ARG, "Invalid volume value");
+		return false;
+	}
+	volume = value;
+	emitEvent(IDLE_MIXER);
+	return true;
+}
+
+static bool cmdStatus(struct mockClient* client, int argc, char** argv) {
+	static const char* stateNames[] = { "stop", "play", "pause" };
+	out(client, "volume: %d\nrepeat: %d\nrandom: %d\nsingle: %d\nconsume: %d\nplaylist: %u\nplaylistlength: %zu\nmixrampdb: 0.000000\nstate: %s\n",
+		volume, optRepeat, optRandom, optSingle, optConsume, queueVersion, queueLength, stateNames[state]);
+	if (current != -1) {
+		const unsigned int duration = songs[queue[current].song].duration;
+		out(client, "song: %ld\nsongid: %u\n", current, queue[current].id);
+		if (current + 1 < (long) queueLength) {
+			out(client, "nextsong: %ld\nnextsongid: %u\n", current + 1, queue[current + 1].id);
+		}
+		if (state != STATE_STOP) {
+			out(client, "time: 0:%u\nelapsed: 0.000\nduration: %u.000\nbitrate: 320\naudio: 44100:24:2\n", duration, duration);
+		}
+	}
+	if (updating) {
+		out(client, "updating_db: %u\n", updateJob);
+	}
+	return true;
+}
+
+static bool cmdCurrentsong(struct mockClient* client, int argc, char** argv) {
+	if (current != -1) {
+		printQueueEntry(client, current);
+	}
+	return true;
+}
+
+static bool cmdStats(struct mockClient* client, int argc, char** argv) {
+	unsigned long long playtime = 0;
+	for (size_t i = 0; i < songCount; ++i) {
+		playtime += songs[i].duration;
+	}
+	out(client, "artists: %zu\nalbums: %zu\nsongs: %zu\nuptime: %ld\ndb_playtime: %llu\ndb_update: %ld\nplaytime: 0\n",
+		countDistinct(offsetof(struct mockSong, artist)), countDistinct(offsetof(struct mockSong, album)), songCount,
+		(long) (time(NULL) - startTime), playtime, (long) dbUpdate);
+	return true;
+}
+
+static int64_t nowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Bumps mtime of some album directories and their songs, so sync code sees something to pick up
+static void mutateLibrary(const char* uri) {
+	const size_t len = strlen(uri);
+	const time_t now = time(NULL);
+	for (unsigned int m = 0; m < mutateDirs && directoryCount; ++m) {
+		size_t d = rngBelow(directoryCount);
+		for (size_t tries = 0; tries < directoryCount && !isInside(directories[d].path, uri, len); ++tries) {
+			d = (d + 1) % directoryCount;
+		}
+		if (!isInside(directories[d].path, uri, len)) {
+			return;
+		}
+		directories[d].mtime = now;
+		const size_t dirLen = strlen(directories[d].path);
+		for (size_t s = songLowerBound(directories[d].path); s < songCount && isInside(songs[s].file, directories[d].path, dirLen); ++s) {
+			songs[s].mtime = now;
+		}
+	}
+}
+
+static bool cmdUpdate(struct mockClient* client, int argc, char** argv) {
+	if (!updating) {
+		updating = true;
+		++updateJob;
+		mutateLibrary(argc > 1 ? argv[1] : "");
+		updateDoneAt = nowMs() + updateMs;
+		emitEvent(IDLE_UPDATE);
+	}
+	out(client, "updating_db: %u\n", updateJob);
+	return true;
+}
+
+static bool cmdPing(struct mockClient* client, int argc, char** argv) {
+	return true;
+}
+
+struct mockCommand {
+	const char* name;
+	bool (*handler)(struct mockClient*, int, char**);
+	int minArgs, maxArgs;
+};
+
+static const struct mockCommand commands[] = {
+	{ "add", cmdAdd, 1, 1 },
+	{ "addid", cmdAddid, 1, 2 },
+	{ "clear", cmdClear, 0, 0 },
+	{ "consume", cmdConsume, 1, 1 },
+	{ "currentsong", cmdCurrentsong, 0, 0 },
+	{ "delete", cmdDelete, 1, 1 },
+	{ "deleteid", cmdDeleteid, 1, 1 },
+	{ "find", cmdFind, 2, MOCK_MAX_ARGS - 1 },
+	{ "listall", cmdListall, 0, 1 },
+	{ "listallinfo", cmdListallinfo, 0, 1 },
+	{ "listplaylist", cmdListplaylist, 1, 1 },
+	{ "listplaylists", cmdListplaylists, 0, 0 },
+	{ "load", cmdLoad, 1, 1 },
+	{ "lsinfo", cmdLsinfo, 0, 1 },
+	{ "move", cmdMove, 2, 2 },
+	{ "moveid", cmdMoveid, 2, 2 },
+	{ "next", cmdNext, 0, 0 },
+	{ "pause", cmdPause, 0, 1 },
+	{ "ping", cmdPing, 0, 0 },
+	{ "play", cmdPlay, 0, 1 },
+	{ "playid", cmdPlayid, 0, 1 },
+	{ "playlistadd", cmdPlaylistadd, 2, 2 },
+	{ "playlistclear", cmdPlaylistclear, 1, 1 },
+	{ "playlistdelete", cmdPlaylistdelete, 2, 2 },
+	{ "playlistfind", cmdPlaylistfind, 2, 2 },
+	{ "playlistinfo", cmdPlaylistinfo, 0, 1 },
+	{ "plchanges", cmdPlchanges, 1, 2 },
+	{ "plchangesposid", cmdPlchangesposid, 1, 2 },
+	{ "previous", cmdPrevious, 0, 0 },
+	{ "random", cmdRandom, 1, 1 },
+	{ "repeat", cmdRepeat, 1, 1 },
+	{ "rm", cmdRm, 1, 1 },
+	{ "setvol", cmdSetvol, 1, 1 },
+	{ "shuffle", cmdShuffle, 0, 1 },
+	{ "single", cmdSingle, 1, 1 },
+	{ "stats", cmdStats, 0, 0 },
+	{ "status", cmdStatus, 0, 0 },
+	{ "stop", cmdStop, 0, 0 },
+	{ "update", cmdUpdate, 0, 1 },
+	{ NULL, NULL, 0, 0 }
+};
+
+// Splits line in place into MPD arguments, handling "quoted \"strings\"" the same way as MPD does
+static int tokenize(char* line, char** argv) {
+	int argc = 0;
+	char* p = line;
+	while (*p && argc < MOCK_MAX_ARGS) {
+		while (*p == ' ' || *p == '\t') {
+			++p;
+		}
+		if (!*p) {
+			break;
+		}
+		if (*p == '"') {
+			char* dst = ++p;
+			argv[argc++] = dst;
+			while (*p && *p != '"') {
+				if (*p == '\\' && p[1]) {
+					++p;
+				}
+				*dst++ = *p++;
+			}
+			if (*p == '"') {
+				++p;
+			}
+			*dst = '\0';
+		} else {
+			argv[argc++] = p;
+			while (*p && *p != ' ' && *p != '\t') {
+				++p;
+			}
+			if (*p) {
+				*p++ = '\0';
+			}
+		}
+	}
+	return argc;
+}
+
+static bool executeLine(struct mockClient* client, char* line) {
+	char* argv[MOCK_MAX_ARGS];
+	const int argc = tokenize(line, argv);
+	if (argc == 0) {
+		client->commandName = "";
+		ack(client, ACK_ERROR_UNKNOWN, "No command given");
+		return false;
+	}
+	client->commandName = argv[0];
+	for (const struct mockCommand* command = commands; command->name; ++command) {
+		if (strcmp(command->name, argv[0]) == 0) {
+			if (argc - 1 < command->minArgs || argc - 1 > command->maxArgs) {
+				ack(client, ACK_ERROR_ARG, "wrong number of arguments for \"%s\"", argv[0]);
+				return false;
+			}
+			return command->handler(client, argc, argv);
+		}
+	}
+	ack(client, ACK_ERROR_UNKNOWN, "unknown command \"%s\"", argv[0]);
+	return false;
+}
+
+static void injectLatency(void) {
+	const unsigned int ms = latencyMs + (jitterMs ? rngBelow(jitterMs + 1) : 0);
+	if (ms) {
+		const struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void resetList(struct mockClient* client) {
+	for (size_t i = 0; i < client->listLength; ++i) {
+		free(client->list[i]);
+	}
+	client->listLength = 0;
+	client->inList = false;
+}
+
+static unsigned int parseIdleMask(int argc, char** argv) {
+	if (argc < 2) {
+		return IDLE_ALL;
+	}
+	unsigned int mask = 0;
+	for (int i = 1; i < argc; ++i) {
+		for (unsigned int n = 0; idleNames[n]; ++n) {
+			if (strcmp(argv[i], idleNames[n]) == 0) {
+				mask |= 1U << n;
+			}
+		}
+	}
+	return mask;
+}
+
+// Returns false if connection should be closed
+static bool handleLine(struct mockClient* client, char* line) {
+	if (verbose) {
+		fprintf(stderr, "[%d] %s\n", client->fd, line);
+	}
+	client->listIndex = 0;
+	if (client->inList) {
+		if (strcmp(line, "command_list_end") == 0) {
+			injectLatency();
+			bool ok = true;
+			for (size_t i = 0; i < client->listLength && ok; ++i) {
+				client->listIndex = i;
+				ok = executeLine(client, client->list[i]);
+				if (ok && client->listOk) {
+					out(client, "list_OK\n");
+				}
+			}
+			if (ok) {
+				out(client, "OK\n");
+			}
+			resetList(client);
+		} else {
+			client->list = growArray(client->list, &client->listCapacity, client->listLength, sizeof(char*));
+			client->list[client->listLength++] = xstrdup(line);
+		}
+		return true;
+	}
+	if (client->idle) {
+		if (strcmp(line, "noidle") == 0) {
+			sendIdleChanges(client);
+			return true;
+		}
+		return false; // MPD closes connection on anything else during idle
+	}
+	if (strcmp(line, "command_list_begin") == 0 || strcmp(line, "command_list_ok_begin") == 0) {
+		client->inList = true;
+		client->listOk = strcmp(line, "command_list_ok_begin") == 0;
+		return true;
+	}
+	if (strcmp(line, "close") == 0) {
+		return false;
+	}
+	if (strncmp(line, "idle", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+		char* argv[MOCK_MAX_ARGS];
+		const int argc = tokenize(line, argv);
+		client->idleMask = parseIdleMask(argc, argv);
+		client->idle = true;
+		if (client->pending & client->idleMask) {
+			sendIdleChanges(client);
+		}
+		return true;
+	}
+	if (strcmp(line, "noidle") == 0) {
+		return true; // Not idling, nothing to cancel
+	}
+	injectLatency();
+	if (executeLine(client, line)) {
+		out(client, "OK\n");
+	}
+	return true;
+}
+
+static void closeClient(struct mockClient* client) {
+	close(client->fd);
+	client->fd = -1;
+	resetList(client);
+	free(client->in);
+	free(client->out);
+	free(client->list);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+static bool readClient(struct mockClient* client) {
+	if (client->inCapacity - client->inLength < 4096) {
+		client->inCapacity = client->inCapacity ? client->inCapacity * 2 : 8192;
+		client->in = realloc(client->in, client->inCapacity);
+		if (!client->in) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	const ssize_t r = read(client->fd, client->in + client->inLength, client->inCapacity - client->inLength - 1);
+	if (r <= 0) {
+		return r == -1 && errno == EINTR;
+	}
+	client->inLength += r;
+	char* start = client->in;
+	char* newline;
+	bool keep = true;
+	while (keep && (newline = memchr(start, '\n', client->in + client->inLength - start))) {
+		*newline = '\0';
+		keep = handleLine(client, start);
+		start = newline + 1;
+	}
+	client->inLength -= start - client->in;
+	memmove(client->in, start, client->inLength);
+	flushClient(client);
+	return keep;
+}
+
+static void onSignal(int sig) {
+	running = 0;
+}
+
+static void usage(const char* self) {
+	fprintf(stderr, "Usage: %s [-S socket | -p port] [-t tracks] [-s seed] [-l latencyMs] [-j jitterMs] [-u updateMs] [-M dirsPerUpdate] [-v]\n", self);
+}
+
+int main(int argc, char* argv[]) {
+	const char* socketPath = NULL;
+	unsigned int port = MOCK_DEFAULT_PORT;
+	size_t tracks = MOCK_DEFAULT_TRACKS;
+	int opt;
+	while ((opt = getopt(argc, argv, "S:p:t:s:l:j:u:M:vh")) != -1) {
+		switch (opt) {
+			case 'S':
+				socketPath = optarg;
+				break;
+			case 'p':
+				port = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				tracks = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				rngState = strtoull(optarg, NULL, 0) | 1;
+				break;
+			case 'l':
+				latencyMs = strtoul(optarg, NULL, 10);
+				break;
+			case 'j':
+				jitterMs = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				updateMs = strtoul(optarg, NULL, 10);
+				break;
+			case 'M':
+				mutateDirs = strtoul(optarg, NULL, 10);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	startTime = time(NULL);
+	generateLibrary(tracks);
+
+	int listener;
+	if (socketPath) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Socket path too long\n");
+			return 1;
+		}
+		strcpy(addr.sun_path, socketPath);
+		unlink(socketPath);
+		listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listener == -1 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+			perror("bind");
+			return 1;
+		}
+	} else {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		const int one = 1;
+		if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+			perror("bind");
+			return 1;
+		}
+	}
+	if (listen(listener, 16) == -1) {
+		perror("listen");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	for (unsigned int i = 0; i < MOCK_MAX_CLIENTS; ++i) {
+		clients[i].fd = -1;
+	}
+	fprintf(stderr, "Mock MPD ready: %zu songs, %zu directories\n", songCount, directoryCount);
+
+	while (running) {
+		struct pollfd fds[MOCK_MAX_CLIENTS + 1];
+		unsigned int owners[MOCK_MAX_CLIENTS + 1];
+		nfds_t nfds = 0;
+		fds[nfds].fd = listener;
+		fds[nfds++].events = POLLIN;
+		for (unsigned int i = 0; i < MOCK_MAX_CLIENTS; ++i) {
+			if (clients[i].fd != -1) {
+				owners[nfds] = i;
+				fds[nfds].fd = clients[i].fd;
+				fds[nfds++].events = POLLIN;
+			}
+		}
+		int timeout = -1;
+		if (updateDoneAt >= 0) {
+			const int64_t left = updateDoneAt - nowMs();
+			timeout = left > 0 ? (int) left : 0;
+		}
+		if (poll(fds, nfds, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+		if (updateDoneAt >= 0 && nowMs() >= updateDoneAt) {
+			updateDoneAt = -1;
+			updating = false;
+			dbUpdate = time(NULL);
+			emitEvent(IDLE_DATABASE | IDLE_UPDATE);
+		}
+		if (fds[0].revents & POLLIN) {
+			const int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd != -1) {
+				unsigned int i = 0;
+				while (i < MOCK_MAX_CLIENTS && clients[i].fd != -1) {
+					++i;
+				}
+				if (i == MOCK_MAX_CLIENTS) {
+					close(fd);
+				} else {
+					clients[i].fd = fd;
+					out(&clients[i], "OK MPD %s\n", MOCK_VERSION);
+					flushClient(&clients[i]);
+				}
+			}
+		}
+		for (nfds_t n = 1; n < nfds; ++n) {
+			if (fds[n].revents & (POLLIN | POLLHUP | POLLERR)) {
+				struct mockClient* client = &clients[owners[n]];
+				if (client->fd != -1 && !readClient(client)) {
+					closeClient(client);
+				}
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < MOCK_MAX_CLIENTS; ++i) {
+		if (clients[i].fd != -1) {
+			closeClient(&clients[i]);
+		}
+	}
+	close(listener);
+	if (socketPath) {
+		unlink(socketPath);
+	}
+	return 0;
+}
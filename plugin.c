@@ -34,15 +34,34 @@ limitations under the License.
 #endif
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "public_definitions.h"
@@ -99,6 +118,10 @@ static const char* botNickname = "ArchiTSMBot"; // Can be any valid nickname use
 static const char* musicPath = "/home/ts3mb/music/"; // Absolute path to music folder, with trailing slash
 static const char* rootGroup = "90521"; // Server group (ID) that has full (root) access to all commands
 static const char* favWebPath = "http://radio.JustArchi.net/favs/";
+static const bool searchIgnoreDiacritics = true; // Whether "lodz" should find "Łódź" as well
+static const unsigned int searchMaxTypos = 2; // Forgiven by fuzzy search and "did you mean", 0 turns them off
+static const unsigned int commandTimeout = 15; // Seconds a command gets for talking to MPD and tools it runs
+static const unsigned int bulkCommandTimeout = 900; // Same for bulk ones, like !update or !zipfavs
 
 // Don't change things below
 static uint64 myServerConnectionHandlerID = 0;
@@ -114,9 +137,10 @@ static bool notifyIsWorking = false;
 static char botPath[PATH_BUFSIZE];
 static char themeFile[PATH_BUFSIZE];
 static char favPath[PATH_BUFSIZE];
+static char libraryFile[PATH_BUFSIZE];
+static char metricsFile[PATH_BUFSIZE];
+static char traceFile[PATH_BUFSIZE];
 
-//static pthread_mutex_t notifyThreadMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_t notifyThread = 0;
 //static pthread_t pokeThread = 0;
 
 typedef enum {ALL, RANDOM, LAST} favPlayType;
@@ -125,9 +149,651 @@ static inline bool randomBool() {
 	return rand() % 2 == 1;
 }
 
-static void toLower(char* string) {
-	for (unsigned int i = 0; string[i]; ++i) {
-		string[i] = tolower(string[i]);
+/*********************************** Search keys ************************************/
+/*
+ * Everything we search in is compared by its key: case folded for Latin, Greek and Cyrillic scripts and,
+ * with searchIgnoreDiacritics, stripped of diacritics, so "lodz" finds "ŁÓDŹ". Keys are plain UTF-8 themselves,
+ * so once both sides are made, matching is a plain byte-wise strstr(), as cheap as ASCII strcasestr().
+ */
+
+#define SEARCH_KEY_SIZE(length) ((length) + 1) // Keys are never longer than strings they're made of
+
+// Base letters of U+00E0-U+00FF and U+0100-U+017F, '#' marks ligatures which expand to two letters
+static const char searchBaseLatin1[] = "aaaaaa#ceeeeiiiidnooooo#ouuuuy#y";
+static const char searchBaseLatinExtendedA[] =
+	"aaaaaaccccccccdd" "ddeeeeeeeeeegggg" "gggghhhhiiiiiiii" "ii##jjkkklllllll"
+	"lllnnnnnnnnnoooo" "oo##rrrrrrssssss" "ssttttttuuuuuuuu" "uuuuwwyyyzzzzzzs";
+
+// Simple case folding, only the characters we know about, everything else stays as it is
+static uint32_t searchFold(const uint32_t c) {
+	if (c < 0x80) {
+		return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+	}
+	if ((c >= 0xc0 && c <= 0xde && c != 0xd7) || (c >= 0x391 && c <= 0x3ab && c != 0x3a2) || (c >= 0x410 && c <= 0x42f)) {
+		return c + 0x20;
+	}
+	if ((c >= 0x100 && c <= 0x12f) || (c >= 0x132 && c <= 0x137) || (c >= 0x14a && c <= 0x177) || (c >= 0x218 && c <= 0x21b)
+		|| (c >= 0x460 && c <= 0x481) || (c >= 0x48a && c <= 0x4bf) || (c >= 0x1e00 && c <= 0x1e95) || (c >= 0x1ea0 && c <= 0x1eff)) {
+		return c | 1;
+	}
+	if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) {
+		return c + (c & 1);
+	}
+	if (c >= 0x400 && c <= 0x40f) {
+		return c + 0x50;
+	}
+	if (c >= 0x388 && c <= 0x38a) {
+		return c + 0x25;
+	}
+	switch (c) {
+		case 0x130: return 'i'; // Dotted capital I
+		case 0x178: return 0xff;
+		case 0x17f: return 's'; // Long s
+		case 0x386: return 0x3ac;
+		case 0x38c: return 0x3cc;
+		case 0x38e: return 0x3cd;
+		case 0x38f: return 0x3ce;
+		case 0x3c2: return 0x3c3; // Final sigma
+		default: return c;
+	}
+}
+
+// Base letter of already folded c, 0 if it has no diacritics to strip
+static uint32_t searchStrip(const uint32_t c) {
+	if (c >= 0xe0 && c <= 0xff && searchBaseLatin1[c - 0xe0] != '#' && c != 0xf7) {
+		return searchBaseLatin1[c - 0xe0];
+	}
+	if (c >= 0x100 && c <= 0x17f && searchBaseLatinExtendedA[c - 0x100] != '#') {
+		return searchBaseLatinExtendedA[c - 0x100];
+	}
+	switch (c) {
+		case 0x219: return 's';
+		case 0x21b: return 't';
+		case 0x390: case 0x3af: case 0x3ca: return 0x3b9; // ι
+		case 0x3b0: case 0x3cd: case 0x3cb: return 0x3c5; // υ
+		case 0x3ac: return 0x3b1; // α
+		case 0x3ad: return 0x3b5; // ε
+		case 0x3ae: return 0x3b7; // η
+		case 0x3cc: return 0x3bf; // ο
+		case 0x3ce: return 0x3c9; // ω
+		case 0x439: return 0x438; // й
+		case 0x451: return 0x435; // ё
+		default: return 0;
+	}
+}
+
+static inline size_t searchPut(char* output, size_t length, const uint32_t c) {
+	if (c < 0x80) {
+		output[length++] = c;
+	} else if (c < 0x800) {
+		output[length++] = 0xc0 | (c >> 6);
+		output[length++] = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		output[length++] = 0xe0 | (c >> 12);
+		output[length++] = 0x80 | ((c >> 6) & 0x3f);
+		output[length++] = 0x80 | (c & 0x3f);
+	} else {
+		output[length++] = 0xf0 | (c >> 18);
+		output[length++] = 0x80 | ((c >> 12) & 0x3f);
+		output[length++] = 0x80 | ((c >> 6) & 0x3f);
+		output[length++] = 0x80 | (c & 0x3f);
+	}
+	return length;
+}
+
+// Writes key of input to output, which has to have at least SEARCH_KEY_SIZE(strlen(input)) bytes, returns its length
+static size_t searchKey(char* output, const char* input) {
+	const unsigned char* s = (const unsigned char*) input;
+	size_t length = 0;
+	while (*s) {
+		if (*s < 0x80) { // Most of the time
+			output[length++] = *s >= 'A' && *s <= 'Z' ? *s + ('a' - 'A') : *s;
+			++s;
+			continue;
+		}
+		uint32_t c;
+		unsigned int size;
+		if ((*s & 0xe0) == 0xc0) {
+			c = *s & 0x1f;
+			size = 2;
+		} else if ((*s & 0xf0) == 0xe0) {
+			c = *s & 0x0f;
+			size = 3;
+		} else if ((*s & 0xf8) == 0xf0) {
+			c = *s & 0x07;
+			size = 4;
+		} else {
+			size = 0;
+		}
+		for (unsigned int i = 1; i < size; ++i) {
+			if ((s[i] & 0xc0) != 0x80) {
+				size = 0;
+				break;
+			}
+			c = (c << 6) | (s[i] & 0x3f);
+		}
+		if (unlikely(size == 0)) { // Not UTF-8, compare such bytes as they are
+			output[length++] = *s++;
+			continue;
+		}
+		s += size;
+		c = searchFold(c);
+		if (c == 0xdf || c == 0x1e9e) { // ß folds to two letters
+			output[length++] = 's';
+			output[length++] = 's';
+			continue;
+		}
+		if (searchIgnoreDiacritics) {
+			if (c >= 0x300 && c <= 0x36f) { // Combining marks, decomposed names are common on files coming from Macs
+				continue;
+			}
+			const char* ligature = NULL;
+			switch (c) {
+				case 0xe6: ligature = "ae"; break;
+				case 0xfe: ligature = "th"; break;
+				case 0x133: ligature = "ij"; break;
+				case 0x153: ligature = "oe"; break;
+			}
+			if (ligature != NULL) {
+				output[length++] = ligature[0];
+				output[length++] = ligature[1];
+				continue;
+			}
+			const uint32_t base = searchStrip(c);
+			if (base != 0) {
+				c = base;
+			}
+		}
+		length = searchPut(output, length, c);
+	}
+	output[length] = '\0';
+	return length;
+}
+
+// Whether text contains key (already made with searchKey()), for text we don't have keys for
+static bool searchMatch(const char* text, const char* key) {
+	char textKey[SEARCH_KEY_SIZE(strlen(text))];
+	searchKey(textKey, text);
+	return strstr(textKey, key) != NULL;
+}
+
+/*********************************** Metrics ************************************/
+/*
+ * Every thread gets its own shard of counters and histograms, written only by that thread,
+ * so recording is a plain relaxed load + store without any locking or atomic read-modify-write.
+ * Shards are pushed once to a global lock-free list and summed up when somebody asks for a report.
+ */
+
+#define METRICS_DUMP_INTERVAL 60 // Seconds between dumps of metrics.prom
+#define METRICS_HISTOGRAM_SUB_BITS 3 // 8 linear sub-buckets per power of two, max 12.5% error
+#define METRICS_HISTOGRAM_SUB_BUCKETS (1 << METRICS_HISTOGRAM_SUB_BITS)
+#define METRICS_HISTOGRAM_BUCKETS ((32 - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_BUCKETS) // Up to 2^32 us
+
+// Keep sorted, looked up with bsearch()
+static const char* metricsCommandNames[] = {
+	"!addartist", "!addartists", "!addfile", "!addfiles", "!addsong", "!addsongs", "!addtheme", "!addtree", "!artist", "!artists",
+	"!cancel", "!clear", "!consume", "!debug", "!fav", "!fav?", "!favs", "!file", "!files", "!fixfavs", "!fuzzy", "!guess", "!lastfav",
+	"!ls", "!next", "!nextfav", "!notify", "!pause", "!perf", "!play", "!playfavs", "!playfile", "!playsong", "!playtheme",
+	"!poke", "!pokespam", "!prev", "!random", "!randomfav", "!rankfav", "!repeat", "!reset", "!restart", "!say",
+	"!shh", "!shuffle", "!single", "!song", "!songs", "!stats", "!status", "!stop", "!theme", "!themefixed",
+	"!themes", "!trace", "!unfav", "!update", "!version", "!vol+", "!vol-", "!wypierdol", "!zipfavs",
+	"unknown" // Must be last
+};
+#define METRICS_COMMANDS (sizeof(metricsCommandNames) / sizeof(metricsCommandNames[0]))
+#define METRICS_UNKNOWN_COMMAND (METRICS_COMMANDS - 1)
+
+typedef enum {
+	METRIC_MPD_ROUNDTRIPS,
+	METRIC_FORKS,
+	METRIC_MESSAGES_SENT,
+	METRIC_MESSAGES_FAILED,
+	METRIC_LIBRARY_HITS, // Every cache has hits followed by misses
+	METRIC_LIBRARY_MISSES,
+	METRIC_THEMES_HITS,
+	METRIC_THEMES_MISSES,
+	METRIC_FAVS_HITS,
+	METRIC_FAVS_MISSES,
+	METRIC_CLIENTS_HITS,
+	METRIC_CLIENTS_MISSES,
+	METRIC_REGEX_HITS,
+	METRIC_REGEX_MISSES,
+	METRIC_QUERIES_HITS,
+	METRIC_QUERIES_MISSES,
+	METRIC_PLAYLISTS_HITS,
+	METRIC_PLAYLISTS_MISSES,
+	METRIC_LIBRARY_SYNCS,
+	METRIC_LIBRARY_RELOADS,
+	METRIC_WATCHER_UPDATES,
+	METRIC_WATCHER_OVERFLOWS,
+	METRIC_SEARCH_SUGGESTIONS,
+	METRIC_ARENA_ALLOCATIONS,
+	METRIC_ARENA_BYTES,
+	METRIC_ARENA_OVERFLOWS,
+	METRIC_ARENA_FAILURES,
+	METRIC_JOBS_REJECTED,
+	METRIC_JOBS_CANCELLED,
+	METRIC_COMMAND_TIMEOUTS,
+	METRIC_MPD_TIMEOUTS,
+	METRIC_CHILD_TIMEOUTS,
+	METRIC_COUNTERS // Must be last
+} metricCounter;
+
+static const char* metricsCounterNames[METRIC_COUNTERS] = {
+	"mpd_roundtrips_total",
+	"forks_total",
+	"messages_sent_total",
+	"messages_failed_total",
+	"library_cache_hits_total",
+	"library_cache_misses_total",
+	"themes_cache_hits_total",
+	"themes_cache_misses_total",
+	"favs_cache_hits_total",
+	"favs_cache_misses_total",
+	"clients_cache_hits_total",
+	"clients_cache_misses_total",
+	"regex_cache_hits_total",
+	"regex_cache_misses_total",
+	"query_cache_hits_total",
+	"query_cache_misses_total",
+	"playlists_cache_hits_total",
+	"playlists_cache_misses_total",
+	"library_syncs_total",
+	"library_reloads_total",
+	"watcher_updates_total",
+	"watcher_overflows_total",
+	"search_suggestions_total",
+	"arena_allocations_total",
+	"arena_bytes_total",
+	"arena_overflow_blocks_total",
+	"arena_failures_total",
+	"jobs_rejected_total",
+	"jobs_cancelled_total",
+	"command_timeouts_total",
+	"mpd_timeouts_total",
+	"child_timeouts_total"
+};
+
+static const struct {
+	const char* name;
+	metricCounter hits; // Misses are right after
+} metricsCaches[] = {
+	{ "library", METRIC_LIBRARY_HITS },
+	{ "themes", METRIC_THEMES_HITS },
+	{ "favs", METRIC_FAVS_HITS },
+	{ "clients", METRIC_CLIENTS_HITS },
+	{ "regex", METRIC_REGEX_HITS },
+	{ "query", METRIC_QUERIES_HITS },
+	{ "playlists", METRIC_PLAYLISTS_HITS }
+};
+
+typedef enum {
+	METRIC_COMMANDS_IN_FLIGHT,
+	METRIC_LOOP_TASKS_QUEUED,
+	METRIC_ARENA_BYTES_RESERVED,
+	METRIC_CONTROL_JOBS_QUEUED,
+	METRIC_QUERY_JOBS_QUEUED,
+	METRIC_BULK_JOBS_QUEUED,
+	METRIC_GAUGES // Must be last
+} metricGauge;
+
+static const char* metricsGaugeNames[METRIC_GAUGES] = {
+	"commands_in_flight",
+	"loop_tasks_queued",
+	"arena_bytes_reserved",
+	"control_jobs_queued",
+	"query_jobs_queued",
+	"bulk_jobs_queued"
+};
+
+struct metricsShard {
+	uint64_t counters[METRIC_COUNTERS];
+	uint64_t commandCount[METRICS_COMMANDS];
+	uint64_t commandSum[METRICS_COMMANDS]; // In microseconds
+	uint64_t commandMax[METRICS_COMMANDS];
+	uint64_t histogram[METRICS_COMMANDS][METRICS_HISTOGRAM_BUCKETS];
+	struct metricsShard* next;
+};
+
+static struct metricsShard* metricsShards = NULL;
+static __thread struct metricsShard* metricsLocalShard = NULL;
+static unsigned int metricsGeneration = 0; // Bumped by metricsFree(), shards of older ones are gone
+static __thread unsigned int metricsLocalGeneration = 0;
+static int64_t metricsGauges[METRIC_GAUGES]; // Shared by all threads, these go both ways
+
+static struct metricsShard* metricsShard() {
+	if (unlikely(!metricsLocalShard || metricsLocalGeneration != __atomic_load_n(&metricsGeneration, __ATOMIC_ACQUIRE))) {
+		struct metricsShard* shard = (struct metricsShard*) calloc(1, sizeof(struct metricsShard));
+		if (unlikely(!shard)) {
+			return NULL;
+		}
+		shard->next = __atomic_load_n(&metricsShards, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&metricsShards, &shard->next, shard, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		metricsLocalShard = shard;
+		metricsLocalGeneration = __atomic_load_n(&metricsGeneration, __ATOMIC_RELAXED);
+	}
+	return metricsLocalShard;
+}
+
+// Only owning thread writes to the shard, readers may see slightly stale but never torn values
+static inline void metricsAdd(uint64_t* counter, const uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void metricsCountMany(const metricCounter counter, const uint64_t value) {
+	struct metricsShard* shard = metricsShard();
+	if (likely(shard != NULL)) {
+		metricsAdd(&shard->counters[counter], value);
+	}
+}
+
+static inline void metricsCount(const metricCounter counter) {
+	metricsCountMany(counter, 1);
+}
+
+static inline void metricsGaugeAdd(const metricGauge gauge, const int64_t value) {
+	__atomic_add_fetch(&metricsGauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metricsNow() { // In microseconds
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline unsigned int metricsBucket(uint64_t value) {
+	if (value < METRICS_HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	if (unlikely(value > UINT32_MAX)) {
+		value = UINT32_MAX;
+	}
+	const unsigned int exponent = 63 - __builtin_clzll(value);
+	const unsigned int sub = (value >> (exponent - METRICS_HISTOGRAM_SUB_BITS)) & (METRICS_HISTOGRAM_SUB_BUCKETS - 1);
+	return (exponent - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static inline uint64_t metricsBucketUpperBound(const unsigned int bucket) { // Inclusive
+	if (bucket < METRICS_HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	const unsigned int exponent = bucket / METRICS_HISTOGRAM_SUB_BUCKETS + METRICS_HISTOGRAM_SUB_BITS - 1;
+	const uint64_t sub = bucket % METRICS_HISTOGRAM_SUB_BUCKETS;
+	return ((METRICS_HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - METRICS_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static int metricsCompareCommand(const void* key, const void* element) {
+	return strcmp((const char*) key, *(const char* const*) element);
+}
+
+static unsigned int metricsCommandIndex(const char* message) {
+	char keyword[16];
+	unsigned int i = 0;
+	for (; message[i] && message[i] != ' ' && i < sizeof(keyword) - 1; ++i) {
+		keyword[i] = tolower(message[i]);
+	}
+	keyword[i] = '\0';
+	const char** found = (const char**) bsearch(keyword, metricsCommandNames, METRICS_UNKNOWN_COMMAND, sizeof(const char*), metricsCompareCommand);
+	return found ? found - metricsCommandNames : METRICS_UNKNOWN_COMMAND;
+}
+
+static void metricsRecordCommand(const unsigned int command, const uint64_t microseconds) {
+	struct metricsShard* shard = metricsShard();
+	if (likely(shard != NULL)) {
+		metricsAdd(&shard->commandCount[command], 1);
+		metricsAdd(&shard->commandSum[command], microseconds);
+		metricsAdd(&shard->histogram[command][metricsBucket(microseconds)], 1);
+		if (microseconds > shard->commandMax[command]) {
+			__atomic_store_n(&shard->commandMax[command], microseconds, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*********************************** Tracing ************************************/
+/*
+ * Scoped spans, recorded into per-thread rings of complete events and exported on demand as Chrome trace JSON
+ * (chrome://tracing, Perfetto). While tracing is off, TRACE_SPAN() costs a single well-predicted branch on entry,
+ * and an equally predictable one on scope exit.
+ */
+
+#define TRACE_RING_SIZE 8192 // Events per thread, must be power of two
+
+struct traceEvent {
+	const char* category;
+	const char* name;
+	uint64_t start; // In nanoseconds
+	uint64_t duration;
+};
+
+struct traceRing {
+	struct traceEvent events[TRACE_RING_SIZE];
+	uint64_t head; // Total number of events ever written, owner thread only
+	pid_t tid;
+	struct traceRing* next;
+};
+
+struct traceSpan {
+	const char* category;
+	const char* name;
+	uint64_t start;
+};
+
+static bool traceEnabled = false;
+static uint64_t traceStartedAt = 0;
+static struct traceRing* traceRings = NULL;
+static __thread struct traceRing* traceLocalRing = NULL;
+static unsigned int traceGeneration = 0; // Bumped by traceFree(), rings of older ones are gone
+static __thread unsigned int traceLocalGeneration = 0;
+
+static inline uint64_t traceNow() { // In nanoseconds
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct traceRing* traceRing() {
+	if (unlikely(!traceLocalRing || traceLocalGeneration != __atomic_load_n(&traceGeneration, __ATOMIC_ACQUIRE))) {
+		struct traceRing* ring = (struct traceRing*) calloc(1, sizeof(struct traceRing));
+		if (unlikely(!ring)) {
+			return NULL;
+		}
+		ring->tid = syscall(SYS_gettid);
+		ring->next = __atomic_load_n(&traceRings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&traceRings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		traceLocalRing = ring;
+		traceLocalGeneration = __atomic_load_n(&traceGeneration, __ATOMIC_RELAXED);
+	}
+	return traceLocalRing;
+}
+
+// Only once no other thread of ours is left, threads that stay (TS3's) get new rings on their next span
+static void traceFree() {
+	struct traceRing* ring = __atomic_exchange_n(&traceRings, NULL, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&traceGeneration, 1, __ATOMIC_RELEASE);
+	while (ring != NULL) {
+		struct traceRing* next = ring->next;
+		free(ring);
+		ring = next;
+	}
+}
+
+static void traceSpanEnd(struct traceSpan* span) {
+	if (unlikely(span->start != 0)) {
+		struct traceRing* ring = traceRing();
+		if (likely(ring != NULL)) {
+			struct traceEvent* event = &ring->events[ring->head & (TRACE_RING_SIZE - 1)];
+			event->category = span->category;
+			event->name = span->name;
+			event->start = span->start;
+			event->duration = traceNow() - span->start;
+			__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(category, name) \
+	struct traceSpan TRACE_CONCAT(traceSpan, __LINE__) __attribute__ ((cleanup (traceSpanEnd), unused)) = \
+		{ (category), (name), unlikely(__atomic_load_n(&traceEnabled, __ATOMIC_RELAXED)) ? traceNow() : 0 }
+
+/*********************************** Arena ************************************/
+/*
+ * Bump allocator for temporaries of a command: argument views, query results, formatted messages and command strings.
+ * Every thread has its own arena, so allocating is bumping an offset without any locking, and freeing is rewinding
+ * to a mark taken earlier, everything at once. What doesn't fit into the newest block goes into a new one chained
+ * behind it, those go away on rewind while the first block stays for the next command. Arena of a thread never grows
+ * over ARENA_MAX, asking for more fails with ENOMEM, so a huge message can't take the stack (nor all memory) down.
+ */
+
+#define ARENA_BLOCK (64 * 1024) // Bytes of the first block, overflow ones are at least that big too
+#define ARENA_MAX (16 * 1024 * 1024) // Bytes of all blocks of one thread
+#define ARENA_ALIGN 16
+
+struct arenaBlock {
+	struct arenaBlock* previous;
+	size_t size; // Of data
+	size_t used;
+	char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+struct arena {
+	struct arenaBlock* block; // Newest one, only the first one has no previous
+	size_t reserved; // Bytes of data of all blocks
+	struct arena* next;
+};
+
+struct arenaMark {
+	struct arenaBlock* block; // NULL if thread had no arena and couldn't get one
+	size_t used;
+};
+
+static struct arena* arenas = NULL;
+static __thread struct arena* arenaLocal = NULL;
+static unsigned int arenaGeneration = 0; // Bumped by arenasFree(), arenas of older ones are gone
+static __thread unsigned int arenaLocalGeneration = 0;
+
+static struct arena* arenaThread() {
+	if (unlikely(!arenaLocal || arenaLocalGeneration != __atomic_load_n(&arenaGeneration, __ATOMIC_ACQUIRE))) {
+		struct arena* arena = (struct arena*) malloc(sizeof(struct arena));
+		struct arenaBlock* block = (struct arenaBlock*) malloc(sizeof(struct arenaBlock) + ARENA_BLOCK);
+		if (unlikely(!arena || !block)) {
+			free(arena);
+			free(block);
+			return NULL;
+		}
+		block->previous = NULL;
+		block->size = ARENA_BLOCK;
+		block->used = 0;
+		arena->block = block;
+		arena->reserved = ARENA_BLOCK;
+		arena->next = __atomic_load_n(&arenas, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&arenas, &arena->next, arena, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		arenaLocal = arena;
+		arenaLocalGeneration = __atomic_load_n(&arenaGeneration, __ATOMIC_RELAXED);
+		metricsGaugeAdd(METRIC_ARENA_BYTES_RESERVED, ARENA_BLOCK);
+	}
+	return arenaLocal;
+}
+
+// Uninitialized and aligned, valid until a rewind to a mark taken before, NULL (with ENOMEM) if arena is full
+static void* arenaAlloc(const size_t size) {
+	struct arena* arena = arenaThread();
+	if (unlikely(!arena || size > ARENA_MAX)) {
+		metricsCount(METRIC_ARENA_FAILURES);
+		errno = ENOMEM;
+		return NULL;
+	}
+	const size_t aligned = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	struct arenaBlock* block = arena->block;
+	if (unlikely(block->size - block->used < aligned)) { // Rest of this one is lost until rewind
+		const size_t blockSize = aligned > ARENA_BLOCK ? aligned : ARENA_BLOCK;
+		if (unlikely(blockSize > ARENA_MAX - arena->reserved || !(block = (struct arenaBlock*) malloc(sizeof(struct arenaBlock) + blockSize)))) {
+			metricsCount(METRIC_ARENA_FAILURES);
+			errno = ENOMEM;
+			return NULL;
+		}
+		block->previous = arena->block;
+		block->size = blockSize;
+		block->used = 0;
+		arena->block = block;
+		arena->reserved += blockSize;
+		metricsCount(METRIC_ARENA_OVERFLOWS);
+		metricsGaugeAdd(METRIC_ARENA_BYTES_RESERVED, blockSize);
+	}
+	void* memory = block->data + block->used;
+	block->used += aligned;
+	metricsCount(METRIC_ARENA_ALLOCATIONS);
+	metricsCountMany(METRIC_ARENA_BYTES, aligned);
+	return memory;
+}
+
+static char* arenaStrdup(const char* string) {
+	const size_t size = strlen(string) + 1;
+	char* copy = (char*) arenaAlloc(size);
+	if (likely(copy != NULL)) {
+		memcpy(copy, string, size);
+	}
+	return copy;
+}
+
+__attribute__ ((format (printf, 1, 2)))
+static char* arenaPrintf(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	const int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (unlikely(length < 0)) {
+		return NULL;
+	}
+	char* string = (char*) arenaAlloc(length + 1);
+	if (likely(string != NULL)) {
+		va_start(args, format);
+		vsnprintf(string, length + 1, format, args);
+		va_end(args);
+	}
+	return string;
+}
+
+static struct arenaMark arenaMark() {
+	struct arena* arena = arenaThread();
+	struct arenaMark mark = { NULL, 0 };
+	if (likely(arena != NULL)) {
+		mark.block = arena->block;
+		mark.used = arena->block->used;
+	}
+	return mark;
+}
+
+// Frees everything allocated after mark was taken, by this thread
+static void arenaRewind(const struct arenaMark mark) {
+	struct arena* arena = arenaLocal;
+	if (unlikely(!arena || arenaLocalGeneration != __atomic_load_n(&arenaGeneration, __ATOMIC_ACQUIRE))) {
+		return;
+	}
+	while (arena->block != mark.block && arena->block->previous != NULL) {
+		struct arenaBlock* block = arena->block;
+		arena->block = block->previous;
+		arena->reserved -= block->size;
+		metricsGaugeAdd(METRIC_ARENA_BYTES_RESERVED, -(int64_t) block->size);
+		free(block);
+	}
+	arena->block->used = mark.block != NULL ? mark.used : 0;
+}
+
+// Only once no other thread of ours is left, threads that stay (TS3's) get new arenas on their next allocation
+static void arenasFree() {
+	struct arena* arena = __atomic_exchange_n(&arenas, NULL, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&arenaGeneration, 1, __ATOMIC_RELEASE);
+	while (arena != NULL) {
+		struct arena* next = arena->next;
+		while (arena->block != NULL) {
+			struct arenaBlock* previous = arena->block->previous;
+			free(arena->block);
+			arena->block = previous;
+		}
+		metricsGaugeAdd(METRIC_ARENA_BYTES_RESERVED, -(int64_t) arena->reserved);
+		free(arena);
+		arena = next;
 	}
 }
 
@@ -143,16 +809,179 @@ static void logErrorToConsole(const char* message) {
 	}
 }
 
-static void sendErrorToChannel(const char* rawMessage) {
-	if (likely(myChannelID != -1 && myServerConnectionHandlerID != 0)) {
-		char message[14 + strlen(rawMessage) + 12 + 1];
-		snprintf(message, sizeof(message), "%s%s%s", "[b][color=red]", rawMessage, "[/color][/b]");
-		if (unlikely(ts3Functions.requestSendChannelTextMsg(myServerConnectionHandlerID, message, myChannelID, NULL) != ERROR_ok)) {
+/*
+ * Bot's own state (myServerConnectionHandlerID, myChannelID, myID, silence, nickname correction) belongs to
+ * the event loop thread, see loopWorker(). TS3 callbacks and helper threads don't touch it (lanes only read
+ * myServerConnectionHandlerID, atomically), they wrap what they want done into a task and post it through a lock-free
+ * MPSC queue (Vyukov's, with a stub node), eventfd wakes the loop up, and the loop runs tasks one at a time, in order
+ * they came. Nothing the loop runs may block. Commands and whatever the control lane sends come through an urgent
+ * queue, which the loop empties first, so they don't wait behind a long list of search results.
+ * Before the loop starts and after it stops, posting simply runs the task in place.
+ */
+
+struct loopTask;
+typedef void (*loopTaskRun)(struct loopTask* task);
+
+struct loopTask {
+	struct loopTask* next;
+	loopTaskRun run;
+	uint64_t postedAt; // In microseconds, see metricsNow()
+	uint64 serverConnectionHandlerID;
+	anyID clientID;
+	bool error;
+	bool urgent; // Goes through LOOP_QUEUE_URGENT
+	bool rootGranted; // Commands in lanes only, see isAccessGranted()
+	const char* text[3]; // Copies in data, or NULL
+	char data[];
+};
+
+typedef enum {
+	LOOP_QUEUE_URGENT,
+	LOOP_QUEUE_NORMAL,
+	LOOP_QUEUES // Must be last
+} loopQueueIndex;
+
+struct loopQueue {
+	struct loopTask* head; // Producers swap themselves in here
+	struct loopTask* tail; // Only the loop takes from here
+	struct loopTask* stub;
+};
+
+static struct loopTask loopUrgentStub;
+static struct loopTask loopNormalStub;
+static struct loopQueue loopQueues[LOOP_QUEUES] = {
+	[LOOP_QUEUE_URGENT] = { &loopUrgentStub, &loopUrgentStub, &loopUrgentStub },
+	[LOOP_QUEUE_NORMAL] = { &loopNormalStub, &loopNormalStub, &loopNormalStub }
+};
+static int loopEventFd = -1;
+static bool loopIsWorking = false;
+static __thread bool loopIsCurrent = false;
+static __thread bool loopPostsUrgent = false; // Tasks this thread makes are urgent, control lane's are
+
+// Task with its own copies of given strings, NULL if out of memory
+static struct loopTask* loopTaskNew(const loopTaskRun run, const char* text0, const char* text1, const char* text2) {
+	const char* texts[3] = { text0, text1, text2 };
+	size_t size = sizeof(struct loopTask);
+	for (unsigned int i = 0; i < 3; ++i) {
+		if (texts[i] != NULL) {
+			size += strlen(texts[i]) + 1;
+		}
+	}
+	struct loopTask* task = (struct loopTask*) calloc(1, size);
+	if (unlikely(!task)) {
+		return NULL;
+	}
+	task->run = run;
+	task->postedAt = metricsNow();
+	task->urgent = loopPostsUrgent;
+	char* data = task->data;
+	for (unsigned int i = 0; i < 3; ++i) {
+		if (texts[i] != NULL) {
+			const size_t length = strlen(texts[i]) + 1;
+			memcpy(data, texts[i], length);
+			task->text[i] = data;
+			data += length;
+		}
+	}
+	return task;
+}
+
+static void loopPush(struct loopQueue* queue, struct loopTask* task) {
+	__atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+	struct loopTask* previous = __atomic_exchange_n(&queue->head, task, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&previous->next, task, __ATOMIC_RELEASE); // Until now the loop sees queue ending at previous
+}
+
+// Loop only, NULL when there's nothing (or a producer is half-way through loopPush(), its eventfd write will come)
+static struct loopTask* loopPopFrom(struct loopQueue* queue) {
+	struct loopTask* tail = queue->tail;
+	struct loopTask* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == queue->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		queue->tail = tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next == NULL) {
+		if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		loopPush(queue, queue->stub); // Last one can't go until something is behind it
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+		if (next == NULL) {
+			return NULL;
+		}
+	}
+	queue->tail = next;
+	metricsGaugeAdd(METRIC_LOOP_TASKS_QUEUED, -1);
+	return tail;
+}
+
+// Urgent ones first, every time
+static struct loopTask* loopPop() {
+	for (unsigned int i = 0; i < LOOP_QUEUES; ++i) {
+		struct loopTask* task = loopPopFrom(&loopQueues[i]);
+		if (task != NULL) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+// Takes ownership of task
+static void loopPost(struct loopTask* task) {
+	if (!__atomic_load_n(&loopIsWorking, __ATOMIC_ACQUIRE)) {
+		task->run(task);
+		free(task);
+		return;
+	}
+	metricsGaugeAdd(METRIC_LOOP_TASKS_QUEUED, 1);
+	loopPush(&loopQueues[task->urgent ? LOOP_QUEUE_URGENT : LOOP_QUEUE_NORMAL], task);
+	const uint64_t one = 1;
+	while (write(loopEventFd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+static void channelSend(const char* message, const char* rawMessage, const bool error);
+
+static void loopRunSend(struct loopTask* task) {
+	channelSend(task->text[0], task->text[1], task->error);
+}
+
+// Sends already formatted message, rawMessage goes to console instead if we can't, from other threads through the loop
+static void channelSend(const char* message, const char* rawMessage, const bool error) {
+	if (!loopIsCurrent && __atomic_load_n(&loopIsWorking, __ATOMIC_ACQUIRE)) {
+		struct loopTask* task = loopTaskNew(&loopRunSend, message, rawMessage, NULL);
+		if (likely(task != NULL)) {
+			task->error = error;
+			loopPost(task);
+			return;
+		}
+	}
+	if (unlikely(error && (myChannelID == (anyID) -1 || myServerConnectionHandlerID == 0))) {
+		logErrorToConsole(rawMessage);
+	} else if (unlikely(ts3Functions.requestSendChannelTextMsg(myServerConnectionHandlerID, message, myChannelID, NULL) != ERROR_ok)) {
+		metricsCount(METRIC_MESSAGES_FAILED);
+		if (error) {
 			logErrorToConsole(rawMessage);
+		} else {
+			logToConsole(rawMessage); // In unformatted form
 		}
+	} else {
+		metricsCount(METRIC_MESSAGES_SENT);
+	}
+}
+
+static void sendErrorToChannel(const char* rawMessage) {
+	TRACE_SPAN("send", __func__);
+	const struct arenaMark mark = arenaMark();
+	const char* message = arenaPrintf("%s%s%s", "[b][color=red]", rawMessage, "[/color][/b]");
+	if (likely(message != NULL)) {
+		channelSend(message, rawMessage, true);
 	} else {
 		logErrorToConsole(rawMessage);
 	}
+	arenaRewind(mark);
 }
 
 #ifdef ARCHI_DEBUG
@@ -169,17 +998,27 @@ void sendErrorToChannel_unsigned_int(const unsigned int rawMessage) {
 #endif
 
 static void sendMessageToChannel(const char* rawMessage) {
-	char message[17 + strlen(rawMessage) + 12 + 1];
-	snprintf(message, sizeof(message), "%s%s%s", "[b][color=purple]", rawMessage, "[/color][/b]");
-	if (unlikely(ts3Functions.requestSendChannelTextMsg(myServerConnectionHandlerID, message, myChannelID, NULL) != ERROR_ok)) {
-		logToConsole(rawMessage); // In unformatted form
+	TRACE_SPAN("send", __func__);
+	const struct arenaMark mark = arenaMark();
+	const char* message = arenaPrintf("%s%s%s", "[b][color=purple]", rawMessage, "[/color][/b]");
+	if (likely(message != NULL)) {
+		channelSend(message, rawMessage, false);
+	} else {
+		logToConsole(rawMessage);
 	}
+	arenaRewind(mark);
 }
 
 static void sendMessageToChannel_2(const char* rawMessage1, const char* rawMessage2) {
-	char message[strlen(rawMessage1) + strlen(rawMessage2) + 1];
-	snprintf(message, sizeof(message), "%s%s", rawMessage1, rawMessage2);
-	sendMessageToChannel(message);
+	const struct arenaMark mark = arenaMark();
+	const char* message = arenaPrintf("%s%s", rawMessage1, rawMessage2);
+	if (likely(message != NULL)) {
+		sendMessageToChannel(message);
+	} else {
+		logToConsole(rawMessage1);
+		logToConsole(rawMessage2);
+	}
+	arenaRewind(mark);
 }
 
 /*static void removeChar(char* str, const char garbage) {
@@ -191,233 +1030,848 @@ static void sendMessageToChannel_2(const char* rawMessage1, const char* rawMessa
 	*dst = '\0';
 }*/
 
-static bool executeCommandWithErrorToChannel(const char* command) {
-	FILE *stream = popen(command, "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return false;
-	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	bool result = true;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-		sendErrorToChannel(line);
-		result = false; // We printed something, and this is error stream
+/*
+ * Deadlines: every command gets commandTimeout (bulkCommandTimeout in the bulk lane) for whatever it waits on. It's
+ * kept per thread, so MPD requests and children learn about it without passing it around: MPD client doesn't poll()
+ * longer than what's left, children of command streams are killed by the lifecycle watchdog once it passes, spawned
+ * tools get no more than that either, and laneCancelled() turns true, so loops give up at their checkpoints. Command
+ * that ran out of time is told so in the channel once, every timed out MPD request and child is counted.
+ */
+
+static __thread uint64_t deadlineCurrent = 0; // See metricsNow(), 0 when this thread runs no command
+static __thread bool deadlineReported = false;
+
+static inline void deadlineStart(const unsigned int seconds) {
+	deadlineCurrent = metricsNow() + seconds * 1000000ULL;
+	deadlineReported = false;
+}
+
+static inline void deadlineEnd() {
+	deadlineCurrent = 0;
+}
+
+static inline bool deadlinePassed() {
+	return deadlineCurrent != 0 && unlikely(metricsNow() >= deadlineCurrent);
+}
+
+// For poll(), timeout (milliseconds) or less if deadline comes sooner, 0 once it's gone
+static int deadlinePollTimeout(const int timeout) {
+	if (deadlineCurrent == 0) {
+		return timeout;
 	}
-	pclose(stream);
-	if (unlikely(line != NULL)) {
-		free(line);
+	const uint64_t now = metricsNow();
+	if (now >= deadlineCurrent) {
+		return 0;
 	}
-	return result;
+	const uint64_t remaining = (deadlineCurrent - now + 999) / 1000;
+	return remaining < (uint64_t) timeout ? (int) remaining : timeout;
 }
 
-static bool executeCommandWithOutputToChannel(const char* command) {
-	FILE *stream = popen(command, "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return false;
-	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-		sendMessageToChannel(line);
+// Absolute CLOCK_REALTIME for pthread_*timed*() functions, of deadline given in metricsNow() terms
+static void deadlineTimespec(const uint64_t deadline, struct timespec* timeout) {
+	clock_gettime(CLOCK_REALTIME, timeout);
+	const uint64_t now = metricsNow();
+	const uint64_t remaining = deadline > now ? deadline - now : 0;
+	timeout->tv_sec += remaining / 1000000 + (timeout->tv_nsec + (remaining % 1000000) * 1000) / 1000000000;
+	timeout->tv_nsec = (timeout->tv_nsec + (remaining % 1000000) * 1000) % 1000000000;
+}
+
+// Something took too long, command hears about it once, the rest of what it does fails fast anyway
+static void deadlineExceeded() {
+	if (deadlineCurrent != 0) {
+		if (deadlineReported) {
+			return;
+		}
+		deadlineReported = true;
+		metricsCount(METRIC_COMMAND_TIMEOUTS);
 	}
-	pclose(stream);
-	if (likely(line != NULL)) {
-		free(line);
+	sendErrorToChannel("Took too long, gave up! :-(");
+}
+
+/*
+ * Lifecycle: whatever outlives a single call is registered here, so ts3plugin_shutdown() can find it and stop it
+ * before TS3 unloads us. Background threads come with a function that tells them to finish, children (spawned tools
+ * and mpc behind command streams) get SIGTERM and later SIGKILL, MPD connections sitting in idle get noidle, and
+ * lifecycleWakeFd becomes readable for good, so anybody sleeping in poll() on it wakes up and sees we're stopping.
+ * Threads started by registered threads (tag scanner workers) are joined by them. Children can also come with
+ * a deadline, the watchdog thread kills them (same way, SIGTERM first) once it passes.
+ */
+
+#define LIFECYCLE_MAX_THREADS 16
+#define LIFECYCLE_MAX_CHILDREN 32
+#define LIFECYCLE_MAX_IDLE 8
+#define LIFECYCLE_JOIN_TIMEOUT 2000 // Milliseconds for all threads to finish after being told to
+#define LIFECYCLE_KILL_TIMEOUT 1000 // Milliseconds more after children got SIGKILL
+#define LIFECYCLE_ALL 0 // Tag of children started outside of any job, and of all children in lifecycleChildrenSignal()
+
+struct lifecycleThread {
+	pthread_t* thread; // Owner's variable, we zero it once joined
+	const char* name;
+	void (*wake)();
+};
+
+struct lifecycleChild {
+	pid_t pid;
+	FILE* stream; // For command streams, NULL otherwise
+	uint64_t tag; // Of the job that started it, see lifecycleTag
+	uint64_t deadline; // When watchdog sends the next signal, see metricsNow(), 0 for never
+	unsigned int signals; // Sent by watchdog so far
+};
+
+static pthread_mutex_t lifecycleMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct lifecycleThread lifecycleThreads[LIFECYCLE_MAX_THREADS];
+static struct lifecycleChild lifecycleChildren[LIFECYCLE_MAX_CHILDREN];
+static int lifecycleIdle[LIFECYCLE_MAX_IDLE] = { -1, -1, -1, -1, -1, -1, -1, -1 }; // Sockets of MPD connections in idle
+static bool lifecycleStopping = false;
+static int lifecycleWakeFd = -1;
+static __thread uint64_t lifecycleTag = 0; // Children started by this thread get it, so they can be signalled together
+static pthread_cond_t lifecycleWatchdogChanged = PTHREAD_COND_INITIALIZER; // With lifecycleMutex
+static pthread_t lifecycleWatchdogThread = 0;
+
+static inline bool lifecycleIsStopping() {
+	return __atomic_load_n(&lifecycleStopping, __ATOMIC_ACQUIRE);
+}
+
+static void lifecycleStart() {
+	__atomic_store_n(&lifecycleStopping, false, __ATOMIC_RELEASE);
+	lifecycleWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(lifecycleWakeFd == -1)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("eventfd() error");
 	}
-	return true;
 }
 
-static bool executeCommandWithOutput(const char* command, char** output) {
-	FILE *stream = popen(command, "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return false;
+// pthread_create() that shutdown knows about, wake is called (from any thread) when it should finish
+static bool lifecycleThreadStart(pthread_t* thread, const char* name, void* (*worker)(void*), void (*wake)()) {
+	pthread_mutex_lock(&lifecycleMutex);
+	unsigned int slot = 0;
+	while (slot < LIFECYCLE_MAX_THREADS && lifecycleThreads[slot].thread != NULL) {
+		++slot;
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	if (likely((read = getline(&line, &len, stream)) != -1)) {
-		pclose(stream);
-		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-		*output = (char* ) malloc((read + 1) * sizeof(char));
-		if (unlikely(!output)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("malloc() error");
-			free(line);
-			return false;
-		}
-		strncpy(*output, line, read);
-		free(line);
-	} else {
-		*output = (char* ) malloc(sizeof(char));
-		if (unlikely(!output)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("malloc() error");
-			return false;
-		}
-		strncpy(*output, "", 0);
+	if (unlikely(slot == LIFECYCLE_MAX_THREADS || lifecycleIsStopping() || pthread_create(thread, NULL, worker, (void*) NULL))) {
+		pthread_mutex_unlock(&lifecycleMutex);
+		*thread = 0;
+		return false;
 	}
+	lifecycleThreads[slot] = (struct lifecycleThread) { thread, name, wake };
+	pthread_mutex_unlock(&lifecycleMutex);
 	return true;
 }
 
-static void getArgWithDelimiter(char* messageSubstring, const char* message, const int whichOne, const char* delimiters) {
-	char buffer[strlen(message) + 1];
-	strncpy(buffer, message, sizeof(buffer));
-	char* p = strtok(buffer, delimiters);
-	int number = whichOne;
-	if (number >= 0) {
-		while (number > 0 && p != NULL) {
-			p = strtok(NULL, delimiters);
-			--number;
-		}
-		if (p != NULL) {
-			strncpy(messageSubstring, p, sizeof(buffer));
-		} else {
-			strncpy(messageSubstring, "", sizeof(buffer));
-		}
-	} else {
-		while (number < 0 && p != NULL) {
-			p = strtok(NULL, delimiters);
-			++number;
-		}
-		if (p != NULL) {
-			strncpy(messageSubstring, p, sizeof(buffer));
-			p = strtok(NULL, delimiters);
-			while (p != NULL) {
-				strncat(messageSubstring, delimiters, sizeof(buffer) - strlen(messageSubstring) - 1); // TODO: Maybe we can
-				strncat(messageSubstring, p, sizeof(buffer) - strlen(messageSubstring) - 1); // do it better?
-				p = strtok(NULL, delimiters);
-			}
-		} else {
-			strncpy(messageSubstring, "", sizeof(buffer));
+// Children with tag, or all of them with LIFECYCLE_ALL
+static void lifecycleChildrenSignal(const int signal, const uint64_t tag) {
+	pthread_mutex_lock(&lifecycleMutex);
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_CHILDREN; ++i) {
+		if (lifecycleChildren[i].pid > 0 && (tag == LIFECYCLE_ALL || lifecycleChildren[i].tag == tag)) {
+			kill(-lifecycleChildren[i].pid, signal); // Each one leads its own process group
 		}
 	}
-}
-
-static void getArg(char* messageSubstring, const char* message, const int whichOne) {
-	getArgWithDelimiter(messageSubstring, message, whichOne, " ");
+	pthread_mutex_unlock(&lifecycleMutex);
 }
 
 /*
-static bool clientBelongsToChannelGroup(const anyID fromID, const int targetGroupID) {
-	int currentGroupID = 0;
-	if (unlikely(ts3Functions.getClientVariableAsInt(myServerConnectionHandlerID, fromID, CLIENT_CHANNEL_GROUP_ID, &currentGroupID) != ERROR_ok)) {
-		sendErrorToChannel("getClientVariableAsInt() error");
-		return false;
+ * Joins thread started by lifecycleThreadStart(), giving it until deadline (see metricsNow()), after which its
+ * children are killed and it gets LIFECYCLE_KILL_TIMEOUT more. False if it's still running even then, it's detached
+ * and left alone.
+ */
+static bool lifecycleThreadJoin(pthread_t* thread, const uint64_t deadline) {
+	if (*thread == 0) {
+		return true;
 	}
-	return currentGroupID == targetGroupID;
+	bool joined = false;
+	for (unsigned int attempt = 0; attempt < 2 && !joined; ++attempt) {
+		struct timespec timeout;
+		deadlineTimespec(attempt == 0 ? deadline : metricsNow() + LIFECYCLE_KILL_TIMEOUT * 1000ULL, &timeout);
+		joined = pthread_timedjoin_np(*thread, NULL, &timeout) == 0;
+		if (!joined && attempt == 0) {
+			lifecycleChildrenSignal(SIGKILL, LIFECYCLE_ALL); // Most likely it waits for one of them
+		}
+	}
+	pthread_mutex_lock(&lifecycleMutex);
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_THREADS; ++i) {
+		if (lifecycleThreads[i].thread == thread) {
+			if (unlikely(!joined)) {
+				char message[64];
+				snprintf(message, sizeof(message), "%s%s", lifecycleThreads[i].name, " thread didn't stop in time");
+				logErrorToConsole(message);
+			}
+			lifecycleThreads[i].thread = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lifecycleMutex);
+	if (unlikely(!joined)) {
+		pthread_detach(*thread);
+	}
+	*thread = 0;
+	return joined;
 }
 
-static anyID getClientIDfromClientName(const char* targetName) {
-	anyID ret = NULL;
-	anyID *clients;
-	if (unlikely(ts3Functions.getClientList(myServerConnectionHandlerID, &clients) != ERROR_ok)) {
-		sendErrorToChannel("getClientList() error");
-		return ret;
+/*
+ * Tells everything registered to stop and joins all threads within LIFECYCLE_JOIN_TIMEOUT (plus LIFECYCLE_KILL_TIMEOUT
+ * if children had to be killed). False if some thread is still running, then nothing it may use can be freed.
+ */
+static bool lifecycleStop() {
+	pthread_mutex_lock(&lifecycleMutex);
+	__atomic_store_n(&lifecycleStopping, true, __ATOMIC_RELEASE);
+	pthread_t* threads[LIFECYCLE_MAX_THREADS];
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_THREADS; ++i) {
+		if (lifecycleThreads[i].thread != NULL) {
+			threads[count++] = lifecycleThreads[i].thread;
+			lifecycleThreads[i].wake();
+		}
 	}
-	for (unsigned int i = 0; clients[i] != '\0'; ++i) {
-		char* clientName;
-		if (likely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName)) == ERROR_ok) {
-			if (strncasecmp(targetName, clientName, strlen(targetName)) == 0) {
-				ret = clients[i];
-				ts3Functions.freeMemory(clientName);
+	if (lifecycleWakeFd != -1) {
+		const uint64_t one = 1;
+		while (write(lifecycleWakeFd, &one, sizeof(one)) == -1 && errno == EINTR);
+	}
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_IDLE; ++i) {
+		if (lifecycleIdle[i] != -1) {
+			send(lifecycleIdle[i], "noidle\n", 7, MSG_NOSIGNAL); // Owner reads the answer, errors are its business too
+		}
+	}
+	pthread_mutex_unlock(&lifecycleMutex);
+	lifecycleChildrenSignal(SIGTERM, LIFECYCLE_ALL);
+
+	const uint64_t deadline = metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL;
+	bool stopped = true;
+	for (unsigned int i = 0; i < count; ++i) {
+		stopped &= lifecycleThreadJoin(threads[i], deadline);
+	}
+	if (stopped && lifecycleWakeFd != -1) {
+		close(lifecycleWakeFd);
+		lifecycleWakeFd = -1;
+	}
+	return stopped;
+}
+
+// False if there's no room or we're stopping, child should be killed then, watchdog kills it at deadline unless it's 0
+static bool lifecycleChildAdd(const pid_t pid, const uint64_t deadline) {
+	pthread_mutex_lock(&lifecycleMutex);
+	bool added = false;
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_CHILDREN && !added && !lifecycleIsStopping(); ++i) {
+		if (lifecycleChildren[i].pid == 0) {
+			lifecycleChildren[i] = (struct lifecycleChild) { pid, NULL, lifecycleTag, deadline, 0 };
+			added = true;
+		}
+	}
+	if (added && deadline != 0) {
+		pthread_cond_signal(&lifecycleWatchdogChanged);
+	}
+	pthread_mutex_unlock(&lifecycleMutex);
+	return added;
+}
+
+// Attaches stream to pid, or with pid 0 looks pid of stream up and forgets the stream, 0 if it's not there
+static pid_t lifecycleChildStream(const pid_t pid, FILE* stream) {
+	pid_t found = 0;
+	pthread_mutex_lock(&lifecycleMutex);
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_CHILDREN; ++i) {
+		if (pid != 0 ? lifecycleChildren[i].pid == pid : lifecycleChildren[i].stream == stream) {
+			found = lifecycleChildren[i].pid;
+			lifecycleChildren[i].stream = pid != 0 ? stream : NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lifecycleMutex);
+	return found;
+}
+
+// waitpid() for children from spawnStart(), which forgets them once they're gone
+static pid_t lifecycleChildWait(const pid_t pid, int* status, const int options) {
+	pid_t ret;
+	while ((ret = waitpid(pid, status, options)) == -1 && errno == EINTR);
+	if (ret == pid) {
+		pthread_mutex_lock(&lifecycleMutex);
+		for (unsigned int i = 0; i < LIFECYCLE_MAX_CHILDREN; ++i) {
+			if (lifecycleChildren[i].pid == pid) {
+				lifecycleChildren[i] = (struct lifecycleChild) { 0, NULL, 0, 0, 0 };
 				break;
 			}
-			ts3Functions.freeMemory(clientName);
-		} else {
-			sendErrorToChannel("getClientVariableAsString() error");
-			ts3Functions.freeMemory(clients);
-			return ret;
 		}
+		pthread_mutex_unlock(&lifecycleMutex);
 	}
-	ts3Functions.freeMemory(clients);
 	return ret;
 }
 
-static bool getClientNameByRegex(const char* regex, char** output) {
-	anyID *clients;
-	if (unlikely(ts3Functions.getClientList(myServerConnectionHandlerID, &clients) != ERROR_ok)) {
-		sendErrorToChannel("getClientList() error");
-		return false;
+/*
+ * Called with MPD socket before sending idle, false if we're stopping already. Owner should have lifecycleWakeFd in
+ * its poll() too, in case noidle comes before its idle.
+ */
+static bool lifecycleIdleBegin(const int fd) {
+	pthread_mutex_lock(&lifecycleMutex);
+	const bool stopping = lifecycleIsStopping();
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_IDLE && !stopping; ++i) {
+		if (lifecycleIdle[i] == -1) {
+			lifecycleIdle[i] = fd;
+			break;
+		}
 	}
-	bool found = false;
-	for (unsigned int i = 0; clients[i] != '\0'; ++i) {
-		char* clientName;
-		if (likely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName)) == ERROR_ok) {
-			if (strncasecmp(targetName, clientName, strlen(targetName)) == 0) {
-				found = true;
-				*output = (char* ) malloc((strlen(clientName) + 1) * sizeof(char));
-				if (unlikely(!output)) {
-					sendErrorToChannel(strerror(errno));
-					sendErrorToChannel("malloc() error");
-					ts3Functions.freeMemory(clientName);
-					ts3Functions.freeMemory(clients);
-					return false;
+	pthread_mutex_unlock(&lifecycleMutex);
+	return !stopping;
+}
+
+// Once the answer to idle is in, or before the socket is closed
+static void lifecycleIdleEnd(const int fd) {
+	pthread_mutex_lock(&lifecycleMutex);
+	for (unsigned int i = 0; i < LIFECYCLE_MAX_IDLE; ++i) {
+		if (lifecycleIdle[i] == fd) {
+			lifecycleIdle[i] = -1;
+		}
+	}
+	pthread_mutex_unlock(&lifecycleMutex);
+}
+
+// Sleeps until the nearest deadline of a child, whoever waits for its output sees end of it once it's killed
+static void* lifecycleWatchdog(void* args) {
+	pthread_mutex_lock(&lifecycleMutex);
+	while (!lifecycleIsStopping()) {
+		const uint64_t now = metricsNow();
+		uint64_t nearest = 0;
+		for (unsigned int i = 0; i < LIFECYCLE_MAX_CHILDREN; ++i) {
+			struct lifecycleChild* child = &lifecycleChildren[i];
+			if (child->pid <= 0 || child->deadline == 0) {
+				continue;
+			}
+			if (now >= child->deadline) {
+				if (child->signals == 0) {
+					metricsCount(METRIC_CHILD_TIMEOUTS);
 				}
-				strncpy(*output, clientName, strlen(clientName));
-				ts3Functions.freeMemory(clientName);
-				break;
+				kill(-child->pid, child->signals++ == 0 ? SIGTERM : SIGKILL); // Each one leads its own process group
+				child->deadline = child->signals == 1 ? now + LIFECYCLE_KILL_TIMEOUT * 1000ULL : 0;
 			}
-			ts3Functions.freeMemory(clientName);
+			if (child->deadline != 0 && (nearest == 0 || child->deadline < nearest)) {
+				nearest = child->deadline;
+			}
+		}
+		if (nearest == 0) {
+			pthread_cond_wait(&lifecycleWatchdogChanged, &lifecycleMutex);
 		} else {
-			sendErrorToChannel("getClientVariableAsString() error");
-			ts3Functions.freeMemory(clients);
-			return ret;
+			struct timespec timeout;
+			deadlineTimespec(nearest, &timeout);
+			pthread_cond_timedwait(&lifecycleWatchdogChanged, &lifecycleMutex, &timeout);
 		}
 	}
-	ts3Functions.freeMemory(clients);
-	return found;
+	pthread_mutex_unlock(&lifecycleMutex);
+	return NULL;
 }
-*/
 
-static bool clientBelongsToServerGroup(const anyID fromID, const char* targetGroupID) {
-	char* clientGroups = NULL;
-	if (unlikely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, fromID, CLIENT_SERVERGROUPS, &clientGroups) != ERROR_ok)) {
-		sendErrorToChannel("getClientVariableAsString() error");
-		return false;
+// lifecycleStop() calls it with lifecycleMutex held, watchdog looks at lifecycleStopping under it too
+static void lifecycleWatchdogWake() {
+	pthread_cond_broadcast(&lifecycleWatchdogChanged);
+}
+
+static void lifecycleWatchdogStart() {
+	if (unlikely(!lifecycleThreadStart(&lifecycleWatchdogThread, "Watchdog", &lifecycleWatchdog, &lifecycleWatchdogWake))) {
+		logErrorToConsole("pthread_create() error"); // Children can still take long, but shutdown stops them
 	}
-	char buffer[strlen(clientGroups) + 1];
-	strncpy(buffer, clientGroups, sizeof(buffer));
-	ts3Functions.freeMemory(clientGroups);
-	char* clientGroup = strtok(buffer, ",");
-	bool accessGranted = false;
-	while (clientGroup != NULL) {
-		if (strcmp(clientGroup, targetGroupID) == 0) {
-			accessGranted = true;
-			break;
+}
+
+/*
+ * Lanes: interactive control commands (transport, volume, toggles), queries and bulk jobs (tagging, database updates,
+ * zipping, adding whole directories, poke spam) go to lanes of their own, each with one thread taking jobs in order
+ * they came, the loop only hands them out. So control never waits behind anything but other control, and a long bulk
+ * job holds up only bulk jobs queued after it. Control lane's messages go through the loop's urgent queue, so they
+ * don't wait behind the other lanes' either. What only the loop knows (whether sender is root) comes along with
+ * the job, see isAccessGranted(). Running bulk job can be cancelled with !cancel: loops in bulk paths check
+ * laneCancelled() at their checkpoints, and children the job started get SIGTERM, so whatever it waits for ends early.
+ */
+
+#define LANE_MAX_QUEUED 16 // Jobs waiting in one lane, more are turned down
+
+typedef enum {
+	LANE_CONTROL,
+	LANE_QUERY,
+	LANE_BULK,
+	LANES // Must be last
+} commandLane;
+
+struct lane {
+	const char* name;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed; // Job came or finished, or we're stopping
+	struct loopTask* head; // Oldest one, jobs are commands
+	struct loopTask* tail;
+	unsigned int queued;
+	const char* running; // Command of the job running now, NULL if there's none
+	uint64_t runningTag;
+	uint64_t cancelledTag; // Job with this tag should stop, written under mutex, read anywhere
+	bool isWorking;
+	pthread_t thread;
+	metricGauge gauge;
+};
+
+static struct lane lanes[LANES] = {
+	[LANE_CONTROL] = { .name = "Control lane", .mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .gauge = METRIC_CONTROL_JOBS_QUEUED },
+	[LANE_QUERY] = { .name = "Query lane", .mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .gauge = METRIC_QUERY_JOBS_QUEUED },
+	[LANE_BULK] = { .name = "Bulk lane", .mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .gauge = METRIC_BULK_JOBS_QUEUED }
+};
+static uint64_t laneTags = 0;
+static __thread struct lane* laneCurrent = NULL;
+static __thread const struct loopTask* laneJob = NULL; // Running on this thread, NULL on the loop
+
+// True if job of this thread was cancelled or we're stopping altogether
+static inline bool laneJobCancelled() {
+	if (unlikely(lifecycleIsStopping())) {
+		return true;
+	}
+	return laneCurrent != NULL && lifecycleTag != LIFECYCLE_ALL && unlikely(__atomic_load_n(&laneCurrent->cancelledTag, __ATOMIC_ACQUIRE) == lifecycleTag);
+}
+
+// Checkpoint for loops in bulk paths, true once they should give up, also when command's deadline passed
+static inline bool laneCancelled() {
+	return laneJobCancelled() || deadlinePassed();
+}
+
+static void laneWork(struct lane* lane) {
+	laneCurrent = lane;
+	loopPostsUrgent = lane == &lanes[LANE_CONTROL];
+	pthread_mutex_lock(&lane->mutex);
+	while (lane->isWorking) {
+		struct loopTask* job = lane->head;
+		if (job == NULL) {
+			pthread_cond_wait(&lane->changed, &lane->mutex);
+			continue;
+		}
+		lane->head = job->next;
+		if (lane->head == NULL) {
+			lane->tail = NULL;
 		}
-		clientGroup = strtok(NULL, ",");
+		--lane->queued;
+		metricsGaugeAdd(lane->gauge, -1);
+		lane->running = job->text[2];
+		lane->runningTag = lifecycleTag = __atomic_add_fetch(&laneTags, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&lane->mutex);
+		laneJob = job;
+		job->run(job);
+		laneJob = NULL;
+		if (unlikely(laneJobCancelled()) && !lifecycleIsStopping()) {
+			metricsCount(METRIC_JOBS_CANCELLED);
+			sendMessageToChannel_2("Cancelled: ", job->text[2]);
+		}
+		pthread_mutex_lock(&lane->mutex);
+		lane->running = NULL;
+		lane->runningTag = lifecycleTag = LIFECYCLE_ALL;
+		pthread_cond_broadcast(&lane->changed);
+		free(job);
 	}
-	return accessGranted;
+	pthread_mutex_unlock(&lane->mutex);
 }
 
-static bool isAccessGranted(const anyID fromID, const char* targetGroupID) {
-	if (clientBelongsToServerGroup(fromID, targetGroupID)) {
+static void* laneControlWorker(void* args) {
+	laneWork(&lanes[LANE_CONTROL]);
+	return NULL;
+}
+
+static void* laneQueryWorker(void* args) {
+	laneWork(&lanes[LANE_QUERY]);
+	return NULL;
+}
+
+static void* laneBulkWorker(void* args) {
+	laneWork(&lanes[LANE_BULK]);
+	return NULL;
+}
+
+static void lanesWake() {
+	for (unsigned int i = 0; i < LANES; ++i) {
+		pthread_mutex_lock(&lanes[i].mutex);
+		lanes[i].isWorking = false;
+		pthread_cond_broadcast(&lanes[i].changed);
+		pthread_mutex_unlock(&lanes[i].mutex);
+	}
+}
+
+static void lanesStart() {
+	void* (*workers[LANES])(void*) = { [LANE_CONTROL] = &laneControlWorker, [LANE_QUERY] = &laneQueryWorker, [LANE_BULK] = &laneBulkWorker };
+	for (unsigned int i = 0; i < LANES; ++i) {
+		pthread_mutex_lock(&lanes[i].mutex);
+		lanes[i].isWorking = true;
+		pthread_mutex_unlock(&lanes[i].mutex);
+		if (unlikely(!lifecycleThreadStart(&lanes[i].thread, lanes[i].name, workers[i], &lanesWake))) {
+			logErrorToConsole("pthread_create() error");
+			pthread_mutex_lock(&lanes[i].mutex);
+			lanes[i].isWorking = false; // Its jobs will run right on the loop
+			pthread_mutex_unlock(&lanes[i].mutex);
+		}
+	}
+}
+
+// Jobs still queued are dropped, they're commands, so they leave commands_in_flight too
+static void lanesStop() {
+	lanesWake();
+	for (unsigned int i = 0; i < LANES; ++i) {
+		lifecycleThreadJoin(&lanes[i].thread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+		pthread_mutex_lock(&lanes[i].mutex);
+		struct loopTask* job = lanes[i].head;
+		lanes[i].head = lanes[i].tail = NULL;
+		metricsGaugeAdd(lanes[i].gauge, -(int64_t) lanes[i].queued);
+		lanes[i].queued = 0;
+		pthread_mutex_unlock(&lanes[i].mutex);
+		while (job != NULL) {
+			struct loopTask* next = job->next;
+			metricsGaugeAdd(METRIC_COMMANDS_IN_FLIGHT, -1);
+			free(job);
+			job = next;
+		}
+	}
+}
+
+// Takes ownership of job, false (job is freed then) if lane is full, without lane's thread job runs right here
+static bool lanePost(const commandLane index, struct loopTask* job) {
+	struct lane* lane = &lanes[index];
+	pthread_mutex_lock(&lane->mutex);
+	if (!lane->isWorking) {
+		pthread_mutex_unlock(&lane->mutex);
+		job->run(job);
+		free(job);
 		return true;
+	}
+	if (unlikely(lane->queued >= LANE_MAX_QUEUED)) {
+		pthread_mutex_unlock(&lane->mutex);
+		free(job);
+		return false;
+	}
+	job->next = NULL;
+	if (lane->tail != NULL) {
+		lane->tail->next = job;
 	} else {
-		sendMessageToChannel("Sorry! You're not permitted to use that command! :-(");
+		lane->head = job;
+	}
+	lane->tail = job;
+	++lane->queued;
+	metricsGaugeAdd(lane->gauge, 1);
+	pthread_cond_broadcast(&lane->changed);
+	pthread_mutex_unlock(&lane->mutex);
+	return true;
+}
+
+// !cancel: running bulk job stops at its next checkpoint, with all queued ones are dropped too
+static void laneCancel(const bool all) {
+	struct lane* lane = &lanes[LANE_BULK];
+	pthread_mutex_lock(&lane->mutex);
+	const uint64_t tag = lane->runningTag;
+	const char* running = lane->running != NULL ? arenaStrdup(lane->running) : NULL;
+	if (tag != LIFECYCLE_ALL) {
+		__atomic_store_n(&lane->cancelledTag, tag, __ATOMIC_RELEASE);
+	}
+	struct loopTask* dropped = NULL;
+	const unsigned int droppedCount = all ? lane->queued : 0;
+	if (all) {
+		dropped = lane->head;
+		lane->head = lane->tail = NULL;
+		metricsGaugeAdd(lane->gauge, -(int64_t) lane->queued);
+		lane->queued = 0;
+	}
+	pthread_mutex_unlock(&lane->mutex);
+	if (tag != LIFECYCLE_ALL) {
+		lifecycleChildrenSignal(SIGTERM, tag);
+	}
+	while (dropped != NULL) {
+		struct loopTask* next = dropped->next;
+		metricsGaugeAdd(METRIC_COMMANDS_IN_FLIGHT, -1);
+		metricsCount(METRIC_JOBS_CANCELLED);
+		free(dropped);
+		dropped = next;
+	}
+	if (tag != LIFECYCLE_ALL) {
+		sendMessageToChannel_2("Cancelling: ", running != NULL ? running : "running job");
+	}
+	if (droppedCount != 0) {
+		char message[48];
+		snprintf(message, sizeof(message), "%s%u%s", "Dropped ", droppedCount, droppedCount == 1 ? " queued job" : " queued jobs");
+		sendMessageToChannel(message);
+	}
+	if (tag == LIFECYCLE_ALL && droppedCount == 0) {
+		sendMessageToChannel("Nothing to cancel! 8)");
+	}
+}
+
+#ifdef ARCHITSMBOT_BENCH
+// Until lanes have nothing queued nor running, for loopDrain()
+static void lanesWaitIdle() {
+	for (unsigned int i = 0; i < LANES; ++i) {
+		pthread_mutex_lock(&lanes[i].mutex);
+		while (lanes[i].isWorking && (lanes[i].head != NULL || lanes[i].running != NULL)) {
+			pthread_cond_wait(&lanes[i].changed, &lanes[i].mutex);
+		}
+		pthread_mutex_unlock(&lanes[i].mutex);
+	}
+}
+#endif
+
+/*
+ * Tools other than mpc run without shell: posix_spawn() with explicit argv, so file names can't break the command
+ * line (or get into it) and there's no /bin/sh to start first. Child's output comes through a non-blocking pipe,
+ * polled until child's deadline, then its process group gets SIGTERM and, if that doesn't help, SIGKILL.
+ * At most SPAWN_MAX_CHILDREN run at once, anybody else waits for a free slot.
+ */
+
+#define SPAWN_MAX_CHILDREN 4
+#define SPAWN_TIMEOUT 60 // Seconds before a child gets SIGTERM
+#define SPAWN_KILL_TIMEOUT 2 // Seconds after SIGTERM before SIGKILL
+#define SPAWN_OUTPUT_LIMIT 65536 // Bytes of output we keep, the rest is read and dropped
+#define SPAWN_TIMED_OUT -2
+#define SPAWN_CANCELLED -3 // See laneCancelled()
+
+typedef enum {
+	SPAWN_STDERR, // Stdout goes to /dev/null
+	SPAWN_STDOUT, // Stderr is left alone, like popen() does
+	SPAWN_STDOUT_STDERR
+} spawnOutput;
+
+static pthread_mutex_t spawnMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spawnFinished = PTHREAD_COND_INITIALIZER;
+static unsigned int spawnRunning = 0;
+
+/*
+ * Starts argv with output going to pipe read in fd, -1 with errno on failure, lifecycleChildWait() it once done.
+ * Watchdog kills it at deadline (see metricsNow()), 0 if it can take as long as it wants.
+ */
+static pid_t spawnStart(char* const argv[], const spawnOutput output, const uint64_t deadline, int* fd) {
+	if (unlikely(lifecycleIsStopping())) {
+		errno = ECANCELED;
+		return -1;
+	}
+	int fds[2];
+	if (unlikely(pipe2(fds, O_CLOEXEC) == -1)) {
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK); // Only our end, child writes the usual way
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	int error = posix_spawn_file_actions_init(&actions);
+	if (likely(error == 0) && unlikely((error = posix_spawnattr_init(&attributes)) != 0)) {
+		posix_spawn_file_actions_destroy(&actions);
+	}
+	if (unlikely(error != 0)) {
+		close(fds[0]);
+		close(fds[1]);
+		errno = error;
+		return -1;
+	}
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigset_t defaults; // TeamSpeak may ignore these, children shouldn't
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	sigaddset(&defaults, SIGTERM);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGHUP);
+	posix_spawnattr_setsigmask(&attributes, &mask);
+	posix_spawnattr_setsigdefault(&attributes, &defaults);
+	posix_spawnattr_setpgroup(&attributes, 0); // Own group, so whatever it starts goes away with it
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	if (output != SPAWN_STDERR) {
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	} else {
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	}
+	if (output != SPAWN_STDOUT) {
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+	}
+	pid_t pid;
+	metricsCount(METRIC_FORKS);
+	error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	close(fds[1]);
+	if (unlikely(error != 0)) {
+		close(fds[0]);
+		errno = error;
+		return -1;
+	}
+	if (unlikely(!lifecycleChildAdd(pid, deadline))) { // Shutdown wouldn't know about it
+		error = lifecycleIsStopping() ? ECANCELED : EAGAIN;
+		kill(-pid, SIGKILL);
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+		close(fds[0]);
+		errno = error;
+		return -1;
+	}
+	*fd = fds[0];
+	return pid;
+}
+
+// Reads whatever is in fd now into output, false on end of file or error
+static bool spawnRead(const int fd, char** output, size_t* length) {
+	char chunk[4096];
+	ssize_t got;
+	while ((got = read(fd, chunk, sizeof(chunk))) > 0 || (got == -1 && errno == EINTR)) {
+		const size_t keep = got <= 0 ? 0 : *length + got > SPAWN_OUTPUT_LIMIT ? SPAWN_OUTPUT_LIMIT - *length : (size_t) got;
+		if (keep == 0) {
+			continue;
+		}
+		char* grown = (char*) realloc(*output, *length + keep + 1);
+		if (unlikely(!grown)) {
+			continue;
+		}
+		*output = grown;
+		memcpy(*output + *length, chunk, keep);
+		*length += keep;
+		(*output)[*length] = '\0';
+	}
+	return got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Runs argv[0] (looked up in PATH) with argv until it exits or timeout (seconds) runs out. Result is what it printed
+ * to output, caller frees it. Returns exit status, 128 + signal if something killed it,
+ * SPAWN_TIMED_OUT if we did, SPAWN_CANCELLED if its job was cancelled, -1 if it couldn't start (errno is set then).
+ */
+static int spawnCommand(char* const argv[], const spawnOutput output, const unsigned int timeout, char** result) {
+	TRACE_SPAN("file", "spawn");
+	*result = NULL;
+	uint64_t deadline = metricsNow() + timeout * 1000000ULL;
+	if (deadlineCurrent != 0 && deadlineCurrent < deadline) { // Command can't wait that long
+		deadline = deadlineCurrent;
+	}
+	bool timedOut = false;
+	pthread_mutex_lock(&spawnMutex);
+	while (spawnRunning >= SPAWN_MAX_CHILDREN && !timedOut) {
+		struct timespec until;
+		deadlineTimespec(deadline, &until);
+		timedOut = pthread_cond_timedwait(&spawnFinished, &spawnMutex, &until) == ETIMEDOUT && spawnRunning >= SPAWN_MAX_CHILDREN;
+	}
+	if (likely(!timedOut)) {
+		++spawnRunning;
+	}
+	pthread_mutex_unlock(&spawnMutex);
+	if (unlikely(timedOut)) {
+		return SPAWN_TIMED_OUT;
+	}
+	int fd = -1;
+	const pid_t pid = spawnStart(argv, output, 0, &fd); // Deadline is ours to keep, so we know what happened
+	int status = -1;
+	if (likely(pid != -1)) {
+		size_t length = 0;
+		unsigned int signals = 0;
+		bool reading = true;
+		bool cancelled = false;
+		pid_t exited = 0;
+		int waitStatus = 0;
+		while (exited == 0) {
+			const uint64_t now = metricsNow();
+			if (!cancelled && unlikely(laneJobCancelled())) {
+				cancelled = true;
+				deadline = now; // Same way out as when it takes too long
+			}
+			if (now >= deadline) {
+				if (signals == 0 && !cancelled) {
+					metricsCount(METRIC_CHILD_TIMEOUTS);
+				}
+				kill(-pid, signals++ == 0 ? SIGTERM : SIGKILL);
+				deadline = now + SPAWN_KILL_TIMEOUT * 1000000ULL;
+			}
+			// Exit doesn't wake up poll() (and something it started may still hold the pipe), so we look now and then
+			const uint64_t remaining = (deadline - now + 999) / 1000;
+			const int wait = !reading ? 10 : remaining < 100 ? (int) remaining : 100;
+			struct pollfd pollfd = { .fd = reading ? fd : -1, .events = POLLIN };
+			if (poll(&pollfd, 1, wait) > 0) {
+				reading = spawnRead(fd, result, &length);
+			}
+			exited = lifecycleChildWait(pid, &waitStatus, WNOHANG);
+		}
+		spawnRead(fd, result, &length); // What it wrote just before it exited
+		close(fd);
+		if (unlikely(exited == -1)) {
+			status = -1;
+		} else if (cancelled || laneJobCancelled()) { // SIGTERM from laneCancel() may have got there first
+			status = SPAWN_CANCELLED;
+		} else if (signals != 0) {
+			status = SPAWN_TIMED_OUT;
+		} else {
+			status = WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : 128 + WTERMSIG(waitStatus);
+		}
+	}
+	pthread_mutex_lock(&spawnMutex);
+	--spawnRunning;
+	pthread_cond_signal(&spawnFinished);
+	pthread_mutex_unlock(&spawnMutex);
+	return status;
+}
+
+// Output of argv goes to channel line by line, with errors if it couldn't run
+static bool spawnWithOutputToChannel(char* const argv[], const bool asErrors) {
+	char* output;
+	const int status = spawnCommand(argv, asErrors ? SPAWN_STDERR : SPAWN_STDOUT_STDERR, SPAWN_TIMEOUT, &output);
+	if (unlikely(status == -1)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("posix_spawn() error");
 		return false;
+	} else if (status == SPAWN_CANCELLED) { // Whoever cancelled it hears about it
+		free(output);
+		return false;
+	}
+	bool printed = false;
+	char* saveptr;
+	for (char* line = output != NULL ? strtok_r(output, "\r\n", &saveptr) : NULL; line != NULL; line = strtok_r(NULL, "\r\n", &saveptr)) {
+		if (asErrors) {
+			sendErrorToChannel(line);
+		} else {
+			sendMessageToChannel(line);
+		}
+		printed = true;
 	}
+	free(output);
+	if (status == SPAWN_TIMED_OUT) {
+		deadlineExceeded();
+	} else if (status != 0 && asErrors && !printed) {
+		char message[32];
+		snprintf(message, sizeof(message), "%s%d", "Exit status: ", status);
+		sendErrorToChannel(message);
+	}
+	return status == 0 && !(asErrors && printed);
 }
 
+// All external commands go through here, so we know how many processes and mpc round trips each command costs
+static FILE* openCommandStream(const char* command) {
+	TRACE_SPAN("mpd", "popen");
+	for (const char* mpc = strstr(command, "mpc"); mpc != NULL; mpc = strstr(mpc + 3, "mpc")) {
+		if ((mpc == command || mpc[-1] == ' ') && (mpc[3] == ' ' || mpc[3] == '\0')) {
+			metricsCount(METRIC_MPD_ROUNDTRIPS);
+		}
+	}
+	// Same as popen(), except that shutdown can find (and kill) the child
+	char* argv[] = { "/bin/sh", "-c", (char*) command, NULL };
+	int fd;
+	const pid_t pid = spawnStart(argv, SPAWN_STDOUT, deadlineCurrent, &fd);
+	if (unlikely(pid == -1)) {
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, 0); // Callers read it the usual, blocking way
+	FILE* stream = fdopen(fd, "r");
+	if (unlikely(!stream)) {
+		const int error = errno;
+		close(fd);
+		kill(-pid, SIGTERM);
+		lifecycleChildWait(pid, NULL, 0);
+		errno = error;
+		return NULL;
+	}
+	lifecycleChildStream(pid, stream);
+	return stream;
+}
 
-static void resetPlaylist() {
-	executeCommandWithErrorToChannel("mpc clear >/dev/null");
-	executeCommandWithErrorToChannel("mpc ls | mpc add >/dev/null");
-	executeCommandWithOutputToChannel("mpc play 2>&1");
+// pclose() for openCommandStream()
+static int closeCommandStream(FILE* stream) {
+	const pid_t pid = lifecycleChildStream(0, stream);
+	fclose(stream);
+	int status = -1;
+	if (likely(pid != 0)) {
+		lifecycleChildWait(pid, &status, 0);
+	}
+	if (unlikely(deadlinePassed())) { // Watchdog killed it, or the command is out of time anyway
+		deadlineExceeded();
+	}
+	return status;
 }
 
-static bool isPlaylistRandom() {
-	FILE *stream = popen("mpc status 2>&1", "r");
+static bool executeCommandWithErrorToChannel(const char* command) {
+	TRACE_SPAN("mpd", __func__);
+	FILE *stream = openCommandStream(command);
 	if (unlikely(!stream)) {
 		sendErrorToChannel(strerror(errno));
 		sendErrorToChannel("popen() error");
@@ -426,1151 +1880,8054 @@ static bool isPlaylistRandom() {
 	char* line = NULL;
 	size_t len = 0;
 	ssize_t read = -1;
-	bool ret = false;
+	bool result = true;
 	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strstr(line, "random: ")) { // If message contains substring
-			if (strstr(line, "random: on")) { // If message contains substring
-				ret = true;
-			}
-			break;
-		}
+		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+		sendErrorToChannel(line);
+		result = false; // We printed something, and this is error stream
 	}
-	pclose(stream);
-	if (line != NULL) {
+	closeCommandStream(stream);
+	if (unlikely(line != NULL)) {
 		free(line);
 	}
-	return ret;
+	return result;
 }
 
-static void addArtist(const char* regex, const bool one) {
-	FILE *stream = popen("mpc -f %artist% ls 2>&1", "r");
+static bool executeCommandWithOutputToChannel(const char* command) {
+	TRACE_SPAN("mpd", __func__);
+	FILE *stream = openCommandStream(command);
 	if (unlikely(!stream)) {
 		sendErrorToChannel(strerror(errno));
 		sendErrorToChannel("popen() error");
-		return;
+		return false;
 	}
 	char* line = NULL;
 	size_t len = 0;
 	ssize_t read = -1;
-	bool found = false;
 	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			//removeChar(line, '\'');
-			char command[21 + read + 6 + 1];
-			snprintf(command, sizeof(command), "%s%s%s", "mpc add -f %artist% \"", line, "\" 2>&1");
-			if (likely(executeCommandWithErrorToChannel(command))) {
-				snprintf(command, sizeof(command), "%s%s", "Added: ", line);
-				sendMessageToChannel(command);
-			}
-			if (one) {
-				break;
-			}
-		}
+		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+		sendMessageToChannel(line);
 	}
-	pclose(stream);
-	if (line != NULL) {
+	closeCommandStream(stream);
+	if (likely(line != NULL)) {
 		free(line);
 	}
-	if (found) {
-		executeCommandWithOutputToChannel("mpc play 2>&1");
-	} else {
-		sendMessageToChannel("Couldn't find anything! :-(");
-	}
+	return true;
 }
 
-static void getArtist(const char* regex, const bool one) {
-	FILE *stream = popen("mpc -f %artist% ls 2>&1", "r");
+static bool executeCommandWithOutput(const char* command, char** output) {
+	TRACE_SPAN("mpd", __func__);
+	FILE *stream = openCommandStream(command);
 	if (unlikely(!stream)) {
 		sendErrorToChannel(strerror(errno));
 		sendErrorToChannel("popen() error");
-		return;
+		return false;
 	}
 	char* line = NULL;
 	size_t len = 0;
 	ssize_t read = -1;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			char command[7 + read + 1];
-			snprintf(command, sizeof(command), "%s%s", "Found: ", line);
-			sendMessageToChannel(command);
-			if (one) {
-				break;
-			}
+	if (likely((read = getline(&line, &len, stream)) != -1)) {
+		closeCommandStream(stream);
+		line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+		*output = (char* ) malloc((read + 1) * sizeof(char));
+		if (unlikely(!output)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("malloc() error");
+			free(line);
+			return false;
 		}
-	}
-	pclose(stream);
-	if (line != NULL) {
+		strncpy(*output, line, read);
 		free(line);
+	} else {
+		closeCommandStream(stream);
+		free(line); // getline() allocates it even when it fails
+		if (unlikely(deadlinePassed())) { // It was killed, empty output doesn't mean anything
+			return false;
+		}
+		*output = (char* ) malloc(sizeof(char));
+		if (unlikely(!output)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("malloc() error");
+			return false;
+		}
+		**output = '\0';
 	}
-	if (!found) {
-		sendMessageToChannel("Couldn't find anything! :-(");
+	return true;
+}
+
+/*
+static bool clientBelongsToChannelGroup(const anyID fromID, const int targetGroupID) {
+	int currentGroupID = 0;
+	if (unlikely(ts3Functions.getClientVariableAsInt(myServerConnectionHandlerID, fromID, CLIENT_CHANNEL_GROUP_ID, &currentGroupID) != ERROR_ok)) {
+		sendErrorToChannel("getClientVariableAsInt() error");
+		return false;
 	}
+	return currentGroupID == targetGroupID;
 }
 
-static void addFile(const char* regex, const bool one) {
-	FILE *stream = popen("mpc -f %file% listall 2>&1", "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return;
+static anyID getClientIDfromClientName(const char* targetName) {
+	anyID ret = NULL;
+	anyID *clients;
+	if (unlikely(ts3Functions.getClientList(myServerConnectionHandlerID, &clients) != ERROR_ok)) {
+		sendErrorToChannel("getClientList() error");
+		return ret;
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			//removeChar(line, '\'');
-			char command[19 + read + 6 + 1];
-			snprintf(command, sizeof(command), "%s%s%s", "mpc add -f %file% \"", line, "\" 2>&1");
-			if (likely(executeCommandWithErrorToChannel(command))) {
-				snprintf(command, sizeof(command), "%s%s", "Added: ", line);
-				sendMessageToChannel(command);
-			}
-			if (one) {
+	for (unsigned int i = 0; clients[i] != '\0'; ++i) {
+		char* clientName;
+		if (likely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName)) == ERROR_ok) {
+			if (strncasecmp(targetName, clientName, strlen(targetName)) == 0) {
+				ret = clients[i];
+				ts3Functions.freeMemory(clientName);
 				break;
 			}
+			ts3Functions.freeMemory(clientName);
+		} else {
+			sendErrorToChannel("getClientVariableAsString() error");
+			ts3Functions.freeMemory(clients);
+			return ret;
 		}
 	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
-	}
-	if (found) {
-		executeCommandWithOutputToChannel("mpc play 2>&1");
-	} else {
-		sendMessageToChannel("Couldn't find anything! :-(");
-	}
+	ts3Functions.freeMemory(clients);
+	return ret;
 }
 
-static void getFile(const char* regex, const bool one) {
-	FILE *stream = popen("mpc -f %file% listall 2>&1", "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return;
+static bool getClientNameByRegex(const char* regex, char** output) {
+	anyID *clients;
+	if (unlikely(ts3Functions.getClientList(myServerConnectionHandlerID, &clients) != ERROR_ok)) {
+		sendErrorToChannel("getClientList() error");
+		return false;
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
 	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			char command[7 + read + 1];
-			snprintf(command, sizeof(command), "%s%s", "Found: ", line);
-			sendMessageToChannel(command);
-			if (one) {
+	for (unsigned int i = 0; clients[i] != '\0'; ++i) {
+		char* clientName;
+		if (likely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName)) == ERROR_ok) {
+			if (strncasecmp(targetName, clientName, strlen(targetName)) == 0) {
+				found = true;
+				*output = (char* ) malloc((strlen(clientName) + 1) * sizeof(char));
+				if (unlikely(!output)) {
+					sendErrorToChannel(strerror(errno));
+					sendErrorToChannel("malloc() error");
+					ts3Functions.freeMemory(clientName);
+					ts3Functions.freeMemory(clients);
+					return false;
+				}
+				strncpy(*output, clientName, strlen(clientName));
+				ts3Functions.freeMemory(clientName);
 				break;
 			}
+			ts3Functions.freeMemory(clientName);
+		} else {
+			sendErrorToChannel("getClientVariableAsString() error");
+			ts3Functions.freeMemory(clients);
+			return ret;
 		}
 	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
-	}
-	if (!found) {
-		sendMessageToChannel("Couldn't find anything! :-(");
-	}
+	ts3Functions.freeMemory(clients);
+	return found;
 }
+*/
 
-static void addSong(const char* regex, const bool one) {
-	FILE *stream = popen("mpc listall 2>&1", "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return;
+static bool clientBelongsToServerGroup(const anyID fromID, const char* targetGroupID) {
+	TRACE_SPAN("permission", __func__);
+	char* clientGroups = NULL;
+	if (unlikely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, fromID, CLIENT_SERVERGROUPS, &clientGroups) != ERROR_ok)) {
+		sendErrorToChannel("getClientVariableAsString() error");
+		return false;
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			//removeChar(line, '\'');
-			char command[9 + read + 6 + 1];
-			snprintf(command, sizeof(command), "%s%s%s", "mpc add \"", line, "\" 2>&1");
-			if (likely(executeCommandWithErrorToChannel(command))) {
-				snprintf(command, sizeof(command), "%s%s", "Added: ", line);
-				sendMessageToChannel(command);
-			}
-			if (one) {
-				break;
-			}
+	char buffer[strlen(clientGroups) + 1];
+	strncpy(buffer, clientGroups, sizeof(buffer));
+	ts3Functions.freeMemory(clientGroups);
+	char* saveptr;
+	char* clientGroup = strtok_r(buffer, ",", &saveptr);
+	bool accessGranted = false;
+	while (clientGroup != NULL) {
+		if (strcmp(clientGroup, targetGroupID) == 0) {
+			accessGranted = true;
+			break;
 		}
+		clientGroup = strtok_r(NULL, ",", &saveptr);
 	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
-	}
-	if (found) {
-		executeCommandWithOutputToChannel("mpc play 2>&1");
+	return accessGranted;
+}
+
+// Jobs in lanes were checked on the loop already, with rootGroup, the only group anybody asks about
+static bool isAccessGranted(const anyID fromID, const char* targetGroupID) {
+	if (laneJob != NULL ? laneJob->rootGranted : clientBelongsToServerGroup(fromID, targetGroupID)) {
+		return true;
 	} else {
-		sendMessageToChannel("Couldn't find anything! :-(");
+		sendMessageToChannel("Sorry! You're not permitted to use that command! :-(");
+		return false;
 	}
 }
 
-static void getSong(const char* regex, const bool one) {
-	FILE *stream = popen("mpc listall 2>&1", "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return;
-	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			char command[7 + read + 1];
-			snprintf(command, sizeof(command), "%s%s", "Found: ", line);
-			sendMessageToChannel(command);
-			if (one) {
-				break;
-			}
+
+/*********************************** MPD client ************************************/
+/*
+ * Minimal native client for the MPD protocol, so hot paths don't have to fork mpc for every question.
+ * Follows MPD_HOST ([password@]host or absolute socket path) and MPD_PORT, same as mpc does. Socket doesn't block,
+ * we poll() it for no longer than MPD_TIMEOUT or what's left until command's deadline, whichever comes first.
+ */
+
+#define MPD_BUFSIZE 65536 // Longest line we can receive, MPD keeps tag values way below that
+#define MPD_TIMEOUT 10 // Seconds for any single connect, read or write on MPD socket
+
+struct mpdConnection {
+	int fd;
+	size_t start;
+	size_t end;
+	char error[256];
+	char buffer[MPD_BUFSIZE];
+};
+
+// Writes argument into output quoted and escaped for MPD, output needs 2 * strlen(argument) + 3 bytes
+static void mpdQuote(char* output, const char* argument) {
+	*output++ = '"';
+	for (; *argument; ++argument) {
+		if (*argument == '"' || *argument == '\\') {
+			*output++ = '\\';
 		}
+		*output++ = *argument;
 	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
-	}
-	if (!found) {
-		sendMessageToChannel("Couldn't find anything! :-(");
-	}
+	*output++ = '"';
+	*output = '\0';
 }
 
-static void playNum_unsigned_long_int(const unsigned long int number) {
-	char command[9 + 10 + 5 + 1]; // Unsigned long int has no more than 10 digits -> <0, 4,294,967,295>
-	snprintf(command, sizeof(command), "%s%lu%s", "mpc play ", number, " 2>&1");
-	executeCommandWithOutputToChannel(command);
+// prefix, argument quoted by mpdQuote() and suffix, in the arena, NULL (with connection->error) if that's full
+static char* mpdQuoted(struct mpdConnection* connection, const char* prefix, const char* argument, const char* suffix) {
+	const size_t prefixLength = strlen(prefix);
+	char* command = (char*) arenaAlloc(prefixLength + 2 * strlen(argument) + 3 + strlen(suffix));
+	if (unlikely(!command)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "arenaAlloc() error");
+		return NULL;
+	}
+	memcpy(command, prefix, prefixLength);
+	mpdQuote(command + prefixLength, argument);
+	strcat(command + prefixLength, suffix);
+	return command;
 }
 
-static void playNum(const char* regex) {
-	const unsigned long int number = strtoul(regex, NULL, 0);
-	if (number != 0) {
-		playNum_unsigned_long_int(number);
-	} else {
-		sendMessageToChannel("Wrong number! :-(");
+static void mpdDisconnect(struct mpdConnection* connection) {
+	if (connection->fd != -1) {
+		close(connection->fd);
+		connection->fd = -1;
 	}
 }
 
-static bool play(const char* format, const char* regex) {
-	FILE *stream = NULL;
-	if (format != NULL) {
-		char command[7 + strlen(format) + 14 + 1];
-		snprintf(command, sizeof(command), "%s%s%s", "mpc -f ", format, " playlist 2>&1");
-		stream = popen(command, "r");
-	} else {
-		stream = popen("mpc playlist 2>&1", "r");
-	}
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return false;
-	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	unsigned long int playNumber = 0;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		++playNumber;
-		if (strcasestr(line, regex) != NULL) {
-			found = true;
-			break;
-		}
-	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
-	}
-	if (found) {
-		playNum_unsigned_long_int(playNumber);
+// Until socket is ready for events, false (disconnected, with connection->error) if it took too long
+static bool mpdWait(struct mpdConnection* connection, const short events) {
+	struct pollfd pollfd = { .fd = connection->fd, .events = events };
+	int ready;
+	while ((ready = poll(&pollfd, 1, deadlinePollTimeout(MPD_TIMEOUT * 1000))) == -1 && errno == EINTR);
+	if (likely(ready > 0)) {
 		return true;
+	}
+	if (ready == 0) {
+		metricsCount(METRIC_MPD_TIMEOUTS);
+		snprintf(connection->error, sizeof(connection->error), "%s", "MPD took too long to answer");
 	} else {
-		return false;
+		snprintf(connection->error, sizeof(connection->error), "%s%s", "poll() error: ", strerror(errno));
+	}
+	mpdDisconnect(connection); // Late answer would be taken for the one to the next request
+	if (ready == 0 && deadlinePassed()) {
+		deadlineExceeded();
 	}
+	return false;
 }
 
-static void playFile(const char* regex) {
-	if (!play("%file%", regex)) {
-		sendMessageToChannel("Couldn't find anything! :-(");
+static bool mpdWrite(struct mpdConnection* connection, const char* data, size_t length) {
+	while (length > 0) {
+		const ssize_t written = send(connection->fd, data, length, MSG_NOSIGNAL);
+		if (unlikely(written < 0)) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (unlikely(!mpdWait(connection, POLLOUT))) {
+					return false;
+				}
+				continue;
+			}
+			snprintf(connection->error, sizeof(connection->error), "%s%s", "send() error: ", strerror(errno));
+			mpdDisconnect(connection);
+			return false;
+		}
+		data += written;
+		length -= written;
 	}
+	return true;
 }
 
-static void playSong(const char* regex) {
-	if (!play(NULL, regex)) {
-		sendMessageToChannel("Couldn't find anything! :-(");
+// Returns next line without the newline, valid until the next call, or NULL on error
+static char* mpdReadLine(struct mpdConnection* connection) {
+	while (true) {
+		char* newline = (char*) memchr(connection->buffer + connection->start, '\n', connection->end - connection->start);
+		if (newline != NULL) {
+			char* line = connection->buffer + connection->start;
+			*newline = '\0';
+			connection->start = newline - connection->buffer + 1;
+			return line;
+		}
+		if (connection->start > 0) { // Make room for the rest of the line
+			memmove(connection->buffer, connection->buffer + connection->start, connection->end - connection->start);
+			connection->end -= connection->start;
+			connection->start = 0;
+		}
+		if (unlikely(connection->end == sizeof(connection->buffer))) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "MPD sent too long line");
+			mpdDisconnect(connection);
+			return NULL;
+		}
+		const ssize_t received = recv(connection->fd, connection->buffer + connection->end, sizeof(connection->buffer) - connection->end, 0);
+		if (unlikely(received <= 0)) {
+			if (received < 0 && errno == EINTR) {
+				continue;
+			}
+			if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (unlikely(!mpdWait(connection, POLLIN))) {
+					return NULL;
+				}
+				continue;
+			}
+			snprintf(connection->error, sizeof(connection->error), "%s%s", "recv() error: ", received == 0 ? "connection closed" : strerror(errno));
+			mpdDisconnect(connection);
+			return NULL;
+		}
+		connection->end += received;
 	}
 }
 
-static void refreshFavSymlink(const char* clientName, const char* clientUID) {
-	struct stat st = {0};
+// Returns 1 for "key: value" (and "list_OK" with empty value), 0 for final OK, -1 for ACK or connection error described in connection->error
+static int mpdReadPair(struct mpdConnection* connection, char** key, char** value) {
+	char* line = mpdReadLine(connection);
+	if (unlikely(!line)) {
+		return -1;
+	}
+	if (strcmp(line, "OK") == 0) {
+		return 0;
+	}
+	if (strncmp(line, "ACK ", 4) == 0) {
+		snprintf(connection->error, sizeof(connection->error), "%s", line);
+		return -1;
+	}
+	*key = line;
+	char* separator = strstr(line, ": ");
+	if (separator != NULL) {
+		*separator = '\0';
+		*value = separator + 2;
+	} else {
+		*value = line + strlen(line);
+	}
+	return 1;
+}
 
-	char favFile[strlen(favPath) + strlen(clientUID) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, clientUID, ".txt");
-	bool favFileExists = false;
-	if (stat(favFile, &st) != -1) { // If favfile exists
-		favFileExists = true;
+// Command must include trailing newline, can also be a whole command list
+static bool mpdSend(struct mpdConnection* connection, const char* command) {
+	if (unlikely(connection->fd == -1)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "Not connected to MPD");
+		return false;
 	}
+	metricsCount(METRIC_MPD_ROUNDTRIPS);
+	return mpdWrite(connection, command, strlen(command));
+}
 
-	char clientNameLower[strlen(clientName) + 1];
-	strncpy(clientNameLower, clientName, sizeof(clientNameLower));
-	toLower(clientNameLower);
+// Sends command and skips the response, true if MPD said OK
+static bool mpdCommand(struct mpdConnection* connection, const char* command) {
+	if (unlikely(!mpdSend(connection, command))) {
+		return false;
+	}
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1);
+	return ret == 0;
+}
 
-	char favFileSymlink[strlen(favPath) + strlen(clientNameLower) + 4 + 1];
-	snprintf(favFileSymlink, sizeof(favFileSymlink), "%s%s%s", favPath, clientNameLower, ".txt");
-	char favFileSymlinkTarget[strlen(clientUID) + 4 + 1];
-	snprintf(favFileSymlinkTarget, sizeof(favFileSymlinkTarget), "%s%s", clientUID, ".txt");
+// connect() for non-blocking socket, false (disconnected, with connection->error) if it failed or took too long
+static bool mpdConnectTo(struct mpdConnection* connection, const struct sockaddr* address, const socklen_t length) {
+	if (connect(connection->fd, address, length) == 0) {
+		return true;
+	}
+	if (errno == EINPROGRESS && mpdWait(connection, POLLOUT)) {
+		int error = 0;
+		socklen_t size = sizeof(error);
+		if (likely(getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0)) {
+			return true;
+		}
+		errno = error != 0 ? error : errno;
+	}
+	if (connection->fd != -1) { // Otherwise mpdWait() said why
+		snprintf(connection->error, sizeof(connection->error), "%s%s", "connect() error: ", strerror(errno));
+		mpdDisconnect(connection);
+	}
+	return false;
+}
 
-	if (lstat(favFileSymlink, &st) != -1) { // If symlink exists
-		char favFileSymlinkTargetReal[st.st_size + 1];
-		ssize_t r;
-		if (likely((r = readlink(favFileSymlink, favFileSymlinkTargetReal, st.st_size + 1)) != -1)) {
-			favFileSymlinkTargetReal[r] = '\0'; // readlink() does not append a null byte to buf
-			if (strcmp(favFileSymlinkTarget, favFileSymlinkTargetReal) == 0) { // If symlinks are the same
-				if (!favFileExists) { // If favfile doesn't exist (user removed his last fav)
-					if (unlikely(remove(favFileSymlink))) { // Remove (now invalid) symlink to favfile
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("remove() error");
-					}
-				}
-			} else { // If symlinks are different
-				if (favFileExists) { // If favfile exists
-					if (unlikely(remove(favFileSymlink))) { // Remove outdated symlink
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("remove() error");
-					}
-					if (unlikely(symlink(favFileSymlinkTarget, favFileSymlink))) { // Create new symlink to favfile
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("symlink() error");
-					}
-				}
-			}
-		} else {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("readlink() error");
-			return;
+static bool mpdConnect(struct mpdConnection* connection) {
+	TRACE_SPAN("mpd", __func__);
+	connection->fd = -1;
+	connection->start = connection->end = 0;
+	connection->error[0] = '\0';
+
+	const char* host = getenv("MPD_HOST");
+	const char* port = getenv("MPD_PORT");
+	if (host == NULL || *host == '\0') {
+		host = "localhost";
+	}
+	if (port == NULL || *port == '\0') {
+		port = "6600";
+	}
+	const char* password = NULL;
+	size_t passwordLength = 0;
+	const char* at = strrchr(host, '@');
+	if (at != NULL && at != host) {
+		password = host;
+		passwordLength = at - host;
+		host = at + 1;
+	}
+
+	if (host[0] == '/') {
+		struct sockaddr_un address = { .sun_family = AF_UNIX };
+		if (unlikely(strlen(host) >= sizeof(address.sun_path))) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "MPD_HOST socket path too long");
+			return false;
 		}
-	} else { // If symlink doesn't exist
-		if (favFileExists) { // If favfile exists
-			if (unlikely(symlink(favFileSymlinkTarget, favFileSymlink))) { // Create new symlink to favfile
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("symlink() error");
+		memcpy(address.sun_path, host, strlen(host) + 1);
+		connection->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (connection->fd != -1) {
+			mpdConnectTo(connection, (struct sockaddr*) &address, sizeof(address));
+		}
+	} else {
+		struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+		struct addrinfo* addresses = NULL;
+		const int ret = getaddrinfo(host, port, &hints, &addresses);
+		if (unlikely(ret != 0)) {
+			snprintf(connection->error, sizeof(connection->error), "%s%s", "getaddrinfo() error: ", gai_strerror(ret));
+			return false;
+		}
+		for (struct addrinfo* address = addresses; address != NULL && connection->fd == -1; address = address->ai_next) {
+			connection->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+			if (connection->fd != -1) {
+				mpdConnectTo(connection, address->ai_addr, address->ai_addrlen);
 			}
 		}
+		freeaddrinfo(addresses);
+	}
+	if (connection->fd == -1) {
+		if (connection->error[0] == '\0') { // socket() failed
+			snprintf(connection->error, sizeof(connection->error), "%s%s", "socket() error: ", strerror(errno));
+		}
+		return false;
+	}
+	connection->error[0] = '\0'; // Of addresses that didn't work
+
+	const char* greeting = mpdReadLine(connection);
+	if (unlikely(!greeting)) {
+		return false;
+	}
+	if (unlikely(strncmp(greeting, "OK MPD ", 7) != 0)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "That's not MPD on the other side");
+		mpdDisconnect(connection);
+		return false;
+	}
+	if (password != NULL) {
+		char passwordRaw[passwordLength + 1];
+		memcpy(passwordRaw, password, passwordLength);
+		passwordRaw[passwordLength] = '\0';
+		char command[9 + 2 * passwordLength + 3 + 1];
+		memcpy(command, "password ", 9);
+		mpdQuote(command + 9, passwordRaw);
+		strcat(command, "\n");
+		if (unlikely(!mpdCommand(connection, command))) {
+			mpdDisconnect(connection);
+			return false;
+		}
 	}
+	return true;
 }
 
-static void addFav(const char* fromUniqueIdentifier, const bool imSure) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	bool firstFav = false;
-	if (stat(favFile, &st) == -1) { // If doesn't exist yet
-		firstFav = true;
+/*********************************** Regular expressions ************************************/
+/*
+ * Queries written as /pattern/flags are regular expressions: literals, ., [classes], \d \w \s (and negations),
+ * groups, |, * + ? {n,m}, ^ and $. They're parsed into a tree, compiled into a Thompson NFA over UTF-8 bytes and
+ * matched with a lazy DFA, whose states are made only when some text actually gets there. That's linear in
+ * the length of text no matter the pattern, and DFA is flushed when it grows too big. With the i flag, pattern
+ * and text are both turned into search keys, so it's as forgiving as plain searches are.
+ */
+
+#define REGEX_MAX_PATTERN 256 // Bytes
+#define REGEX_MAX_REPEAT 100 // Biggest n and m in {n,m}
+#define REGEX_MAX_NODES 4096
+#define REGEX_MAX_NFA_STATES 8192
+#define REGEX_MAX_DFA_STATES 1024 // Before it gets flushed
+#define REGEX_MAX_CLASS 256 // Non-ASCII characters in one [class]
+#define REGEX_MAX_DEPTH 32 // Groups in groups
+#define REGEX_CACHE_SIZE 8 // Compiled patterns kept for later
+#define REGEX_TIME_LIMIT 250000 // Microseconds one search may take
+#define REGEX_NONE UINT32_MAX
+#define REGEX_INFINITY UINT16_MAX
+
+typedef enum {REGEX_BYTES, REGEX_CONCAT, REGEX_ALTERNATE, REGEX_REPEAT, REGEX_BOL, REGEX_EOL, REGEX_EMPTY, REGEX_SPLIT, REGEX_MATCH} regexType;
+
+struct regexNode {
+	uint8_t type;
+	uint16_t min; // Of REGEX_REPEAT
+	uint16_t max;
+	uint32_t left;
+	uint32_t right;
+	uint8_t bytes[32]; // Of REGEX_BYTES, bit per byte
+};
+
+struct regexClass {
+	uint8_t ascii[16];
+	bool anyMultibyte; // Everything that isn't ASCII, from \D, \W and \S
+	unsigned int count;
+	unsigned char members[REGEX_MAX_CLASS][9]; // Length first, folded "ß" is 2 characters
+};
+
+struct regexParser {
+	const unsigned char* p;
+	const unsigned char* end;
+	struct regexNode* nodes;
+	uint32_t count;
+	unsigned int depth;
+	bool caseless;
+	const char* error;
+};
+
+struct regexNfaState {
+	uint8_t type; // REGEX_BYTES, REGEX_SPLIT, REGEX_EMPTY, REGEX_BOL, REGEX_EOL or REGEX_MATCH
+	uint32_t out[2];
+	uint8_t bytes[32];
+};
+
+#define REGEX_DFA_MATCH 1 // Matched already, whatever comes next
+#define REGEX_DFA_MATCH_AT_END 2 // Matches if text ends here
+#define REGEX_DFA_DEAD 4 // Can't match anymore
+#define REGEX_DFA_HASH (2 * REGEX_MAX_DFA_STATES)
+#define REGEX_MAX_DFA_SETS (1 << 20) // NFA states of all DFA states together, before it gets flushed
+
+struct regex {
+	char* source; // As typed, including slashes and flags
+	bool caseless;
+	char* literal; // searchKey() of the longest literal every match contains, "" if there isn't one
+	struct regexNfaState* states;
+	uint32_t statesCount;
+	uint32_t start;
+	uint8_t classes[256]; // Bytes nobody tells apart share a class, and a column of DFA transitions
+	uint32_t classCount;
+	int32_t* dfaNext; // classCount per state, -1 if not made yet
+	uint8_t* dfaFlags;
+	uint32_t* dfaSetStart; // NFA states of DFA state i are dfaSets[dfaSetStart[i]] until dfaSets[dfaSetStart[i + 1]]
+	uint32_t* dfaSets;
+	uint32_t dfaSetsCapacity;
+	uint32_t dfaCount;
+	int32_t dfaInitial;
+	uint32_t dfaHash[REGEX_DFA_HASH]; // DFA state + 1, 0 is empty
+	uint32_t* marks; // Two per NFA state, before and after $
+	uint32_t mark;
+	uint32_t* stack;
+	uint32_t* work;
+};
+
+static inline bool regexBit(const uint8_t* bytes, const unsigned int byte) {
+	return (bytes[byte >> 3] >> (byte & 7)) & 1;
+}
+
+static inline void regexSetBit(uint8_t* bytes, const unsigned int byte) {
+	bytes[byte >> 3] |= 1 << (byte & 7);
+}
+
+static uint32_t regexNode(struct regexParser* parser, const regexType type, const uint32_t left, const uint32_t right) {
+	if (parser->count == REGEX_MAX_NODES) {
+		parser->error = "pattern is too complex";
+		return REGEX_NONE;
 	}
-	FILE *cmdStream = popen("mpc -f %file% current 2>&1", "r");
-	if (unlikely(!cmdStream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
-		return;
+	struct regexNode* node = &parser->nodes[parser->count];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return parser->count++;
+}
+
+static uint32_t regexBytes(struct regexParser* parser, const uint8_t bytes[32]) {
+	const uint32_t node = regexNode(parser, REGEX_BYTES, REGEX_NONE, REGEX_NONE);
+	if (node != REGEX_NONE) {
+		memcpy(parser->nodes[node].bytes, bytes, 32);
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
-		pclose(cmdStream);
-		FILE *favStream = fopen(favFile, "a+");
-		if (unlikely(!favStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			free(line);
-			return;
+	return node;
+}
+
+static uint32_t regexByteRange(struct regexParser* parser, const unsigned int from, const unsigned int to) {
+	uint8_t bytes[32] = {0};
+	for (unsigned int byte = from; byte <= to; ++byte) {
+		regexSetBit(bytes, byte);
+	}
+	return regexBytes(parser, bytes);
+}
+
+// Either of them may be REGEX_NONE (nothing yet), errors are passed along
+static uint32_t regexConcat(struct regexParser* parser, const uint32_t left, const uint32_t right) {
+	if (parser->error != NULL) {
+		return REGEX_NONE;
+	}
+	return left == REGEX_NONE ? right : right == REGEX_NONE ? left : regexNode(parser, REGEX_CONCAT, left, right);
+}
+
+static uint32_t regexAlternate(struct regexParser* parser, const uint32_t left, const uint32_t right) {
+	if (parser->error != NULL) {
+		return REGEX_NONE;
+	}
+	return left == REGEX_NONE ? right : right == REGEX_NONE ? left : regexNode(parser, REGEX_ALTERNATE, left, right);
+}
+
+static uint32_t regexSequence(struct regexParser* parser, const unsigned char* bytes, const size_t length) {
+	uint32_t node = REGEX_NONE;
+	for (size_t i = 0; i < length; ++i) {
+		node = regexConcat(parser, node, regexByteRange(parser, bytes[i], bytes[i]));
+	}
+	return node;
+}
+
+// Any character of length bytes (from depth on) except members, REGEX_NONE if there's none
+static uint32_t regexExcept(struct regexParser* parser, unsigned char (*members)[9], const unsigned int count, const unsigned int depth, const unsigned int length, const unsigned int from, const unsigned int to) {
+	uint8_t rest[32] = {0};
+	for (unsigned int byte = from; byte <= to; ++byte) {
+		regexSetBit(rest, byte);
+	}
+	uint8_t used[32] = {0};
+	for (unsigned int i = 0; i < count; ++i) {
+		regexSetBit(used, members[i][1 + depth]);
+		rest[members[i][1 + depth] >> 3] &= ~(1 << (members[i][1 + depth] & 7));
+	}
+	uint32_t node = REGEX_NONE;
+	bool any = false;
+	for (unsigned int byte = from; byte <= to && !any; ++byte) {
+		any = regexBit(rest, byte);
+	}
+	if (any) {
+		node = regexBytes(parser, rest);
+		for (unsigned int i = depth + 1; i < length; ++i) {
+			node = regexConcat(parser, node, regexByteRange(parser, 0x80, 0xbf));
 		}
-		char currentSong[read + 1];
-		strncpy(currentSong, line, sizeof(currentSong));
-		bool alreadyExists = false;
-		while ((read = getline(&line, &len, favStream)) != -1) {
-			if (strcmp(currentSong, line) == 0) {
-				alreadyExists = true;
-				break;
+	}
+	if (depth + 1 == length) {
+		return node;
+	}
+	for (unsigned int byte = from; byte <= to; ++byte) {
+		if (!regexBit(used, byte)) {
+			continue;
+		}
+		unsigned char same[count + 1][9];
+		unsigned int sameCount = 0;
+		for (unsigned int i = 0; i < count; ++i) {
+			if (members[i][1 + depth] == byte) {
+				memcpy(same[sameCount++], members[i], 9);
 			}
 		}
-		free(line);
-		if (alreadyExists) {
-			fclose(favStream);
-			sendMessageToChannel("You already faved this song! 8)");
-		} else {
-			if (!imSure) {
-				if (randomBool()) {
-					sendMessageToChannel("Magic crystall ball decided: Yup! 8)");
-				} else {
-					sendMessageToChannel("Magic crystall ball decided: Nope! 8)");
-					return;
+		const uint32_t tail = regexExcept(parser, same, sameCount, depth + 1, length, 0x80, 0xbf);
+		if (tail != REGEX_NONE) {
+			node = regexAlternate(parser, node, regexConcat(parser, regexByteRange(parser, byte, byte), tail));
+		}
+	}
+	return node;
+}
+
+// Whole class as a node, characters which aren't ASCII are sequences of bytes
+static uint32_t regexClassNode(struct regexParser* parser, struct regexClass* class, const bool negated) {
+	uint8_t bytes[32] = {0};
+	bool any = false;
+	for (unsigned int byte = 1; byte < 0x80; ++byte) {
+		if (regexBit(class->ascii, byte) != negated) {
+			regexSetBit(bytes, byte);
+			any = true;
+		}
+	}
+	uint32_t node = any ? regexBytes(parser, bytes) : REGEX_NONE;
+	if (class->anyMultibyte != negated) {
+		unsigned char (*excluded)[9] = NULL;
+		unsigned int excludedCount = 0;
+		if (negated && class->count != 0) {
+			excluded = class->members; // Sorted by length below, only real characters are excluded
+		}
+		static const unsigned char leads[3][2] = {{0xc2, 0xdf}, {0xe0, 0xef}, {0xf0, 0xf4}};
+		for (unsigned int length = 2; length <= 4; ++length) {
+			excludedCount = 0;
+			unsigned char same[class->count + 1][9];
+			for (unsigned int i = 0; excluded != NULL && i < class->count; ++i) {
+				if (excluded[i][0] == length && excluded[i][1] >= leads[length - 2][0] && excluded[i][1] <= leads[length - 2][1]) {
+					memcpy(same[excludedCount++], excluded[i], 9);
 				}
 			}
-			fprintf(favStream, "%s", currentSong);
-			fclose(favStream);
-			sendMessageToChannel("Faved! 8)");
+			node = regexAlternate(parser, node, regexExcept(parser, same, excludedCount, 0, length, leads[length - 2][0], leads[length - 2][1]));
 		}
-		if (firstFav) {
-			sendMessageToChannel("This is your first fav! 8)");
+	} else if (!negated) {
+		for (unsigned int i = 0; i < class->count; ++i) {
+			node = regexAlternate(parser, node, regexSequence(parser, class->members[i] + 1, class->members[i][0]));
 		}
-	} else {
-		sendErrorToChannel("getline() error");
-		pclose(cmdStream);
-		return;
 	}
+	if (node == REGEX_NONE && parser->error == NULL) {
+		memset(bytes, 0, sizeof(bytes));
+		node = regexBytes(parser, bytes); // Never matches
+	}
+	return node;
 }
 
-static void delFav(const char* fromUniqueIdentifier) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		FILE *cmdStream = popen("mpc -f %file% current 2>&1", "r");
-		if (unlikely(!cmdStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("popen() error");
+static unsigned int regexCharLength(const unsigned char lead) {
+	return lead < 0xc0 ? 1 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+}
+
+// Adds character (bytes of one, folded if needed) to class
+static void regexClassAdd(struct regexParser* parser, struct regexClass* class, const unsigned char* character, const unsigned int length) {
+	unsigned char folded[9];
+	if (parser->caseless) {
+		char input[5] = {0};
+		memcpy(input, character, length);
+		const size_t foldedLength = searchKey((char*) folded + 1, input);
+		folded[0] = foldedLength;
+	} else {
+		folded[0] = length;
+		memcpy(folded + 1, character, length);
+	}
+	if (folded[0] == 1 && folded[1] < 0x80) {
+		regexSetBit(class->ascii, folded[1]);
+	} else if (folded[0] != 0) {
+		if (class->count == REGEX_MAX_CLASS) {
+			parser->error = "class is too big";
 			return;
 		}
-		char favFileTemp[strlen(favFile) + 4 + 1];
-		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		bool alreadyRemoved = true;
-		bool finalFileIsEmpty = true;
-		if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
-			pclose(cmdStream);
-			FILE *favStream = fopen(favFile, "r");
-			if (unlikely(!favStream)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				free(line);
-				return;
+		memcpy(class->members[class->count++], folded, 9);
+	}
+}
+
+static void regexClassEscape(struct regexClass* class, const unsigned char escape) {
+	const bool negated = escape == 'D' || escape == 'W' || escape == 'S';
+	const unsigned char lower = escape | 0x20;
+	for (unsigned int byte = 1; byte < 0x80; ++byte) {
+		const bool member = lower == 'd' ? (byte >= '0' && byte <= '9')
+			: lower == 'w' ? ((byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || byte == '_')
+			: (byte == ' ' || (byte >= '\t' && byte <= '\r'));
+		if (member != negated) {
+			regexSetBit(class->ascii, byte);
+		}
+	}
+	if (negated) {
+		class->anyMultibyte = true;
+	}
+}
+
+static uint32_t regexParseAlternation(struct regexParser* parser);
+
+// One character of class, or escape; false if it's not a character (\d and such went straight to class)
+static bool regexParseClassCharacter(struct regexParser* parser, struct regexClass* class, uint32_t* codepoint, unsigned char* character, unsigned int* length) {
+	if (*parser->p == '\\' && parser->p + 1 < parser->end) {
+		const unsigned char escape = parser->p[1];
+		parser->p += 2;
+		if (strchr("dDwWsS", escape) != NULL) {
+			regexClassEscape(class, escape);
+			return false;
+		}
+		character[0] = escape == 't' ? '\t' : escape == 'n' ? '\n' : escape;
+		*length = 1;
+	} else {
+		*length = regexCharLength(*parser->p);
+		if (parser->p + *length > parser->end) {
+			parser->error = "broken UTF-8";
+			return false;
+		}
+		memcpy(character, parser->p, *length);
+		parser->p += *length;
+	}
+	*codepoint = *length == 1 ? character[0] : character[0] & (0x7f >> *length);
+	for (unsigned int i = 1; i < *length; ++i) {
+		*codepoint = (*codepoint << 6) | (character[i] & 0x3f);
+	}
+	return true;
+}
+
+static uint32_t regexParseClass(struct regexParser* parser) {
+	struct regexClass* class = (struct regexClass*) calloc(1, sizeof(struct regexClass));
+	if (unlikely(!class)) {
+		parser->error = "out of memory";
+		return REGEX_NONE;
+	}
+	const bool negated = parser->p < parser->end && *parser->p == '^';
+	if (negated) {
+		++parser->p;
+	}
+	bool first = true;
+	while (parser->error == NULL) {
+		if (parser->p >= parser->end) {
+			parser->error = "missing ]";
+			break;
+		}
+		if (*parser->p == ']' && !first) {
+			++parser->p;
+			break;
+		}
+		first = false;
+		uint32_t from;
+		unsigned char character[4];
+		unsigned int length;
+		if (!regexParseClassCharacter(parser, class, &from, character, &length)) {
+			continue;
+		}
+		if (parser->p + 1 < parser->end && *parser->p == '-' && parser->p[1] != ']') {
+			++parser->p;
+			uint32_t to;
+			unsigned char last[4];
+			unsigned int lastLength;
+			if (!regexParseClassCharacter(parser, class, &to, last, &lastLength)) {
+				if (parser->error == NULL) {
+					parser->error = "bad range";
+				}
+				break;
 			}
-			FILE *favStreamTemp = fopen(favFileTemp, "w");
-			if (unlikely(!favStreamTemp)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				fclose(favStream);
-				free(line);
-				return;
+			if (to < from || (to >= 0x80 && to - from > REGEX_MAX_CLASS)) {
+				parser->error = "bad range";
+				break;
 			}
-			char currentSong[read + 1];
-			strncpy(currentSong, line, sizeof(currentSong));
-			while ((read = getline(&line, &len, favStream)) != -1) {
-				if (strcmp(currentSong, line) != 0) {
-					finalFileIsEmpty = false;
-					fprintf(favStreamTemp, "%s", line);
-				} else {
-					alreadyRemoved = false;
-				}
-			}
-			fclose(favStream);
-			fclose(favStreamTemp);
-			free(line);
-			if (alreadyRemoved) {
-				if (unlikely(remove(favFileTemp))) {
-					sendErrorToChannel(strerror(errno));
-					sendErrorToChannel("remove() error");
-				}
-				sendMessageToChannel("You didn't fav this song! 8)");
-			} else {
-				sendMessageToChannel("Unfaved! 8)");
-				if (finalFileIsEmpty) {
-					sendMessageToChannel("That was your last fav! 8)");
-					if (unlikely(remove(favFile))) {
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("remove() error");
-					}
-					if (unlikely(remove(favFileTemp))) {
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("remove() error");
-					}
-				} else {
-					if (unlikely(rename(favFileTemp, favFile))) {
-						sendErrorToChannel(strerror(errno));
-						sendErrorToChannel("rename() error");
-					}
+			for (uint32_t c = from; c <= to && parser->error == NULL; ++c) {
+				char utf8[5];
+				const size_t utf8Length = searchPut(utf8, 0, c);
+				regexClassAdd(parser, class, (const unsigned char*) utf8, utf8Length);
+				if (parser->caseless && c < 0x80) {
+					regexSetBit(class->ascii, c); // Keep both, it doesn't hurt
 				}
 			}
 		} else {
-			sendErrorToChannel("getline() error");
-			pclose(cmdStream);
-			return;
+			regexClassAdd(parser, class, character, length);
 		}
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
 	}
+	const uint32_t node = parser->error == NULL ? regexClassNode(parser, class, negated) : REGEX_NONE;
+	free(class);
+	return node;
 }
 
-static void rankFav(const char* fromUniqueIdentifier, const char* position) {
-	unsigned long int targetNumber = strtoul(position, NULL, 0);
-	if (unlikely(targetNumber < 1)) {
-		 targetNumber = 1;
+// Any single UTF-8 character
+static uint32_t regexAnyCharacter(struct regexParser* parser) {
+	struct regexClass class = { .anyMultibyte = true };
+	memset(class.ascii, 0xff, sizeof(class.ascii));
+	return regexClassNode(parser, &class, false);
+}
+
+static uint32_t regexParseAtom(struct regexParser* parser) {
+	const unsigned char c = *parser->p;
+	if (c == '(') {
+		++parser->p;
+		if (parser->end - parser->p >= 2 && parser->p[0] == '?' && parser->p[1] == ':') {
+			parser->p += 2;
+		}
+		if (++parser->depth > REGEX_MAX_DEPTH) {
+			parser->error = "too many nested groups";
+			return REGEX_NONE;
+		}
+		uint32_t node = regexParseAlternation(parser);
+		--parser->depth;
+		if (parser->error == NULL && (parser->p >= parser->end || *parser->p != ')')) {
+			parser->error = "missing )";
+		}
+		++parser->p;
+		return node != REGEX_NONE || parser->error != NULL ? node : regexNode(parser, REGEX_EMPTY, REGEX_NONE, REGEX_NONE);
 	}
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		FILE *cmdStream = popen("mpc -f %file% current 2>&1", "r");
-		if (unlikely(!cmdStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("popen() error");
-			return;
+	if (c == '[') {
+		++parser->p;
+		return regexParseClass(parser);
+	}
+	if (c == '.') {
+		++parser->p;
+		return regexAnyCharacter(parser);
+	}
+	if (c == '^' || c == '$') {
+		++parser->p;
+		return regexNode(parser, c == '^' ? REGEX_BOL : REGEX_EOL, REGEX_NONE, REGEX_NONE);
+	}
+	if (c == '*' || c == '+' || c == '?' || c == '{') {
+		parser->error = "nothing to repeat";
+		return REGEX_NONE;
+	}
+	if (c == '\\') {
+		if (parser->p + 1 >= parser->end) {
+			parser->error = "trailing \\";
+			return REGEX_NONE;
 		}
-		char favFileTemp[strlen(favFile) + 4 + 1];
-		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
-			pclose(cmdStream);
-			FILE *favStream = fopen(favFile, "r");
-			if (unlikely(!favStream)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				free(line);
-				return;
-			}
-			FILE *favStreamTemp = fopen(favFileTemp, "w");
-			if (unlikely(!favStreamTemp)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				fclose(favStream);
-				free(line);
-				return;
-			}
-			char currentSong[read + 1];
-			strncpy(currentSong, line, sizeof(currentSong));
-			unsigned long int favNumber = 0;
-			while ((read = getline(&line, &len, favStream)) != -1) {
-				if (++favNumber == targetNumber) {
-					fprintf(favStreamTemp, "%s", currentSong);
-				}
-				if (strcmp(currentSong, line) != 0) {
-					fprintf(favStreamTemp, "%s", line);
+		const unsigned char escape = parser->p[1];
+		if (strchr("dDwWsS", escape) != NULL) {
+			parser->p += 2;
+			struct regexClass class = {0};
+			regexClassEscape(&class, escape);
+			return regexClassNode(parser, &class, false);
+		}
+	}
+	struct regexClass class = {0};
+	uint32_t codepoint;
+	unsigned char character[4];
+	unsigned int length;
+	regexParseClassCharacter(parser, &class, &codepoint, character, &length);
+	if (parser->error != NULL) {
+		return REGEX_NONE;
+	}
+	if (!parser->caseless) {
+		return regexSequence(parser, character, length);
+	}
+	char input[5] = {0};
+	memcpy(input, character, length);
+	char folded[5];
+	const size_t foldedLength = searchKey(folded, input);
+	return foldedLength != 0 ? regexSequence(parser, (const unsigned char*) folded, foldedLength) : regexNode(parser, REGEX_EMPTY, REGEX_NONE, REGEX_NONE);
+}
+
+static unsigned int regexParseNumber(struct regexParser* parser, bool* valid) {
+	unsigned int number = 0;
+	*valid = false;
+	while (parser->p < parser->end && *parser->p >= '0' && *parser->p <= '9') {
+		number = number * 10 + (*parser->p++ - '0');
+		*valid = true;
+		if (number > REGEX_MAX_REPEAT) {
+			number = REGEX_MAX_REPEAT + 1;
+		}
+	}
+	return number;
+}
+
+static uint32_t regexParseRepeat(struct regexParser* parser) {
+	uint32_t node = regexParseAtom(parser);
+	while (parser->error == NULL && parser->p < parser->end) {
+		unsigned int min;
+		unsigned int max;
+		const unsigned char c = *parser->p;
+		if (c == '*' || c == '+' || c == '?') {
+			++parser->p;
+			min = c == '+' ? 1 : 0;
+			max = c == '?' ? 1 : REGEX_INFINITY;
+		} else if (c == '{') {
+			++parser->p;
+			bool valid;
+			min = regexParseNumber(parser, &valid);
+			max = min;
+			if (valid && parser->p < parser->end && *parser->p == ',') {
+				++parser->p;
+				bool bounded;
+				max = regexParseNumber(parser, &bounded);
+				if (!bounded) {
+					max = REGEX_INFINITY;
 				}
 			}
-			fclose(favStream);
-			if (favNumber < targetNumber) { // Target number is bigger than all positions, add fav on the last position
-				fprintf(favStreamTemp, "%s", currentSong);
+			if (!valid || parser->p >= parser->end || *parser->p != '}' || min > max) {
+				parser->error = "bad {n,m}";
+				break;
 			}
-			fclose(favStreamTemp);
-			free(line);
-			if (unlikely(rename(favFileTemp, favFile))) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("rename() error");
-				return;
+			++parser->p;
+			if (min > REGEX_MAX_REPEAT || (max != REGEX_INFINITY && max > REGEX_MAX_REPEAT)) {
+				parser->error = "{n,m} is too big";
+				break;
 			}
-			sendMessageToChannel("Done! 8)");
 		} else {
-			sendErrorToChannel("getline() error");
-			pclose(cmdStream);
-			return;
+			break;
 		}
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
+		if (parser->p < parser->end && *parser->p == '?') {
+			++parser->p; // Lazy or not, all that matters to us is whether there's a match
+		}
+		const uint32_t repeat = regexNode(parser, REGEX_REPEAT, node, REGEX_NONE);
+		if (repeat != REGEX_NONE) {
+			parser->nodes[repeat].min = min;
+			parser->nodes[repeat].max = max;
+		}
+		node = repeat;
 	}
+	return node;
 }
 
-static void fixFavs(const char* fromUniqueIdentifier) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		char favFileTemp[strlen(favFile) + 4 + 1];
-		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
-		FILE *favStream = fopen(favFile, "r");
-		if (unlikely(!favStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			return;
+static uint32_t regexParseConcat(struct regexParser* parser) {
+	uint32_t node = REGEX_NONE;
+	while (parser->error == NULL && parser->p < parser->end && *parser->p != '|' && *parser->p != ')') {
+		node = regexConcat(parser, node, regexParseRepeat(parser));
+	}
+	return node != REGEX_NONE || parser->error != NULL ? node : regexNode(parser, REGEX_EMPTY, REGEX_NONE, REGEX_NONE);
+}
+
+static uint32_t regexParseAlternation(struct regexParser* parser) {
+	uint32_t node = regexParseConcat(parser);
+	while (parser->error == NULL && parser->p < parser->end && *parser->p == '|') {
+		++parser->p;
+		node = regexNode(parser, REGEX_ALTERNATE, node, regexParseConcat(parser));
+	}
+	return node;
+}
+
+// Longest run of literal bytes in the top-level concatenation, every match has to contain it
+static void regexLiteral(const struct regexParser* parser, const uint32_t node, unsigned char* run, size_t* runLength, unsigned char* best, size_t* bestLength) {
+	const struct regexNode* n = &parser->nodes[node];
+	if (n->type == REGEX_CONCAT) {
+		regexLiteral(parser, n->left, run, runLength, best, bestLength);
+		regexLiteral(parser, n->right, run, runLength, best, bestLength);
+		return;
+	}
+	int byte = -1;
+	if (n->type == REGEX_BYTES) {
+		for (unsigned int i = 0; i < 256; ++i) {
+			if (regexBit(n->bytes, i)) {
+				if (byte != -1) {
+					byte = -1;
+					break;
+				}
+				byte = i;
+			}
 		}
-		FILE *favStreamTemp = fopen(favFileTemp, "w");
-		if (unlikely(!favStreamTemp)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			fclose(favStream);
-			return;
+	}
+	if (byte > 0) {
+		run[(*runLength)++] = byte;
+		if (*runLength > *bestLength) {
+			memcpy(best, run, *runLength);
+			*bestLength = *runLength;
 		}
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		bool fixedSomething = false;
-		while ((read = getline(&line, &len, favStream)) != -1) {
-			char fileToDelete[strlen(musicPath) + read + 1];
-			snprintf(fileToDelete, sizeof(fileToDelete), "%s%s", musicPath, line);
-			fileToDelete[strcspn(fileToDelete, "\r\n")] = 0; // Make sure that there are no newlines
-			if (stat(fileToDelete, &st) == -1) { // If file doesn't exist
-				fixedSomething = true;
-			} else {
-				fprintf(favStreamTemp, "%s", line);
+	} else if (n->type != REGEX_BOL && n->type != REGEX_EOL && n->type != REGEX_EMPTY) {
+		*runLength = 0;
+	}
+}
+
+struct regexFragment {
+	uint32_t start;
+	uint32_t outs; // Dangling outs as (state << 1 | which), linked through themselves
+};
+
+static uint32_t regexNfaState(struct regex* regex, const regexType type) {
+	if (regex->statesCount == REGEX_MAX_NFA_STATES) {
+		return REGEX_NONE;
+	}
+	struct regexNfaState* state = &regex->states[regex->statesCount];
+	memset(state, 0, sizeof(*state));
+	state->type = type;
+	state->out[0] = state->out[1] = REGEX_NONE;
+	return regex->statesCount++;
+}
+
+static void regexPatch(struct regex* regex, uint32_t outs, const uint32_t target) {
+	while (outs != REGEX_NONE) {
+		uint32_t* out = &regex->states[outs >> 1].out[outs & 1];
+		outs = *out;
+		*out = target;
+	}
+}
+
+static uint32_t regexAppend(struct regex* regex, const uint32_t outs, const uint32_t more) {
+	if (outs == REGEX_NONE) {
+		return more;
+	}
+	uint32_t last = outs;
+	while (regex->states[last >> 1].out[last & 1] != REGEX_NONE) {
+		last = regex->states[last >> 1].out[last & 1];
+	}
+	regex->states[last >> 1].out[last & 1] = more;
+	return outs;
+}
+
+// Fragment with start REGEX_NONE means we ran out of states
+static struct regexFragment regexCompile(struct regex* regex, const struct regexParser* parser, const uint32_t node);
+
+static struct regexFragment regexCompileConcat(struct regex* regex, struct regexFragment first, const struct regexFragment second) {
+	if (first.start == REGEX_NONE || second.start == REGEX_NONE) {
+		return (struct regexFragment) {REGEX_NONE, REGEX_NONE};
+	}
+	regexPatch(regex, first.outs, second.start);
+	first.outs = second.outs;
+	return first;
+}
+
+static struct regexFragment regexCompile(struct regex* regex, const struct regexParser* parser, const uint32_t node) {
+	const struct regexNode* n = &parser->nodes[node];
+	const struct regexFragment failed = {REGEX_NONE, REGEX_NONE};
+	switch (n->type) {
+		case REGEX_BYTES:
+		case REGEX_BOL:
+		case REGEX_EOL:
+		case REGEX_EMPTY: {
+			const uint32_t state = regexNfaState(regex, (regexType) n->type);
+			if (state == REGEX_NONE) {
+				return failed;
 			}
+			memcpy(regex->states[state].bytes, n->bytes, 32);
+			return (struct regexFragment) {state, state << 1};
 		}
-		fclose(favStream);
-		fclose(favStreamTemp);
-		if (line != NULL) {
-			free(line);
+		case REGEX_CONCAT:
+			return regexCompileConcat(regex, regexCompile(regex, parser, n->left), regexCompile(regex, parser, n->right));
+		case REGEX_ALTERNATE: {
+			const struct regexFragment left = regexCompile(regex, parser, n->left);
+			const struct regexFragment right = regexCompile(regex, parser, n->right);
+			const uint32_t split = regexNfaState(regex, REGEX_SPLIT);
+			if (left.start == REGEX_NONE || right.start == REGEX_NONE || split == REGEX_NONE) {
+				return failed;
+			}
+			regex->states[split].out[0] = left.start;
+			regex->states[split].out[1] = right.start;
+			return (struct regexFragment) {split, regexAppend(regex, left.outs, right.outs)};
 		}
-		if (fixedSomething) {
-			if (unlikely(rename(favFileTemp, favFile))) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("rename() error");
+		case REGEX_REPEAT: {
+			uint32_t empty = regexNfaState(regex, REGEX_EMPTY);
+			if (empty == REGEX_NONE) {
+				return failed;
 			}
-			sendMessageToChannel("Fixed! 8)");
-		} else {
-			if (unlikely(remove(favFileTemp))) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("remove() error");
+			struct regexFragment fragment = {empty, empty << 1};
+			for (unsigned int i = 0; i < n->min; ++i) {
+				fragment = regexCompileConcat(regex, fragment, regexCompile(regex, parser, n->left));
 			}
-			sendMessageToChannel("Nothing to fix! 8)");
+			const unsigned int optional = n->max == REGEX_INFINITY ? 1 : n->max - n->min;
+			for (unsigned int i = 0; i < optional && fragment.start != REGEX_NONE; ++i) {
+				const struct regexFragment child = regexCompile(regex, parser, n->left);
+				const uint32_t split = regexNfaState(regex, REGEX_SPLIT);
+				if (child.start == REGEX_NONE || split == REGEX_NONE) {
+					return failed;
+				}
+				regex->states[split].out[0] = child.start;
+				if (n->max == REGEX_INFINITY) {
+					regexPatch(regex, child.outs, split); // Loop
+					fragment = regexCompileConcat(regex, fragment, (struct regexFragment) {split, split << 1 | 1});
+				} else {
+					fragment = regexCompileConcat(regex, fragment, (struct regexFragment) {split, regexAppend(regex, child.outs, split << 1 | 1)});
+				}
+			}
+			return fragment;
 		}
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
+		default:
+			return failed;
 	}
 }
 
-static void getFav(const char* fromUniqueIdentifier) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		FILE *favStream = fopen(favFile, "r");
-		if (unlikely(!favStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			return;
+static void regexFree(struct regex* regex) {
+	if (regex != NULL) {
+		free(regex->source);
+		free(regex->literal);
+		free(regex->states);
+		free(regex->dfaNext);
+		free(regex->dfaFlags);
+		free(regex->dfaSetStart);
+		free(regex->dfaSets);
+		free(regex->marks);
+		free(regex->stack);
+		free(regex->work);
+		free(regex);
+	}
+}
+
+static void regexFlush(struct regex* regex) {
+	regex->dfaCount = 0;
+	regex->dfaSetStart[0] = 0;
+	regex->dfaInitial = -1;
+	memset(regex->dfaHash, 0, sizeof(regex->dfaHash));
+}
+
+// Compiles source (/pattern/flags), NULL with *error set if it's invalid
+static struct regex* regexNew(const char* source, const char** error) {
+	TRACE_SPAN("search", __func__);
+	const char* end = strrchr(source, '/');
+	struct regex* regex = (struct regex*) calloc(1, sizeof(struct regex));
+	struct regexParser parser = { .p = (const unsigned char*) source + 1, .end = (const unsigned char*) end };
+	parser.nodes = (struct regexNode*) malloc(REGEX_MAX_NODES * sizeof(struct regexNode));
+	if (unlikely(!regex || !parser.nodes || !(regex->source = strdup(source)))) {
+		free(parser.nodes);
+		regexFree(regex);
+		*error = "out of memory";
+		return NULL;
+	}
+	for (const char* flag = end + 1; *flag; ++flag) {
+		if (*flag == 'i') {
+			regex->caseless = true;
+		} else {
+			parser.error = "unknown flag";
 		}
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		unsigned long int counter = 0;
-		while ((read = getline(&line, &len, favStream)) != -1) {
-			++counter;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			sendMessageToChannel(line);
+	}
+	parser.caseless = regex->caseless;
+	if (parser.error == NULL && end - source - 1 > REGEX_MAX_PATTERN) {
+		parser.error = "pattern is too long";
+	}
+	uint32_t root = parser.error == NULL ? regexParseAlternation(&parser) : REGEX_NONE;
+	if (parser.error == NULL && parser.p < parser.end) {
+		parser.error = "unmatched )";
+	}
+	if (parser.error == NULL) {
+		unsigned char run[REGEX_MAX_PATTERN * 4];
+		unsigned char best[REGEX_MAX_PATTERN * 4 + 1];
+		size_t runLength = 0;
+		size_t bestLength = 0;
+		regexLiteral(&parser, root, run, &runLength, best, &bestLength);
+		best[bestLength] = '\0';
+		if ((regex->literal = (char*) malloc(bestLength + 1)) != NULL) {
+			searchKey(regex->literal, (const char*) best);
 		}
-		fclose(favStream);
-		if (line != NULL) {
-			free(line);
+		regex->states = (struct regexNfaState*) malloc(REGEX_MAX_NFA_STATES * sizeof(struct regexNfaState));
+		if (unlikely(!regex->literal || !regex->states)) {
+			parser.error = "out of memory";
 		}
-		sendMessageToChannel("----------");
-		char message[5 + 10 + 1];
-		snprintf(message, sizeof(message), "%s%lu", "Sum: ", counter);
-		sendMessageToChannel(message);
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
 	}
-}
-
-static void playFav(const char* fromUniqueIdentifier, const favPlayType favPlayType, const bool insert) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		if (favPlayType == ALL) {
-			if (!insert) {
-				executeCommandWithErrorToChannel("mpc clear >/dev/null");
-				char command[11 + strlen(favFile) + 12 + 1];
-				snprintf(command, sizeof(command), "%s%s%s", "mpc add < \'", favFile, "\' >/dev/null");
-				executeCommandWithErrorToChannel(command);
-				executeCommandWithOutputToChannel("mpc play 2>&1");
-			} else {
-				if (isPlaylistRandom()) {
-					executeCommandWithErrorToChannel("mpc random off >/dev/null");
-					executeCommandWithErrorToChannel("mpc shuffle >/dev/null");
+	if (parser.error == NULL) {
+		// Unless it starts with ^, match may start anywhere, so the whole thing goes after a loop eating any bytes
+		const struct regexNode* first = &parser.nodes[root];
+		while (first->type == REGEX_CONCAT) {
+			first = &parser.nodes[first->left];
+		}
+		struct regexFragment fragment = regexCompile(regex, &parser, root);
+		const uint32_t match = regexNfaState(regex, REGEX_MATCH);
+		if (fragment.start == REGEX_NONE || match == REGEX_NONE) {
+			parser.error = "pattern is too complex";
+		} else {
+			regexPatch(regex, fragment.outs, match);
+			regex->start = fragment.start;
+			if (first->type != REGEX_BOL) {
+				const uint32_t loop = regexNfaState(regex, REGEX_SPLIT);
+				const uint32_t any = regexNfaState(regex, REGEX_BYTES);
+				if (loop == REGEX_NONE || any == REGEX_NONE) {
+					parser.error = "pattern is too complex";
+				} else {
+					memset(regex->states[any].bytes, 0xff, 32);
+					regex->states[any].out[0] = loop;
+					regex->states[loop].out[0] = any;
+					regex->states[loop].out[1] = fragment.start;
+					regex->start = loop;
 				}
-				char command[14 + strlen(favFile) + 6 + 1];
-				snprintf(command, sizeof(command), "%s%s%s", "mpc insert < \'", favFile, "\' 2>&1");
-				executeCommandWithErrorToChannel(command);
 			}
-		} else {
-			FILE *favStream = fopen(favFile, "r");
-			if (unlikely(!favStream)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				return;
+		}
+	}
+	free(parser.nodes);
+	if (parser.error != NULL) {
+		regexFree(regex);
+		*error = parser.error;
+		return NULL;
+	}
+	// Byte classes, refined by every set of bytes NFA has
+	uint32_t classes = 1;
+	for (uint32_t i = 0; i < regex->statesCount; ++i) {
+		if (regex->states[i].type != REGEX_BYTES) {
+			continue;
+		}
+		int32_t remap[256][2];
+		memset(remap, -1, sizeof(remap));
+		uint32_t next = 0;
+		for (unsigned int byte = 0; byte < 256; ++byte) {
+			int32_t* class = &remap[regex->classes[byte]][regexBit(regex->states[i].bytes, byte)];
+			if (*class == -1) {
+				*class = next++;
+			}
+			regex->classes[byte] = *class;
+		}
+		classes = next;
+	}
+	regex->classCount = classes;
+	regex->dfaSetsCapacity = 4096;
+	regex->dfaNext = (int32_t*) malloc((size_t) REGEX_MAX_DFA_STATES * classes * sizeof(int32_t));
+	regex->dfaFlags = (uint8_t*) malloc(REGEX_MAX_DFA_STATES);
+	regex->dfaSetStart = (uint32_t*) malloc((REGEX_MAX_DFA_STATES + 1) * sizeof(uint32_t));
+	regex->dfaSets = (uint32_t*) malloc(regex->dfaSetsCapacity * sizeof(uint32_t));
+	regex->marks = (uint32_t*) calloc(2 * regex->statesCount, sizeof(uint32_t));
+	regex->stack = (uint32_t*) malloc(5 * regex->statesCount * sizeof(uint32_t)); // Every state may be pushed by both its predecessors
+	regex->work = (uint32_t*) malloc(regex->statesCount * sizeof(uint32_t));
+	if (unlikely(!regex->dfaNext || !regex->dfaFlags || !regex->dfaSetStart || !regex->dfaSets || !regex->marks || !regex->stack || !regex->work)) {
+		regexFree(regex);
+		*error = "out of memory";
+		return NULL;
+	}
+	regexFlush(regex);
+	return regex;
+}
+
+static int regexCompareStates(const void* a, const void* b) {
+	const uint32_t x = *(const uint32_t*) a;
+	const uint32_t y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+// DFA state of everything reachable from NFA states from[0..count), -1 if DFA is full
+static int32_t regexDfaState(struct regex* regex, const uint32_t* from, const uint32_t count, const bool atStart) {
+	if (++regex->mark == 0) {
+		memset(regex->marks, 0, 2 * regex->statesCount * sizeof(uint32_t));
+		regex->mark = 1;
+	}
+	const uint32_t setStart = regex->dfaSetStart[regex->dfaCount];
+	uint32_t setCount = 0;
+	uint8_t flags = 0;
+	uint32_t stackSize = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		regex->stack[stackSize++] = from[i] << 1;
+	}
+	while (stackSize != 0) {
+		const uint32_t item = regex->stack[--stackSize];
+		if (regex->marks[item] == regex->mark) {
+			continue;
+		}
+		regex->marks[item] = regex->mark;
+		const uint32_t index = item >> 1;
+		const bool ended = item & 1; // Went through $, nothing can be consumed anymore
+		const struct regexNfaState* state = &regex->states[index];
+		switch (state->type) {
+			case REGEX_BYTES:
+				if (!ended) {
+					if (setStart + setCount == regex->dfaSetsCapacity) {
+						if (regex->dfaSetsCapacity == REGEX_MAX_DFA_SETS) {
+							return -1;
+						}
+						uint32_t* sets = (uint32_t*) realloc(regex->dfaSets, 2 * regex->dfaSetsCapacity * sizeof(uint32_t));
+						if (unlikely(!sets)) {
+							return -1;
+						}
+						regex->dfaSets = sets;
+						regex->dfaSetsCapacity *= 2;
+					}
+					regex->dfaSets[setStart + setCount++] = index;
+				}
+				break;
+			case REGEX_MATCH:
+				flags |= ended ? REGEX_DFA_MATCH_AT_END : REGEX_DFA_MATCH;
+				break;
+			case REGEX_SPLIT:
+				regex->stack[stackSize++] = state->out[1] << 1 | ended;
+				// Fall through
+			case REGEX_EMPTY:
+				regex->stack[stackSize++] = state->out[0] << 1 | ended;
+				break;
+			case REGEX_BOL:
+				if (atStart) {
+					regex->stack[stackSize++] = state->out[0] << 1 | ended;
+				}
+				break;
+			case REGEX_EOL:
+				regex->stack[stackSize++] = state->out[0] << 1 | 1;
+				break;
+		}
+	}
+	uint32_t* set = regex->dfaSets + setStart;
+	qsort(set, setCount, sizeof(uint32_t), regexCompareStates);
+	if (setCount == 0 && !(flags & REGEX_DFA_MATCH)) {
+		flags |= REGEX_DFA_DEAD;
+	}
+	uint32_t hash = 2166136261u ^ flags;
+	for (uint32_t i = 0; i < setCount; ++i) {
+		hash = (hash ^ set[i]) * 16777619u;
+	}
+	uint32_t slot = hash % REGEX_DFA_HASH;
+	for (; regex->dfaHash[slot] != 0; slot = (slot + 1) % REGEX_DFA_HASH) {
+		const uint32_t existing = regex->dfaHash[slot] - 1;
+		const uint32_t existingCount = regex->dfaSetStart[existing + 1] - regex->dfaSetStart[existing];
+		if (regex->dfaFlags[existing] == flags && existingCount == setCount && memcmp(regex->dfaSets + regex->dfaSetStart[existing], set, setCount * sizeof(uint32_t)) == 0) {
+			return existing;
+		}
+	}
+	if (regex->dfaCount == REGEX_MAX_DFA_STATES) {
+		return -1;
+	}
+	const uint32_t state = regex->dfaCount++;
+	regex->dfaFlags[state] = flags;
+	regex->dfaSetStart[state + 1] = setStart + setCount;
+	memset(regex->dfaNext + (size_t) state * regex->classCount, -1, regex->classCount * sizeof(int32_t));
+	regex->dfaHash[slot] = state + 1;
+	return state;
+}
+
+// Same as regexDfaState(), but flushes DFA when it's full, -1 if even that didn't help
+static int32_t regexDfaStateOrFlush(struct regex* regex, const uint32_t* from, const uint32_t count, const bool atStart) {
+	int32_t state = regexDfaState(regex, from, count, atStart);
+	if (state == -1) {
+		regexFlush(regex);
+		state = regexDfaState(regex, from, count, atStart);
+	}
+	return state;
+}
+
+// 1 if text matches, 0 if it doesn't, -1 if we couldn't tell (out of memory)
+static int regexMatch(struct regex* regex, const char* text, const size_t length) {
+	if (regex->dfaInitial == -1 && (regex->dfaInitial = regexDfaStateOrFlush(regex, &regex->start, 1, true)) == -1) {
+		return -1;
+	}
+	int32_t state = regex->dfaInitial;
+	for (size_t i = 0; i < length; ++i) {
+		if (regex->dfaFlags[state] & REGEX_DFA_MATCH) {
+			return 1;
+		}
+		if (regex->dfaFlags[state] & REGEX_DFA_DEAD) {
+			return 0;
+		}
+		const unsigned char byte = text[i];
+		int32_t next = regex->dfaNext[(size_t) state * regex->classCount + regex->classes[byte]];
+		if (next == -1) {
+			uint32_t count = 0;
+			for (uint32_t j = regex->dfaSetStart[state]; j < regex->dfaSetStart[state + 1]; ++j) {
+				const struct regexNfaState* nfa = &regex->states[regex->dfaSets[j]];
+				if (regexBit(nfa->bytes, byte)) {
+					regex->work[count++] = nfa->out[0];
+				}
+			}
+			const uint32_t before = regex->dfaCount;
+			if ((next = regexDfaStateOrFlush(regex, regex->work, count, false)) == -1) {
+				return -1;
+			}
+			if (regex->dfaCount >= before) { // Otherwise it was flushed and state is gone
+				regex->dfaNext[(size_t) state * regex->classCount + regex->classes[byte]] = next;
+			}
+		}
+		state = next;
+	}
+	return (regex->dfaFlags[state] & (REGEX_DFA_MATCH | REGEX_DFA_MATCH_AT_END)) != 0;
+}
+
+static pthread_mutex_t regexCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	struct regex* regex;
+	uint64_t lastUsed;
+} regexCache[REGEX_CACHE_SIZE];
+static uint64_t regexCacheClock = 0;
+
+// Compiled source from cache or made now, it's ours until regexRelease(), NULL with *error if it's invalid
+static struct regex* regexAcquire(const char* source, const char** error) {
+	pthread_mutex_lock(&regexCacheMutex);
+	for (unsigned int i = 0; i < REGEX_CACHE_SIZE; ++i) {
+		struct regex* regex = regexCache[i].regex;
+		if (regex != NULL && strcmp(regex->source, source) == 0) {
+			regexCache[i].regex = NULL; // Lazy DFA isn't thread-safe, nobody else gets it until we're done
+			pthread_mutex_unlock(&regexCacheMutex);
+			metricsCount(METRIC_REGEX_HITS);
+			return regex;
+		}
+	}
+	pthread_mutex_unlock(&regexCacheMutex);
+	metricsCount(METRIC_REGEX_MISSES);
+	return regexNew(source, error);
+}
+
+// Puts regex back to cache, evicting the one not used for the longest time
+static void regexRelease(struct regex* regex) {
+	pthread_mutex_lock(&regexCacheMutex);
+	unsigned int slot = 0;
+	for (unsigned int i = 0; i < REGEX_CACHE_SIZE; ++i) {
+		if (regexCache[i].regex == NULL) {
+			slot = i;
+			break;
+		}
+		if (regexCache[i].lastUsed < regexCache[slot].lastUsed) {
+			slot = i;
+		}
+	}
+	struct regex* evicted = regexCache[slot].regex;
+	regexCache[slot].regex = regex;
+	regexCache[slot].lastUsed = ++regexCacheClock;
+	pthread_mutex_unlock(&regexCacheMutex);
+	regexFree(evicted);
+}
+
+static void regexCacheFree() {
+	pthread_mutex_lock(&regexCacheMutex);
+	for (unsigned int i = 0; i < REGEX_CACHE_SIZE; ++i) {
+		regexFree(regexCache[i].regex);
+		regexCache[i].regex = NULL;
+	}
+	pthread_mutex_unlock(&regexCacheMutex);
+}
+
+/*
+ * What users search for: substring (as search key) or /regex/. Searches give up after REGEX_TIME_LIMIT,
+ * which only regexes can get anywhere near.
+ */
+struct searchQuery {
+	char* key; // searchKey() of the substring, or of the literal regex needs
+	struct regex* regex;
+	uint64_t deadline;
+	unsigned int matches; // Calls, to look at the clock only every now and then
+	bool gaveUp;
+};
+
+// Plain substring search, even if input looks like a regex, false (already reported) on error
+static bool searchQueryInitSubstring(struct searchQuery* query, const char* input) {
+	memset(query, 0, sizeof(*query));
+	query->deadline = metricsNow() + REGEX_TIME_LIMIT;
+	if (unlikely(!(query->key = (char*) malloc(SEARCH_KEY_SIZE(strlen(input)))))) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("malloc() error");
+		return false;
+	}
+	searchKey(query->key, input);
+	return true;
+}
+
+// false (already reported) if input looks like a regex, but isn't a valid one
+static bool searchQueryInit(struct searchQuery* query, const char* input) {
+	memset(query, 0, sizeof(*query));
+	query->deadline = metricsNow() + REGEX_TIME_LIMIT;
+	const char* end = strrchr(input, '/');
+	if (input[0] == '/' && end != input && strspn(end + 1, "i") == strlen(end + 1)) {
+		const char* error = NULL;
+		if ((query->regex = regexAcquire(input, &error)) == NULL) {
+			char message[15 + strlen(error) + 4 + 1];
+			snprintf(message, sizeof(message), "%s%s%s", "Invalid regex: ", error, " :-(");
+			sendMessageToChannel(message);
+			return false;
+		}
+		return true;
+	}
+	return searchQueryInitSubstring(query, input);
+}
+
+// Lets users know if the search was cut short
+static void searchQueryFree(struct searchQuery* query) {
+	if (query->gaveUp) {
+		sendMessageToChannel("Regex took too long, results may be incomplete! :-(");
+	}
+	free(query->key);
+	if (query->regex != NULL) {
+		regexRelease(query->regex);
+	}
+	memset(query, 0, sizeof(*query));
+}
+
+// Whether first length bytes of text match, key is searchKey() of the same (keyLength bytes of it) if caller has it, or NULL
+static bool searchQueryMatch(struct searchQuery* query, const char* text, const size_t length, const char* key, size_t keyLength) {
+	if (query->gaveUp) {
+		return false;
+	}
+	char textKey[key == NULL ? SEARCH_KEY_SIZE(length) : 1];
+	if (key == NULL && (query->regex == NULL || query->regex->caseless || query->regex->literal[0] != '\0')) {
+		char copy[length + 1];
+		memcpy(copy, text, length);
+		copy[length] = '\0';
+		keyLength = searchKey(textKey, copy);
+		key = textKey;
+	}
+	if (query->regex == NULL) {
+		return memmem(key, keyLength, query->key, strlen(query->key)) != NULL;
+	}
+	const char* literal = query->regex->literal;
+	if (literal[0] != '\0' && memmem(key, keyLength, literal, strlen(literal)) == NULL) {
+		return false;
+	}
+	if ((++query->matches & 63) == 0 && metricsNow() > query->deadline) {
+		query->gaveUp = true;
+		return false;
+	}
+	const int matched = query->regex->caseless ? regexMatch(query->regex, key, keyLength) : regexMatch(query->regex, text, length);
+	if (unlikely(matched == -1)) {
+		query->gaveUp = true;
+	}
+	return matched == 1;
+}
+
+/*********************************** Caches ************************************/
+/*
+ * Everything we'd otherwise ask mpc or the disk for on every command. Caches are filled in the background
+ * as soon as we connect (see warmupWorker()), until then, or when anything goes wrong, commands take the old slow path.
+ */
+
+// Immutable once published, strings are referenced by offsets so the whole thing can live in one flat file
+struct libraryRecord {
+	uint32_t file;
+	uint32_t artist;
+	uint32_t album;
+	uint32_t title;
+	uint32_t comment;
+	uint32_t genre;
+	uint32_t fileKey; // searchKey() of file, same offset if there was nothing to fold
+	uint32_t commentKey; // Same for comment
+	uint32_t time; // In seconds
+};
+
+struct libraryDirectory {
+	uint32_t path; // Root is ""
+	uint32_t reserved;
+	uint64_t modified; // mtime of the directory as of when we got its songs, 0 if unknown
+};
+
+struct library {
+	struct libraryRecord* records; // Sorted by file, so every directory is one contiguous range
+	uint32_t count;
+	struct libraryDirectory* directories; // Sorted by path
+	uint32_t directoriesCount;
+	char* strings; // NUL-terminated, offset 0 is always ""
+	uint32_t stringsSize;
+	uint64_t dbUpdate; // MPD's db_update at the moment of loading
+	unsigned int references;
+	void* mapping; // Everything above lives in mmap'd snapshot, if not NULL
+	size_t mappingSize;
+	struct searchIndex* index; // Set once by libraryIndex() or with the snapshot, NULL until then
+	struct libraryTree* tree; // Same
+	uint64_t generation; // Set by libraryPublish(), every published library has another one
+};
+
+/*
+ * Trigram index over keys of every searchField, made once per library in the background. Every trigram (together with
+ * its field) is hashed into one of the buckets, bucket's posting list holds ascending indexes of records having it,
+ * so a substring can only be in the records of its rarest trigram's list, and a string with k typos still shares
+ * all but 3k of its trigrams with the original.
+ */
+
+#define SEARCH_INDEX_BITS 16
+#define SEARCH_INDEX_BUCKETS (1u << SEARCH_INDEX_BITS)
+
+// What field query terms look in, plain searches go through paths, artist is the top-level directory of untagged songs
+typedef enum {SEARCH_FIELD_PATH, SEARCH_FIELD_ARTIST, SEARCH_FIELD_ALBUM, SEARCH_FIELD_TITLE, SEARCH_FIELD_THEME, SEARCH_FIELDS} searchField;
+
+static const char* searchFieldNames[SEARCH_FIELDS] = {"path", "artist", "album", "title", "theme"};
+
+struct searchIndex {
+	uint32_t* offsets; // SEARCH_INDEX_BUCKETS + 1 of them, bucket b is postings[offsets[b]] until postings[offsets[b + 1]]
+	uint32_t* postings;
+	uint32_t postingsCount;
+	bool mapped; // Both live in library's snapshot mapping
+};
+
+static inline uint32_t searchTrigram(const char* key, const searchField field) {
+	const uint32_t trigram = (unsigned char) key[0] | (unsigned char) key[1] << 8 | (unsigned char) key[2] << 16 | (uint32_t) field << 24;
+	return (trigram * 2654435761u) >> (32 - SEARCH_INDEX_BITS);
+}
+
+static void searchIndexFree(struct searchIndex* index) {
+	if (index != NULL) {
+		if (!index->mapped) {
+			free(index->offsets);
+			free(index->postings);
+		}
+		free(index);
+	}
+}
+
+/*
+ * Directory tree of library, made once per library in the background next to the index. Records are sorted by file,
+ * so every directory is one contiguous range of them and node only needs to know where it starts and how long it is.
+ * Chains of directories with nothing but one subdirectory are a single node (its name has slashes then).
+ */
+
+struct libraryTreeNode {
+	uint32_t record; // First record of the subtree, its file has the name of the node
+	uint32_t count; // Records of the subtree
+	uint32_t start; // Name is the file of the first record from start until end, root has none
+	uint32_t end;
+	uint32_t children; // Index of the first child, children of one node are next to each other, ordered by record
+	uint32_t childrenCount;
+};
+
+struct libraryTree {
+	struct libraryTreeNode* nodes; // Root is the first one
+	uint32_t count;
+	uint32_t capacity;
+};
+
+static void libraryTreeFree(struct libraryTree* tree) {
+	if (tree != NULL) {
+		free(tree->nodes);
+		free(tree);
+	}
+}
+
+static pthread_mutex_t libraryMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct library* currentLibrary = NULL;
+static uint64_t libraryGenerations = 0;
+
+static inline const char* libraryString(const struct library* library, const uint32_t offset) {
+	return library->strings + offset;
+}
+
+static void libraryFree(struct library* library) {
+	if (library->mapping != NULL) {
+		munmap(library->mapping, library->mappingSize);
+	} else {
+		free(library->records);
+		free(library->directories);
+		free(library->strings);
+	}
+	searchIndexFree(library->index);
+	libraryTreeFree(library->tree);
+	free(library);
+}
+
+// NULL if library isn't loaded (yet), otherwise must be given back with libraryRelease()
+static struct library* libraryGet() {
+	pthread_mutex_lock(&libraryMutex);
+	struct library* library = currentLibrary;
+	if (library != NULL) {
+		++library->references;
+	}
+	pthread_mutex_unlock(&libraryMutex);
+	return library;
+}
+
+// Same as libraryGet(), for commands, so we know how often they had to go the slow path
+static struct library* libraryAcquire() {
+	struct library* library = libraryGet();
+	metricsCount(library != NULL ? METRIC_LIBRARY_HITS : METRIC_LIBRARY_MISSES);
+	return library;
+}
+
+static void libraryRelease(struct library* library) {
+	pthread_mutex_lock(&libraryMutex);
+	const bool last = --library->references == 0;
+	pthread_mutex_unlock(&libraryMutex);
+	if (last) {
+		libraryFree(library);
+	}
+}
+
+// db_update of the current library, 0 if there's none
+static uint64_t libraryDbUpdate() {
+	pthread_mutex_lock(&libraryMutex);
+	const uint64_t dbUpdate = currentLibrary != NULL ? currentLibrary->dbUpdate : 0;
+	pthread_mutex_unlock(&libraryMutex);
+	return dbUpdate;
+}
+
+// Takes over the reference of a freshly built library, NULL drops the current one
+static void libraryPublish(struct library* library) {
+	pthread_mutex_lock(&libraryMutex);
+	if (library != NULL) {
+		library->generation = ++libraryGenerations;
+	}
+	struct library* old = currentLibrary;
+	currentLibrary = library;
+	pthread_mutex_unlock(&libraryMutex);
+	if (old != NULL) {
+		libraryRelease(old);
+	}
+}
+
+// Same as libraryPublish(), unless current library isn't old anymore, then false and library is freed
+static bool libraryReplace(const struct library* old, struct library* library) {
+	pthread_mutex_lock(&libraryMutex);
+	const bool same = currentLibrary == old;
+	if (same) {
+		library->generation = ++libraryGenerations;
+		currentLibrary = library;
+	}
+	pthread_mutex_unlock(&libraryMutex);
+	libraryRelease(same ? (struct library*) old : library); // Reference of the published one, or the only one of ours
+	return same;
+}
+
+struct libraryBuilder {
+	struct library* library;
+	uint32_t recordsCapacity;
+	uint32_t directoriesCapacity;
+	size_t stringsCapacity;
+	uint32_t* intern; // Open addressing on string offsets, 0 is an empty slot
+	uint32_t internMask;
+	uint32_t internCount;
+	bool failed;
+};
+
+static inline uint32_t libraryHash(const char* string) { // FNV-1a
+	uint32_t hash = 2166136261u;
+	for (; *string; ++string) {
+		hash = (hash ^ (unsigned char) *string) * 16777619u;
+	}
+	return hash;
+}
+
+static bool libraryBuilderInit(struct libraryBuilder* builder) {
+	memset(builder, 0, sizeof(*builder));
+	builder->library = (struct library*) calloc(1, sizeof(struct library));
+	builder->stringsCapacity = 1 << 16;
+	builder->internMask = (1 << 12) - 1;
+	builder->intern = (uint32_t*) calloc(builder->internMask + 1, sizeof(uint32_t));
+	if (unlikely(!builder->library || !builder->intern || !(builder->library->strings = (char*) malloc(builder->stringsCapacity)))) {
+		if (builder->library != NULL) {
+			libraryFree(builder->library);
+		}
+		free(builder->intern);
+		memset(builder, 0, sizeof(*builder));
+		return false;
+	}
+	builder->library->strings[0] = '\0';
+	builder->library->stringsSize = 1;
+	builder->library->references = 1;
+	return true;
+}
+
+static bool libraryBuilderGrowIntern(struct libraryBuilder* builder) {
+	const uint32_t mask = builder->internMask * 2 + 1;
+	uint32_t* intern = (uint32_t*) calloc(mask + 1, sizeof(uint32_t));
+	if (unlikely(!intern)) {
+		return false;
+	}
+	for (uint32_t i = 0; i <= builder->internMask; ++i) {
+		const uint32_t offset = builder->intern[i];
+		if (offset != 0) {
+			uint32_t slot = libraryHash(builder->library->strings + offset) & mask;
+			while (intern[slot] != 0) {
+				slot = (slot + 1) & mask;
+			}
+			intern[slot] = offset;
+		}
+	}
+	free(builder->intern);
+	builder->intern = intern;
+	builder->internMask = mask;
+	return true;
+}
+
+// Returns offset of the string, interned ones (artists, albums, themes) are stored only once
+static uint32_t libraryBuilderString(struct libraryBuilder* builder, const char* string, const bool intern) {
+	if (*string == '\0' || builder->failed) {
+		return 0;
+	}
+	struct library* library = builder->library;
+	uint32_t slot = 0;
+	if (intern) {
+		if ((builder->internCount + 1) * 2 > builder->internMask && unlikely(!libraryBuilderGrowIntern(builder))) {
+			builder->failed = true;
+			return 0;
+		}
+		for (slot = libraryHash(string) & builder->internMask; builder->intern[slot] != 0; slot = (slot + 1) & builder->internMask) {
+			if (strcmp(library->strings + builder->intern[slot], string) == 0) {
+				return builder->intern[slot];
+			}
+		}
+	}
+	const size_t length = strlen(string) + 1;
+	if (library->stringsSize + length > builder->stringsCapacity) {
+		size_t capacity = builder->stringsCapacity * 2;
+		while (capacity < library->stringsSize + length) {
+			capacity *= 2;
+		}
+		char* strings = capacity <= UINT32_MAX ? (char*) realloc(library->strings, capacity) : NULL;
+		if (unlikely(!strings)) {
+			builder->failed = true;
+			return 0;
+		}
+		library->strings = strings;
+		builder->stringsCapacity = capacity;
+	}
+	const uint32_t offset = library->stringsSize;
+	memcpy(library->strings + offset, string, length);
+	library->stringsSize += length;
+	if (intern) {
+		builder->intern[slot] = offset;
+		++builder->internCount;
+	}
+	return offset;
+}
+
+// Valid only until the next call
+static struct libraryRecord* libraryBuilderRecord(struct libraryBuilder* builder) {
+	struct library* library = builder->library;
+	if (builder->failed) {
+		return NULL;
+	}
+	if (library->count == builder->recordsCapacity) {
+		const uint32_t capacity = builder->recordsCapacity ? builder->recordsCapacity * 2 : 1024;
+		struct libraryRecord* records = (struct libraryRecord*) realloc(library->records, capacity * sizeof(struct libraryRecord));
+		if (unlikely(!records)) {
+			builder->failed = true;
+			return NULL;
+		}
+		library->records = records;
+		builder->recordsCapacity = capacity;
+	}
+	struct libraryRecord* record = &library->records[library->count++];
+	memset(record, 0, sizeof(*record));
+	return record;
+}
+
+// Returns index of the new directory, UINT32_MAX if we're out of memory
+static uint32_t libraryBuilderDirectory(struct libraryBuilder* builder, const char* path, const uint64_t modified) {
+	struct library* library = builder->library;
+	const uint32_t offset = libraryBuilderString(builder, path, false);
+	if (builder->failed) {
+		return UINT32_MAX;
+	}
+	if (library->directoriesCount == builder->directoriesCapacity) {
+		const uint32_t capacity = builder->directoriesCapacity ? builder->directoriesCapacity * 2 : 256;
+		struct libraryDirectory* directories = (struct libraryDirectory*) realloc(library->directories, capacity * sizeof(struct libraryDirectory));
+		if (unlikely(!directories)) {
+			builder->failed = true;
+			return UINT32_MAX;
+		}
+		library->directories = directories;
+		builder->directoriesCapacity = capacity;
+	}
+	struct libraryDirectory* directory = &library->directories[library->directoriesCount];
+	memset(directory, 0, sizeof(*directory));
+	directory->path = offset;
+	directory->modified = modified;
+	return library->directoriesCount++;
+}
+
+// Same record in the new library, strings get interned again
+static void libraryBuilderCopy(struct libraryBuilder* builder, const struct library* from, const struct libraryRecord* fromRecord) {
+	struct libraryRecord* record = libraryBuilderRecord(builder);
+	if (record != NULL) {
+		record->file = libraryBuilderString(builder, libraryString(from, fromRecord->file), false);
+		record->artist = libraryBuilderString(builder, libraryString(from, fromRecord->artist), true);
+		record->album = libraryBuilderString(builder, libraryString(from, fromRecord->album), true);
+		record->title = libraryBuilderString(builder, libraryString(from, fromRecord->title), false);
+		record->comment = libraryBuilderString(builder, libraryString(from, fromRecord->comment), true);
+		record->genre = libraryBuilderString(builder, libraryString(from, fromRecord->genre), true);
+		record->time = fromRecord->time;
+	}
+}
+
+// Offset of searchKey() of the string at offset, which is reused as it is when there's nothing to fold
+static uint32_t libraryBuilderKey(struct libraryBuilder* builder, const uint32_t offset, const bool intern) {
+	const char* string = builder->library->strings + offset;
+	char key[SEARCH_KEY_SIZE(strlen(string))];
+	searchKey(key, string);
+	return strcmp(key, string) == 0 ? offset : libraryBuilderString(builder, key, intern);
+}
+
+static int libraryCompareRecords(const void* a, const void* b, void* strings) {
+	return strcmp((const char*) strings + ((const struct libraryRecord*) a)->file, (const char*) strings + ((const struct libraryRecord*) b)->file);
+}
+
+static int libraryCompareDirectories(const void* a, const void* b, void* strings) {
+	return strcmp((const char*) strings + ((const struct libraryDirectory*) a)->path, (const char*) strings + ((const struct libraryDirectory*) b)->path);
+}
+
+// Returns finished library sorted and without duplicates, or NULL (and frees everything) if building failed
+static struct library* libraryBuilderFinish(struct libraryBuilder* builder, const bool success) {
+	struct library* library = builder->library;
+	for (uint32_t i = 0; success && i < library->count && !builder->failed; ++i) {
+		library->records[i].fileKey = libraryBuilderKey(builder, library->records[i].file, false);
+		library->records[i].commentKey = libraryBuilderKey(builder, library->records[i].comment, true);
+	}
+	free(builder->intern);
+	if (!success || builder->failed) {
+		libraryFree(library);
+		return NULL;
+	}
+	qsort_r(library->records, library->count, sizeof(struct libraryRecord), libraryCompareRecords, library->strings);
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < library->count; ++i) {
+		if (count == 0 || strcmp(library->strings + library->records[count - 1].file, library->strings + library->records[i].file) != 0) {
+			library->records[count++] = library->records[i];
+		}
+	}
+	library->count = count;
+	qsort_r(library->directories, library->directoriesCount, sizeof(struct libraryDirectory), libraryCompareDirectories, library->strings);
+	count = 0;
+	for (uint32_t i = 0; i < library->directoriesCount; ++i) {
+		if (count == 0 || strcmp(library->strings + library->directories[count - 1].path, library->strings + library->directories[i].path) != 0) {
+			library->directories[count++] = library->directories[i];
+		}
+	}
+	library->directoriesCount = count;
+	return library;
+}
+
+// Field of record, *length bytes of text, *key is its searchKey() (*keyLength bytes of it) or NULL if there's none made
+static const char* libraryField(const struct library* library, const struct libraryRecord* record, const searchField field, size_t* length, const char** key, size_t* keyLength) {
+	const char* text;
+	*key = NULL;
+	switch (field) {
+		case SEARCH_FIELD_PATH:
+			text = libraryString(library, record->file);
+			*key = libraryString(library, record->fileKey);
+			break;
+		case SEARCH_FIELD_ARTIST:
+			if (record->artist == 0) {
+				text = libraryString(library, record->file);
+				*length = strcspn(text, "/");
+				*key = libraryString(library, record->fileKey);
+				*keyLength = strcspn(*key, "/"); // Folding never makes nor eats slashes
+				return text;
+			}
+			text = libraryString(library, record->artist);
+			break;
+		case SEARCH_FIELD_ALBUM:
+			text = libraryString(library, record->album);
+			break;
+		case SEARCH_FIELD_TITLE:
+			text = libraryString(library, record->title);
+			break;
+		default:
+			text = libraryString(library, record->comment);
+			*key = libraryString(library, record->commentKey);
+			break;
+	}
+	*length = strlen(text);
+	if (*key != NULL) {
+		*keyLength = strlen(*key);
+	}
+	return text;
+}
+
+// Counts (or, with fill, writes) record i in buckets of its trigrams, cursors tell whether it's there already
+static void libraryIndexRecord(const struct library* library, const uint32_t i, struct searchIndex* index, uint32_t* cursors, const bool fill) {
+	for (unsigned int field = 0; field < SEARCH_FIELDS; ++field) {
+		size_t length;
+		const char* key;
+		size_t keyLength;
+		const char* text = libraryField(library, &library->records[i], field, &length, &key, &keyLength);
+		char made[key == NULL ? SEARCH_KEY_SIZE(length) : 1];
+		if (key == NULL) {
+			keyLength = searchKey(made, text);
+			key = made;
+		}
+		for (size_t j = 0; j + 2 < keyLength; ++j) {
+			const uint32_t bucket = searchTrigram(key + j, field);
+			if (!fill && cursors[bucket] != i + 1) {
+				cursors[bucket] = i + 1;
+				++index->offsets[bucket + 1];
+			} else if (fill && (cursors[bucket] == index->offsets[bucket] || index->postings[cursors[bucket] - 1] != i)) {
+				index->postings[cursors[bucket]++] = i;
+			}
+		}
+	}
+}
+
+// Where names of children of node start in its files
+static inline uint32_t libraryTreeOffset(const struct libraryTree* tree, const uint32_t node) {
+	return node == 0 ? 0 : tree->nodes[node].end + 1;
+}
+
+// Appends children of node (and theirs), false if we're out of memory
+static bool libraryTreeChildren(const struct library* library, struct libraryTree* tree, const uint32_t node) {
+	const uint32_t offset = libraryTreeOffset(tree, node);
+	const uint32_t last = tree->nodes[node].record + tree->nodes[node].count;
+	const uint32_t children = tree->count;
+	for (uint32_t i = tree->nodes[node].record; i < last;) {
+		const char* file = libraryString(library, library->records[i].file);
+		const char* slash = strchr(file + offset, '/');
+		if (slash == NULL) { // Song right in there
+			++i;
+			continue;
+		}
+		const size_t length = slash - file + 1;
+		uint32_t j = i + 1;
+		while (j < last && strncmp(libraryString(library, library->records[j].file), file, length) == 0) {
+			++j;
+		}
+		// Common prefix of the first and the last file is common to all of them, its last slash is where the node ends
+		const char* lastFile = libraryString(library, library->records[j - 1].file);
+		size_t common = length;
+		while (file[common] != '\0' && file[common] == lastFile[common]) {
+			++common;
+		}
+		while (file[common - 1] != '/') {
+			--common;
+		}
+		if (tree->count == tree->capacity) {
+			const uint32_t capacity = tree->capacity * 2;
+			struct libraryTreeNode* nodes = (struct libraryTreeNode*) realloc(tree->nodes, capacity * sizeof(struct libraryTreeNode));
+			if (unlikely(!nodes)) {
+				return false;
+			}
+			tree->nodes = nodes;
+			tree->capacity = capacity;
+		}
+		struct libraryTreeNode* child = &tree->nodes[tree->count++];
+		child->record = i;
+		child->count = j - i;
+		child->start = offset;
+		child->end = common - 1;
+		child->children = 0;
+		child->childrenCount = 0;
+		i = j;
+	}
+	tree->nodes[node].children = children;
+	tree->nodes[node].childrenCount = tree->count - children;
+	for (uint32_t child = children; child < children + tree->nodes[node].childrenCount; ++child) {
+		if (unlikely(!libraryTreeChildren(library, tree, child))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Builds library->tree if it isn't there yet
+static void libraryTreeBuild(struct library* library) {
+	if (__atomic_load_n(&library->tree, __ATOMIC_ACQUIRE) != NULL) {
+		return;
+	}
+	TRACE_SPAN("search", __func__);
+	struct libraryTree* tree = (struct libraryTree*) calloc(1, sizeof(struct libraryTree));
+	if (unlikely(!tree || !(tree->nodes = (struct libraryTreeNode*) calloc(64, sizeof(struct libraryTreeNode))))) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("calloc() error");
+		free(tree);
+		return;
+	}
+	tree->capacity = 64;
+	tree->count = 1;
+	tree->nodes[0].count = library->count;
+	if (unlikely(!libraryTreeChildren(library, tree, 0))) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("realloc() error");
+		libraryTreeFree(tree);
+		return;
+	}
+	__atomic_store_n(&library->tree, tree, __ATOMIC_RELEASE);
+}
+
+// Node of directory with key made by searchKey(), *end is where its path ends in node's files, which is before
+// the end of node if the directory is in the middle of a chain, false if there's no such directory
+static bool libraryTreeFind(const struct library* library, const struct libraryTree* tree, const char* key, uint32_t* node, uint32_t* end) {
+	*node = 0;
+	*end = 0;
+	while (*key != '\0') {
+		const struct libraryTreeNode* parent = &tree->nodes[*node];
+		bool found = false;
+		for (uint32_t i = parent->children; i < parent->children + parent->childrenCount && !found; ++i) {
+			const struct libraryTreeNode* child = &tree->nodes[i];
+			const char* file = libraryString(library, library->records[child->record].file);
+			const size_t length = child->end - child->start;
+			char name[length + 1];
+			memcpy(name, file + child->start, length);
+			name[length] = '\0';
+			char nameKey[SEARCH_KEY_SIZE(length)];
+			const size_t nameKeyLength = searchKey(nameKey, name);
+			const size_t keyLength = strlen(key);
+			if (keyLength >= nameKeyLength && memcmp(key, nameKey, nameKeyLength) == 0 && (key[nameKeyLength] == '\0' || key[nameKeyLength] == '/')) {
+				found = true;
+				*node = i;
+				*end = child->end;
+				key += nameKeyLength + (key[nameKeyLength] == '/');
+			} else if (keyLength < nameKeyLength && memcmp(key, nameKey, keyLength) == 0 && nameKey[keyLength] == '/') {
+				// Somewhere in the chain, keys have the same slashes as names, so it's after as many of them as key has
+				unsigned int slashes = 0;
+				for (size_t j = 0; j < keyLength; ++j) {
+					slashes += key[j] == '/';
+				}
+				const char* slash = name;
+				for (unsigned int j = 0; j <= slashes; ++j) {
+					slash = strchr(slash, '/') + 1;
+				}
+				*node = i;
+				*end = child->start + (slash - 1 - name);
+				return true;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Builds library->index (and tree) if it isn't there yet, readers who find it NULL just scan everything
+static void libraryIndex(struct library* library) {
+	if (library == NULL) {
+		return;
+	}
+	libraryTreeBuild(library);
+	if (__atomic_load_n(&library->index, __ATOMIC_ACQUIRE) != NULL) {
+		return;
+	}
+	TRACE_SPAN("search", __func__);
+	struct searchIndex* index = (struct searchIndex*) calloc(1, sizeof(struct searchIndex));
+	uint32_t* cursors = (uint32_t*) calloc(SEARCH_INDEX_BUCKETS, sizeof(uint32_t)); // Last record counted, then where to write
+	if (unlikely(!index || !cursors || !(index->offsets = (uint32_t*) calloc(SEARCH_INDEX_BUCKETS + 1, sizeof(uint32_t))))) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("calloc() error");
+		free(cursors);
+		searchIndexFree(index);
+		return;
+	}
+	for (uint32_t i = 0; i < library->count; ++i) {
+		libraryIndexRecord(library, i, index, cursors, false);
+	}
+	for (uint32_t bucket = 0; bucket < SEARCH_INDEX_BUCKETS; ++bucket) {
+		index->offsets[bucket + 1] += index->offsets[bucket];
+		cursors[bucket] = index->offsets[bucket];
+	}
+	index->postingsCount = index->offsets[SEARCH_INDEX_BUCKETS];
+	index->postings = (uint32_t*) malloc(index->postingsCount * sizeof(uint32_t) + 1);
+	if (unlikely(!index->postings)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("malloc() error");
+		free(cursors);
+		searchIndexFree(index);
+		return;
+	}
+	for (uint32_t i = 0; i < library->count; ++i) {
+		libraryIndexRecord(library, i, index, cursors, true);
+	}
+	free(cursors);
+	__atomic_store_n(&library->index, index, __ATOMIC_RELEASE);
+}
+
+// Records whose field may contain key: list of *count indexes, or NULL if it can be any of the first *count records
+static const uint32_t* libraryCandidates(const struct library* library, const searchField field, const char* key, uint32_t* count) {
+	const struct searchIndex* index = __atomic_load_n(&library->index, __ATOMIC_ACQUIRE);
+	*count = library->count;
+	if (index == NULL) {
+		return NULL;
+	}
+	const uint32_t* list = NULL;
+	for (; key[0] && key[1] && key[2]; ++key) {
+		const uint32_t bucket = searchTrigram(key, field);
+		if (index->offsets[bucket + 1] - index->offsets[bucket] < *count || list == NULL) {
+			list = index->postings + index->offsets[bucket];
+			*count = index->offsets[bucket + 1] - index->offsets[bucket];
+		}
+	}
+	if (list == NULL) { // Shorter than a trigram
+		*count = library->count;
+	}
+	return list;
+}
+
+/*
+ * Fuzzy search, for when exact one finds nothing. Candidates sharing enough trigrams with the key are verified with
+ * Myers' bit-parallel edit distance (the key against the best matching substring), which handles keys of up to 64 bytes.
+ */
+
+#define SEARCH_FUZZY_RESULTS 5 // Best matches listed by !fuzzy
+#define SEARCH_SUGGESTIONS 3 // Best matches offered when exact search finds nothing
+
+struct searchFuzzyResult {
+	uint32_t record;
+	uint32_t distance;
+	uint32_t length; // Of the matched field, shorter one wins a tie
+};
+
+// Typos forgiven for key of that length, short keys would match just about anything
+static inline unsigned int searchMaxDistance(const size_t length) {
+	return length / 4 < searchMaxTypos ? length / 4 : searchMaxTypos;
+}
+
+static unsigned int searchPatternInit(uint64_t peq[256], const char* key) {
+	memset(peq, 0, 256 * sizeof(uint64_t));
+	unsigned int length = 0;
+	for (; key[length] && length < 64; ++length) {
+		peq[(unsigned char) key[length]] |= (uint64_t) 1 << length;
+	}
+	return length;
+}
+
+// Smallest edit distance between the pattern and any substring of text (first length bytes of it)
+static unsigned int searchDistance(const uint64_t peq[256], const unsigned int patternLength, const char* text, const size_t length) {
+	const uint64_t last = (uint64_t) 1 << (patternLength - 1);
+	uint64_t pv = ~(uint64_t) 0;
+	uint64_t mv = 0;
+	unsigned int score = patternLength;
+	unsigned int best = patternLength;
+	for (size_t i = 0; i < length; ++i) {
+		const uint64_t eq = peq[(unsigned char) text[i]];
+		const uint64_t xv = eq | mv;
+		const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+		if (ph & last) {
+			++score;
+		} else if (mh & last) {
+			--score;
+		}
+		ph <<= 1; // Nothing shifted in, so a match may start anywhere in text
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		if (score < best) {
+			best = score;
+		}
+	}
+	return best;
+}
+
+// Whether text we have no key for is within searchMaxDistance() of key
+static bool searchClose(const char* text, const char* key) {
+	uint64_t peq[256];
+	const unsigned int patternLength = searchPatternInit(peq, key);
+	const unsigned int maxDistance = searchMaxDistance(patternLength);
+	if (maxDistance == 0) {
+		return false;
+	}
+	char textKey[SEARCH_KEY_SIZE(strlen(text))];
+	const size_t length = searchKey(textKey, text);
+	return searchDistance(peq, patternLength, textKey, length) <= maxDistance;
+}
+
+// Up to maxMatches best records within searchMaxDistance() of key, with artists only the first record of every artist
+static unsigned int libraryFuzzy(const struct library* library, const char* key, const bool artists, struct searchFuzzyResult* matches, const unsigned int maxMatches) {
+	TRACE_SPAN("search", __func__);
+	uint64_t peq[256];
+	const unsigned int patternLength = searchPatternInit(peq, key);
+	const unsigned int maxDistance = searchMaxDistance(patternLength);
+	if (maxDistance == 0) {
+		return 0;
+	}
+	// Distinct buckets of the key, candidates need all but 3 per typo of them
+	uint32_t buckets[patternLength];
+	unsigned int bucketsCount = 0;
+	for (unsigned int i = 0; i + 2 < patternLength; ++i) {
+		const uint32_t bucket = searchTrigram(key + i, SEARCH_FIELD_PATH);
+		unsigned int j = 0;
+		while (j < bucketsCount && buckets[j] != bucket) {
+			++j;
+		}
+		if (j == bucketsCount) {
+			buckets[bucketsCount++] = bucket;
+		}
+	}
+	const struct searchIndex* index = __atomic_load_n(&library->index, __ATOMIC_ACQUIRE);
+	const unsigned int needed = bucketsCount > 3 * maxDistance ? bucketsCount - 3 * maxDistance : 0;
+	uint8_t* counts = NULL;
+	if (index != NULL && needed > 0 && (counts = (uint8_t*) calloc(library->count + 1, 1)) != NULL) {
+		for (unsigned int i = 0; i < bucketsCount; ++i) {
+			for (uint32_t j = index->offsets[buckets[i]]; j < index->offsets[buckets[i] + 1]; ++j) {
+				++counts[index->postings[j]]; // 64 bytes have no more than 62 trigrams, never overflows
+			}
+		}
+	}
+	unsigned int count = 0;
+	const char* previous = NULL;
+	size_t previousLength = 0;
+	for (uint32_t i = 0; i < library->count; ++i) {
+		if (counts != NULL && counts[i] < needed) {
+			continue;
+		}
+		const char* text = libraryString(library, library->records[i].fileKey);
+		const size_t length = artists ? strcspn(text, "/") : strlen(text);
+		if (artists) {
+			if (previous != NULL && length == previousLength && strncmp(text, previous, length) == 0) {
+				continue; // Same artist as the one we've just checked
+			}
+			previous = text;
+			previousLength = length;
+		}
+		const unsigned int distance = searchDistance(peq, patternLength, text, length);
+		if (distance > maxDistance || (count == maxMatches && (distance > matches[count - 1].distance
+			|| (distance == matches[count - 1].distance && length >= matches[count - 1].length)))) {
+			continue;
+		}
+		unsigned int position = count < maxMatches ? count++ : count - 1;
+		while (position > 0 && (matches[position - 1].distance > distance || (matches[position - 1].distance == distance && matches[position - 1].length > length))) {
+			matches[position] = matches[position - 1];
+			--position;
+		}
+		matches[position].record = i;
+		matches[position].distance = distance;
+		matches[position].length = length;
+	}
+	free(counts);
+	return count;
+}
+
+// ISO 8601 as MPD prints it, 0 if it's something else
+static uint64_t mpdParseTime(const char* value) {
+	struct tm tm = {0};
+	const char* end = strptime(value, "%Y-%m-%dT%H:%M:%SZ", &tm);
+	if (end == NULL || *end != '\0') {
+		return 0;
+	}
+	const time_t t = timegm(&tm);
+	return t > 0 ? (uint64_t) t : 0;
+}
+
+// Reads songs (and directories, if asked to) until the end of response, returns 1 for list_OK, 0 for OK and -1 on MPD error
+static int libraryBuilderReadSongs(struct libraryBuilder* builder, struct mpdConnection* connection, const bool withDirectories) {
+	struct libraryRecord* record = NULL;
+	uint32_t directory = UINT32_MAX;
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (strcmp(key, "file") == 0) {
+			directory = UINT32_MAX;
+			if ((record = libraryBuilderRecord(builder)) != NULL) {
+				record->file = libraryBuilderString(builder, value, false);
+			}
+		} else if (strcmp(key, "directory") == 0) {
+			record = NULL;
+			directory = withDirectories ? libraryBuilderDirectory(builder, value, 0) : UINT32_MAX;
+		} else if (strcmp(key, "playlist") == 0) {
+			record = NULL;
+			directory = UINT32_MAX;
+		} else if (strcmp(key, "list_OK") == 0) {
+			return 1;
+		} else if (record != NULL) {
+			if (record->artist == 0 && strcmp(key, "Artist") == 0) {
+				record->artist = libraryBuilderString(builder, value, true);
+			} else if (record->album == 0 && strcmp(key, "Album") == 0) {
+				record->album = libraryBuilderString(builder, value, true);
+			} else if (record->title == 0 && strcmp(key, "Title") == 0) {
+				record->title = libraryBuilderString(builder, value, false);
+			} else if (record->comment == 0 && strcmp(key, "Comment") == 0) {
+				record->comment = libraryBuilderString(builder, value, true);
+			} else if (record->genre == 0 && strcmp(key, "Genre") == 0) {
+				record->genre = libraryBuilderString(builder, value, true);
+			} else if (strcmp(key, "Time") == 0) {
+				record->time = strtoul(value, NULL, 10);
+			}
+		} else if (directory != UINT32_MAX && strcmp(key, "Last-Modified") == 0) {
+			builder->library->directories[directory].modified = mpdParseTime(value);
+		}
+	}
+	return ret;
+}
+
+// Timestamp of the last database update, changes whenever anything in the library does, and number of songs
+static bool mpdStats(struct mpdConnection* connection, uint64_t* dbUpdate, uint32_t* songs) {
+	if (unlikely(!mpdSend(connection, "stats\n"))) {
+		return false;
+	}
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (strcmp(key, "db_update") == 0) {
+			*dbUpdate = strtoull(value, NULL, 10);
+		} else if (strcmp(key, "songs") == 0) {
+			*songs = strtoul(value, NULL, 10);
+		}
+	}
+	return ret == 0;
+}
+
+/*
+ * MPD only tells us that something in the database changed, so we find out what on our own.
+ * When musicPath is on this machine, we stat() every directory below it, added or removed files
+ * change mtime of their directory. Otherwise, we only have MPD's own idea of directories.
+ */
+
+#define LIBRARY_WALK_MAX_DEPTH 32
+
+struct libraryWalkEntry {
+	char* path; // Relative to musicPath, same as MPD URIs
+	uint64_t modified;
+};
+
+struct libraryWalk {
+	struct libraryWalkEntry* entries;
+	uint32_t count;
+	uint32_t capacity;
+	bool failed;
+};
+
+// Takes over fd
+static void libraryWalkDirectory(struct libraryWalk* walk, const int fd, const char* path, const uint64_t modified, const unsigned int depth) {
+	if (walk->count == walk->capacity) {
+		const uint32_t capacity = walk->capacity ? walk->capacity * 2 : 256;
+		struct libraryWalkEntry* entries = (struct libraryWalkEntry*) realloc(walk->entries, capacity * sizeof(struct libraryWalkEntry));
+		if (unlikely(!entries)) {
+			walk->failed = true;
+			close(fd);
+			return;
+		}
+		walk->entries = entries;
+		walk->capacity = capacity;
+	}
+	if (unlikely(!(walk->entries[walk->count].path = strdup(path)))) {
+		walk->failed = true;
+		close(fd);
+		return;
+	}
+	walk->entries[walk->count++].modified = modified;
+	DIR* dir = depth < LIBRARY_WALK_MAX_DEPTH ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		close(fd);
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL && !walk->failed) {
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)) {
+			continue; // MPD skips hidden ones too, that includes "." and ".."
+		}
+		const int child = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (child == -1) {
+			continue; // Not a directory after all, or one that MPD can't read either
+		}
+		struct stat st = {0};
+		if (unlikely(fstat(child, &st) == -1)) {
+			close(child);
+			continue;
+		}
+		char childPath[strlen(path) + 1 + strlen(entry->d_name) + 1];
+		snprintf(childPath, sizeof(childPath), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+		libraryWalkDirectory(walk, child, childPath, st.st_mtim.tv_sec, depth + 1);
+	}
+	closedir(dir);
+}
+
+static int libraryCompareWalkEntries(const void* a, const void* b) {
+	return strcmp(((const struct libraryWalkEntry*) a)->path, ((const struct libraryWalkEntry*) b)->path);
+}
+
+static void libraryWalkFree(struct libraryWalk* walk) {
+	for (uint32_t i = 0; i < walk->count; ++i) {
+		free(walk->entries[i].path);
+	}
+	free(walk->entries);
+	memset(walk, 0, sizeof(*walk));
+}
+
+// All directories below musicPath sorted by path, false if musicPath isn't here (MPD on another machine)
+static bool libraryWalk(struct libraryWalk* walk) {
+	TRACE_SPAN("file", __func__);
+	memset(walk, 0, sizeof(*walk));
+	const int fd = open(musicPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st = {0};
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+	libraryWalkDirectory(walk, fd, "", st.st_mtim.tv_sec, 0);
+	if (unlikely(walk->failed)) {
+		libraryWalkFree(walk);
+		return false;
+	}
+	qsort(walk->entries, walk->count, sizeof(struct libraryWalkEntry), libraryCompareWalkEntries);
+	return true;
+}
+
+/*
+ * Fills directories of the builder from the walk. mtime we got from the disk is only good if MPD's update
+ * started after it, for directories touched later we keep what we knew (sorted known, strings behind *knownStrings),
+ * so they get checked again the next time. This also remembers directories MPD doesn't list (no songs in them).
+ */
+static void libraryBuilderWalkDirectories(struct libraryBuilder* builder, const struct libraryWalk* walk, const struct libraryDirectory* known, const uint32_t knownCount, char* const* knownStrings) {
+	for (uint32_t i = 0, j = 0; i < walk->count && !builder->failed; ++i) {
+		int cmp = -1;
+		while (j < knownCount && (cmp = strcmp(*knownStrings + known[j].path, walk->entries[i].path)) < 0) {
+			++j;
+		}
+		const uint64_t modified = walk->entries[i].modified < builder->library->dbUpdate ? walk->entries[i].modified : j < knownCount && cmp == 0 ? known[j].modified : 0;
+		libraryBuilderDirectory(builder, walk->entries[i].path, modified);
+	}
+}
+
+/*
+ * One listallinfo for the whole database can easily overflow MPD's max_output_buffer_size,
+ * so we list top-level directories first and then ask for each one of them separately.
+ * keepGoing is checked between directories, so whoever started us can give up early.
+ */
+static struct library* libraryLoad(struct mpdConnection* connection, const uint64_t dbUpdate, const struct libraryWalk* walk, const bool* keepGoing) {
+	TRACE_SPAN("mpd", __func__);
+	struct libraryBuilder builder;
+	if (unlikely(!libraryBuilderInit(&builder))) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "Out of memory");
+		return NULL;
+	}
+	struct library* library = builder.library;
+	library->dbUpdate = dbUpdate;
+	libraryBuilderDirectory(&builder, "", 0); // Nobody tells us mtime of the root
+	if (unlikely(!mpdSend(connection, "lsinfo\n"))) {
+		return libraryBuilderFinish(&builder, false);
+	}
+	bool success = libraryBuilderReadSongs(&builder, connection, true) == 0; // Also songs lying directly in the root
+	const uint32_t topLevel = library->directoriesCount;
+	for (uint32_t i = 1; i < topLevel && success; ++i) {
+		if (!__atomic_load_n(keepGoing, __ATOMIC_RELAXED)) {
+			success = false;
+			break;
+		}
+		const struct arenaMark mark = arenaMark();
+		const char* command = mpdQuoted(connection, "listallinfo ", libraryString(library, library->directories[i].path), "\n");
+		success = command != NULL && mpdSend(connection, command);
+		arenaRewind(mark);
+		success = success && libraryBuilderReadSongs(&builder, connection, true) == 0;
+	}
+	if (success && walk != NULL && !builder.failed) { // Disk knows better, what MPD told us is only for those it's not sure about
+		const uint32_t count = library->directoriesCount;
+		struct libraryDirectory* known = (struct libraryDirectory*) malloc(count * sizeof(struct libraryDirectory));
+		if (likely(known != NULL)) {
+			qsort_r(library->directories, count, sizeof(struct libraryDirectory), libraryCompareDirectories, library->strings);
+			memcpy(known, library->directories, count * sizeof(struct libraryDirectory));
+			library->directoriesCount = 0;
+			libraryBuilderWalkDirectories(&builder, walk, known, count, &library->strings);
+			free(known);
+		}
+	}
+	return libraryBuilderFinish(&builder, success);
+}
+
+#define LIBRARY_SYNC_MAX_DIRECTORIES 256 // More changed directories than that and full reload is cheaper
+
+static int libraryCompareStrings(const void* a, const void* b) {
+	return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+// Binary search in the first count records of the builder, sorted beforehand
+static bool libraryBuilderHasFile(const struct libraryBuilder* builder, const uint32_t count, const char* file) {
+	uint32_t low = 0;
+	uint32_t high = count;
+	while (low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		const int cmp = strcmp(builder->library->strings + builder->library->records[middle].file, file);
+		if (cmp == 0) {
+			return true;
+		} else if (cmp < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return false;
+}
+
+/*
+ * Incremental sync, everything goes in a single command list, so MPD traffic is proportional to the change:
+ *  - songs modified since the last db_update (tags edited in place, new files) come from find modified-since,
+ *  - songs of new directories and of those with different mtime than we remember come from lsinfo,
+ *  - songs of directories that are gone, or that we fetch again, are dropped, the rest is copied from the old library.
+ * Song count from stats is the safety net, that's the only thing telling us about deletions without the walk.
+ * Returns NULL if incremental sync isn't possible or doesn't add up, caller should load everything then.
+ */
+static struct library* librarySync(struct mpdConnection* connection, const struct library* old, const uint64_t dbUpdate, const uint32_t songs, const struct libraryWalk* walk) {
+	TRACE_SPAN("mpd", __func__);
+	const uint32_t walkCount = walk != NULL ? walk->count : 0;
+	const char** replaced = (const char**) malloc((walkCount + old->directoriesCount + 1) * sizeof(char*));
+	const char** fetched = (const char**) malloc((walkCount + 1) * sizeof(char*));
+	uint32_t replacedCount = 0;
+	uint32_t fetchedCount = 0;
+	if (unlikely(!replaced || !fetched)) {
+		free(replaced);
+		free(fetched);
+		return NULL;
+	}
+	for (uint32_t i = 0, j = 0; i < walkCount || (walk != NULL && j < old->directoriesCount); ) {
+		const int cmp = i == walkCount ? 1 : j == old->directoriesCount ? -1 : strcmp(walk->entries[i].path, libraryString(old, old->directories[j].path));
+		if (cmp < 0) { // New one
+			replaced[replacedCount++] = fetched[fetchedCount++] = walk->entries[i++].path;
+		} else if (cmp > 0) { // Gone
+			replaced[replacedCount++] = libraryString(old, old->directories[j++].path);
+		} else {
+			if (walk->entries[i].modified != old->directories[j].modified) {
+				replaced[replacedCount++] = fetched[fetchedCount++] = walk->entries[i].path;
+			}
+			++i;
+			++j;
+		}
+	}
+	size_t commandSize = 128; // Command list around find modified-since
+	for (uint32_t i = 0; i < fetchedCount; ++i) {
+		commandSize += 7 + 2 * strlen(fetched[i]) + 3;
+	}
+	struct libraryBuilder builder;
+	char* command = replacedCount <= LIBRARY_SYNC_MAX_DIRECTORIES ? (char*) malloc(commandSize) : NULL;
+	if (command == NULL || unlikely(!libraryBuilderInit(&builder))) {
+		free(command);
+		free(replaced);
+		free(fetched);
+		return NULL;
+	}
+	qsort(replaced, replacedCount, sizeof(char*), libraryCompareStrings);
+	builder.library->dbUpdate = dbUpdate;
+	size_t length = snprintf(command, commandSize, "command_list_ok_begin\nfind modified-since \"%" PRIu64 "\"\n", old->dbUpdate);
+	for (uint32_t i = 0; i < fetchedCount; ++i) {
+		memcpy(command + length, "lsinfo ", 7);
+		mpdQuote(command + length + 7, fetched[i]);
+		length += strlen(command + length);
+		command[length++] = '\n';
+	}
+	memcpy(command + length, "command_list_end\n", 18);
+	bool success = mpdSend(connection, command);
+	free(command);
+	free(fetched);
+	for (uint32_t i = 0; i <= fetchedCount && success; ++i) { // An ACK aborts the list, directory might be gone already
+		success = libraryBuilderReadSongs(&builder, connection, false) == 1;
+	}
+	success = success && libraryBuilderReadSongs(&builder, connection, false) == 0;
+
+	// Whatever we didn't just get from MPD stays as it was
+	const uint32_t fresh = builder.library->count;
+	if (success) {
+		qsort_r(builder.library->records, fresh, sizeof(struct libraryRecord), libraryCompareRecords, builder.library->strings);
+	}
+	for (uint32_t i = 0; i < old->count && success && !builder.failed; ++i) {
+		const struct libraryRecord* oldRecord = &old->records[i];
+		const char* file = libraryString(old, oldRecord->file);
+		const char* slash = strrchr(file, '/');
+		const size_t directoryLength = slash != NULL ? (size_t) (slash - file) : 0;
+		char directory[directoryLength + 1];
+		memcpy(directory, file, directoryLength);
+		directory[directoryLength] = '\0';
+		const char* key = directory;
+		if (bsearch(&key, replaced, replacedCount, sizeof(char*), libraryCompareStrings) != NULL || libraryBuilderHasFile(&builder, fresh, file)) {
+			continue;
+		}
+		libraryBuilderCopy(&builder, old, oldRecord);
+	}
+	free(replaced);
+	if (success && walk != NULL) {
+		libraryBuilderWalkDirectories(&builder, walk, old->directories, old->directoriesCount, &old->strings);
+	} else {
+		for (uint32_t i = 0; i < old->directoriesCount && success; ++i) {
+			libraryBuilderDirectory(&builder, libraryString(old, old->directories[i].path), old->directories[i].modified);
+		}
+	}
+
+	struct library* library = libraryBuilderFinish(&builder, success);
+	if (library != NULL && library->count != songs) {
+		char message[128];
+		snprintf(message, sizeof(message), "Library sync ended with %" PRIu32 " songs instead of %" PRIu32 ", reloading", library->count, songs);
+		logToConsole(message);
+		libraryFree(library);
+		return NULL;
+	}
+	return library;
+}
+
+/*
+ * Library snapshot (library.bin) lets us start with the library right away, instead of waiting for MPD.
+ * It's just the header followed by directories, records and strings exactly as they are in memory, so it's mmap'd
+ * and used as is. Everything is referenced by offsets, native byte order is fine as it never leaves this machine.
+ */
+
+// Record of file, library->count if there's none
+static uint32_t libraryFindFile(const struct library* library, const char* file) {
+	uint32_t low = 0;
+	uint32_t high = library->count;
+	while (low < high) {
+		const uint32_t middle = low + (high - low) / 2;
+		if (strcmp(libraryString(library, library->records[middle].file), file) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < library->count && strcmp(libraryString(library, library->records[low].file), file) == 0 ? low : library->count;
+}
+
+// Publishes current library without file, so searches stop finding it before MPD tells us about it
+static void libraryForget(const char* file) {
+	struct library* library = libraryGet();
+	if (library == NULL) {
+		return;
+	}
+	const uint32_t low = libraryFindFile(library, file);
+	struct libraryBuilder builder;
+	if (low == library->count || unlikely(!libraryBuilderInit(&builder))) {
+		libraryRelease(library);
+		return;
+	}
+	TRACE_SPAN("search", __func__);
+	builder.library->dbUpdate = library->dbUpdate; // Still what MPD had, so the next sync picks up the rest
+	for (uint32_t i = 0; i < library->count; ++i) {
+		if (i != low) {
+			libraryBuilderCopy(&builder, library, &library->records[i]);
+		}
+	}
+	for (uint32_t i = 0; i < library->directoriesCount; ++i) {
+		libraryBuilderDirectory(&builder, libraryString(library, library->directories[i].path), library->directories[i].modified);
+	}
+	struct library* smaller = libraryBuilderFinish(&builder, true);
+	if (smaller != NULL) {
+		libraryIndex(smaller);
+		libraryReplace(library, smaller);
+	}
+	libraryRelease(library);
+}
+
+#define LIBRARY_SNAPSHOT_MAGIC "ATSMBLIB"
+#define LIBRARY_SNAPSHOT_VERSION 5 // Bump whenever anything in the layout changes
+#define LIBRARY_SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct librarySnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t recordSize;
+	uint32_t count;
+	uint32_t directoriesCount;
+	uint32_t stringsSize;
+	uint32_t searchIgnoreDiacritics; // Keys are useless if they were made differently
+	uint32_t indexBuckets; // 0 if it was saved without search index
+	uint32_t postingsCount;
+	uint32_t reserved;
+	uint64_t dbUpdate;
+	uint64_t directoriesOffset;
+	uint64_t recordsOffset;
+	uint64_t offsetsOffset;
+	uint64_t postingsOffset;
+	uint64_t stringsOffset;
+};
+
+// Search index goes with it if it's there already, so that it doesn't have to be made again on every start
+static void librarySave(const struct library* library) {
+	TRACE_SPAN("file", __func__);
+	const struct searchIndex* index = __atomic_load_n(&library->index, __ATOMIC_ACQUIRE);
+	struct librarySnapshotHeader header = {
+		.version = LIBRARY_SNAPSHOT_VERSION,
+		.byteOrder = LIBRARY_SNAPSHOT_BYTE_ORDER,
+		.recordSize = sizeof(struct libraryRecord),
+		.count = library->count,
+		.directoriesCount = library->directoriesCount,
+		.stringsSize = library->stringsSize,
+		.searchIgnoreDiacritics = searchIgnoreDiacritics,
+		.indexBuckets = index != NULL ? SEARCH_INDEX_BUCKETS : 0,
+		.postingsCount = index != NULL ? index->postingsCount : 0,
+		.dbUpdate = library->dbUpdate,
+		.directoriesOffset = sizeof(struct librarySnapshotHeader),
+		.recordsOffset = sizeof(struct librarySnapshotHeader) + (uint64_t) library->directoriesCount * sizeof(struct libraryDirectory)
+	};
+	header.offsetsOffset = header.recordsOffset + (uint64_t) library->count * sizeof(struct libraryRecord);
+	header.postingsOffset = header.offsetsOffset + (index != NULL ? (SEARCH_INDEX_BUCKETS + 1) * sizeof(uint32_t) : 0);
+	header.stringsOffset = header.postingsOffset + (uint64_t) header.postingsCount * sizeof(uint32_t);
+	memcpy(header.magic, LIBRARY_SNAPSHOT_MAGIC, sizeof(header.magic));
+	char libraryFileTemp[strlen(libraryFile) + 4 + 1];
+	snprintf(libraryFileTemp, sizeof(libraryFileTemp), "%s%s", libraryFile, ".new");
+	FILE* stream = fopen(libraryFileTemp, "w");
+	if (unlikely(!stream)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("fopen() error");
+		return;
+	}
+	fwrite(&header, sizeof(header), 1, stream);
+	fwrite(library->directories, sizeof(struct libraryDirectory), library->directoriesCount, stream);
+	fwrite(library->records, sizeof(struct libraryRecord), library->count, stream);
+	if (index != NULL) {
+		fwrite(index->offsets, sizeof(uint32_t), SEARCH_INDEX_BUCKETS + 1, stream);
+		fwrite(index->postings, sizeof(uint32_t), index->postingsCount, stream);
+	}
+	fwrite(library->strings, 1, library->stringsSize, stream);
+	const bool failed = ferror(stream);
+	if (unlikely(fclose(stream) || failed)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("fwrite() error");
+		remove(libraryFileTemp);
+		return;
+	}
+	if (unlikely(rename(libraryFileTemp, libraryFile))) { // Whoever has the old one mmap'd keeps it
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("rename() error");
+	}
+}
+
+// NULL if there's no snapshot or we can't trust it, it's only a cache anyway
+static struct library* librarySnapshotLoad() {
+	TRACE_SPAN("file", __func__);
+	const int fd = open(libraryFile, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (unlikely(errno != ENOENT)) {
+			logErrorToConsole(strerror(errno));
+			logErrorToConsole("open() error");
+		}
+		return NULL;
+	}
+	struct stat st = {0};
+	if (unlikely(fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(struct librarySnapshotHeader))) {
+		close(fd);
+		logErrorToConsole("Library snapshot is truncated, ignoring it");
+		return NULL;
+	}
+	void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (unlikely(mapping == MAP_FAILED)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("mmap() error");
+		return NULL;
+	}
+	const struct librarySnapshotHeader* header = (const struct librarySnapshotHeader*) mapping;
+	bool valid = memcmp(header->magic, LIBRARY_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 && header->version == LIBRARY_SNAPSHOT_VERSION
+		&& header->byteOrder == LIBRARY_SNAPSHOT_BYTE_ORDER && header->recordSize == sizeof(struct libraryRecord)
+		&& header->searchIgnoreDiacritics == searchIgnoreDiacritics
+		&& header->directoriesOffset == sizeof(struct librarySnapshotHeader)
+		&& header->recordsOffset == header->directoriesOffset + (uint64_t) header->directoriesCount * sizeof(struct libraryDirectory)
+		&& header->offsetsOffset == header->recordsOffset + (uint64_t) header->count * sizeof(struct libraryRecord)
+		&& (header->indexBuckets == SEARCH_INDEX_BUCKETS || (header->indexBuckets == 0 && header->postingsCount == 0))
+		&& header->postingsOffset == header->offsetsOffset + (header->indexBuckets != 0 ? (SEARCH_INDEX_BUCKETS + 1) * sizeof(uint32_t) : 0)
+		&& header->stringsOffset == header->postingsOffset + (uint64_t) header->postingsCount * sizeof(uint32_t)
+		&& header->stringsSize > 0 && header->stringsOffset + header->stringsSize == (uint64_t) st.st_size;
+	const char* strings = (const char*) mapping + (valid ? header->stringsOffset : 0);
+	valid = valid && strings[0] == '\0' && strings[header->stringsSize - 1] == '\0';
+	const struct libraryRecord* records = (const struct libraryRecord*) ((const char*) mapping + header->recordsOffset);
+	for (uint32_t i = 0; valid && i < header->count; ++i) { // Every string must start inside and end with the last NUL at worst
+		valid = records[i].file < header->stringsSize && records[i].artist < header->stringsSize && records[i].album < header->stringsSize
+			&& records[i].title < header->stringsSize && records[i].comment < header->stringsSize && records[i].genre < header->stringsSize
+			&& records[i].fileKey < header->stringsSize && records[i].commentKey < header->stringsSize;
+	}
+	const struct libraryDirectory* directories = (const struct libraryDirectory*) ((const char*) mapping + header->directoriesOffset);
+	for (uint32_t i = 0; valid && i < header->directoriesCount; ++i) {
+		valid = directories[i].path < header->stringsSize;
+	}
+	const uint32_t* offsets = (const uint32_t*) ((const char*) mapping + header->offsetsOffset);
+	const uint32_t* postings = (const uint32_t*) ((const char*) mapping + header->postingsOffset);
+	if (valid && header->indexBuckets != 0) { // Every list must be inside postings and point at records there are
+		valid = offsets[0] == 0 && offsets[SEARCH_INDEX_BUCKETS] == header->postingsCount;
+		for (uint32_t bucket = 0; valid && bucket < SEARCH_INDEX_BUCKETS; ++bucket) {
+			valid = offsets[bucket] <= offsets[bucket + 1];
+		}
+		for (uint32_t i = 0; valid && i < header->postingsCount; ++i) {
+			valid = postings[i] < header->count;
+		}
+	}
+	struct library* library = valid ? (struct library*) calloc(1, sizeof(struct library)) : NULL;
+	if (unlikely(!library)) {
+		munmap(mapping, st.st_size);
+		logErrorToConsole(valid ? "calloc() error" : "Library snapshot is invalid, ignoring it");
+		return NULL;
+	}
+	library->records = (struct libraryRecord*) records;
+	library->count = header->count;
+	library->directories = (struct libraryDirectory*) directories;
+	library->directoriesCount = header->directoriesCount;
+	library->strings = (char*) strings;
+	library->stringsSize = header->stringsSize;
+	library->dbUpdate = header->dbUpdate;
+	library->references = 1;
+	library->mapping = mapping;
+	library->mappingSize = st.st_size;
+	if (header->indexBuckets != 0) { // Without it warm-up just makes one
+		struct searchIndex* index = (struct searchIndex*) calloc(1, sizeof(struct searchIndex));
+		if (unlikely(!index)) {
+			logErrorToConsole(strerror(errno));
+			logErrorToConsole("calloc() error");
+		} else {
+			index->offsets = (uint32_t*) offsets;
+			index->postings = (uint32_t*) postings;
+			index->postingsCount = header->postingsCount;
+			index->mapped = true;
+			library->index = index;
+		}
+	}
+	return library;
+}
+
+// Brings current library up to date with MPD, incrementally if we can, false (with connection->error) on failure
+static bool libraryRefresh(struct mpdConnection* connection, const bool* keepGoing) {
+	uint64_t dbUpdate = 0;
+	uint32_t songs = 0;
+	if (unlikely(!mpdStats(connection, &dbUpdate, &songs))) {
+		return false;
+	}
+	struct library* old = libraryGet();
+	if (old != NULL && dbUpdate != 0 && old->dbUpdate == dbUpdate) {
+		libraryRelease(old);
+		return true;
+	}
+	const uint64_t start = metricsNow();
+	struct libraryWalk walk;
+	const bool walked = libraryWalk(&walk);
+	struct library* library = NULL;
+	if (old != NULL) {
+		if (old->dbUpdate != 0) { // Otherwise we don't know since when to look
+			library = librarySync(connection, old, dbUpdate, songs, walked ? &walk : NULL);
+		}
+		libraryRelease(old);
+	}
+	const bool incremental = library != NULL;
+	if (library == NULL && connection->fd != -1) {
+		library = libraryLoad(connection, dbUpdate, walked ? &walk : NULL, keepGoing);
+	}
+	libraryWalkFree(&walk);
+	if (library == NULL) {
+		return false;
+	}
+	metricsCount(incremental ? METRIC_LIBRARY_SYNCS : METRIC_LIBRARY_RELOADS);
+	char message[128];
+	snprintf(message, sizeof(message), "Library %s: %" PRIu32 " songs in %.1f ms", incremental ? "synced" : "reloaded", library->count, (metricsNow() - start) / 1000.0);
+	logToConsole(message);
+	libraryIndex(library); // Before saving, so that the snapshot has it
+	librarySave(library);
+	libraryPublish(library);
+	return true;
+}
+
+#define LIBRARY_WATCH_RETRY 5 // Seconds between attempts to get MPD back
+#define LIBRARY_WATCH_POLL 1000 // Milliseconds between checks whether we should stop, shutdown doesn't wait for it
+
+// Keeps library in sync with idle database until keepGoing goes false, connection may be disconnected at start
+static void libraryWatch(struct mpdConnection* connection, const bool* keepGoing) {
+	while (__atomic_load_n(keepGoing, __ATOMIC_RELAXED)) {
+		if (connection->fd == -1) {
+			for (unsigned int i = 0; i < LIBRARY_WATCH_RETRY * 1000 / LIBRARY_WATCH_POLL && __atomic_load_n(keepGoing, __ATOMIC_RELAXED); ++i) {
+				struct pollfd wake = { .fd = lifecycleWakeFd, .events = POLLIN };
+				if (poll(&wake, 1, LIBRARY_WATCH_POLL) > 0) {
+					break; // Shutdown, keepGoing follows
+				}
+			}
+			if (!__atomic_load_n(keepGoing, __ATOMIC_RELAXED) || !mpdConnect(connection) || !libraryRefresh(connection, keepGoing)) {
+				mpdDisconnect(connection);
+				continue;
+			}
+		}
+		const int fd = connection->fd;
+		if (!lifecycleIdleBegin(fd)) {
+			break;
+		}
+		if (unlikely(!mpdSend(connection, "idle database\n"))) {
+			lifecycleIdleEnd(fd);
+			continue;
+		}
+		// Shutdown sends noidle, wake up is just in case it came before our idle
+		struct pollfd pollfds[2] = { { .fd = fd, .events = POLLIN }, { .fd = lifecycleWakeFd, .events = POLLIN } };
+		int ready;
+		while ((ready = poll(pollfds, 2, LIBRARY_WATCH_POLL)) == 0 || (ready == -1 && errno == EINTR)) {
+			if (!__atomic_load_n(keepGoing, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		if (ready <= 0 || pollfds[0].revents == 0) {
+			lifecycleIdleEnd(fd);
+			mpdDisconnect(connection); // MPD is fine with idling clients going away
+			continue;
+		}
+		bool changed = false;
+		char* key;
+		char* value;
+		int ret;
+		while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+			if (strcmp(key, "changed") == 0 && strcmp(value, "database") == 0) {
+				changed = true;
+			}
+		}
+		lifecycleIdleEnd(fd);
+		if (unlikely(ret != 0) || (changed && !libraryRefresh(connection, keepGoing))) {
+			logErrorToConsole(connection->error);
+		}
+	}
+	mpdDisconnect(connection);
+}
+
+
+/*
+ * Tag scanner reads tags straight from files under musicPath, for when MPD is down and there's no snapshot.
+ * Directories are spread over a small pool of threads, each one takes from its own deque and steals from the others
+ * when it runs dry. Only tag headers are read (ID3v2, ID3v1, FLAC metadata, MP4 atoms), audio data is skipped by offsets.
+ */
+
+#define TAGS_MAX_WORKERS 8
+#define TAGS_HEAD_SIZE 8192 // First read of every file, covers tag headers and usually all text frames too
+#define TAGS_MAX_FIELD 1024 // Longer tag values are cut, nobody searches in lyrics
+#define TAGS_MAX_BLOCK (1 << 20) // FLAC comment blocks over that are skipped
+
+struct tagsFile {
+	int fd;
+	uint64_t size;
+	unsigned char head[TAGS_HEAD_SIZE];
+	size_t headLength;
+};
+
+struct tagsFields {
+	char artist[TAGS_MAX_FIELD];
+	char album[TAGS_MAX_FIELD];
+	char title[TAGS_MAX_FIELD];
+	char comment[TAGS_MAX_FIELD];
+	char genre[TAGS_MAX_FIELD];
+	uint32_t time;
+};
+
+static inline void tagsClear(struct tagsFields* fields) {
+	fields->artist[0] = fields->album[0] = fields->title[0] = fields->comment[0] = fields->genre[0] = '\0';
+	fields->time = 0;
+}
+
+// Like pread(), but served from the head when possible, true if we got all of it
+static bool tagsRead(struct tagsFile* file, void* buffer, const size_t length, const uint64_t offset) {
+	if (offset + length <= file->headLength) {
+		memcpy(buffer, file->head + offset, length);
+		return true;
+	}
+	if (offset + length > file->size) {
+		return false;
+	}
+	for (size_t done = 0; done < length; ) {
+		const ssize_t got = pread(file->fd, (char*) buffer + done, length - done, offset + done);
+		if (got <= 0) {
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += got;
+	}
+	return true;
+}
+
+static inline uint32_t tagsBigEndian(const unsigned char* bytes, const unsigned int length) {
+	uint32_t value = 0;
+	for (unsigned int i = 0; i < length; ++i) {
+		value = value << 8 | bytes[i];
+	}
+	return value;
+}
+
+static inline uint32_t tagsLittleEndian(const unsigned char* bytes) {
+	return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static inline uint32_t tagsSyncsafe(const unsigned char* bytes) {
+	return (bytes[0] & 0x7f) << 21 | (bytes[1] & 0x7f) << 14 | (bytes[2] & 0x7f) << 7 | (bytes[3] & 0x7f);
+}
+
+static size_t tagsPutUtf8(char* output, size_t length, const uint32_t codepoint) {
+	if (codepoint < 0x80) {
+		if (length + 1 < TAGS_MAX_FIELD) {
+			output[length++] = codepoint;
+		}
+	} else if (codepoint < 0x800) {
+		if (length + 2 < TAGS_MAX_FIELD) {
+			output[length++] = 0xc0 | codepoint >> 6;
+			output[length++] = 0x80 | (codepoint & 0x3f);
+		}
+	} else if (codepoint < 0x10000) {
+		if (length + 3 < TAGS_MAX_FIELD) {
+			output[length++] = 0xe0 | codepoint >> 12;
+			output[length++] = 0x80 | ((codepoint >> 6) & 0x3f);
+			output[length++] = 0x80 | (codepoint & 0x3f);
+		}
+	} else if (length + 4 < TAGS_MAX_FIELD) {
+		output[length++] = 0xf0 | codepoint >> 18;
+		output[length++] = 0x80 | ((codepoint >> 12) & 0x3f);
+		output[length++] = 0x80 | ((codepoint >> 6) & 0x3f);
+		output[length++] = 0x80 | (codepoint & 0x3f);
+	}
+	return length;
+}
+
+/*
+ * Converts ID3v2 text (0 Latin-1, 1 UTF-16 with BOM, 2 UTF-16BE, 3 UTF-8) up to its terminator into output,
+ * trailing spaces go away, they're padding in ID3v1. Returns number of input bytes used, terminator included.
+ */
+static size_t tagsText(char* output, const unsigned char* input, const size_t inputLength, const unsigned int encoding) {
+	size_t length = 0;
+	size_t i = 0;
+	if (encoding == 1 || encoding == 2) {
+		bool bigEndian = encoding == 2;
+		if (i + 1 < inputLength && ((input[0] == 0xff && input[1] == 0xfe) || (input[0] == 0xfe && input[1] == 0xff))) {
+			bigEndian = input[0] == 0xfe;
+			i += 2;
+		}
+		for (; i + 1 < inputLength; i += 2) {
+			uint32_t unit = bigEndian ? input[i] << 8 | input[i + 1] : input[i + 1] << 8 | input[i];
+			if (unit == 0) {
+				i += 2;
+				break;
+			}
+			if (unit >= 0xd800 && unit < 0xdc00 && i + 3 < inputLength) { // Surrogate pair
+				const uint32_t low = bigEndian ? input[i + 2] << 8 | input[i + 3] : input[i + 3] << 8 | input[i + 2];
+				if (low >= 0xdc00 && low < 0xe000) {
+					unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+					i += 2;
+				}
+			}
+			length = tagsPutUtf8(output, length, unit);
+		}
+	} else {
+		for (; i < inputLength; ++i) {
+			if (input[i] == '\0') {
+				++i;
+				break;
+			}
+			if (encoding == 0) {
+				length = tagsPutUtf8(output, length, input[i]);
+			} else if (length + 1 < TAGS_MAX_FIELD) {
+				output[length++] = input[i];
+			}
+		}
+	}
+	while (length > 0 && output[length - 1] == ' ') {
+		--length;
+	}
+	output[length] = '\0';
+	return i;
+}
+
+// Undoes ID3v2 unsynchronisation (0xff 0x00 -> 0xff) in place, returns the new length
+static size_t tagsUnsynchronise(unsigned char* data, const size_t length) {
+	size_t out = 0;
+	for (size_t i = 0; i < length; ++i) {
+		data[out++] = data[i];
+		if (data[i] == 0xff && i + 1 < length && data[i + 1] == 0x00) {
+			++i;
+		}
+	}
+	return out;
+}
+
+static char* tagsId3v2Field(struct tagsFields* fields, const char* id) {
+	if (strcmp(id, "TPE1") == 0 || strcmp(id, "TP1") == 0) {
+		return fields->artist;
+	} else if (strcmp(id, "TALB") == 0 || strcmp(id, "TAL") == 0) {
+		return fields->album;
+	} else if (strcmp(id, "TIT2") == 0 || strcmp(id, "TT2") == 0) {
+		return fields->title;
+	} else if (strcmp(id, "COMM") == 0 || strcmp(id, "COM") == 0) {
+		return fields->comment;
+	} else if (strcmp(id, "TCON") == 0 || strcmp(id, "TCO") == 0) {
+		return fields->genre;
+	}
+	return NULL;
+}
+
+// Returns offset right after the tag (where FLAC can start), 0 if there's none
+static uint64_t tagsId3v2(struct tagsFile* file, struct tagsFields* fields) {
+	unsigned char header[10];
+	if (!tagsRead(file, header, sizeof(header), 0) || memcmp(header, "ID3", 3) != 0 || header[3] < 2 || header[3] > 4) {
+		return 0;
+	}
+	const unsigned int version = header[3];
+	const uint64_t framesEnd = 10 + (uint64_t) tagsSyncsafe(header + 6);
+	uint64_t offset = 10;
+	if ((header[5] & 0x40) && version >= 3) { // Extended header, nothing for us there
+		unsigned char extended[4];
+		if (!tagsRead(file, extended, sizeof(extended), offset)) {
+			return framesEnd;
+		}
+		offset += version == 3 ? 4 + tagsBigEndian(extended, 4) : tagsSyncsafe(extended);
+	}
+	const unsigned int headerLength = version == 2 ? 6 : 10;
+	unsigned char frame[10];
+	while (offset + headerLength <= framesEnd && tagsRead(file, frame, headerLength, offset) && frame[0] != '\0') {
+		char id[5] = {0};
+		uint32_t frameSize;
+		bool unsynchronised = header[5] & 0x80;
+		unsigned int skip = 0;
+		bool usable = true;
+		if (version == 2) {
+			memcpy(id, frame, 3);
+			frameSize = tagsBigEndian(frame + 3, 3);
+		} else {
+			memcpy(id, frame, 4);
+			frameSize = version == 4 ? tagsSyncsafe(frame + 4) : tagsBigEndian(frame + 4, 4);
+			if (version == 3) {
+				usable = !(frame[9] & 0xc0); // Compressed or encrypted
+				skip = frame[9] & 0x20 ? 1 : 0; // Grouping identity
+			} else {
+				usable = !(frame[9] & 0x0c);
+				unsynchronised = unsynchronised || (frame[9] & 0x02);
+				skip = (frame[9] & 0x40 ? 1 : 0) + (frame[9] & 0x01 ? 4 : 0); // Grouping identity, data length indicator
+			}
+		}
+		offset += headerLength;
+		char* field = tagsId3v2Field(fields, id);
+		if (field != NULL && field[0] == '\0' && usable && frameSize > skip + 1 && offset + frameSize <= framesEnd) {
+			unsigned char data[TAGS_MAX_FIELD * 2];
+			size_t length = frameSize - skip < sizeof(data) ? frameSize - skip : sizeof(data);
+			if (tagsRead(file, data, length, offset + skip)) {
+				if (unsynchronised) {
+					length = tagsUnsynchronise(data, length);
+				}
+				if (field == fields->comment) { // Encoding, language, description, text
+					char description[TAGS_MAX_FIELD];
+					const size_t used = length > 4 ? tagsText(description, data + 4, length - 4, data[0]) : 0;
+					if (length > 4 + used && strncmp(description, "iTun", 4) != 0) {
+						tagsText(field, data + 4 + used, length - 4 - used, data[0]);
+					}
+				} else {
+					tagsText(field, data + 1, length - 1, data[0]);
+				}
+			}
+		}
+		offset += frameSize;
+	}
+	return framesEnd + (header[5] & 0x10 ? 10 : 0); // Footer
+}
+
+static void tagsId3v1(struct tagsFile* file, struct tagsFields* fields) {
+	unsigned char tag[128];
+	if (file->size < sizeof(tag) || !tagsRead(file, tag, sizeof(tag), file->size - sizeof(tag)) || memcmp(tag, "TAG", 3) != 0) {
+		return;
+	}
+	if (fields->title[0] == '\0') {
+		tagsText(fields->title, tag + 3, 30, 0);
+	}
+	if (fields->artist[0] == '\0') {
+		tagsText(fields->artist, tag + 33, 30, 0);
+	}
+	if (fields->album[0] == '\0') {
+		tagsText(fields->album, tag + 63, 30, 0);
+	}
+	if (fields->comment[0] == '\0') {
+		tagsText(fields->comment, tag + 97, tag[125] == '\0' && tag[126] != '\0' ? 28 : 30, 0); // ID3v1.1 keeps track number at the end
+	}
+}
+
+static void tagsVorbisComments(const unsigned char* data, const size_t length, struct tagsFields* fields) {
+	if (length < 8) {
+		return;
+	}
+	size_t offset = 4 + (size_t) tagsLittleEndian(data); // Vendor
+	if (offset + 4 > length) {
+		return;
+	}
+	uint32_t count = tagsLittleEndian(data + offset);
+	offset += 4;
+	for (; count > 0 && offset + 4 <= length; --count) {
+		const size_t entryLength = tagsLittleEndian(data + offset);
+		offset += 4;
+		if (entryLength > length - offset) {
+			return;
+		}
+		const char* entry = (const char*) data + offset;
+		const char* separator = (const char*) memchr(entry, '=', entryLength);
+		offset += entryLength;
+		if (separator == NULL) {
+			continue;
+		}
+		const size_t keyLength = separator - entry;
+		char* field = NULL;
+		if (keyLength == 6 && strncasecmp(entry, "ARTIST", 6) == 0) {
+			field = fields->artist;
+		} else if (keyLength == 5 && strncasecmp(entry, "ALBUM", 5) == 0) {
+			field = fields->album;
+		} else if (keyLength == 5 && strncasecmp(entry, "TITLE", 5) == 0) {
+			field = fields->title;
+		} else if ((keyLength == 7 && strncasecmp(entry, "COMMENT", 7) == 0) || (keyLength == 11 && strncasecmp(entry, "DESCRIPTION", 11) == 0)) {
+			field = fields->comment;
+		} else if (keyLength == 5 && strncasecmp(entry, "GENRE", 5) == 0) {
+			field = fields->genre;
+		}
+		if (field != NULL && field[0] == '\0') {
+			tagsText(field, (const unsigned char*) separator + 1, entryLength - keyLength - 1, 3);
+		}
+	}
+}
+
+static bool tagsFlac(struct tagsFile* file, uint64_t offset, struct tagsFields* fields) {
+	unsigned char header[4];
+	if (!tagsRead(file, header, sizeof(header), offset) || memcmp(header, "fLaC", 4) != 0) {
+		return false;
+	}
+	offset += 4;
+	for (bool last = false; !last && tagsRead(file, header, sizeof(header), offset); ) {
+		last = header[0] & 0x80;
+		const unsigned int type = header[0] & 0x7f;
+		const uint32_t length = tagsBigEndian(header + 1, 3);
+		offset += 4;
+		if (type == 0 && length >= 18) { // STREAMINFO
+			unsigned char info[18];
+			if (tagsRead(file, info, sizeof(info), offset)) {
+				const uint32_t rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+				const uint64_t samples = (uint64_t) (info[13] & 0x0f) << 32 | tagsBigEndian(info + 14, 4);
+				fields->time = rate ? samples / rate : 0;
+			}
+		} else if (type == 4 && length <= TAGS_MAX_BLOCK) { // VORBIS_COMMENT
+			unsigned char* data = (unsigned char*) malloc(length);
+			if (likely(data != NULL) && tagsRead(file, data, length, offset)) {
+				tagsVorbisComments(data, length, fields);
+			}
+			free(data);
+		}
+		offset += length;
+	}
+	return true;
+}
+
+// Walks atoms in [offset, end), only down the path to metadata, sample tables and media data are never read
+static void tagsMp4Atoms(struct tagsFile* file, uint64_t offset, const uint64_t end, const unsigned int depth, const bool items, struct tagsFields* fields) {
+	unsigned char header[16];
+	while (offset + 8 <= end && depth < 8 && tagsRead(file, header, 8, offset)) {
+		uint64_t size = tagsBigEndian(header, 4);
+		unsigned int headerLength = 8;
+		if (size == 1) {
+			if (!tagsRead(file, header + 8, 8, offset + 8)) {
+				return;
+			}
+			size = (uint64_t) tagsBigEndian(header + 8, 4) << 32 | tagsBigEndian(header + 12, 4);
+			headerLength = 16;
+		} else if (size == 0) {
+			size = end - offset;
+		}
+		if (size < headerLength || size > end - offset) {
+			return;
+		}
+		const char* type = (const char*) header + 4;
+		const uint64_t body = offset + headerLength;
+		const uint64_t bodyEnd = offset + size;
+		if (items) {
+			char* field = memcmp(type, "\251ART", 4) == 0 ? fields->artist
+				: memcmp(type, "\251alb", 4) == 0 ? fields->album
+				: memcmp(type, "\251nam", 4) == 0 ? fields->title
+				: memcmp(type, "\251cmt", 4) == 0 ? fields->comment
+				: memcmp(type, "\251gen", 4) == 0 ? fields->genre : NULL;
+			unsigned char data[TAGS_MAX_FIELD + 16];
+			const size_t length = bodyEnd - body < sizeof(data) ? bodyEnd - body : sizeof(data);
+			if (field != NULL && field[0] == '\0' && length > 16 && tagsRead(file, data, length, body) && memcmp(data + 4, "data", 4) == 0) {
+				const size_t dataLength = tagsBigEndian(data, 4) < length ? tagsBigEndian(data, 4) : length; // Size, "data", type, locale, value
+				if (dataLength > 16) {
+					tagsText(field, data + 16, dataLength - 16, 3);
+				}
+			}
+		} else if (memcmp(type, "moov", 4) == 0 || memcmp(type, "udta", 4) == 0) {
+			tagsMp4Atoms(file, body, bodyEnd, depth + 1, false, fields);
+		} else if (memcmp(type, "meta", 4) == 0) { // Full box, version and flags first
+			tagsMp4Atoms(file, body + 4, bodyEnd, depth + 1, false, fields);
+		} else if (memcmp(type, "ilst", 4) == 0) {
+			tagsMp4Atoms(file, body, bodyEnd, depth + 1, true, fields);
+		} else if (memcmp(type, "mvhd", 4) == 0) {
+			unsigned char mvhd[32];
+			if (tagsRead(file, mvhd, sizeof(mvhd), body)) {
+				const uint32_t timescale = tagsBigEndian(mvhd + (mvhd[0] == 1 ? 20 : 12), 4);
+				const uint64_t duration = mvhd[0] == 1 ? (uint64_t) tagsBigEndian(mvhd + 24, 4) << 32 | tagsBigEndian(mvhd + 28, 4) : tagsBigEndian(mvhd + 16, 4);
+				fields->time = timescale ? duration / timescale : 0;
+			}
+		}
+		offset = bodyEnd;
+	}
+}
+
+// False if it doesn't look like a song at all
+static bool tagsReadFile(const int dirFd, const char* name, struct tagsFields* fields) {
+	struct tagsFile file;
+	file.fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+	if (file.fd == -1) {
+		return false;
+	}
+	struct stat st = {0};
+	if (fstat(file.fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(file.fd);
+		return false;
+	}
+	file.size = st.st_size;
+	const ssize_t headLength = pread(file.fd, file.head, sizeof(file.head), 0);
+	file.headLength = headLength > 0 ? headLength : 0;
+	tagsClear(fields);
+
+	const char* extension = strrchr(name, '.');
+	bool song = true;
+	uint64_t id3v2End;
+	if ((id3v2End = tagsId3v2(&file, fields)) != 0) {
+		struct tagsFields id3;
+		tagsClear(&id3);
+		if (tagsFlac(&file, id3v2End, &id3)) { // Some taggers put ID3 in front of FLAC, Vorbis comments are the real ones
+			memcpy(fields, &id3, sizeof(id3));
+		} else {
+			tagsId3v1(&file, fields);
+		}
+	} else if (file.headLength >= 8 && memcmp(file.head + 4, "ftyp", 4) == 0) {
+		tagsMp4Atoms(&file, 0, file.size, 0, false, fields);
+	} else if (extension != NULL && strcasecmp(extension, ".mp3") == 0) {
+		tagsId3v1(&file, fields);
+	} else { // Tags in Ogg aren't supported, but it's still a song
+		song = tagsFlac(&file, 0, fields) || (file.headLength >= 4 && memcmp(file.head, "OggS", 4) == 0);
+	}
+	close(file.fd);
+	return song;
+}
+
+struct tagsQueue {
+	pthread_mutex_t mutex;
+	char** paths; // Directories relative to musicPath, [head, tail) are waiting
+	unsigned int head;
+	unsigned int tail;
+	unsigned int capacity;
+};
+
+struct tagsScanner {
+	struct tagsQueue queues[TAGS_MAX_WORKERS];
+	struct libraryBuilder builders[TAGS_MAX_WORKERS];
+	unsigned int workers;
+	unsigned int pending; // Directories waiting or being scanned, nobody is done until it's 0
+	const bool* keepGoing;
+};
+
+struct tagsWorkerArgs {
+	struct tagsScanner* scanner;
+	unsigned int index;
+};
+
+// Takes over path
+static void tagsPush(struct tagsScanner* scanner, const unsigned int index, char* path) {
+	struct tagsQueue* queue = &scanner->queues[index];
+	pthread_mutex_lock(&queue->mutex);
+	if (queue->tail == queue->capacity) {
+		if (queue->head > 0) { // Make room at the end
+			memmove(queue->paths, queue->paths + queue->head, (queue->tail - queue->head) * sizeof(char*));
+			queue->tail -= queue->head;
+			queue->head = 0;
+		}
+		if (queue->tail == queue->capacity) {
+			const unsigned int capacity = queue->capacity ? queue->capacity * 2 : 64;
+			char** paths = (char**) realloc(queue->paths, capacity * sizeof(char*));
+			if (unlikely(!paths)) {
+				pthread_mutex_unlock(&queue->mutex);
+				scanner->builders[index].failed = true;
+				free(path);
+				return;
+			}
+			queue->paths = paths;
+			queue->capacity = capacity;
+		}
+	}
+	queue->paths[queue->tail++] = path;
+	__atomic_add_fetch(&scanner->pending, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Owner takes the newest one (stays close to what it just read), thieves take the oldest one (biggest subtree)
+static char* tagsTake(struct tagsQueue* queue, const bool steal) {
+	char* path = NULL;
+	pthread_mutex_lock(&queue->mutex);
+	if (queue->head < queue->tail) {
+		path = steal ? queue->paths[queue->head++] : queue->paths[--queue->tail];
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return path;
+}
+
+static void tagsScanDirectory(struct tagsScanner* scanner, const unsigned int index, const char* path) {
+	struct libraryBuilder* builder = &scanner->builders[index];
+	char fullPath[strlen(musicPath) + strlen(path) + 1];
+	snprintf(fullPath, sizeof(fullPath), "%s%s", musicPath, path);
+	DIR* dir = opendir(fullPath);
+	struct stat st = {0};
+	if (dir == NULL || fstat(dirfd(dir), &st) == -1) {
+		if (dir != NULL) {
+			closedir(dir);
+		}
+		return;
+	}
+	libraryBuilderDirectory(builder, path, st.st_mtim.tv_sec);
+	unsigned int depth = 0;
+	for (const char* slash = path; (slash = strchr(slash, '/')) != NULL; ++slash) {
+		++depth;
+	}
+	struct tagsFields fields;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL && !builder->failed) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char childPath[strlen(path) + 1 + strlen(entry->d_name) + 1];
+		snprintf(childPath, sizeof(childPath), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+		bool directory = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+			directory = fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+		if (directory) {
+			char* child = depth < LIBRARY_WALK_MAX_DEPTH ? strdup(childPath) : NULL;
+			if (child != NULL) {
+				tagsPush(scanner, index, child);
+			}
+		} else if (tagsReadFile(dirfd(dir), entry->d_name, &fields)) {
+			struct libraryRecord* record = libraryBuilderRecord(builder);
+			if (record != NULL) {
+				record->file = libraryBuilderString(builder, childPath, false);
+				record->artist = libraryBuilderString(builder, fields.artist, true);
+				record->album = libraryBuilderString(builder, fields.album, true);
+				record->title = libraryBuilderString(builder, fields.title, false);
+				record->comment = libraryBuilderString(builder, fields.comment, true);
+				record->genre = libraryBuilderString(builder, fields.genre, true);
+				record->time = fields.time;
+			}
+		}
+	}
+	closedir(dir);
+}
+
+static void *tagsWorker(void *args) {
+	struct tagsScanner* scanner = ((struct tagsWorkerArgs*) args)->scanner;
+	const unsigned int index = ((struct tagsWorkerArgs*) args)->index;
+	while (true) {
+		char* path = tagsTake(&scanner->queues[index], false);
+		for (unsigned int i = 1; path == NULL && i < scanner->workers; ++i) {
+			path = tagsTake(&scanner->queues[(index + i) % scanner->workers], true);
+		}
+		if (path == NULL) {
+			if (__atomic_load_n(&scanner->pending, __ATOMIC_ACQUIRE) == 0) {
+				break;
+			}
+			usleep(100); // Somebody is still reading a directory that may give us more work
+			continue;
+		}
+		if (__atomic_load_n(scanner->keepGoing, __ATOMIC_RELAXED)) {
+			tagsScanDirectory(scanner, index, path);
+		}
+		free(path);
+		__atomic_sub_fetch(&scanner->pending, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+// Whole library from files alone, dbUpdate is 0 so the first time MPD answers it gets loaded properly
+static struct library* tagsScan(const bool* keepGoing) {
+	TRACE_SPAN("file", __func__);
+	struct tagsScanner* scanner = (struct tagsScanner*) calloc(1, sizeof(struct tagsScanner));
+	if (unlikely(!scanner)) {
+		return NULL;
+	}
+	const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	scanner->workers = processors < 1 ? 1 : processors > TAGS_MAX_WORKERS ? TAGS_MAX_WORKERS : processors;
+	scanner->keepGoing = keepGoing;
+	bool success = true;
+	for (unsigned int i = 0; i < scanner->workers; ++i) {
+		pthread_mutex_init(&scanner->queues[i].mutex, NULL);
+		success = libraryBuilderInit(&scanner->builders[i]) && success;
+	}
+	char* root = strdup("");
+	if (success && likely(root != NULL)) {
+		tagsPush(scanner, 0, root);
+	} else {
+		free(root);
+		success = false;
+	}
+
+	pthread_t threads[TAGS_MAX_WORKERS];
+	struct tagsWorkerArgs args[TAGS_MAX_WORKERS];
+	unsigned int started = 0;
+	for (; success && started < scanner->workers; ++started) {
+		args[started].scanner = scanner;
+		args[started].index = started;
+		if (unlikely(pthread_create(&threads[started], NULL, &tagsWorker, (void*) &args[started]))) {
+			break;
+		}
+	}
+	if (started == 0 && success) { // No threads, do it ourselves
+		args[0].scanner = scanner;
+		args[0].index = 0;
+		tagsWorker((void*) &args[0]);
+	}
+	for (unsigned int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Every worker has its own part, put them together
+	struct libraryBuilder builder;
+	success = success && __atomic_load_n(keepGoing, __ATOMIC_RELAXED) && libraryBuilderInit(&builder);
+	for (unsigned int i = 0; i < scanner->workers; ++i) {
+		const struct library* part = scanner->builders[i].library;
+		if (success && !scanner->builders[i].failed) {
+			for (uint32_t j = 0; j < part->count; ++j) {
+				libraryBuilderCopy(&builder, part, &part->records[j]);
+			}
+			for (uint32_t j = 0; j < part->directoriesCount; ++j) {
+				libraryBuilderDirectory(&builder, libraryString(part, part->directories[j].path), part->directories[j].modified);
+			}
+		} else if (success) {
+			success = false;
+			libraryBuilderFinish(&builder, false);
+		}
+		if (part != NULL) {
+			libraryBuilderFinish(&scanner->builders[i], false);
+		}
+		for (unsigned int j = scanner->queues[i].head; j < scanner->queues[i].tail; ++j) { // Left there if we gave up
+			free(scanner->queues[i].paths[j]);
+		}
+		free(scanner->queues[i].paths);
+		pthread_mutex_destroy(&scanner->queues[i].mutex);
+	}
+	free(scanner);
+	return success ? libraryBuilderFinish(&builder, true) : NULL;
+}
+
+// Library from files when MPD can't give us one, false if there's nothing there either
+static bool libraryScan(const bool* keepGoing) {
+	const uint64_t start = metricsNow();
+	struct library* library = tagsScan(keepGoing);
+	if (library == NULL || library->count == 0) {
+		if (library != NULL) {
+			libraryFree(library);
+		}
+		return false;
+	}
+	char message[128];
+	snprintf(message, sizeof(message), "Library scanned from files: %" PRIu32 " songs in %.1f ms", library->count, (metricsNow() - start) / 1000.0);
+	logToConsole(message);
+	libraryIndex(library);
+	librarySave(library);
+	libraryPublish(library);
+	return true;
+}
+
+/*
+ * Small text files (themes, favs) kept in memory as lines. Every use costs one stat(),
+ * file is read again only if it's a different file (rename()) or it was modified since.
+ */
+struct lineCache {
+	char* data;
+	char** lines;
+	char* keysData;
+	char** keys; // searchKey() of every line
+	unsigned int count;
+	ino_t inode;
+	off_t size;
+	struct timespec modified;
+	bool loaded;
+};
+
+static void lineCacheFree(struct lineCache* cache) {
+	free(cache->data);
+	free(cache->lines);
+	free(cache->keysData);
+	free(cache->keys);
+	memset(cache, 0, sizeof(*cache));
+}
+
+// Missing file is fine and results in no lines, false means an error which was already reported
+static bool lineCacheLoad(struct lineCache* cache, const char* path, const metricCounter hit, const metricCounter miss) {
+	struct stat st = {0};
+	if (stat(path, &st) == -1) {
+		if (unlikely(errno != ENOENT)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("stat() error");
+			return false;
+		}
+		if (cache->loaded && cache->inode == 0) { // Still doesn't exist
+			metricsCount(hit);
+			return true;
+		}
+		metricsCount(miss);
+		lineCacheFree(cache);
+		cache->loaded = true;
+		return true;
+	}
+	if (cache->loaded && cache->inode == st.st_ino && cache->size == st.st_size && cache->modified.tv_sec == st.st_mtim.tv_sec && cache->modified.tv_nsec == st.st_mtim.tv_nsec) {
+		metricsCount(hit);
+		return true;
+	}
+	metricsCount(miss);
+	lineCacheFree(cache);
+	FILE* stream = fopen(path, "r");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("fopen() error");
+		return false;
+	}
+	cache->data = (char*) malloc(st.st_size + 1);
+	if (unlikely(!cache->data)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("malloc() error");
+		fclose(stream);
+		return false;
+	}
+	const size_t read = fread(cache->data, 1, st.st_size, stream);
+	fclose(stream);
+	if (unlikely(read != (size_t) st.st_size)) { // Somebody truncated it under our hands
+		sendErrorToChannel("fread() error");
+		lineCacheFree(cache);
+		return false;
+	}
+	cache->data[read] = '\0';
+	unsigned int lines = 0;
+	for (size_t i = 0; i < read; ++i) {
+		if (cache->data[i] == '\n') {
+			++lines;
+		}
+	}
+	cache->lines = (char**) malloc((lines + 1) * sizeof(char*));
+	cache->keysData = (char*) malloc(read + 1); // Keys are never longer than lines
+	cache->keys = (char**) malloc((lines + 1) * sizeof(char*));
+	if (unlikely(!cache->lines || !cache->keysData || !cache->keys)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("malloc() error");
+		lineCacheFree(cache);
+		return false;
+	}
+	for (char* line = cache->data; *line; ) {
+		char* next = line + strcspn(line, "\n");
+		const bool last = *next == '\0';
+		*next = '\0';
+		line[strcspn(line, "\r")] = 0; // Make sure that there are no newlines
+		cache->lines[cache->count++] = line;
+		if (last) {
+			break;
+		}
+		line = next + 1;
+	}
+	char* key = cache->keysData;
+	for (unsigned int i = 0; i < cache->count; ++i) {
+		cache->keys[i] = key;
+		key += searchKey(key, cache->lines[i]) + 1;
+	}
+	cache->inode = st.st_ino;
+	cache->size = st.st_size;
+	cache->modified = st.st_mtim;
+	cache->loaded = true;
+	return true;
+}
+
+static pthread_mutex_t themesMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct lineCache themesCache;
+
+// Caller holds themesMutex
+static struct lineCache* themesGet() {
+	return lineCacheLoad(&themesCache, themeFile, METRIC_THEMES_HITS, METRIC_THEMES_MISSES) ? &themesCache : NULL;
+}
+
+// Copy of the first theme matching regex goes to *theme (NULL if none, caller frees), false if there are no themes at all
+static bool themesFind(const char* regex, char** theme) {
+	*theme = NULL;
+	struct searchQuery query;
+	if (!searchQueryInit(&query, regex)) {
+		return false;
+	}
+	pthread_mutex_lock(&themesMutex);
+	const struct lineCache* themes = themesGet();
+	if (unlikely(!themes)) {
+		pthread_mutex_unlock(&themesMutex);
+		searchQueryFree(&query);
+		return false;
+	}
+	const unsigned int count = themes->count;
+	for (unsigned int i = 0; i < count; ++i) {
+		if (searchQueryMatch(&query, themes->lines[i], strlen(themes->lines[i]), themes->keys[i], strlen(themes->keys[i]))) {
+			if (unlikely(!(*theme = strdup(themes->lines[i])))) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("strdup() error");
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&themesMutex);
+	searchQueryFree(&query);
+	if (count == 0) {
+		sendMessageToChannel("No themes added yet! 8)");
+		return false;
+	}
+	return true;
+}
+
+#define FAVS_CACHE_SIZE 64 // Users whose favs we keep in memory
+
+struct favsCacheEntry {
+	char uid[64];
+	uint64_t lastUsed;
+	struct lineCache favs;
+};
+
+static pthread_mutex_t favsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct favsCacheEntry favsCache[FAVS_CACHE_SIZE];
+static uint64_t favsCacheClock = 0;
+
+// Caller holds favsMutex, NULL means an error which was already reported
+static struct lineCache* favsGet(const char* uid) {
+	static struct lineCache noFavs = { .loaded = true };
+	if (strlen(uid) >= sizeof(favsCache[0].uid)) { // Can't be a valid UID
+		return &noFavs;
+	}
+	struct favsCacheEntry* entry = &favsCache[0];
+	for (unsigned int i = 0; i < FAVS_CACHE_SIZE; ++i) {
+		if (strcmp(favsCache[i].uid, uid) == 0) {
+			entry = &favsCache[i];
+			break;
+		}
+		if (favsCache[i].lastUsed < entry->lastUsed) { // Least recently used one goes away if we don't find it
+			entry = &favsCache[i];
+		}
+	}
+	if (strcmp(entry->uid, uid) != 0) {
+		lineCacheFree(&entry->favs);
+		strcpy(entry->uid, uid);
+	}
+	entry->lastUsed = ++favsCacheClock;
+	char favFile[strlen(favPath) + strlen(uid) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, uid, ".txt");
+	return lineCacheLoad(&entry->favs, favFile, METRIC_FAVS_HITS, METRIC_FAVS_MISSES) ? &entry->favs : NULL;
+}
+
+struct clientsCacheEntry {
+	anyID id;
+	char nickname[128];
+	char uid[64];
+};
+
+static pthread_mutex_t clientsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct clientsCacheEntry* clientsCache = NULL;
+static unsigned int clientsCacheCount = 0;
+
+// Caller holds clientsMutex
+static bool clientsRefresh() {
+	TRACE_SPAN("ts3", __func__);
+	const uint64 serverConnectionHandlerID = __atomic_load_n(&myServerConnectionHandlerID, __ATOMIC_RELAXED); // Lanes call it too
+	anyID *clients;
+	if (unlikely(ts3Functions.getClientList(serverConnectionHandlerID, &clients) != ERROR_ok)) {
+		sendErrorToChannel("getClientList() error");
+		return false;
+	}
+	unsigned int count = 0;
+	while (clients[count] != 0) {
+		++count;
+	}
+	struct clientsCacheEntry* cache = (struct clientsCacheEntry*) calloc(count + 1, sizeof(struct clientsCacheEntry));
+	if (unlikely(!cache)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("calloc() error");
+		ts3Functions.freeMemory(clients);
+		return false;
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		char* clientName = NULL;
+		char* clientUID = NULL;
+		if (unlikely(ts3Functions.getClientVariableAsString(serverConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName) != ERROR_ok || ts3Functions.getClientVariableAsString(serverConnectionHandlerID, clients[i], CLIENT_UNIQUE_IDENTIFIER, &clientUID) != ERROR_ok)) {
+			sendErrorToChannel("getClientVariableAsString() error");
+			if (clientName != NULL) {
+				ts3Functions.freeMemory(clientName);
+			}
+			free(cache);
+			ts3Functions.freeMemory(clients);
+			return false;
+		}
+		cache[i].id = clients[i];
+		_strcpy(cache[i].nickname, sizeof(cache[i].nickname), clientName);
+		_strcpy(cache[i].uid, sizeof(cache[i].uid), clientUID);
+		ts3Functions.freeMemory(clientName);
+		ts3Functions.freeMemory(clientUID);
+	}
+	ts3Functions.freeMemory(clients);
+	free(clientsCache);
+	clientsCache = cache;
+	clientsCacheCount = count;
+	return true;
+}
+
+// Caller holds clientsMutex, returns 0 if there's nobody with such nickname
+static anyID clientsFind(const char* nickname) {
+	for (unsigned int i = 0; i < clientsCacheCount; ++i) {
+		if (strcasecmp(nickname, clientsCache[i].nickname) == 0) {
+			// Client IDs are reused, make sure that it's still the same person
+			char* clientName = NULL;
+			if (likely(ts3Functions.getClientVariableAsString(__atomic_load_n(&myServerConnectionHandlerID, __ATOMIC_RELAXED), clientsCache[i].id, CLIENT_NICKNAME, &clientName) == ERROR_ok)) {
+				const bool same = strcmp(clientName, clientsCache[i].nickname) == 0;
+				ts3Functions.freeMemory(clientName);
+				if (same) {
+					metricsCount(METRIC_CLIENTS_HITS);
+					return clientsCache[i].id;
+				}
+			}
+			break;
+		}
+	}
+	metricsCount(METRIC_CLIENTS_MISSES);
+	if (unlikely(!clientsRefresh())) {
+		return 0;
+	}
+	for (unsigned int i = 0; i < clientsCacheCount; ++i) {
+		if (strcasecmp(nickname, clientsCache[i].nickname) == 0) {
+			return clientsCache[i].id;
+		}
+	}
+	return 0;
+}
+
+static void addToPlaylist(const char* path) {
+	if (likely(spawnWithOutputToChannel((char*[]) {"mpc", "add", (char*) path, NULL}, true))) { // No shell, names may have anything in them
+		sendMessageToChannel_2("Added: ", path);
+	}
+}
+
+/*
+ * Field queries: space separated terms like `artist:foo title:"bar baz" theme:chill -live`, every term has to match
+ * (negated ones must not), term without a field looks in paths, value can be a /regex/ too. Input using none of that
+ * is one plain search through paths, spaces and all, same as always.
+ */
+
+#define SEARCH_MAX_TERMS 16
+// mpc format with every searchField, in their order, for when we have to ask mpc
+#define SEARCH_PLAN_FORMAT "\"%file%\t[%artist%]\t[%album%]\t[%title%]\t[%comment%]\""
+
+struct searchTerm {
+	searchField field;
+	bool negated;
+	struct searchQuery query;
+};
+
+struct searchPlan {
+	struct searchTerm terms[SEARCH_MAX_TERMS];
+	unsigned int count;
+	bool fielded; // Uses any of the syntax above, otherwise there's just one plain term
+};
+
+// Length of the term's value at input, which is after "field:" and "-"
+static size_t searchPlanValueLength(const char* input, bool* quoted) {
+	*quoted = input[0] == '"' && strchr(input + 1, '"') != NULL;
+	if (*quoted) {
+		return strchr(input + 1, '"') - input + 1;
+	}
+	if (input[0] == '/') { // Regexes may have spaces, they end with '/' and flags followed by space
+		for (size_t i = 1; input[i]; ++i) {
+			if (input[i] == '\\' && input[i + 1]) {
+				++i;
+			} else if (input[i] == '/') {
+				const size_t end = i + 1 + strspn(input + i + 1, "i");
+				if (input[end] == '\0' || input[end] == ' ') {
+					return end;
+				}
+			}
+		}
+	}
+	return strcspn(input, " ");
+}
+
+// Field named at input, followed by ':', SEARCH_FIELDS if there's none
+static searchField searchPlanField(const char* input, size_t* length) {
+	for (unsigned int field = 0; field < SEARCH_FIELDS; ++field) {
+		*length = strlen(searchFieldNames[field]);
+		if (strncasecmp(input, searchFieldNames[field], *length) == 0 && input[*length] == ':') {
+			++*length;
+			return field;
+		}
+	}
+	*length = 0;
+	return SEARCH_FIELDS;
+}
+
+static void searchPlanFree(struct searchPlan* plan) {
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		searchQueryFree(&plan->terms[i].query);
+	}
+	plan->count = 0;
+}
+
+// Plan of one plain substring search through paths, even if input looks like anything else, false (already reported) on error
+static bool searchPlanInitSubstring(struct searchPlan* plan, const char* input) {
+	plan->fielded = false;
+	plan->terms[0].field = SEARCH_FIELD_PATH;
+	plan->terms[0].negated = false;
+	plan->count = searchQueryInitSubstring(&plan->terms[0].query, input) ? 1 : 0;
+	return plan->count == 1;
+}
+
+// false (already reported) if input isn't a valid query
+static bool searchPlanInit(struct searchPlan* plan, const char* input) {
+	plan->count = 0;
+	plan->fielded = false;
+	struct {
+		searchField field;
+		bool negated;
+		bool quoted;
+		const char* value;
+		size_t length;
+	} terms[SEARCH_MAX_TERMS + 1]; // Last one is a scratch for words past the limit, plain search may have any number of them
+	unsigned int count = 0;
+	bool tooMany = false;
+	for (const char* cursor = input + strspn(input, " "); *cursor; cursor += strspn(cursor, " ")) {
+		tooMany = tooMany || count == SEARCH_MAX_TERMS;
+		terms[count].negated = cursor[0] == '-' && cursor[1] && cursor[1] != ' ';
+		cursor += terms[count].negated;
+		size_t length;
+		terms[count].field = searchPlanField(cursor, &length);
+		cursor += length;
+		terms[count].value = cursor;
+		terms[count].length = searchPlanValueLength(cursor, &terms[count].quoted);
+		plan->fielded = plan->fielded || terms[count].negated || terms[count].quoted || terms[count].field != SEARCH_FIELDS;
+		cursor += terms[count].length;
+		count += count < SEARCH_MAX_TERMS;
+	}
+	if (plan->fielded && tooMany) {
+		sendMessageToChannel("Too many search terms! :-(");
+		return false;
+	}
+	if (!plan->fielded) {
+		plan->terms[0].field = SEARCH_FIELD_PATH;
+		plan->terms[0].negated = false;
+		plan->count = searchQueryInit(&plan->terms[0].query, input) ? 1 : 0;
+		return plan->count == 1;
+	}
+	for (unsigned int i = 0; i < count; ++i) {
+		const size_t length = terms[i].quoted ? terms[i].length - 2 : terms[i].length;
+		char value[length + 1];
+		memcpy(value, terms[i].value + terms[i].quoted, length);
+		value[length] = '\0';
+		struct searchTerm* term = &plan->terms[plan->count];
+		term->field = terms[i].field != SEARCH_FIELDS ? terms[i].field : SEARCH_FIELD_PATH;
+		term->negated = terms[i].negated;
+		if (!(terms[i].quoted ? searchQueryInitSubstring(&term->query, value) : searchQueryInit(&term->query, value))) {
+			searchPlanFree(plan);
+			return false;
+		}
+		++plan->count;
+	}
+	return true;
+}
+
+// Whether any of the terms had to give up, so results may be incomplete
+static bool searchPlanGaveUp(const struct searchPlan* plan) {
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		if (plan->terms[i].query.gaveUp) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether fields (in searchField order, keys may be NULL) have everything plan asks for and nothing it negates
+static bool searchPlanMatchFields(struct searchPlan* plan, const char* const* texts, const size_t* lengths, const char* const* keys, const size_t* keyLengths) {
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		const searchField field = plan->terms[i].field;
+		if (searchQueryMatch(&plan->terms[i].query, texts[field], lengths[field], keys[field], keyLengths[field]) == plan->terms[i].negated) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Same for a line printed by mpc, with SEARCH_PLAN_FORMAT if plan is fielded, otherwise with whatever caller wanted
+static bool searchPlanMatchLine(struct searchPlan* plan, const char* line) {
+	const size_t length = strcspn(line, "\r\n");
+	if (!plan->fielded) {
+		return searchQueryMatch(&plan->terms[0].query, line, length, NULL, 0);
+	}
+	const char* texts[SEARCH_FIELDS];
+	size_t lengths[SEARCH_FIELDS];
+	const char* keys[SEARCH_FIELDS] = {NULL};
+	size_t keyLengths[SEARCH_FIELDS] = {0};
+	const char* field = line;
+	for (unsigned int i = 0; i < SEARCH_FIELDS; ++i) {
+		texts[i] = field;
+		lengths[i] = field < line + length ? strcspn(field, "\t\r\n") : 0;
+		field += lengths[i] + (field < line + length);
+	}
+	if (lengths[SEARCH_FIELD_ARTIST] == 0) { // Untagged, same as in libraryField()
+		texts[SEARCH_FIELD_ARTIST] = texts[SEARCH_FIELD_PATH];
+		lengths[SEARCH_FIELD_ARTIST] = strcspn(texts[SEARCH_FIELD_PATH], "/\t\r\n");
+	}
+	return searchPlanMatchFields(plan, texts, lengths, keys, keyLengths);
+}
+
+// Same for record i of library
+static bool libraryPlanMatch(const struct library* library, const uint32_t i, struct searchPlan* plan) {
+	const char* texts[SEARCH_FIELDS];
+	size_t lengths[SEARCH_FIELDS];
+	const char* keys[SEARCH_FIELDS];
+	size_t keyLengths[SEARCH_FIELDS];
+	for (unsigned int field = 0; field < SEARCH_FIELDS; ++field) {
+		texts[field] = libraryField(library, &library->records[i], field, &lengths[field], &keys[field], &keyLengths[field]);
+	}
+	return searchPlanMatchFields(plan, texts, lengths, keys, keyLengths);
+}
+
+static int libraryCompareCounts(const void* a, const void* b) {
+	const uint32_t countA = *(const uint32_t*) a;
+	const uint32_t countB = *(const uint32_t*) b;
+	return countA < countB ? -1 : countA > countB;
+}
+
+/*
+ * Records which may match plan: candidates of its rarest positive term intersected with those of the other ones,
+ * same as libraryCandidates(), but if *owned isn't NULL, the list is ours, in the arena.
+ * Negated terms can't narrow anything down, lists have false positives, so they're left for libraryPlanMatch().
+ */
+static const uint32_t* libraryPlanCandidates(const struct library* library, const struct searchPlan* plan, uint32_t* count, uint32_t** owned) {
+	*owned = NULL;
+	struct {
+		uint32_t count; // First, so libraryCompareCounts() sorts by it
+		const uint32_t* list;
+	} lists[SEARCH_MAX_TERMS];
+	unsigned int listsCount = 0;
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		const struct searchQuery* query = &plan->terms[i].query;
+		if (!plan->terms[i].negated) {
+			lists[listsCount].list = libraryCandidates(library, plan->terms[i].field, query->regex != NULL ? query->regex->literal : query->key, &lists[listsCount].count);
+			listsCount += lists[listsCount].list != NULL;
+		}
+	}
+	*count = library->count;
+	if (listsCount == 0) {
+		return NULL;
+	}
+	qsort(lists, listsCount, sizeof(lists[0]), libraryCompareCounts);
+	*count = lists[0].count;
+	if (listsCount == 1 || *count == 0 || unlikely(!(*owned = (uint32_t*) arenaAlloc(*count * sizeof(uint32_t))))) {
+		return lists[0].list; // Still right if we couldn't get memory, just not as short
+	}
+	memcpy(*owned, lists[0].list, *count * sizeof(uint32_t));
+	for (unsigned int i = 1; i < listsCount && *count != 0; ++i) {
+		uint32_t kept = 0;
+		uint32_t k = 0;
+		for (uint32_t j = 0; j < *count; ++j) {
+			while (k < lists[i].count && lists[i].list[k] < (*owned)[j]) {
+				++k;
+			}
+			if (k < lists[i].count && lists[i].list[k] == (*owned)[j]) {
+				(*owned)[kept++] = (*owned)[j];
+			}
+		}
+		*count = kept;
+	}
+	return *owned;
+}
+
+// "Did you mean" replies for key which matched nothing exactly
+static void librarySuggest(const struct library* library, const char* key, const bool artists) {
+	struct searchFuzzyResult matches[SEARCH_SUGGESTIONS];
+	const unsigned int count = libraryFuzzy(library, key, artists, matches, SEARCH_SUGGESTIONS);
+	for (unsigned int i = 0; i < count; ++i) {
+		const char* file = libraryString(library, library->records[matches[i].record].file);
+		const int length = artists ? (int) strcspn(file, "/") : (int) strlen(file);
+		char message[14 + length + 1 + 1];
+		snprintf(message, sizeof(message), "%s%.*s%s", "Did you mean: ", length, file, "?");
+		sendMessageToChannel(message);
+	}
+	if (count != 0) {
+		metricsCount(METRIC_SEARCH_SUGGESTIONS);
+	}
+}
+
+/*
+ * Results of recent searches, as record indexes, keyed by normalized query and generation of the library
+ * they're from, so they go stale by themselves whenever anything in the database changes.
+ */
+
+#define QUERY_CACHE_SIZE 32 // Searches whose results we keep
+#define QUERY_CACHE_MAX_RECORDS 16384 // Results longer than that aren't worth the memory
+
+static pthread_mutex_t queryCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	char* query;
+	uint64_t generation;
+	uint32_t* records;
+	uint32_t count;
+	uint64_t lastUsed;
+} queryCache[QUERY_CACHE_SIZE];
+static uint64_t queryCacheClock = 0;
+
+// What kind of search it is and whether it's fielded (plain ones only look at names) followed by its terms as they're
+// matched, regex or substring, so "LODZ" and "łódź" are the same query but "/x/" and /x/ aren't, in the arena, NULL if
+// that's full
+static char* queryCacheKey(const char* kind, const struct searchPlan* plan) {
+	const char* mode = plan->fielded ? "fielded" : "plain";
+	size_t length = strlen(kind) + 1 + strlen(mode) + 1;
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		const struct searchQuery* query = &plan->terms[i].query;
+		length += 5 + strlen(searchFieldNames[plan->terms[i].field]) + strlen(query->regex != NULL ? query->regex->source : query->key);
+	}
+	char* key = (char*) arenaAlloc(length);
+	if (unlikely(!key)) {
+		return NULL;
+	}
+	size_t written = snprintf(key, length, "%s %s", kind, mode);
+	for (unsigned int i = 0; i < plan->count; ++i) {
+		const struct searchQuery* query = &plan->terms[i].query;
+		written += snprintf(key + written, length - written, "\n%s%s:%s:%s", plan->terms[i].negated ? "-" : "", searchFieldNames[plan->terms[i].field], query->regex != NULL ? "r" : "s", query->regex != NULL ? query->regex->source : query->key);
+	}
+	return key;
+}
+
+static void queryCacheEvict(const unsigned int i) {
+	free(queryCache[i].query);
+	free(queryCache[i].records);
+	queryCache[i].query = NULL;
+	queryCache[i].records = NULL;
+	queryCache[i].lastUsed = 0;
+}
+
+// Copy of cached results of query in the arena, false if there are none for library of that generation
+static bool queryCacheFind(const char* query, const uint64_t generation, uint32_t** records, uint32_t* count) {
+	pthread_mutex_lock(&queryCacheMutex);
+	for (unsigned int i = 0; i < QUERY_CACHE_SIZE; ++i) {
+		if (queryCache[i].query == NULL) {
+			continue;
+		}
+		if (queryCache[i].generation != generation) {
+			queryCacheEvict(i); // Library changed since
+		} else if (strcmp(queryCache[i].query, query) == 0) {
+			*records = (uint32_t*) arenaAlloc(queryCache[i].count * sizeof(uint32_t) + 1);
+			if (unlikely(!*records)) {
+				break;
+			}
+			memcpy(*records, queryCache[i].records, queryCache[i].count * sizeof(uint32_t));
+			*count = queryCache[i].count;
+			queryCache[i].lastUsed = ++queryCacheClock;
+			pthread_mutex_unlock(&queryCacheMutex);
+			metricsCount(METRIC_QUERIES_HITS);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&queryCacheMutex);
+	metricsCount(METRIC_QUERIES_MISSES);
+	return false;
+}
+
+// Keeps a copy of results, evicting the ones not used for the longest time
+static void queryCacheStore(const char* query, const uint64_t generation, const uint32_t* records, const uint32_t count) {
+	if (count > QUERY_CACHE_MAX_RECORDS) {
+		return;
+	}
+	char* queryCopy = strdup(query);
+	uint32_t* recordsCopy = (uint32_t*) malloc(count * sizeof(uint32_t) + 1);
+	if (unlikely(!queryCopy || !recordsCopy)) {
+		free(queryCopy);
+		free(recordsCopy);
+		return;
+	}
+	memcpy(recordsCopy, records, count * sizeof(uint32_t));
+	pthread_mutex_lock(&queryCacheMutex);
+	unsigned int slot = 0;
+	for (unsigned int i = 0; i < QUERY_CACHE_SIZE; ++i) {
+		if (queryCache[i].query != NULL && strcmp(queryCache[i].query, query) == 0) {
+			slot = i; // Somebody was faster
+			break;
+		}
+		if (queryCache[i].lastUsed < queryCache[slot].lastUsed) {
+			slot = i;
+		}
+	}
+	queryCacheEvict(slot);
+	queryCache[slot].query = queryCopy;
+	queryCache[slot].generation = generation;
+	queryCache[slot].records = recordsCopy;
+	queryCache[slot].count = count;
+	queryCache[slot].lastUsed = ++queryCacheClock;
+	pthread_mutex_unlock(&queryCacheMutex);
+}
+
+static void queryCacheFree() {
+	pthread_mutex_lock(&queryCacheMutex);
+	for (unsigned int i = 0; i < QUERY_CACHE_SIZE; ++i) {
+		queryCacheEvict(i);
+	}
+	pthread_mutex_unlock(&queryCacheMutex);
+}
+
+/*
+ * Every record matching plan, or with artists the first matching one of every top-level directory (plain searches
+ * look only at directory names then). Comes from queryCache if it can, lives in the arena, NULL if that's full.
+ */
+static uint32_t* libraryPlanFind(const struct library* library, struct searchPlan* plan, const bool artists, uint32_t* found) {
+	char* query = queryCacheKey(artists ? "artists" : "files", plan);
+	uint32_t* records;
+	if (query != NULL && queryCacheFind(query, library->generation, &records, found)) {
+		return records;
+	}
+	TRACE_SPAN("search", __func__);
+	uint32_t count;
+	uint32_t* owned;
+	const uint32_t* candidates = libraryPlanCandidates(library, plan, &count, &owned);
+	if (unlikely(!(records = (uint32_t*) arenaAlloc(count * sizeof(uint32_t) + 1)))) {
+		return NULL;
+	}
+	*found = 0;
+	const char* previous = "";
+	size_t previousLength = 0;
+	for (uint32_t j = 0; j < count && !searchPlanGaveUp(plan); ++j) {
+		const uint32_t i = candidates != NULL ? candidates[j] : j;
+		if (!artists) {
+			if (libraryPlanMatch(library, i, plan)) {
+				records[(*found)++] = i;
+			}
+			continue;
+		}
+		const char* file = libraryString(library, library->records[i].file);
+		const size_t length = strcspn(file, "/");
+		if (length == previousLength && strncmp(file, previous, length) == 0) {
+			continue; // Songs of the same directory come one after another, candidates too, it's checked (or found) already
+		}
+		bool matches;
+		if (plan->fielded) {
+			matches = libraryPlanMatch(library, i, plan);
+		} else {
+			const char* fileKey = libraryString(library, library->records[i].fileKey);
+			matches = searchQueryMatch(&plan->terms[0].query, file, length, fileKey, strcspn(fileKey, "/")); // Folding never makes nor eats slashes
+		}
+		if (matches || !plan->fielded) {
+			previous = file;
+			previousLength = length;
+		}
+		if (matches) {
+			records[(*found)++] = i;
+		}
+	}
+	if (query != NULL && !searchPlanGaveUp(plan)) { // Results cut short aren't worth keeping
+		queryCacheStore(query, library->generation, records, *found);
+	}
+	return records;
+}
+
+static bool playlistAdd(const char* const* files, const uint32_t count, const bool clear, const bool play);
+
+// Fast path of addFile()/getFile()/addSong()/getSong() and, with artists, of addArtist()/getArtist(), where artists are
+// top-level directories (and songs lying in the root), false if library isn't loaded and caller has to ask mpc.
+// Whatever is added goes to MPD together with play in one command list, one mpc per path only if MPD isn't there.
+static bool libraryFind(struct searchPlan* plan, const bool artists, const bool one, const bool add) {
+	struct library* library = libraryAcquire();
+	if (library == NULL) {
+		return false;
+	}
+	const struct arenaMark mark = arenaMark();
+	uint32_t count;
+	uint32_t* records = libraryPlanFind(library, plan, artists, &count);
+	if (unlikely(!records)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("arenaAlloc() error");
+		arenaRewind(mark);
+		libraryRelease(library);
+		return true;
+	}
+	const uint32_t wanted = one && count > 1 ? 1 : count;
+	const char** paths = add && wanted != 0 ? (const char**) arenaAlloc(wanted * sizeof(char*)) : NULL;
+	bool queued = false;
+	if (paths != NULL) {
+		bool complete = true;
+		for (uint32_t j = 0; j < wanted && complete; ++j) {
+			const char* file = libraryString(library, library->records[records[j]].file);
+			if (artists) {
+				const size_t length = strcspn(file, "/");
+				char* path = (char*) arenaAlloc(length + 1);
+				if (likely(path != NULL)) {
+					memcpy(path, file, length);
+					path[length] = '\0';
+				}
+				file = path;
+			}
+			paths[j] = file;
+			complete = file != NULL;
+		}
+		queued = complete && playlistAdd(paths, wanted, false, true);
+	}
+	for (uint32_t j = 0; j < wanted && !queued && !(add && laneCancelled()); ++j) {
+		const char* file = libraryString(library, library->records[records[j]].file);
+		const size_t length = artists ? strcspn(file, "/") : strlen(file);
+		char path[length + 1];
+		memcpy(path, file, length);
+		path[length] = '\0';
+		if (add) {
+			addToPlaylist(path);
+		} else {
+			sendMessageToChannel_2("Found: ", path);
+		}
+	}
+	arenaRewind(mark);
+	if (count == 0) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+		if (!plan->fielded && plan->terms[0].query.key != NULL) {
+			librarySuggest(library, plan->terms[0].query.key, artists);
+		}
+	}
+	libraryRelease(library);
+	if (count != 0 && add && !queued) {
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	}
+	return true;
+}
+
+/*
+ * Playlist planner: MPD's queue is mirrored here (ids and files) and brought up to date with plchanges since the
+ * version we saw last, so keeping it costs only as much as the queue changed. Switching to a target list takes the
+ * fewest edits: deleteid for what doesn't belong there, moveid for what's there but out of order (everything except
+ * the longest run that's in order already) and addid for what's missing, all in one command list unless it's huge.
+ * Song that's playing keeps playing if target has it.
+ */
+
+#define PLAYLIST_BATCH (512 * 1024) // Bytes of one command list, MPD refuses ones over 2 MB by default
+#define PLAYLIST_NONE UINT32_MAX
+#define PLAYLIST_DUPLICATE (UINT32_MAX - 1)
+#define PLAYLIST_STORED_SIZE 64 // Stored playlists we keep mirrored in memory
+#define PLAYLIST_STORED_PREFIX "ArchiTSMBot "
+
+struct playlistEntry {
+	uint32_t id;
+	char* file;
+};
+
+// Stored playlist as MPD has it, files in its order
+struct playlistStored {
+	char* name;
+	uint64_t lastUsed;
+	char** files;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+struct playlistBatch {
+	char* data;
+	size_t length;
+	size_t capacity;
+	bool failed;
+};
+
+static pthread_mutex_t playlistMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct playlistEntry* playlistMirror = NULL;
+static uint32_t playlistMirrorCount = 0;
+static uint32_t playlistMirrorCapacity = 0;
+static unsigned long playlistMirrorVersion = 0; // plchanges 0 is the whole queue
+static struct playlistStored playlistStoredCache[PLAYLIST_STORED_SIZE];
+static uint64_t playlistStoredClock = 0;
+
+// Caller holds playlistMutex
+static void playlistMirrorFree() {
+	for (uint32_t i = 0; i < playlistMirrorCount; ++i) {
+		free(playlistMirror[i].file);
+	}
+	free(playlistMirror);
+	playlistMirror = NULL;
+	playlistMirrorCount = playlistMirrorCapacity = 0;
+	playlistMirrorVersion = 0;
+}
+
+// Caller holds playlistMutex, new entries have no file until plchanges tells us
+static bool playlistMirrorResize(const uint32_t count) {
+	for (uint32_t i = count; i < playlistMirrorCount; ++i) {
+		free(playlistMirror[i].file);
+	}
+	if (count > playlistMirrorCapacity) {
+		struct playlistEntry* entries = (struct playlistEntry*) realloc(playlistMirror, count * sizeof(struct playlistEntry));
+		if (unlikely(!entries)) {
+			playlistMirrorCount = playlistMirrorCount < count ? playlistMirrorCount : count;
+			return false;
+		}
+		playlistMirror = entries;
+		playlistMirrorCapacity = count;
+	}
+	if (count > playlistMirrorCount) {
+		memset(playlistMirror + playlistMirrorCount, 0, (count - playlistMirrorCount) * sizeof(struct playlistEntry));
+	}
+	playlistMirrorCount = count;
+	return true;
+}
+
+// Caller holds playlistMutex, false (with connection->error) on failure, current is position of current song or -1
+static bool playlistMirrorRefresh(struct mpdConnection* connection, long* current, uint32_t* currentId, bool* playing) {
+	for (unsigned int attempt = 0; attempt < 2; ++attempt) {
+		char command[64];
+		snprintf(command, sizeof(command), "%s%lu%s", "command_list_begin\nstatus\nplchanges ", playlistMirrorVersion, "\ncommand_list_end\n");
+		if (unlikely(!mpdSend(connection, command))) {
+			return false;
+		}
+		unsigned long version = 0;
+		char* file = NULL;
+		uint32_t position = PLAYLIST_NONE;
+		bool failed = false;
+		*current = -1;
+		*playing = false;
+		char* key;
+		char* value;
+		int ret;
+		while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+			if (strcmp(key, "file") == 0) {
+				free(file);
+				file = strdup(value);
+			} else if (strcmp(key, "Pos") == 0) {
+				position = strtoul(value, NULL, 10);
+			} else if (strcmp(key, "Id") == 0) { // Last one of every song
+				if (position < playlistMirrorCount && file != NULL) {
+					free(playlistMirror[position].file);
+					playlistMirror[position].id = strtoul(value, NULL, 10);
+					playlistMirror[position].file = file;
+					file = NULL;
+				}
+				position = PLAYLIST_NONE;
+			} else if (strcmp(key, "playlistlength") == 0) {
+				failed |= !playlistMirrorResize(strtoul(value, NULL, 10));
+			} else if (strcmp(key, "playlist") == 0) {
+				version = strtoul(value, NULL, 10);
+			} else if (strcmp(key, "song") == 0) {
+				*current = strtol(value, NULL, 10);
+			} else if (strcmp(key, "songid") == 0) {
+				*currentId = strtoul(value, NULL, 10);
+			} else if (strcmp(key, "state") == 0) {
+				*playing = strcmp(value, "play") == 0;
+			}
+		}
+		free(file);
+		if (unlikely(ret != 0 || failed)) {
+			if (failed) {
+				snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+			}
+			playlistMirrorFree();
+			return false;
+		}
+		if (version >= playlistMirrorVersion) {
+			playlistMirrorVersion = version;
+			return true;
+		}
+		playlistMirrorFree(); // MPD was restarted and its versions started over, so we need all of it again
+	}
+	snprintf(connection->error, sizeof(connection->error), "%s", "MPD queue version keeps going back");
+	return false;
+}
+
+static void playlistBatchAppend(struct playlistBatch* batch, const char* command) {
+	const size_t length = strlen(command);
+	if (batch->length + length + 1 > batch->capacity) {
+		const size_t capacity = (batch->length + length + 1) * 2;
+		char* data = (char*) realloc(batch->data, capacity);
+		if (unlikely(!data)) {
+			batch->failed = true;
+			return;
+		}
+		batch->data = data;
+		batch->capacity = capacity;
+	}
+	memcpy(batch->data + batch->length, command, length + 1);
+	batch->length += length;
+}
+
+// Sends commands in batch as one command list and starts the next one, file of currentsong in it goes to file
+static bool playlistBatchSend(struct mpdConnection* connection, struct playlistBatch* batch, char** file) {
+	playlistBatchAppend(batch, "command_list_end\n");
+	if (unlikely(batch->failed)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+		return false;
+	}
+	if (unlikely(!mpdSend(connection, batch->data))) {
+		return false;
+	}
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (strcmp(key, "file") == 0) {
+			free(*file);
+			*file = strdup(value);
+		}
+	}
+	batch->length = 0;
+	playlistBatchAppend(batch, "command_list_begin\n");
+	return ret == 0;
+}
+
+// Adds command to batch, sending it first if it's big enough already
+static bool playlistBatchAdd(struct mpdConnection* connection, struct playlistBatch* batch, const char* command, char** file) {
+	if (batch->length + strlen(command) > PLAYLIST_BATCH && unlikely(!playlistBatchSend(connection, batch, file))) {
+		return false;
+	}
+	playlistBatchAppend(batch, command);
+	return true;
+}
+
+// Entries to move before kept entry k, Fenwick tree over kept entries
+static uint32_t playlistMovesBefore(const uint32_t* tree, uint32_t k) {
+	uint32_t sum = 0;
+	for (; k > 0; k -= k & -k) {
+		sum += tree[k];
+	}
+	return sum;
+}
+
+static void playlistMoved(uint32_t* tree, const uint32_t count, uint32_t k) {
+	for (++k; k <= count; k += k & -k) {
+		--tree[k];
+	}
+}
+
+// Slot of file in open addressing table of files (index + 1, 0 is empty), slot is empty if file isn't there
+static uint32_t playlistSlot(const uint32_t* slots, const uint32_t mask, const char* const* files, const char* file) {
+	uint32_t slot = libraryHash(file) & mask;
+	while (slots[slot] != 0 && strcmp(files[slots[slot] - 1], file) != 0) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Caller holds playlistMutex
+static void playlistStoredFree(struct playlistStored* stored) {
+	for (uint32_t i = 0; i < stored->count; ++i) {
+		free(stored->files[i]);
+	}
+	free(stored->files);
+	free(stored->name);
+	memset(stored, 0, sizeof(*stored));
+}
+
+// Stored playlist for favs or theme, name is made safe for MPD, which doesn't want slashes or newlines in there
+static void playlistStoredName(char* name, const size_t size, const char* kind, const char* id) {
+	snprintf(name, size, "%s%s%s%s", PLAYLIST_STORED_PREFIX, kind, " ", id);
+	for (char* c = name; *c; ++c) {
+		if (*c == '/' || *c == '\n' || *c == '\r') {
+			*c = '_';
+		}
+	}
+}
+
+// Caller holds playlistMutex, mirror of stored playlist read with listplaylist if we don't have it, NULL on failure
+static struct playlistStored* playlistStoredGet(struct mpdConnection* connection, const char* name) {
+	struct playlistStored* stored = &playlistStoredCache[0];
+	for (unsigned int i = 0; i < PLAYLIST_STORED_SIZE; ++i) {
+		if (playlistStoredCache[i].name != NULL && strcmp(playlistStoredCache[i].name, name) == 0) {
+			stored = &playlistStoredCache[i];
+			break;
+		}
+		if (playlistStoredCache[i].lastUsed < stored->lastUsed) { // Least recently used one goes away if we don't find it
+			stored = &playlistStoredCache[i];
+		}
+	}
+	stored->lastUsed = ++playlistStoredClock;
+	if (stored->name != NULL && strcmp(stored->name, name) == 0) {
+		metricsCount(METRIC_PLAYLISTS_HITS);
+		return stored;
+	}
+	metricsCount(METRIC_PLAYLISTS_MISSES);
+	playlistStoredFree(stored);
+	stored->lastUsed = playlistStoredClock;
+	if (unlikely(!(stored->name = strdup(name)))) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+		return NULL;
+	}
+	const struct arenaMark mark = arenaMark();
+	const char* command = mpdQuoted(connection, "listplaylist ", name, "\n");
+	const bool sent = command != NULL && mpdSend(connection, command);
+	arenaRewind(mark);
+	if (unlikely(!sent)) {
+		playlistStoredFree(stored);
+		return NULL;
+	}
+	bool failed = false;
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (strcmp(key, "file") == 0 && !failed) {
+			if (stored->count == stored->capacity) {
+				const uint32_t capacity = stored->capacity ? stored->capacity * 2 : 64;
+				char** files = (char**) realloc(stored->files, capacity * sizeof(char*));
+				if (unlikely(!files)) {
+					failed = true;
+					continue;
+				}
+				stored->files = files;
+				stored->capacity = capacity;
+			}
+			failed = !(stored->files[stored->count] = strdup(value));
+			stored->count += !failed;
+		}
+	}
+	if (ret != 0 && connection->fd != -1 && strncmp(connection->error, "ACK [50@", 8) == 0) { // It doesn't exist yet, playlistadd makes it
+		ret = 0;
+	}
+	if (unlikely(ret != 0 || failed)) {
+		if (failed) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+		}
+		playlistStoredFree(stored);
+		return NULL;
+	}
+	return stored;
+}
+
+/*
+ * Caller holds playlistMutex, adds edits making stored playlist files (duplicates once) to batch: playlistdelete for
+ * what's not in files anymore, from the end so positions stay right, and playlistadd for what's new, at the end.
+ * False (with connection->error) on failure, mirror isn't what MPD has then.
+ */
+static bool playlistStoredSync(struct mpdConnection* connection, struct playlistBatch* batch, struct playlistStored* stored, const char* const* files, const uint32_t count, char** file) {
+	uint32_t mask = 1;
+	while (mask < 2 * count) {
+		mask <<= 1;
+	}
+	if (stored->count + count > stored->capacity) {
+		char** grown = (char**) realloc(stored->files, (stored->count + count) * sizeof(char*));
+		if (unlikely(!grown)) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+			return false;
+		}
+		stored->files = grown;
+		stored->capacity = stored->count + count;
+	}
+	uint32_t* slots = (uint32_t*) calloc(mask + count, sizeof(uint32_t));
+	if (unlikely(!slots)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+		return false;
+	}
+	uint32_t* present = slots + mask;
+	--mask;
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t slot = playlistSlot(slots, mask, files, files[i]);
+		if (slots[slot] == 0) {
+			slots[slot] = i + 1;
+		} else {
+			present[i] = true; // Duplicate, it's there as the first one
+		}
+	}
+	char name[2 * strlen(stored->name) + 3];
+	mpdQuote(name, stored->name);
+	bool success = true;
+	for (uint32_t j = 0; j < stored->count; ++j) { // Of duplicates, the first one stays
+		const uint32_t slot = playlistSlot(slots, mask, files, stored->files[j]);
+		if (slots[slot] != 0 && !present[slots[slot] - 1]) {
+			present[slots[slot] - 1] = true;
+		} else {
+			free(stored->files[j]);
+			stored->files[j] = NULL;
+		}
+	}
+	for (uint32_t j = stored->count; j-- > 0 && success;) {
+		if (stored->files[j] == NULL) {
+			char command[15 + strlen(name) + 1 + 10 + 1 + 1];
+			snprintf(command, sizeof(command), "%s%s%s%" PRIu32 "%s", "playlistdelete ", name, " ", j, "\n");
+			success = playlistBatchAdd(connection, batch, command, file);
+		}
+	}
+	uint32_t left = 0;
+	for (uint32_t j = 0; j < stored->count; ++j) {
+		if (stored->files[j] != NULL) {
+			stored->files[left++] = stored->files[j];
+		}
+	}
+	stored->count = left;
+	for (uint32_t i = 0; i < count && success; ++i) {
+		if (present[i]) {
+			continue;
+		}
+		char command[12 + strlen(name) + 1 + 2 * strlen(files[i]) + 3 + 1 + 1];
+		snprintf(command, sizeof(command), "%s%s%s", "playlistadd ", name, " ");
+		mpdQuote(command + strlen(command), files[i]);
+		strcat(command, "\n");
+		success = playlistBatchAdd(connection, batch, command, file);
+		if (unlikely(!(stored->files[stored->count] = strdup(files[i])))) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+			success = false;
+		} else {
+			++stored->count;
+		}
+	}
+	free(slots);
+	return success;
+}
+
+/*
+ * Makes MPD's queue exactly files (in that order, duplicates once) and plays it, false if MPD isn't reachable and
+ * caller has to ask mpc. With announce, added files are listed followed by "---", current song comes last either way.
+ * Files should be in the database, MPD stops at the first one that isn't. With name, files are kept in that stored
+ * playlist too, in its order, and queue is loaded from it when most of it isn't queued already.
+ */
+static bool playlistPlay(const char* const* files, uint32_t count, const bool announce, const char* name) {
+	struct mpdConnection* connection = (struct mpdConnection*) malloc(sizeof(struct mpdConnection));
+	if (unlikely(!connection)) {
+		return false;
+	}
+	if (!mpdConnect(connection)) {
+		free(connection);
+		return false;
+	}
+	TRACE_SPAN("mpd", __func__);
+	pthread_mutex_lock(&playlistMutex);
+	long current = -1;
+	uint32_t currentId = 0;
+	bool playing = false;
+	bool success = playlistMirrorRefresh(connection, &current, &currentId, &playing);
+	struct playlistBatch batch = {0};
+	char* file = NULL;
+	playlistBatchAppend(&batch, "command_list_begin\n");
+	struct playlistStored* stored = NULL;
+	if (success && name != NULL) {
+		stored = playlistStoredGet(connection, name);
+		success = stored != NULL && playlistStoredSync(connection, &batch, stored, files, count, &file);
+		if (success) {
+			files = (const char* const*) stored->files;
+			count = stored->count;
+		}
+	}
+	const uint32_t queued = playlistMirrorCount;
+	uint32_t mask = 1;
+	while (mask < 2 * count) {
+		mask <<= 1;
+	}
+	uint32_t* memory = success ? (uint32_t*) malloc((mask + count + 7 * ((size_t) queued + 1)) * sizeof(uint32_t)) : NULL;
+	if (success && unlikely(!memory)) {
+		snprintf(connection->error, sizeof(connection->error), "%s", "malloc() error");
+		success = false;
+	}
+	if (success) {
+		uint32_t* slots = memory; // Target + 1, 0 is empty
+		uint32_t* claimed = slots + mask; // Kept entry of every target, PLAYLIST_NONE if it has to be added
+		uint32_t* keptTargets = claimed + count; // Kept entries in queue order
+		uint32_t* keptIds = keptTargets + queued + 1;
+		uint32_t* tails = keptIds + queued + 1;
+		uint32_t* previous = tails + queued + 1;
+		uint32_t* stable = previous + queued + 1;
+		uint32_t* tree = stable + queued + 1;
+		uint32_t* dropped = tree + queued + 1; // Of every queue entry
+		memset(slots, 0, mask * sizeof(uint32_t));
+		--mask;
+		for (uint32_t i = 0; i < count; ++i) {
+			const uint32_t slot = playlistSlot(slots, mask, files, files[i]);
+			claimed[i] = slots[slot] == 0 ? PLAYLIST_NONE : PLAYLIST_DUPLICATE;
+			if (slots[slot] == 0) {
+				slots[slot] = i + 1;
+			}
+		}
+		uint32_t kept = 0;
+		bool currentKept = false;
+		for (uint32_t j = 0; j < queued; ++j) {
+			uint32_t target = PLAYLIST_NONE;
+			if (playlistMirror[j].file != NULL) {
+				const uint32_t slot = playlistSlot(slots, mask, files, playlistMirror[j].file);
+				target = slots[slot] != 0 ? slots[slot] - 1 : PLAYLIST_NONE;
+			}
+			dropped[j] = target == PLAYLIST_NONE || claimed[target] != PLAYLIST_NONE;
+			if (!dropped[j]) {
+				claimed[target] = kept;
+				keptTargets[kept] = target;
+				keptIds[kept++] = playlistMirror[j].id;
+				currentKept |= (long) j == current;
+			}
+		}
+
+		if (stored != NULL && count - kept > count / 2) { // Whole stored playlist is one command for MPD
+			const struct arenaMark mark = arenaMark();
+			const char* command = mpdQuoted(connection, "clear\nload ", stored->name, "\n");
+			success = command != NULL && playlistBatchAdd(connection, &batch, command, &file) && playlistBatchAdd(connection, &batch, "play 0\n", &file);
+			arenaRewind(mark);
+		} else {
+			for (uint32_t j = 0; j < queued && success; ++j) {
+				if (dropped[j]) {
+					char command[9 + 10 + 1 + 1];
+					snprintf(command, sizeof(command), "%s%" PRIu32 "%s", "deleteid ", playlistMirror[j].id, "\n");
+					success = playlistBatchAdd(connection, &batch, command, &file);
+				}
+			}
+
+			// Longest run of kept entries that's in order already stays where it is
+			uint32_t length = 0;
+			for (uint32_t k = 0; k < kept; ++k) {
+				uint32_t low = 0;
+				uint32_t high = length;
+				while (low < high) {
+					const uint32_t middle = low + (high - low) / 2;
+					if (keptTargets[tails[middle]] < keptTargets[k]) {
+						low = middle + 1;
+					} else {
+						high = middle;
+					}
+				}
+				previous[k] = low > 0 ? tails[low - 1] : PLAYLIST_NONE;
+				tails[low] = k;
+				length += low == length;
+				stable[k] = false;
+			}
+			for (uint32_t k = length > 0 ? tails[length - 1] : PLAYLIST_NONE; k != PLAYLIST_NONE; k = previous[k]) {
+				stable[k] = true;
+			}
+			tree[0] = 0;
+			for (uint32_t k = 1; k <= kept; ++k) {
+				tree[k] = !stable[k - 1];
+			}
+			for (uint32_t k = 1; k <= kept; ++k) {
+				if (k + (k & -k) <= kept) {
+					tree[k + (k & -k)] += tree[k];
+				}
+			}
+
+			/*
+			 * Targets go in order, every one right behind the one before it. Kept entries that stay don't move, so what
+			 * was placed since the last of them (anchor) sits right behind it, and in front of it there's everything
+			 * placed and entries still to be moved from there. That's the position of the one placed last.
+			 */
+			uint32_t placed = 0;
+			uint32_t anchor = PLAYLIST_NONE;
+			for (uint32_t i = 0; i < count && success; ++i) {
+				const uint32_t k = claimed[i];
+				if (k == PLAYLIST_DUPLICATE) {
+					continue;
+				}
+				const uint32_t last = placed > 0 ? placed - 1 + (anchor != PLAYLIST_NONE ? playlistMovesBefore(tree, anchor) : 0) : 0;
+				const uint32_t to = placed > 0 ? last + 1 : 0;
+				if (k == PLAYLIST_NONE) {
+					char command[6 + 2 * strlen(files[i]) + 3 + 10 + 1 + 1];
+					memcpy(command, "addid ", 6);
+					mpdQuote(command + 6, files[i]);
+					snprintf(command + strlen(command), sizeof(command) - strlen(command), "%s%" PRIu32 "%s", " ", to, "\n");
+					success = playlistBatchAdd(connection, &batch, command, &file);
+				} else if (stable[k]) {
+					anchor = k;
+				} else {
+					char command[7 + 10 + 1 + 10 + 1 + 1];
+					// Taking it out from in front of the last one placed moves that one back
+					snprintf(command, sizeof(command), "%s%" PRIu32 "%s%" PRIu32 "%s", "moveid ", keptIds[k], " ", anchor != PLAYLIST_NONE && k < anchor ? last : to, "\n");
+					success = playlistBatchAdd(connection, &batch, command, &file);
+					playlistMoved(tree, kept, k);
+				}
+				++placed;
+			}
+			if (success) {
+				char command[7 + 10 + 1 + 1];
+				if (currentKept) {
+					snprintf(command, sizeof(command), "%s%" PRIu32 "%s", "playid ", currentId, "\n");
+				}
+				success = (currentKept && playing) || playlistBatchAdd(connection, &batch, currentKept ? command : "play 0\n", &file);
+			}
+		}
+		success = success && playlistBatchAdd(connection, &batch, "currentsong\n", &file) && playlistBatchSend(connection, &batch, &file);
+		if (success && announce) {
+			for (uint32_t i = 0; i < count; ++i) {
+				if (claimed[i] == PLAYLIST_NONE) {
+					sendMessageToChannel_2("Added: ", files[i]);
+				}
+			}
+			sendMessageToChannel("---");
+		}
+	}
+	if (!success) {
+		if (stored != NULL) { // Might not be what MPD has anymore, it's read again next time
+			playlistStoredFree(stored);
+		}
+		sendErrorToChannel(connection->error);
+	} else if (file != NULL) {
+		sendMessageToChannel_2("Current song: ", file);
+	}
+	pthread_mutex_unlock(&playlistMutex);
+	free(file);
+	free(batch.data);
+	free(memory);
+	mpdDisconnect(connection);
+	free(connection);
+	return true;
+}
+
+/*
+ * Appends files (or whole directories) to MPD's queue, in one command list unless it's huge, false if MPD isn't
+ * reachable and caller has to ask mpc. Every file is announced once MPD took it. With clear, queue is emptied first,
+ * with play, MPD plays (unless it does already) and current song comes after "---". Cancelled command adds no more.
+ */
+static bool playlistAdd(const char* const* files, const uint32_t count, const bool clear, const bool play) {
+	struct mpdConnection* connection = (struct mpdConnection*) malloc(sizeof(struct mpdConnection));
+	if (unlikely(!connection)) {
+		return false;
+	}
+	if (!mpdConnect(connection)) {
+		free(connection);
+		return false;
+	}
+	TRACE_SPAN("mpd", __func__);
+	struct playlistBatch batch = {0};
+	char* file = NULL;
+	uint32_t added = 0;
+	uint32_t announced = 0;
+	bool success = true;
+	playlistBatchAppend(&batch, clear ? "command_list_begin\nclear\n" : "command_list_begin\n");
+	for (; added < count && success && !laneCancelled(); ++added) {
+		const struct arenaMark mark = arenaMark();
+		const char* command = mpdQuoted(connection, "add ", files[added], "\n");
+		if (unlikely(!command)) {
+			success = false;
+		} else if (batch.length + strlen(command) > PLAYLIST_BATCH) {
+			success = playlistBatchSend(connection, &batch, &file);
+			for (; success && announced < added; ++announced) { // MPD has all of them now
+				sendMessageToChannel_2("Added: ", files[announced]);
+			}
+		}
+		if (success) {
+			playlistBatchAppend(&batch, command);
+		}
+		arenaRewind(mark);
+	}
+	if (success && play) {
+		playlistBatchAppend(&batch, "play\ncurrentsong\n");
+	}
+	success = success && playlistBatchSend(connection, &batch, &file);
+	if (success) {
+		for (; announced < added; ++announced) {
+			sendMessageToChannel_2("Added: ", files[announced]);
+		}
+		if (play) {
+			sendMessageToChannel("---");
+			if (file != NULL) {
+				sendMessageToChannel_2("Current song: ", file);
+			}
+		}
+	} else {
+		sendErrorToChannel(connection->error);
+	}
+	free(file);
+	free(batch.data);
+	mpdDisconnect(connection);
+	free(connection);
+	return true;
+}
+
+static void cachesFree() {
+	libraryPublish(NULL);
+	queryCacheFree();
+	regexCacheFree();
+	pthread_mutex_lock(&themesMutex);
+	lineCacheFree(&themesCache);
+	pthread_mutex_unlock(&themesMutex);
+	pthread_mutex_lock(&favsMutex);
+	for (unsigned int i = 0; i < FAVS_CACHE_SIZE; ++i) {
+		lineCacheFree(&favsCache[i].favs);
+		favsCache[i].uid[0] = '\0';
+		favsCache[i].lastUsed = 0;
+	}
+	pthread_mutex_unlock(&favsMutex);
+	pthread_mutex_lock(&clientsMutex);
+	free(clientsCache);
+	clientsCache = NULL;
+	clientsCacheCount = 0;
+	pthread_mutex_unlock(&clientsMutex);
+	pthread_mutex_lock(&playlistMutex);
+	playlistMirrorFree();
+	for (unsigned int i = 0; i < PLAYLIST_STORED_SIZE; ++i) {
+		playlistStoredFree(&playlistStoredCache[i]);
+	}
+	playlistStoredClock = 0;
+	pthread_mutex_unlock(&playlistMutex);
+}
+
+/*
+ * Fast path of resetPlaylist(): MPD adds the whole library itself, in the same command list as clear and play,
+ * false if MPD isn't reachable and caller has to ask mpc. With keepCurrent, song that's playing stays at the top
+ * and keeps playing, everything around it is replaced. Library brings its own copy of that song, it's found in the
+ * same command list and deleted right after, so that costs two more round trips.
+ */
+static bool mpdResetPlaylist(const bool keepCurrent, const bool shuffle) {
+	struct mpdConnection* connection = (struct mpdConnection*) malloc(sizeof(struct mpdConnection));
+	if (unlikely(!connection)) {
+		return false;
+	}
+	if (!mpdConnect(connection)) {
+		free(connection);
+		return false;
+	}
+	long position = -1;
+	unsigned long length = 0;
+	unsigned long id = 0;
+	char* current = NULL;
+	char* key;
+	char* value;
+	int ret = 0;
+	if (keepCurrent) {
+		bool stopped = true;
+		if (likely(mpdSend(connection, "command_list_begin\nstatus\ncurrentsong\ncommand_list_end\n"))) {
+			while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+				if (strcmp(key, "song") == 0) {
+					position = strtol(value, NULL, 10);
+				} else if (strcmp(key, "songid") == 0) {
+					id = strtoul(value, NULL, 10);
+				} else if (strcmp(key, "playlistlength") == 0) {
+					length = strtoul(value, NULL, 10);
+				} else if (strcmp(key, "state") == 0) {
+					stopped = strcmp(value, "stop") == 0;
+				} else if (current == NULL && strcmp(key, "file") == 0) {
+					current = strdup(value);
+				}
+			}
+		} else {
+			ret = -1;
+		}
+		if (stopped || current == NULL) { // Nothing to keep
+			position = -1;
+		}
+	}
+	const struct arenaMark mark = arenaMark();
+	if (likely(ret == 0)) {
+		const char* command = NULL;
+		if (position >= 0) {
+			// Ranges can't be empty, so there's no delete at all when it's the first or the last song
+			char after[32] = "";
+			char before[32] = "";
+			if ((unsigned long) position + 1 < length) {
+				snprintf(after, sizeof(after), "%s%ld%s", "delete ", position + 1, ":\n");
+			}
+			if (position > 0) {
+				snprintf(before, sizeof(before), "%s%ld%s", "delete 0:", position, "\n");
+			}
+			const char* prefix = arenaPrintf("%s%s%s%s%s%s", "command_list_begin\n", after, before, "add \"\"\n", shuffle ? "shuffle 1:\n" : "", "currentsong\nplaylistfind file ");
+			if (likely(prefix != NULL)) {
+				command = mpdQuoted(connection, prefix, current, "\ncommand_list_end\n");
+			}
+		} else {
+			command = arenaPrintf("%s%s%s", "command_list_begin\nclear\nadd \"\"\n", shuffle ? "shuffle\n" : "", "play\ncurrentsong\ncommand_list_end\n");
+		}
+		char* file = NULL;
+		const char* duplicates = NULL; // deleteid for every copy of the kept song but itself
+		if (unlikely(!command)) {
+			snprintf(connection->error, sizeof(connection->error), "%s", "arenaAlloc() error");
+			ret = -1;
+		} else if (likely(mpdSend(connection, command))) {
+			while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+				if (file == NULL && strcmp(key, "file") == 0) {
+					file = strdup(value);
+				} else if (position >= 0 && strcmp(key, "Id") == 0 && strtoul(value, NULL, 10) != id) {
+					duplicates = arenaPrintf("%s%s%s%s", duplicates != NULL ? duplicates : "command_list_begin\n", "deleteid ", value, "\n");
+				}
+			}
+		} else {
+			ret = -1;
+		}
+		if (likely(ret == 0) && duplicates != NULL) {
+			const char* deletes = arenaPrintf("%s%s", duplicates, "command_list_end\n");
+			if (unlikely(!deletes)) {
+				snprintf(connection->error, sizeof(connection->error), "%s", "arenaAlloc() error");
+				ret = -1;
+			} else if (unlikely(!mpdCommand(connection, deletes))) {
+				ret = -1;
+			}
+		}
+		if (likely(ret == 0) && file != NULL) {
+			sendMessageToChannel_2("Current song: ", file);
+		}
+		free(file);
+	}
+	arenaRewind(mark);
+	if (unlikely(ret != 0)) {
+		sendErrorToChannel(connection->error);
+	}
+	free(current);
+	mpdDisconnect(connection);
+	free(connection);
+	return true;
+}
+
+static void resetPlaylist(const bool keepCurrent, const bool shuffle) {
+	TRACE_SPAN("mpd", __func__);
+	if (mpdResetPlaylist(keepCurrent, shuffle)) {
+		return;
+	}
+	char* current = NULL;
+	if (keepCurrent && executeCommandWithOutput("mpc current -f %file% 2>&1", &current) && *current != '\0') {
+		executeCommandWithErrorToChannel("mpc crop >/dev/null");
+	} else {
+		free(current);
+		current = NULL;
+		executeCommandWithErrorToChannel("mpc clear >/dev/null");
+	}
+	executeCommandWithErrorToChannel("mpc ls | mpc add >/dev/null");
+	if (current != NULL) { // Library brought the kept song once more, it's somewhere after the first one
+		FILE *stream = openCommandStream("mpc -f %file% playlist 2>&1");
+		if (unlikely(!stream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("popen() error");
+		} else {
+			char* line = NULL;
+			size_t len = 0;
+			unsigned long position = 0;
+			unsigned long duplicate = 0;
+			while (getline(&line, &len, stream) != -1) {
+				line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+				if (++position > 1 && strcmp(line, current) == 0) {
+					duplicate = position;
+					break;
+				}
+			}
+			closeCommandStream(stream);
+			free(line);
+			if (duplicate != 0) {
+				char command[8 + 20 + 12 + 1];
+				snprintf(command, sizeof(command), "%s%lu%s", "mpc del ", duplicate, " >/dev/null");
+				executeCommandWithErrorToChannel(command);
+			}
+		}
+	}
+	if (shuffle) {
+		executeCommandWithErrorToChannel("mpc shuffle >/dev/null"); // MPD keeps the song that's playing at the top
+	}
+	if (current != NULL) {
+		sendMessageToChannel_2("Current song: ", current);
+		free(current);
+	} else {
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	}
+}
+
+// Options of !reset, whole words in any order, false (already reported) if there's anything else
+static bool resetOptionsParse(const char* options, bool* keepCurrent, bool* shuffle) {
+	*keepCurrent = false;
+	*shuffle = false;
+	for (const char* p = options + strspn(options, " "); *p != '\0'; p += strspn(p, " ")) {
+		const size_t length = strcspn(p, " ");
+		if (length == 4 && strncasecmp(p, "keep", 4) == 0) {
+			*keepCurrent = true;
+		} else if (length == 7 && strncasecmp(p, "shuffle", 7) == 0) {
+			*shuffle = true;
+		} else {
+			sendErrorToChannel("Unknown option! :-(");
+			return false;
+		}
+		p += length;
+	}
+	return true;
+}
+
+static bool isPlaylistRandom() {
+	TRACE_SPAN("mpd", __func__);
+	FILE *stream = openCommandStream("mpc status 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		return false;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool ret = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		if (strstr(line, "random: ")) { // If message contains substring
+			if (strstr(line, "random: on")) { // If message contains substring
+				ret = true;
+			}
+			break;
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	return ret;
+}
+
+static void addArtist(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, true, one, true)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	if (plan.fielded) { // mpc can't tell which directories songs are in
+		searchPlanFree(&plan);
+		sendMessageToChannel("Library isn't loaded yet, try again later! :-(");
+		return;
+	}
+	FILE *stream = openCommandStream("mpc -f %artist% ls 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while (!laneCancelled() && (read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+			//removeChar(line, '\'');
+			const struct arenaMark mark = arenaMark();
+			const char* command = arenaPrintf("%s%s%s", "mpc add -f %artist% \"", line, "\" 2>&1");
+			if (unlikely(!command)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("arenaAlloc() error");
+			} else if (likely(executeCommandWithErrorToChannel(command))) {
+				sendMessageToChannel_2("Added: ", line);
+			}
+			arenaRewind(mark);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (found) {
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	} else {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void getArtist(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, true, one, false)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	if (plan.fielded) { // mpc can't tell which directories songs are in
+		searchPlanFree(&plan);
+		sendMessageToChannel("Library isn't loaded yet, try again later! :-(");
+		return;
+	}
+	FILE *stream = openCommandStream("mpc -f %artist% ls 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+			sendMessageToChannel_2("Found: ", line);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (!found) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void addFile(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, false, one, true)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	FILE *stream = openCommandStream(plan.fielded ? "mpc -f " SEARCH_PLAN_FORMAT " listall 2>&1" : "mpc -f %file% listall 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while (!laneCancelled() && (read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, plan.fielded ? "\t\r\n" : "\r\n")] = 0; // Make sure that there are no newlines (nor other fields)
+			//removeChar(line, '\'');
+			const struct arenaMark mark = arenaMark();
+			const char* command = arenaPrintf("%s%s%s", "mpc add -f %file% \"", line, "\" 2>&1");
+			if (unlikely(!command)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("arenaAlloc() error");
+			} else if (likely(executeCommandWithErrorToChannel(command))) {
+				sendMessageToChannel_2("Added: ", line);
+			}
+			arenaRewind(mark);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (found) {
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	} else {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void getFile(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, false, one, false)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	FILE *stream = openCommandStream(plan.fielded ? "mpc -f " SEARCH_PLAN_FORMAT " listall 2>&1" : "mpc -f %file% listall 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, plan.fielded ? "\t\r\n" : "\r\n")] = 0; // Make sure that there are no newlines (nor other fields)
+			sendMessageToChannel_2("Found: ", line);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (!found) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void addSong(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, false, one, true)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	FILE *stream = openCommandStream(plan.fielded ? "mpc -f " SEARCH_PLAN_FORMAT " listall 2>&1" : "mpc listall 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while (!laneCancelled() && (read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, plan.fielded ? "\t\r\n" : "\r\n")] = 0; // Make sure that there are no newlines (nor other fields)
+			//removeChar(line, '\'');
+			const struct arenaMark mark = arenaMark();
+			const char* command = arenaPrintf("%s%s%s", "mpc add \"", line, "\" 2>&1");
+			if (unlikely(!command)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("arenaAlloc() error");
+			} else if (likely(executeCommandWithErrorToChannel(command))) {
+				sendMessageToChannel_2("Added: ", line);
+			}
+			arenaRewind(mark);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (found) {
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	} else {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void getSong(const char* regex, const bool one) {
+	TRACE_SPAN("mpd", __func__);
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (libraryFind(&plan, false, one, false)) {
+		searchPlanFree(&plan);
+		return;
+	}
+	FILE *stream = openCommandStream(plan.fielded ? "mpc -f " SEARCH_PLAN_FORMAT " listall 2>&1" : "mpc listall 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		searchPlanFree(&plan);
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		if (searchPlanMatchLine(&plan, line)) {
+			found = true;
+			line[strcspn(line, plan.fielded ? "\t\r\n" : "\r\n")] = 0; // Make sure that there are no newlines (nor other fields)
+			sendMessageToChannel_2("Found: ", line);
+			if (one) {
+				break;
+			}
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	searchPlanFree(&plan);
+	if (!found) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+// Best matches ranked by typos, library only, there's no way to do that with mpc in reasonable time
+static void getFuzzy(const char* regex) {
+	TRACE_SPAN("search", __func__);
+	struct library* library = libraryAcquire();
+	if (library == NULL) {
+		sendMessageToChannel("Library isn't loaded yet, try again later! :-(");
+		return;
+	}
+	char key[SEARCH_KEY_SIZE(strlen(regex))];
+	searchKey(key, regex);
+	struct searchFuzzyResult matches[SEARCH_FUZZY_RESULTS];
+	const unsigned int count = libraryFuzzy(library, key, false, matches, SEARCH_FUZZY_RESULTS);
+	for (unsigned int i = 0; i < count; ++i) {
+		sendMessageToChannel_2("Found: ", libraryString(library, library->records[matches[i].record].file));
+	}
+	libraryRelease(library);
+	if (count == 0) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+}
+
+static void sendDirectoryToChannel(const char* name, const size_t length, const uint32_t count) {
+	char message[length + 3 + 10 + 7 + 1];
+	snprintf(message, sizeof(message), "%.*s%s%" PRIu32 "%s", (int) length, name, "/ (", count, count == 1 ? " song)" : " songs)");
+	sendMessageToChannel(message);
+}
+
+// Library with its tree and node of directory at path, false (already reported) if there's no such one or no tree yet
+static bool libraryTreeAcquire(const char* path, struct library** library, uint32_t* node, uint32_t* end) {
+	*library = libraryAcquire();
+	if (*library == NULL || __atomic_load_n(&(*library)->tree, __ATOMIC_ACQUIRE) == NULL) {
+		if (*library != NULL) {
+			libraryRelease(*library);
+		}
+		sendMessageToChannel("Library isn't loaded yet, try again later! :-(");
+		return false;
+	}
+	path += strspn(path, "/");
+	char key[SEARCH_KEY_SIZE(strlen(path))];
+	size_t length = searchKey(key, path);
+	while (length > 0 && key[length - 1] == '/') {
+		key[--length] = '\0';
+	}
+	if (!libraryTreeFind(*library, (*library)->tree, key, node, end)) {
+		libraryRelease(*library);
+		sendMessageToChannel("Couldn't find anything! :-(");
+		return false;
+	}
+	return true;
+}
+
+// Subdirectories (with how many songs they have) and songs right in directory at path, library only
+static void listTree(const char* path) {
+	TRACE_SPAN("search", __func__);
+	struct library* library;
+	uint32_t node;
+	uint32_t end;
+	if (!libraryTreeAcquire(path, &library, &node, &end)) {
+		return;
+	}
+	const struct libraryTree* tree = library->tree;
+	const struct libraryTreeNode* parent = &tree->nodes[node];
+	const char* parentFile = libraryString(library, library->records[parent->record].file);
+	if (node != 0 && end != parent->end) { // In the middle of a chain, the rest of it is all there is
+		sendDirectoryToChannel(parentFile + end + 1, parent->end - end - 1, parent->count);
+		libraryRelease(library);
+		return;
+	}
+	const uint32_t offset = libraryTreeOffset(tree, node);
+	uint32_t record = parent->record;
+	for (uint32_t i = parent->children; i <= parent->children + parent->childrenCount; ++i) {
+		const bool last = i == parent->children + parent->childrenCount;
+		for (const uint32_t until = last ? parent->record + parent->count : tree->nodes[i].record; record < until; ++record) {
+			sendMessageToChannel(libraryString(library, library->records[record].file) + offset); // Songs between subdirectories
+		}
+		if (!last) {
+			const struct libraryTreeNode* child = &tree->nodes[i];
+			sendDirectoryToChannel(libraryString(library, library->records[child->record].file) + child->start, child->end - child->start, child->count);
+			record = child->record + child->count;
+		}
+	}
+	if (parent->count == 0) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+	libraryRelease(library);
+}
+
+// Whole directory at path with everything in it, in one go, library only so that we know it's there
+static void addTree(const char* path) {
+	TRACE_SPAN("mpd", __func__);
+	struct library* library;
+	uint32_t node;
+	uint32_t end;
+	if (!libraryTreeAcquire(path, &library, &node, &end)) {
+		return;
+	}
+	if (node == 0) {
+		libraryRelease(library);
+		sendMessageToChannel("That's the whole library, use !reset for it! 8)");
+		return;
+	}
+	const uint32_t count = library->tree->nodes[node].count;
+	char* directory = (char*) arenaAlloc(end + 1);
+	if (unlikely(!directory)) {
+		libraryRelease(library);
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("arenaAlloc() error");
+		return;
+	}
+	memcpy(directory, libraryString(library, library->records[library->tree->nodes[node].record].file), end);
+	directory[end] = '\0';
+	libraryRelease(library);
+	if (likely(spawnWithOutputToChannel((char*[]) {"mpc", "add", directory, NULL}, true))) { // No shell, names may have anything in them
+		const char* message = arenaPrintf("%s%s%s%" PRIu32 "%s", "Added: ", directory, " (", count, count == 1 ? " song)" : " songs)");
+		sendMessageToChannel(message != NULL ? message : "Added! 8)");
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	}
+}
+
+static void playNum_unsigned_long_int(const unsigned long int number) {
+	TRACE_SPAN("mpd", __func__);
+	char command[9 + 10 + 5 + 1]; // Unsigned long int has no more than 10 digits -> <0, 4,294,967,295>
+	snprintf(command, sizeof(command), "%s%lu%s", "mpc play ", number, " 2>&1");
+	executeCommandWithOutputToChannel(command);
+}
+
+static void playNum(const char* regex) {
+	const unsigned long int number = strtoul(regex, NULL, 0);
+	if (number != 0) {
+		playNum_unsigned_long_int(number);
+	} else {
+		sendMessageToChannel("Wrong number! :-(");
+	}
+}
+
+// Plays the first song in playlist matching plan, looked for in format, or in every field if plan is fielded
+static bool play(const char* format, struct searchPlan* plan) {
+	TRACE_SPAN("mpd", __func__);
+	FILE *stream = NULL;
+	if (plan->fielded) {
+		stream = openCommandStream("mpc -f " SEARCH_PLAN_FORMAT " playlist 2>&1");
+	} else if (format != NULL) {
+		const char* command = arenaPrintf("%s%s%s", "mpc -f ", format, " playlist 2>&1");
+		stream = command != NULL ? openCommandStream(command) : NULL;
+	} else {
+		stream = openCommandStream("mpc playlist 2>&1");
+	}
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		return false;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	unsigned long int playNumber = 0;
+	bool found = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		++playNumber;
+		if (searchPlanMatchLine(plan, line)) {
+			found = true;
+			break;
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	if (found) {
+		playNum_unsigned_long_int(playNumber);
+		return true;
+	} else {
+		return false;
+	}
+}
+
+// Plays the first song in playlist matching regex, if there's none, maybe there's something close in the library
+static void playQuery(const char* format, const char* regex) {
+	struct searchPlan plan;
+	if (!searchPlanInit(&plan, regex)) {
+		return;
+	}
+	if (!play(format, &plan)) {
+		sendMessageToChannel("Couldn't find anything! :-(");
+		struct library* library = !plan.fielded && plan.terms[0].query.key != NULL ? libraryAcquire() : NULL;
+		if (library != NULL) {
+			librarySuggest(library, plan.terms[0].query.key, false);
+			libraryRelease(library);
+		}
+	}
+	searchPlanFree(&plan);
+}
+
+static void playFile(const char* regex) {
+	playQuery("%file%", regex);
+}
+
+static void playSong(const char* regex) {
+	playQuery(NULL, regex);
+}
+
+static void refreshFavSymlink(const char* clientName, const char* clientUID) {
+	TRACE_SPAN("file", __func__);
+	struct stat st = {0};
+
+	char favFile[strlen(favPath) + strlen(clientUID) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, clientUID, ".txt");
+	bool favFileExists = false;
+	if (stat(favFile, &st) != -1) { // If favfile exists
+		favFileExists = true;
+	}
+
+	char clientNameLower[SEARCH_KEY_SIZE(strlen(clientName))];
+	searchKey(clientNameLower, clientName); // Same key searches use, "Łukasz" and "LUKASZ" get the same link
+
+	char favFileSymlink[strlen(favPath) + strlen(clientNameLower) + 4 + 1];
+	snprintf(favFileSymlink, sizeof(favFileSymlink), "%s%s%s", favPath, clientNameLower, ".txt");
+	char favFileSymlinkTarget[strlen(clientUID) + 4 + 1];
+	snprintf(favFileSymlinkTarget, sizeof(favFileSymlinkTarget), "%s%s", clientUID, ".txt");
+
+	if (lstat(favFileSymlink, &st) != -1) { // If symlink exists
+		char favFileSymlinkTargetReal[st.st_size + 1];
+		ssize_t r;
+		if (likely((r = readlink(favFileSymlink, favFileSymlinkTargetReal, st.st_size + 1)) != -1)) {
+			favFileSymlinkTargetReal[r] = '\0'; // readlink() does not append a null byte to buf
+			if (strcmp(favFileSymlinkTarget, favFileSymlinkTargetReal) == 0) { // If symlinks are the same
+				if (!favFileExists) { // If favfile doesn't exist (user removed his last fav)
+					if (unlikely(remove(favFileSymlink))) { // Remove (now invalid) symlink to favfile
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("remove() error");
+					}
+				}
+			} else { // If symlinks are different
+				if (favFileExists) { // If favfile exists
+					if (unlikely(remove(favFileSymlink))) { // Remove outdated symlink
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("remove() error");
+					}
+					if (unlikely(symlink(favFileSymlinkTarget, favFileSymlink))) { // Create new symlink to favfile
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("symlink() error");
+					}
+				}
+			}
+		} else {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("readlink() error");
+			return;
+		}
+	} else { // If symlink doesn't exist
+		if (favFileExists) { // If favfile exists
+			if (unlikely(symlink(favFileSymlinkTarget, favFileSymlink))) { // Create new symlink to favfile
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("symlink() error");
+			}
+		}
+	}
+}
+
+static void addFav(const char* fromUniqueIdentifier, const bool imSure) {
+	TRACE_SPAN("file", __func__);
+	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	struct stat st = {0};
+	bool firstFav = false;
+	if (stat(favFile, &st) == -1) { // If doesn't exist yet
+		firstFav = true;
+	}
+	FILE *cmdStream = openCommandStream("mpc -f %file% current 2>&1");
+	if (unlikely(!cmdStream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
+		closeCommandStream(cmdStream);
+		FILE *favStream = fopen(favFile, "a+");
+		if (unlikely(!favStream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("fopen() error");
+			free(line);
+			return;
+		}
+		char currentSong[read + 1];
+		strncpy(currentSong, line, sizeof(currentSong));
+		bool alreadyExists = false;
+		while ((read = getline(&line, &len, favStream)) != -1) {
+			if (strcmp(currentSong, line) == 0) {
+				alreadyExists = true;
+				break;
+			}
+		}
+		free(line);
+		if (alreadyExists) {
+			fclose(favStream);
+			sendMessageToChannel("You already faved this song! 8)");
+		} else {
+			if (!imSure) {
+				if (randomBool()) {
+					sendMessageToChannel("Magic crystall ball decided: Yup! 8)");
+				} else {
+					sendMessageToChannel("Magic crystall ball decided: Nope! 8)");
+					return;
+				}
+			}
+			fprintf(favStream, "%s", currentSong);
+			fclose(favStream);
+			sendMessageToChannel("Faved! 8)");
+		}
+		if (firstFav) {
+			sendMessageToChannel("This is your first fav! 8)");
+		}
+	} else {
+		sendErrorToChannel("getline() error");
+		closeCommandStream(cmdStream);
+		free(line); // getline() allocates it even when it fails
+		return;
+	}
+}
+
+static void delFav(const char* fromUniqueIdentifier) {
+	TRACE_SPAN("file", __func__);
+	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	struct stat st = {0};
+	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
+		FILE *cmdStream = openCommandStream("mpc -f %file% current 2>&1");
+		if (unlikely(!cmdStream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("popen() error");
+			return;
+		}
+		char favFileTemp[strlen(favFile) + 4 + 1];
+		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read = -1;
+		bool alreadyRemoved = true;
+		bool finalFileIsEmpty = true;
+		if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
+			closeCommandStream(cmdStream);
+			FILE *favStream = fopen(favFile, "r");
+			if (unlikely(!favStream)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("fopen() error");
+				free(line);
+				return;
+			}
+			FILE *favStreamTemp = fopen(favFileTemp, "w");
+			if (unlikely(!favStreamTemp)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("fopen() error");
+				fclose(favStream);
+				free(line);
+				return;
+			}
+			char currentSong[read + 1];
+			strncpy(currentSong, line, sizeof(currentSong));
+			while ((read = getline(&line, &len, favStream)) != -1) {
+				if (strcmp(currentSong, line) != 0) {
+					finalFileIsEmpty = false;
+					fprintf(favStreamTemp, "%s", line);
+				} else {
+					alreadyRemoved = false;
+				}
+			}
+			fclose(favStream);
+			fclose(favStreamTemp);
+			free(line);
+			if (alreadyRemoved) {
+				if (unlikely(remove(favFileTemp))) {
+					sendErrorToChannel(strerror(errno));
+					sendErrorToChannel("remove() error");
+				}
+				sendMessageToChannel("You didn't fav this song! 8)");
+			} else {
+				sendMessageToChannel("Unfaved! 8)");
+				if (finalFileIsEmpty) {
+					sendMessageToChannel("That was your last fav! 8)");
+					if (unlikely(remove(favFile))) {
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("remove() error");
+					}
+					if (unlikely(remove(favFileTemp))) {
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("remove() error");
+					}
+				} else {
+					if (unlikely(rename(favFileTemp, favFile))) {
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("rename() error");
+					}
+				}
+			}
+		} else {
+			sendErrorToChannel("getline() error");
+			closeCommandStream(cmdStream);
+			free(line); // getline() allocates it even when it fails
+			return;
+		}
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+}
+
+static void rankFav(const char* fromUniqueIdentifier, const char* position) {
+	TRACE_SPAN("file", __func__);
+	unsigned long int targetNumber = strtoul(position, NULL, 0);
+	if (unlikely(targetNumber < 1)) {
+		 targetNumber = 1;
+	}
+	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	struct stat st = {0};
+	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
+		FILE *cmdStream = openCommandStream("mpc -f %file% current 2>&1");
+		if (unlikely(!cmdStream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("popen() error");
+			return;
+		}
+		char favFileTemp[strlen(favFile) + 4 + 1];
+		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read = -1;
+		if (likely((read = getline(&line, &len, cmdStream)) != -1)) {
+			closeCommandStream(cmdStream);
+			FILE *favStream = fopen(favFile, "r");
+			if (unlikely(!favStream)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("fopen() error");
+				free(line);
+				return;
+			}
+			FILE *favStreamTemp = fopen(favFileTemp, "w");
+			if (unlikely(!favStreamTemp)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("fopen() error");
+				fclose(favStream);
+				free(line);
+				return;
+			}
+			char currentSong[read + 1];
+			strncpy(currentSong, line, sizeof(currentSong));
+			unsigned long int favNumber = 0;
+			while ((read = getline(&line, &len, favStream)) != -1) {
+				if (++favNumber == targetNumber) {
+					fprintf(favStreamTemp, "%s", currentSong);
+				}
+				if (strcmp(currentSong, line) != 0) {
+					fprintf(favStreamTemp, "%s", line);
+				}
+			}
+			fclose(favStream);
+			if (favNumber < targetNumber) { // Target number is bigger than all positions, add fav on the last position
+				fprintf(favStreamTemp, "%s", currentSong);
+			}
+			fclose(favStreamTemp);
+			free(line);
+			if (unlikely(rename(favFileTemp, favFile))) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("rename() error");
+				return;
+			}
+			sendMessageToChannel("Done! 8)");
+		} else {
+			sendErrorToChannel("getline() error");
+			closeCommandStream(cmdStream);
+			free(line); // getline() allocates it even when it fails
+			return;
+		}
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+}
+
+static void fixFavs(const char* fromUniqueIdentifier) {
+	TRACE_SPAN("file", __func__);
+	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
+	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	struct stat st = {0};
+	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
+		char favFileTemp[strlen(favFile) + 4 + 1];
+		snprintf(favFileTemp, sizeof(favFileTemp), "%s%s", favFile, ".new");
+		FILE *favStream = fopen(favFile, "r");
+		if (unlikely(!favStream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("fopen() error");
+			return;
+		}
+		FILE *favStreamTemp = fopen(favFileTemp, "w");
+		if (unlikely(!favStreamTemp)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("fopen() error");
+			fclose(favStream);
+			return;
+		}
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read = -1;
+		bool fixedSomething = false;
+		while ((read = getline(&line, &len, favStream)) != -1) {
+			char fileToDelete[strlen(musicPath) + read + 1];
+			snprintf(fileToDelete, sizeof(fileToDelete), "%s%s", musicPath, line);
+			fileToDelete[strcspn(fileToDelete, "\r\n")] = 0; // Make sure that there are no newlines
+			if (stat(fileToDelete, &st) == -1) { // If file doesn't exist
+				fixedSomething = true;
+			} else {
+				fprintf(favStreamTemp, "%s", line);
 			}
-			char* line = NULL;
-			size_t len = 0;
-			ssize_t read = -1;
-			unsigned int lines = 0;
-			while ((read = getline(&line, &len, favStream)) != -1) {
-				++lines;
+		}
+		fclose(favStream);
+		fclose(favStreamTemp);
+		if (line != NULL) {
+			free(line);
+		}
+		if (fixedSomething) {
+			if (unlikely(rename(favFileTemp, favFile))) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("rename() error");
 			}
-			fclose(favStream);
+			sendMessageToChannel("Fixed! 8)");
+		} else {
+			if (unlikely(remove(favFileTemp))) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("remove() error");
+			}
+			sendMessageToChannel("Nothing to fix! 8)");
+		}
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+}
+
+static void getFav(const char* fromUniqueIdentifier) {
+	TRACE_SPAN("file", __func__);
+	pthread_mutex_lock(&favsMutex);
+	const struct lineCache* favs = favsGet(fromUniqueIdentifier);
+	if (unlikely(!favs)) {
+		pthread_mutex_unlock(&favsMutex);
+		return;
+	}
+	const unsigned int count = favs->count;
+	for (unsigned int i = 0; i < count; ++i) {
+		sendMessageToChannel(favs->lines[i]);
+	}
+	pthread_mutex_unlock(&favsMutex);
+	if (count != 0) {
+		sendMessageToChannel("----------");
+		char message[5 + 10 + 1];
+		snprintf(message, sizeof(message), "%s%u", "Sum: ", count);
+		sendMessageToChannel(message);
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+}
+
+// Fast path of playFav() with ALL, false if MPD isn't reachable and caller has to ask mpc
+static bool favsPlay(const char* uid) {
+	struct library* library = libraryAcquire();
+	pthread_mutex_lock(&favsMutex);
+	const struct lineCache* favs = favsGet(uid);
+	if (unlikely(!favs)) {
+		pthread_mutex_unlock(&favsMutex);
+		if (library != NULL) {
+			libraryRelease(library);
+		}
+		return true;
+	}
+	size_t size = 0;
+	for (unsigned int i = 0; i < favs->count; ++i) {
+		size += strlen(favs->lines[i]) + 1;
+	}
+	const char** files = (const char**) malloc(favs->count * sizeof(char*) + size);
+	if (unlikely(!files)) {
+		pthread_mutex_unlock(&favsMutex);
+		if (library != NULL) {
+			libraryRelease(library);
+		}
+		return false;
+	}
+	char* data = (char*) (files + favs->count);
+	uint32_t count = 0;
+	for (unsigned int i = 0; i < favs->count; ++i) {
+		// MPD would stop at the first file it doesn't have, those are for !fixfavs anyway
+		if (library == NULL || libraryFindFile(library, favs->lines[i]) != library->count) {
+			strcpy(data, favs->lines[i]);
+			files[count++] = data;
+			data += strlen(data) + 1;
+		}
+	}
+	pthread_mutex_unlock(&favsMutex);
+	if (library != NULL) {
+		libraryRelease(library);
+	}
+	bool played = true;
+	if (count != 0) {
+		char name[sizeof(PLAYLIST_STORED_PREFIX) + 4 + strlen(uid)];
+		playlistStoredName(name, sizeof(name), "fav", uid);
+		played = playlistPlay(files, count, false, name);
+	} else {
+		sendMessageToChannel("Couldn't find anything! :-(");
+	}
+	free(files);
+	return played;
+}
+
+static void playFav(const char* fromUniqueIdentifier, const favPlayType favPlayType, const bool insert) {
+	TRACE_SPAN("file", __func__);
+	const char* favFile = arenaPrintf("%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	if (unlikely(!favFile)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("arenaAlloc() error");
+		return;
+	}
+	struct stat st = {0};
+	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
+		if (favPlayType == ALL) {
+			if (!insert) {
+				if (favsPlay(fromUniqueIdentifier)) {
+					return;
+				}
+				executeCommandWithErrorToChannel("mpc clear >/dev/null");
+				const char* command = arenaPrintf("%s%s%s", "mpc add < \'", favFile, "\' >/dev/null");
+				if (unlikely(!command)) {
+					sendErrorToChannel(strerror(errno));
+					sendErrorToChannel("arenaAlloc() error");
+					return;
+				}
+				executeCommandWithErrorToChannel(command);
+				executeCommandWithOutputToChannel("mpc play 2>&1");
+			} else {
+				if (isPlaylistRandom()) {
+					executeCommandWithErrorToChannel("mpc random off >/dev/null");
+					executeCommandWithErrorToChannel("mpc shuffle >/dev/null");
+				}
+				const char* command = arenaPrintf("%s%s%s", "mpc insert < \'", favFile, "\' 2>&1");
+				if (unlikely(!command)) {
+					sendErrorToChannel(strerror(errno));
+					sendErrorToChannel("arenaAlloc() error");
+					return;
+				}
+				executeCommandWithErrorToChannel(command);
+			}
+		} else {
+			pthread_mutex_lock(&favsMutex);
+			const struct lineCache* favs = favsGet(fromUniqueIdentifier);
+			if (unlikely(!favs || favs->count == 0)) { // Somebody removed the last one in the meantime
+				pthread_mutex_unlock(&favsMutex);
+				return;
+			}
+			const unsigned int targetLine = favPlayType == RANDOM ? rand() % favs->count : favs->count - 1;
+			const char* line = arenaStrdup(favs->lines[targetLine]);
+			pthread_mutex_unlock(&favsMutex);
+			if (unlikely(!line)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("arenaAlloc() error");
+				return;
+			}
+			if (!insert) {
+				struct searchPlan plan;
+				if (unlikely(!searchPlanInitSubstring(&plan, line))) {
+					return;
+				}
+				const bool played = play("%file%", &plan);
+				searchPlanFree(&plan);
+				if (!played) { // Try to play the file from playlist first, maybe we don't need to reset it
+					executeCommandWithErrorToChannel("mpc clear >/dev/null");
+					const char* command = arenaPrintf("%s%s%s", "mpc -f %file% add \'", line, "\' 2>&1");
+					if (unlikely(!command)) {
+						sendErrorToChannel(strerror(errno));
+						sendErrorToChannel("arenaAlloc() error");
+						return;
+					}
+					executeCommandWithErrorToChannel(command);
+					executeCommandWithOutputToChannel("mpc play 2>&1");
+				}
+			} else {
+				if (isPlaylistRandom()) {
+					executeCommandWithErrorToChannel("mpc random off >/dev/null");
+					executeCommandWithErrorToChannel("mpc shuffle >/dev/null");
+				}
+				const char* command = arenaPrintf("%s%s%s", "mpc -f %file% insert \'", line, "\' >/dev/null");
+				if (unlikely(!command)) {
+					sendErrorToChannel(strerror(errno));
+					sendErrorToChannel("arenaAlloc() error");
+					return;
+				}
+				executeCommandWithErrorToChannel(command);
+				sendMessageToChannel_2("Added: ", line);
+			}
+		}
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+}
 
-			unsigned int targetLine;
-			if (favPlayType == RANDOM) {
-				targetLine = rand() % lines + 1; // <1, lines>
+static void zipFav(const char* fromUniqueIdentifier) {
+	TRACE_SPAN("file", __func__);
+	const struct arenaMark mark = arenaMark();
+	char* favFile = arenaPrintf("%s%s%s", favPath, fromUniqueIdentifier, ".txt");
+	char* zipFile = arenaPrintf("%s%s%s", favPath, fromUniqueIdentifier, ".zip");
+	if (unlikely(!favFile || !zipFile)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("arenaAlloc() error");
+		arenaRewind(mark);
+		return;
+	}
+	struct stat st = {0};
+	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
+		if (stat(zipFile, &st) != -1) { // If zipfile exists
+			if (unlikely(remove(zipFile))) { // Remove previous zipfile
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("remove() error");
+				arenaRewind(mark);
+				return;
+			}
+		}
+		FILE *favStream = fopen(favFile, "r");
+		if (unlikely(!favStream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("fopen() error");
+			arenaRewind(mark);
+			return;
+		}
+		unsigned int argc = 3; // zip -0 zipFile
+		unsigned int capacity = 64;
+		char** argv = (char**) arenaAlloc(capacity * sizeof(char*));
+		bool failed = argv == NULL;
+		if (likely(!failed)) {
+			argv[0] = "zip";
+			argv[1] = "-0";
+			argv[2] = zipFile;
+		}
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read = -1;
+		while (!failed && !laneCancelled() && (read = getline(&line, &len, favStream)) != -1) {
+			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+			if (argc + 2 > capacity) { // Room for this one and terminating NULL, old array stays in the arena until rewind
+				char** grown = (char**) arenaAlloc(capacity * 2 * sizeof(char*));
+				if (unlikely(!grown)) {
+					failed = true;
+					break;
+				}
+				memcpy(grown, argv, argc * sizeof(char*));
+				argv = grown;
+				capacity *= 2;
+			}
+			if (unlikely(!(argv[argc++] = arenaPrintf("%s%s", musicPath, line)))) {
+				failed = true;
+				break;
+			}
+		}
+		fclose(favStream);
+		free(line);
+		if (unlikely(failed)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("arenaAlloc() error");
+		} else {
+			argv[argc] = NULL;
+			sendMessageToChannel("Working...");
+			if (likely(spawnWithOutputToChannel(argv, true))) {
+				const char* message = arenaPrintf("%s%s%s%s", "Done! You can find your zip [b][url=", favWebPath , fromUniqueIdentifier, ".zip]here[/url][/b] 8)");
+				sendMessageToChannel(message != NULL ? message : "Done! 8)");
 			} else {
-				targetLine = lines;
+				sendErrorToChannel("Error! :-(");
+			}
+		}
+	} else {
+		sendMessageToChannel("You don't have any favs yet! 8)");
+	}
+	arenaRewind(mark);
+}
+
+static void addTheme(const char* theme) {
+	TRACE_SPAN("file", __func__);
+	FILE *themeStream = fopen(themeFile, "a+");
+	if (unlikely(!themeStream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("fopen() error");
+		return;
+	}
+	bool alreadyExists = false;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	while ((read = getline(&line, &len, themeStream)) != -1) {
+		if (strncmp(theme, line, strlen(theme)) == 0) {
+			alreadyExists = true;
+			break;
+		}
+	}
+	if (likely(line != NULL)) {
+		free(line);
+	}
+	if (alreadyExists) {
+		fclose(themeStream);
+		sendMessageToChannel("This theme exists already! 8)");
+	} else {
+		fprintf(themeStream, "%s\n", theme);
+		fclose(themeStream);
+		sendMessageToChannel("Theme added! 8)");
+	}
+}
+
+static void getTheme(const char* theme) {
+	TRACE_SPAN("file", __func__);
+	struct searchQuery query;
+	if (theme != NULL && !searchQueryInit(&query, theme)) {
+		return;
+	}
+	pthread_mutex_lock(&themesMutex);
+	const struct lineCache* themes = themesGet();
+	if (unlikely(!themes)) {
+		pthread_mutex_unlock(&themesMutex);
+		if (theme != NULL) {
+			searchQueryFree(&query);
+		}
+		return;
+	}
+	if (themes->count != 0) {
+		bool found = false;
+		for (unsigned int i = 0; i < themes->count; ++i) {
+			if (theme == NULL || searchQueryMatch(&query, themes->lines[i], strlen(themes->lines[i]), themes->keys[i], strlen(themes->keys[i]))) {
+				found = true;
+				sendMessageToChannel(themes->lines[i]);
+			}
+		}
+		if (!found) {
+			sendMessageToChannel("Couldn't find anything! :-(");
+		}
+	} else {
+		sendMessageToChannel("No themes added yet! 8)");
+	}
+	pthread_mutex_unlock(&themesMutex);
+	if (theme != NULL) {
+		searchQueryFree(&query);
+	}
+}
+
+static void setTheme(const char* theme, const bool fixed) {
+	TRACE_SPAN("file", __func__);
+	char* foundTheme = NULL;
+	if (!fixed) {
+		if (!themesFind(theme, &foundTheme)) {
+			return;
+		}
+		if (foundTheme == NULL) {
+			sendMessageToChannel("Couldn't find anything! :-(");
+			return;
+		}
+		sendMessageToChannel("Tagging...");
+		theme = foundTheme;
+	}
+	char* output = NULL;
+	if (likely(executeCommandWithOutput("mpc current -f %file% 2>&1", &output))) {
+		char* comment = arenaPrintf("%s%s", "Theme:", theme);
+		char* path = arenaPrintf("%s%s", musicPath, output);
+		free(output);
+		char* argv[] = { "id3v2", "-2", "-c", comment, path, NULL };
+		if (unlikely(!comment || !path)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("arenaAlloc() error");
+		} else if (likely(spawnWithOutputToChannel(argv, true))) {
+			executeCommandWithErrorToChannel("mpc update --wait >/dev/null");
+			sendMessageToChannel_2("Classified as: ", theme);
+		}
+	} else {
+		sendErrorToChannel("executeCommandWithOutput() error");
+	}
+	free(foundTheme);
+}
+
+// Fast path of playTheme() for key of theme made with searchKey(), false if library isn't loaded and caller has to ask mpc
+static bool libraryPlayTheme(const char* theme, const char* key, bool* found, bool* played) {
+	struct library* library = libraryAcquire();
+	if (library == NULL) {
+		return false;
+	}
+	const struct arenaMark mark = arenaMark();
+	const char* query = arenaPrintf("%s%s", "theme\n", key);
+	uint32_t* records;
+	uint32_t count;
+	if (unlikely(!query) || !queryCacheFind(query, library->generation, &records, &count)) {
+		if (unlikely(!query || !(records = (uint32_t*) arenaAlloc(library->count * sizeof(uint32_t) + 1)))) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("arenaAlloc() error");
+			arenaRewind(mark);
+			libraryRelease(library);
+			return true;
+		}
+		count = 0;
+		for (uint32_t i = 0; i < library->count; ++i) {
+			const struct libraryRecord* record = &library->records[i];
+			if (strstr(libraryString(library, record->commentKey), key) != NULL || strstr(libraryString(library, record->fileKey), key) != NULL) {
+				records[count++] = i;
+			}
+		}
+		queryCacheStore(query, library->generation, records, count);
+	}
+	const char** files = count != 0 ? (const char**) arenaAlloc(count * sizeof(char*)) : NULL;
+	if (files != NULL) {
+		for (uint32_t j = 0; j < count; ++j) {
+			files[j] = libraryString(library, library->records[records[j]].file);
+		}
+		char name[sizeof(PLAYLIST_STORED_PREFIX) + 6 + strlen(theme)];
+		playlistStoredName(name, sizeof(name), "theme", theme);
+		*played = playlistPlay(files, count, true, name);
+	}
+	if (!*played) { // One more try at a single command list before it's one mpc per file
+		*played = files != NULL && playlistAdd(files, count, true, true);
+	}
+	if (!*played) {
+		executeCommandWithErrorToChannel("mpc clear >/dev/null");
+		for (uint32_t j = 0; j < count && !laneCancelled(); ++j) {
+			addToPlaylist(libraryString(library, library->records[records[j]].file));
+		}
+	}
+	*found = count != 0;
+	arenaRewind(mark);
+	libraryRelease(library);
+	return true;
+}
+
+static void playTheme(const char* regex) {
+	TRACE_SPAN("file", __func__);
+	char* foundTheme = NULL;
+	if (!themesFind(regex, &foundTheme)) {
+		return;
+	}
+	bool found = false;
+	bool played = false;
+	char key[foundTheme != NULL ? SEARCH_KEY_SIZE(strlen(foundTheme)) : 1];
+	if (foundTheme != NULL) {
+		searchKey(key, foundTheme);
+	}
+	if (foundTheme != NULL && !libraryPlayTheme(foundTheme, key, &found, &played)) {
+		FILE *stream = openCommandStream("mpc -f %comment%:%file% listall 2>&1");
+		if (unlikely(!stream)) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("popen() error");
+			free(foundTheme);
+			return;
+		}
+		executeCommandWithErrorToChannel("mpc clear >/dev/null");
+		char* line = NULL;
+		size_t len = 0;
+		ssize_t read = -1;
+		while (!laneCancelled() && (read = getline(&line, &len, stream)) != -1) {
+			if (searchMatch(line, key)) {
+				found = true;
+				char* save = NULL;
+				strtok_r(line, ":", &save); // Line is ours until the next getline(), cut it in place
+				char* foundFile = strtok_r(NULL, ":", &save);
+				if (foundFile != NULL) {
+					foundFile[strcspn(foundFile, "\r\n")] = 0; // Make sure that there are no newlines
+					//removeChar(foundFile, '\'');
+					addToPlaylist(foundFile);
+				}
 			}
+		}
+		closeCommandStream(stream);
+		free(line);
+	}
+	free(foundTheme);
+	if (played) {
+		return;
+	}
+	if (found) {
+		sendMessageToChannel("---");
+		executeCommandWithOutputToChannel("mpc play 2>&1");
+	} else {
+		sendMessageToChannel("Couldn't find anything! :-(");
+		sendMessageToChannel("---");
+		resetPlaylist(false, false);
+	}
+}
 
-			favStream = fopen(favFile, "r");
-			if (unlikely(!favStream)) {
+/*
+ * Fast path of delSong(): removes the current song from the queue (and the file), keeps playing the next one, false
+ * if MPD isn't reachable and caller has to ask mpc. Queue, playback and database are all done in one command list.
+ */
+static bool mpdDelSong() {
+	struct mpdConnection* connection = (struct mpdConnection*) malloc(sizeof(struct mpdConnection));
+	if (unlikely(!connection)) {
+		return false;
+	}
+	if (!mpdConnect(connection) || !mpdSend(connection, "command_list_begin\ncurrentsong\nstatus\ncommand_list_end\n")) {
+		free(connection);
+		return false;
+	}
+	char* file = NULL;
+	unsigned long id = 0;
+	bool playing = false;
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (file == NULL && strcmp(key, "file") == 0) {
+			file = strdup(value);
+		} else if (strcmp(key, "Id") == 0) {
+			id = strtoul(value, NULL, 10);
+		} else if (strcmp(key, "state") == 0) {
+			playing = strcmp(value, "play") == 0;
+		}
+	}
+	if (unlikely(ret != 0)) {
+		sendErrorToChannel(connection->error);
+	} else if (file == NULL) {
+		sendMessageToChannel("Nothing is playing! :-(");
+	} else {
+		char fileToDelete[strlen(musicPath) + strlen(file) + 1];
+		snprintf(fileToDelete, sizeof(fileToDelete), "%s%s", musicPath, file);
+		if (unlikely(remove(fileToDelete))) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("remove() error");
+		} else {
+			// MPD picks the next song itself so random and single are honoured, then the old one goes away
+			const char* slash = strrchr(file, '/');
+			const size_t directoryLength = slash != NULL ? (size_t) (slash - file) : 0;
+			char directory[directoryLength + 1];
+			memcpy(directory, file, directoryLength);
+			directory[directoryLength] = '\0';
+			const struct arenaMark mark = arenaMark();
+			const char* prefix = arenaPrintf("%s%s%s%lu%s", "command_list_begin\n", playing ? "next\n" : "", "deleteid ", id, "\nupdate ");
+			if (unlikely(!prefix)) {
 				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				if (line != NULL) {
-					free(line);
+				sendErrorToChannel("arenaAlloc() error");
+			} else {
+				const char* command = mpdQuoted(connection, prefix, directory, "\ncommand_list_end\n");
+				if (likely(command != NULL) && likely(mpdCommand(connection, command))) {
+					sendMessageToChannel_2("Deleted: ", file);
+				} else {
+					sendErrorToChannel(connection->error);
 				}
-				return;
 			}
-			lines = 0;
-			while ((read = getline(&line, &len, favStream)) != -1) {
-				if (targetLine == ++lines) {
-					line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-					if (!insert) {
-						if (!play("%file%", line)) { // Try to play the file from playlist first, maybe we don't need to reset it
-							executeCommandWithErrorToChannel("mpc clear >/dev/null");
-							char command[19 + read + 6 + 1];
-							snprintf(command, sizeof(command), "%s%s%s", "mpc -f %file% add \'", line, "\' 2>&1");
-							executeCommandWithErrorToChannel(command);
-							executeCommandWithOutputToChannel("mpc play 2>&1");
-						}
-					} else {
-						if (isPlaylistRandom()) {
-							executeCommandWithErrorToChannel("mpc random off >/dev/null");
-							executeCommandWithErrorToChannel("mpc shuffle >/dev/null");
-						}
-						char command[22 + read + 12 + 1];
-						snprintf(command, sizeof(command), "%s%s%s", "mpc -f %file% insert \'", line, "\' >/dev/null");
-						executeCommandWithErrorToChannel(command);
-						snprintf(command, sizeof(command), "%s%s", "Added: ", line);
-						sendMessageToChannel(command);
+			arenaRewind(mark);
+			libraryForget(file); // Favs keep it until !fixfavs, same as their files, playing them skips it already
+		}
+	}
+	free(file);
+	mpdDisconnect(connection);
+	free(connection);
+	return true;
+}
+
+static void delSong() {
+	TRACE_SPAN("mpd", __func__);
+	if (mpdDelSong()) {
+		return;
+	}
+	char* output = NULL;
+	if (likely(executeCommandWithOutput("mpc current -f %file% 2>&1", &output))) {
+		char fileToDelete[strlen(musicPath) + strlen(output) + 1];
+		snprintf(fileToDelete, sizeof(fileToDelete), "%s%s", musicPath, output);
+		free(output);
+		executeCommandWithErrorToChannel("mpc clear >/dev/null");
+		if (unlikely(remove(fileToDelete))) {
+			sendErrorToChannel(strerror(errno));
+			sendErrorToChannel("remove() error");
+		}
+		resetPlaylist(false, false);
+	} else {
+		sendErrorToChannel("executeCommandWithOutput() error");
+	}
+}
+
+static inline void pokeID(const anyID toPoke, const char* pokeMessage) {
+	if (ts3Functions.requestClientPoke(__atomic_load_n(&myServerConnectionHandlerID, __ATOMIC_RELAXED), toPoke, pokeMessage, NULL) != ERROR_ok) {
+		sendErrorToChannel("requestClientPoke() error");
+	}
+}
+
+static void pokeUser(const char* toPoke, const char* pokeMessage, const unsigned int howManyTimes) {
+	TRACE_SPAN("ts3", __func__);
+	pthread_mutex_lock(&clientsMutex);
+	const anyID clientID = clientsFind(toPoke);
+	char clientName[sizeof(clientsCache[0].nickname)] = "";
+	for (unsigned int i = 0; i < clientsCacheCount; ++i) {
+		if (clientsCache[i].id == clientID) {
+			memcpy(clientName, clientsCache[i].nickname, sizeof(clientName)); // Same size, always terminated
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clientsMutex);
+	if (clientID != 0) {
+		for (unsigned int pokeNum = howManyTimes; pokeNum > 0 && !laneCancelled(); --pokeNum) {
+			pokeID(clientID, pokeMessage);
+		}
+		sendMessageToChannel_2("Poked: ", clientName);
+	} else {
+		sendMessageToChannel("Couldn't find anybody! :-(");
+	}
+}
+
+static void guessSong(const char* guess) {
+	TRACE_SPAN("mpd", __func__);
+	char key[SEARCH_KEY_SIZE(strlen(guess))];
+	searchKey(key, guess);
+	FILE *stream = openCommandStream("mpc -f %artist% current 2>&1");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("popen() error");
+		return;
+	}
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read = -1;
+	bool found = false;
+	while ((read = getline(&line, &len, stream)) != -1) {
+		const bool exact = searchMatch(line, key);
+		if (exact || searchClose(line, key)) { // Typos are fine as long as there aren't too many of them
+			found = true;
+			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
+			//removeChar(line, '\'');
+			const char* message = arenaPrintf("%s%s%s", exact ? "That's right! It's " : "Close enough! It's ", line, "! 8)");
+			sendMessageToChannel(message != NULL ? message : (exact ? "That's right! 8)" : "Close enough! 8)"));
+			break;
+		}
+	}
+	closeCommandStream(stream);
+	if (line != NULL) {
+		free(line);
+	}
+	if (!found) {
+		sendMessageToChannel("Nope, try again! 8)");
+	}
+}
+
+
+
+
+
+/*
+ * Notifier follows MPD's player with idle on its own connection and announces every new song. Without MPD it falls
+ * back to "mpc current --wait". When both fail it tries again after NOTIFY_RETRY. It runs on a thread of its own,
+ * so MPD or mpc taking their time never hold up the loop. While it's off the thread sleeps, !notify wakes it up
+ * through notifyWakeFd either way.
+ */
+
+#define NOTIFY_RETRY 5 // Seconds before we try to follow MPD again
+
+static pthread_t notifyThread = 0;
+static int notifyWakeFd = -1;
+static unsigned long notifyLastId = ULONG_MAX;
+
+static inline bool notifyIsOn() {
+	return __atomic_load_n(&notifyIsWorking, __ATOMIC_ACQUIRE) && !lifecycleIsStopping();
+}
+
+static void notifyWake() {
+	const uint64_t one = 1;
+	while (write(notifyWakeFd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+// Until fd (ignored if it's -1) is readable, notifier is switched, we're stopping or timeout (milliseconds, -1 for
+// none) runs out, true if it's fd
+static bool notifyWait(const int fd, const int timeout) {
+	struct pollfd pollfds[3] = { { .fd = fd, .events = POLLIN }, { .fd = notifyWakeFd, .events = POLLIN }, { .fd = lifecycleWakeFd, .events = POLLIN } };
+	int ready;
+	while ((ready = poll(pollfds, 3, timeout)) == -1 && errno == EINTR);
+	if (pollfds[1].revents != 0) {
+		uint64_t posted;
+		if (read(notifyWakeFd, &posted, sizeof(posted)) == -1 && errno != EAGAIN) {
+			logErrorToConsole(strerror(errno));
+		}
+	}
+	return ready > 0 && pollfds[0].revents != 0;
+}
+
+// Announces current song if it's a different one than last time
+static bool notifyAnnounce(struct mpdConnection* connection, const bool announce) {
+	if (unlikely(!mpdSend(connection, "currentsong\n"))) {
+		return false;
+	}
+	char* file = NULL;
+	char* artist = NULL;
+	char* title = NULL;
+	unsigned long id = ULONG_MAX;
+	char* key;
+	char* value;
+	int ret;
+	while ((ret = mpdReadPair(connection, &key, &value)) == 1) {
+		if (file == NULL && strcmp(key, "file") == 0) {
+			file = strdup(value);
+		} else if (artist == NULL && strcmp(key, "Artist") == 0) {
+			artist = strdup(value);
+		} else if (title == NULL && strcmp(key, "Title") == 0) {
+			title = strdup(value);
+		} else if (strcmp(key, "Id") == 0) {
+			id = strtoul(value, NULL, 10);
+		}
+	}
+	if (likely(ret == 0) && file != NULL && id != notifyLastId && announce) {
+		if (title != NULL) { // Same as mpc's default format
+			char song[(artist != NULL ? strlen(artist) + 3 : 0) + strlen(title) + 1];
+			snprintf(song, sizeof(song), "%s%s%s", artist != NULL ? artist : "", artist != NULL ? " - " : "", title);
+			sendMessageToChannel_2("Current song: ", song);
+		} else {
+			sendMessageToChannel_2("Current song: ", file);
+		}
+	}
+	if (likely(ret == 0)) {
+		notifyLastId = id;
+	}
+	free(file);
+	free(artist);
+	free(title);
+	return ret == 0;
+}
+
+// Idles on MPD until it goes away or notifier is off, false if we couldn't even get to it
+static bool notifyFollowMpd() {
+	struct mpdConnection connection;
+	if (!mpdConnect(&connection) || !notifyAnnounce(&connection, false)) {
+		mpdDisconnect(&connection);
+		return false;
+	}
+	while (notifyIsOn()) {
+		const int fd = connection.fd;
+		if (!lifecycleIdleBegin(fd)) {
+			break;
+		}
+		if (unlikely(!mpdSend(&connection, "idle player\n"))) {
+			lifecycleIdleEnd(fd);
+			logErrorToConsole(connection.error);
+			break;
+		}
+		bool changed = false;
+		while (notifyIsOn() && !(changed = notifyWait(fd, -1)));
+		if (!changed) {
+			lifecycleIdleEnd(fd);
+			break; // MPD is fine with idling clients going away
+		}
+		char* key;
+		char* value;
+		int ret;
+		while ((ret = mpdReadPair(&connection, &key, &value)) == 1); // "changed: player", we check ourselves anyway
+		lifecycleIdleEnd(fd);
+		if (unlikely(ret != 0 || !notifyAnnounce(&connection, true))) {
+			logErrorToConsole(connection.error);
+			break;
+		}
+	}
+	mpdDisconnect(&connection);
+	return true;
+}
+
+// Waits for mpc to tell us about the next song, false if it couldn't
+static bool notifyFollowMpc() {
+	char* argv[] = { "mpc", "current", "--wait", NULL };
+	int fd;
+	const pid_t pid = spawnStart(argv, SPAWN_STDOUT, 0, &fd);
+	if (pid == -1) {
+		return false;
+	}
+	char* output = NULL;
+	size_t length = 0;
+	bool finished = false;
+	while (notifyIsOn() && !finished) {
+		finished = notifyWait(fd, -1) && !spawnRead(fd, &output, &length);
+	}
+	if (!finished) {
+		kill(-pid, SIGTERM);
+	}
+	int status = -1;
+	close(fd);
+	lifecycleChildWait(pid, &status, 0);
+	const bool followed = finished && WIFEXITED(status) && WEXITSTATUS(status) == 0 && output != NULL;
+	if (followed) {
+		output[strcspn(output, "\r\n")] = '\0';
+		sendMessageToChannel_2("Current song: ", output);
+	}
+	free(output);
+	return followed;
+}
+
+static void* notifyWorker(void* args) {
+	while (!lifecycleIsStopping()) {
+		if (!notifyIsOn()) {
+			notifyWait(-1, -1);
+		} else if (notifyFollowMpd() || !notifyFollowMpc()) { // After mpc we try MPD again, it may be back
+			notifyWait(-1, NOTIFY_RETRY * 1000);
+		}
+	}
+	return NULL;
+}
+
+static void notifyStart() {
+	notifyWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(notifyWakeFd == -1)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("eventfd() error");
+	} else if (unlikely(!lifecycleThreadStart(&notifyThread, "Notifier", &notifyWorker, &notifyWake))) {
+		logErrorToConsole("pthread_create() error");
+		close(notifyWakeFd);
+		notifyWakeFd = -1;
+	}
+}
+
+static void notifyStop() {
+	if (notifyThread != 0) {
+		notifyWake();
+		lifecycleThreadJoin(&notifyThread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+	}
+	if (notifyWakeFd != -1) {
+		close(notifyWakeFd);
+		notifyWakeFd = -1;
+	}
+	notifyIsWorking = false;
+	notifyLastId = ULONG_MAX;
+}
+
+// !notify, false if there's no notifier to switch
+static bool notifySwitch(const bool on) {
+	if (unlikely(notifyThread == 0)) {
+		return false;
+	}
+	__atomic_store_n(&notifyIsWorking, on, __ATOMIC_RELEASE);
+	notifyWake();
+	return true;
+}
+
+typedef enum {
+	LOOP_EVENT_QUEUE
+} loopEvent;
+
+static pthread_t loopThread = 0;
+static int loopEpollFd = -1;
+
+static void* loopWorker(void* args) {
+	loopIsCurrent = true;
+	struct epoll_event events[8];
+	while (__atomic_load_n(&loopIsWorking, __ATOMIC_ACQUIRE)) {
+		const int ready = epoll_wait(loopEpollFd, events, sizeof(events) / sizeof(events[0]), -1);
+		for (int i = 0; i < ready; ++i) {
+			switch (events[i].data.u32) {
+				case LOOP_EVENT_QUEUE: {
+					uint64_t posted;
+					if (read(loopEventFd, &posted, sizeof(posted)) == -1 && errno != EAGAIN) {
+						logErrorToConsole(strerror(errno));
+					}
+					struct loopTask* task;
+					while ((task = loopPop()) != NULL) {
+						task->run(task);
+						free(task);
 					}
 					break;
 				}
 			}
-			fclose(favStream);
-			if (line != NULL) {
-				free(line);
+		}
+	}
+	return NULL;
+}
+
+static void loopWake() {
+	__atomic_store_n(&loopIsWorking, false, __ATOMIC_RELEASE);
+	const uint64_t one = 1;
+	while (write(loopEventFd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+static void loopStart() {
+	loopEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	loopEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event queueEvent = { .events = EPOLLIN, .data.u32 = LOOP_EVENT_QUEUE };
+	if (unlikely(loopEpollFd == -1 || loopEventFd == -1 || epoll_ctl(loopEpollFd, EPOLL_CTL_ADD, loopEventFd, &queueEvent) == -1)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("epoll_ctl() error");
+	} else {
+		__atomic_store_n(&loopIsWorking, true, __ATOMIC_RELEASE);
+		if (likely(lifecycleThreadStart(&loopThread, "Event loop", &loopWorker, &loopWake))) {
+			return;
+		}
+		logErrorToConsole("pthread_create() error");
+		__atomic_store_n(&loopIsWorking, false, __ATOMIC_RELEASE);
+	}
+	// Tasks will run right where they're posted, like before we had the loop
+	if (loopEpollFd != -1) {
+		close(loopEpollFd);
+		loopEpollFd = -1;
+	}
+	if (loopEventFd != -1) {
+		close(loopEventFd);
+		loopEventFd = -1;
+	}
+}
+
+static void loopStop() {
+	if (loopThread != 0) {
+		loopWake();
+		lifecycleThreadJoin(&loopThread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+	}
+	if (loopEpollFd != -1) {
+		// Whatever came after the loop's last look, nobody else takes from the queue now
+		struct loopTask* task;
+		while ((task = loopPop()) != NULL) {
+			task->run(task);
+			free(task);
+		}
+		close(loopEpollFd);
+		close(loopEventFd);
+		loopEpollFd = loopEventFd = -1;
+	}
+}
+
+#ifdef ARCHITSMBOT_BENCH
+static pthread_mutex_t loopDrainMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loopDrainCond = PTHREAD_COND_INITIALIZER;
+static bool loopDrained = false;
+
+static void loopRunDrained(struct loopTask* task) {
+	pthread_mutex_lock(&loopDrainMutex);
+	loopDrained = true;
+	pthread_cond_signal(&loopDrainCond);
+	pthread_mutex_unlock(&loopDrainMutex);
+}
+
+static void loopDrainQueue() {
+	struct loopTask* task = loopTaskNew(&loopRunDrained, NULL, NULL, NULL);
+	if (unlikely(!task)) {
+		return;
+	}
+	pthread_mutex_lock(&loopDrainMutex);
+	loopDrained = false;
+	pthread_mutex_unlock(&loopDrainMutex);
+	loopPost(task);
+	pthread_mutex_lock(&loopDrainMutex);
+	while (!loopDrained) {
+		pthread_cond_wait(&loopDrainCond, &loopDrainMutex);
+	}
+	pthread_mutex_unlock(&loopDrainMutex);
+}
+
+// Waits until everything posted so far is done, bench.c measures commands from start to finish with it
+void loopDrain() {
+	loopDrainQueue(); // Commands are either done or in lanes now
+	lanesWaitIdle();
+	loopDrainQueue(); // What lanes sent to the channel
+}
+#endif
+
+/*static bool pokeWorkerIsRunning() {
+	if (pokeThread != 0) {
+		if (pthread_kill(pokeThread, 0) != ESRCH) {
+			return true;
+		} else {
+			pokeThread = 0; // So we won't try to send signal to invalid pthread next time
+		}
+	}
+	return false;
+}
+
+static void *pokeWorker(void *args) {
+	while (pokeIsWorking) {
+		if (pokeID(toPokeID, "")) {
+			sleep(1);
+		} else {
+			pokeIsWorking = false;
+		}
+	}
+	toPokeID = -1;
+	return NULL;
+}*/
+
+static pthread_t warmupThread = 0;
+static bool warmupIsWorking = false;
+static bool warmupIsDone = false;
+static uint64_t warmupDuration = 0; // In microseconds
+
+// Fills all caches right after we connect, so first commands don't have to
+static void *warmupWorker(void *args) {
+	const uint64_t start = metricsNow();
+
+	pthread_mutex_lock(&themesMutex);
+	const struct lineCache* themes = themesGet();
+	const unsigned int themesCount = themes != NULL ? themes->count : 0;
+	pthread_mutex_unlock(&themesMutex);
+
+	// Favs of everybody who is around, they're the ones who will ask for them
+	pthread_mutex_lock(&clientsMutex);
+	unsigned int clientsCount = 0;
+	char (*uids)[sizeof(clientsCache[0].uid)] = NULL;
+	if (clientsRefresh() && (uids = malloc(clientsCacheCount * sizeof(*uids) + 1)) != NULL) {
+		clientsCount = clientsCacheCount;
+		for (unsigned int i = 0; i < clientsCount; ++i) {
+			memcpy(uids[i], clientsCache[i].uid, sizeof(uids[i]));
+		}
+	}
+	pthread_mutex_unlock(&clientsMutex);
+	unsigned int favsCount = 0;
+	for (unsigned int i = 0; i < clientsCount && i < FAVS_CACHE_SIZE && __atomic_load_n(&warmupIsWorking, __ATOMIC_RELAXED); ++i) {
+		if (uids[i][0] == '\0') { // ServerQuery clients and such
+			continue;
+		}
+		pthread_mutex_lock(&favsMutex);
+		const struct lineCache* favs = favsGet(uids[i]);
+		if (favs != NULL && favs->count != 0) {
+			++favsCount;
+		}
+		pthread_mutex_unlock(&favsMutex);
+	}
+	free(uids);
+
+	// Snapshot from the last time is most likely up to date, then we're done with a single stats
+	struct library* snapshot = libraryGet();
+	if (snapshot != NULL) {
+		libraryIndex(snapshot); // Snapshot has no tree (nor index if it was saved without one), it's made here not to hold up the start
+		libraryRelease(snapshot);
+	}
+	struct mpdConnection* connection = (struct mpdConnection*) malloc(sizeof(struct mpdConnection));
+	const uint64_t snapshotDbUpdate = libraryDbUpdate();
+	bool fresh = false;
+	if (likely(connection != NULL)) {
+		if (mpdConnect(connection) && libraryRefresh(connection, &warmupIsWorking)) {
+			fresh = snapshotDbUpdate != 0 && libraryDbUpdate() == snapshotDbUpdate;
+		} else if (__atomic_load_n(&warmupIsWorking, __ATOMIC_RELAXED)) {
+			logErrorToConsole(connection->error);
+			if (libraryDbUpdate() != 0) {
+				logErrorToConsole("Library not refreshed, snapshot may be stale");
+			} else if (!libraryScan(&warmupIsWorking)) { // No MPD and no snapshot from it, files are all we have
+				logErrorToConsole("Library not loaded, falling back to mpc");
 			}
 		}
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
 	}
-}
+	struct library* library;
+	uint32_t songs = 0;
+	if ((library = libraryAcquire()) != NULL) {
+		songs = library->count;
+		libraryRelease(library);
+	}
+
+	__atomic_store_n(&warmupDuration, metricsNow() - start, __ATOMIC_RELAXED);
+	char message[160];
+	snprintf(message, sizeof(message), "Warm-up done in %.1f ms: %" PRIu32 " songs%s, %u themes, %u clients, %u favs", warmupDuration / 1000.0, songs, fresh ? " (snapshot up to date)" : "", themesCount, clientsCount, favsCount);
+	logToConsole(message);
+	__atomic_store_n(&warmupIsDone, true, __ATOMIC_RELEASE);
+
+	// From now on we only follow changes
+	if (likely(connection != NULL)) {
+		libraryWatch(connection, &warmupIsWorking);
+		free(connection);
+	}
+	return NULL;
+}
+
+static void warmupWake() {
+	__atomic_store_n(&warmupIsWorking, false, __ATOMIC_RELAXED);
+}
+
+static void warmupStop() {
+	if (warmupThread != 0) {
+		warmupWake();
+		lifecycleThreadJoin(&warmupThread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+	}
+}
+
+static void warmupStart() {
+	if (warmupThread != 0) {
+		if (!__atomic_load_n(&warmupIsDone, __ATOMIC_ACQUIRE)) {
+			return; // Still at it since the last time
+		}
+		warmupStop();
+	}
+	warmupIsDone = false;
+	warmupIsWorking = true;
+	if (unlikely(!lifecycleThreadStart(&warmupThread, "Warm-up", &warmupWorker, &warmupWake))) {
+		sendErrorToChannel("pthread_create() error");
+		warmupIsWorking = false;
+	}
+}
+
+/*
+ * Watcher follows musicPath with inotify, so new uploads show up within seconds without anybody running !update.
+ * Changes are batched until things calm down for WATCHER_DEBOUNCE, then MPD gets one update per touched subtree,
+ * and libraryWatch() picks the result up from idle database. Useful only when MPD's music is on this machine.
+ */
+
+#define WATCHER_DEBOUNCE 2000000 // Microseconds without events before we tell MPD
+#define WATCHER_MAX_DELAY 10000000 // Microseconds since the first event, for uploads that never stop
+#define WATCHER_POLL 1000 // Milliseconds between checks whether we should stop
+#define WATCHER_MAX_UPDATES 64 // More touched directories than that and we simply update everything
+#define WATCHER_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+struct watcher {
+	int fd;
+	char** paths; // Indexed by watch descriptor, relative to musicPath, NULL if unused
+	unsigned int pathsCapacity;
+	char** touched; // Directories waiting for update
+	unsigned int touchedCount;
+	unsigned int touchedCapacity;
+	uint64_t firstEvent; // metricsNow() of the batch, 0 if nothing is waiting
+	uint64_t lastEvent;
+	bool full; // Out of inotify watches, already said so
+	bool failed; // MPD didn't take the last batch, already said so
+	struct mpdConnection connection;
+};
+
+static pthread_t watcherThread = 0;
+static bool watcherIsWorking = false;
+
+// Watches directory and everything below it, existing watches (moved directories) just get their new path
+static void watcherAddTree(struct watcher* watcher, const char* path, const unsigned int depth) {
+	char fullPath[strlen(musicPath) + strlen(path) + 1];
+	snprintf(fullPath, sizeof(fullPath), "%s%s", musicPath, path);
+	const int wd = inotify_add_watch(watcher->fd, fullPath, WATCHER_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC && !watcher->full) {
+			watcher->full = true;
+			logErrorToConsole("Out of inotify watches, raise fs.inotify.max_user_watches, some directories aren't watched");
+		}
+		return;
+	}
+	if ((unsigned int) wd >= watcher->pathsCapacity) {
+		unsigned int capacity = watcher->pathsCapacity ? watcher->pathsCapacity * 2 : 1024;
+		while (capacity <= (unsigned int) wd) {
+			capacity *= 2;
+		}
+		char** paths = (char**) realloc(watcher->paths, capacity * sizeof(char*));
+		if (unlikely(!paths)) {
+			inotify_rm_watch(watcher->fd, wd);
+			return;
+		}
+		memset(paths + watcher->pathsCapacity, 0, (capacity - watcher->pathsCapacity) * sizeof(char*));
+		watcher->paths = paths;
+		watcher->pathsCapacity = capacity;
+	}
+	free(watcher->paths[wd]);
+	watcher->paths[wd] = strdup(path);
 
-static void zipFav(const char* fromUniqueIdentifier) {
-	char favFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(favFile, sizeof(favFile), "%s%s%s", favPath, fromUniqueIdentifier, ".txt");
-	char zipFile[strlen(favPath) + strlen(fromUniqueIdentifier) + 4 + 1];
-	snprintf(zipFile, sizeof(zipFile), "%s%s%s", favPath, fromUniqueIdentifier, ".zip");
-	struct stat st = {0};
-	if (stat(favFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		if (stat(zipFile, &st) != -1) { // If zipfile exists
-			if (unlikely(remove(zipFile))) { // Remove previous zipfile
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("remove() error");
-				return;
-			}
+	DIR* dir = depth < LIBRARY_WALK_MAX_DEPTH ? opendir(fullPath) : NULL;
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)) {
+			continue;
 		}
-		FILE *favStream = fopen(favFile, "r");
-		if (unlikely(!favStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			return;
+		char childPath[strlen(path) + 1 + strlen(entry->d_name) + 1];
+		snprintf(childPath, sizeof(childPath), "%s%s%s", path, *path ? "/" : "", entry->d_name);
+		watcherAddTree(watcher, childPath, depth + 1); // Files aren't directories, inotify tells us with IN_ONLYDIR
+	}
+	closedir(dir);
+}
+
+// Directory left musicPath (or moved inside, then it comes back with IN_MOVED_TO)
+static void watcherRemoveTree(struct watcher* watcher, const char* path) {
+	const size_t length = strlen(path);
+	for (unsigned int wd = 0; wd < watcher->pathsCapacity; ++wd) {
+		const char* watched = watcher->paths[wd];
+		if (watched != NULL && strncmp(watched, path, length) == 0 && (watched[length] == '\0' || watched[length] == '/')) {
+			inotify_rm_watch(watcher->fd, wd);
+			free(watcher->paths[wd]);
+			watcher->paths[wd] = NULL;
 		}
-		unsigned int mallocCount = 7 + strlen(zipFile) + 1 + 1;
-		char* command = (char*) malloc(mallocCount * sizeof(char));
-		if (unlikely(!command)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("malloc() error");
-			fclose(favStream);
-			return;
+	}
+}
+
+static void watcherTouch(struct watcher* watcher, const char* path) {
+	const uint64_t now = metricsNow();
+	if (watcher->firstEvent == 0) {
+		watcher->firstEvent = now;
+	}
+	watcher->lastEvent = now;
+	for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+		if (strcmp(watcher->touched[i], path) == 0 || watcher->touched[i][0] == '\0') {
+			return; // Already there, or we update everything anyway
 		}
-		snprintf(command, mallocCount, "%s%s%s", "zip -0 ", zipFile, " ");
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		while ((read = getline(&line, &len, favStream)) != -1) {
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			mallocCount += (1 + strlen(musicPath) + read + 2) * sizeof(char);
-			command = (char*) realloc(command, mallocCount);
-			if (unlikely(!command)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("malloc() error");
-				fclose(favStream);
-				free(line);
-				return;
-			}
-			strncat(command, "\"", 1);
-			strncat(command, musicPath, strlen(musicPath));
-			strncat(command, line, read);
-			strncat(command, "\" ", 2);
+	}
+	if (watcher->touchedCount == WATCHER_MAX_UPDATES || *path == '\0') {
+		for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+			free(watcher->touched[i]);
 		}
-		fclose(favStream);
-		free(line);
-		mallocCount += 10;
-		command = (char* ) realloc(command, mallocCount);
-		if (unlikely(!command)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("malloc() error");
+		watcher->touchedCount = 0;
+		path = "";
+	}
+	if (watcher->touchedCount == watcher->touchedCapacity) {
+		const unsigned int capacity = watcher->touchedCapacity ? watcher->touchedCapacity * 2 : 16;
+		char** touched = (char**) realloc(watcher->touched, capacity * sizeof(char*));
+		if (unlikely(!touched)) {
 			return;
 		}
-		strncat(command, ">/dev/null", 10);
-		sendMessageToChannel("Working...");
-		if (likely(executeCommandWithErrorToChannel(command))) {
-			char message[36 + strlen(favWebPath) + strlen(fromUniqueIdentifier) + 22 + 1];
-			snprintf(message, sizeof(message), "%s%s%s%s", "Done! You can find your zip [b][url=", favWebPath , fromUniqueIdentifier, ".zip]here[/url][/b] 8)");
-			sendMessageToChannel(message);
-		} else {
-			sendErrorToChannel("Error! :-(");
-		}
-		free(command);
-	} else {
-		sendMessageToChannel("You don't have any favs yet! 8)");
+		watcher->touched = touched;
+		watcher->touchedCapacity = capacity;
+	}
+	if (likely((watcher->touched[watcher->touchedCount] = strdup(path)) != NULL)) {
+		++watcher->touchedCount;
 	}
 }
 
-static void addTheme(const char* theme) {
-	FILE *themeStream = fopen(themeFile, "a+");
-	if (unlikely(!themeStream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("fopen() error");
+static int watcherComparePaths(const void* a, const void* b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Tells MPD about the batch in a single command list, MPD updates directories recursively, so subdirectories are left out
+static void watcherFlush(struct watcher* watcher) {
+	TRACE_SPAN("mpd", __func__);
+	qsort(watcher->touched, watcher->touchedCount, sizeof(char*), watcherComparePaths);
+	size_t commandSize = 20 + 17 + 1;
+	for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+		commandSize += 7 + 2 * strlen(watcher->touched[i]) + 3;
+	}
+	char* command = (char*) malloc(commandSize);
+	if (unlikely(!command)) {
 		return;
 	}
-	bool alreadyExists = false;
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	while ((read = getline(&line, &len, themeStream)) != -1) {
-		if (strncmp(theme, line, strlen(theme)) == 0) {
-			alreadyExists = true;
-			break;
+	size_t length = snprintf(command, commandSize, "%s", "command_list_begin\n");
+	unsigned int updates = 0;
+	const char* parent = NULL;
+	for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+		const char* path = watcher->touched[i];
+		const size_t parentLength = parent != NULL ? strlen(parent) : 0;
+		if (parent != NULL && strncmp(path, parent, parentLength) == 0 && path[parentLength] == '/') {
+			continue; // Sorted, so the parent was right before its children
 		}
+		parent = path;
+		memcpy(command + length, "update ", 7);
+		mpdQuote(command + length + 7, path);
+		length += strlen(command + length);
+		command[length++] = '\n';
+		++updates;
 	}
-	if (likely(line != NULL)) {
-		free(line);
+	memcpy(command + length, "command_list_end\n", 18);
+
+	if (watcher->connection.fd == -1 && !mpdConnect(&watcher->connection)) {
+		mpdDisconnect(&watcher->connection);
 	}
-	if (alreadyExists) {
-		fclose(themeStream);
-		sendMessageToChannel("This theme exists already! 8)");
+	const bool success = watcher->connection.fd != -1 && mpdCommand(&watcher->connection, command);
+	free(command);
+	if (unlikely(!success) && watcher->connection.fd == -1) { // MPD is away, keep the batch
+		if (!watcher->failed) {
+			watcher->failed = true;
+			logErrorToConsole(watcher->connection.error);
+			logErrorToConsole("MPD update failed, will try again");
+		}
+		watcher->firstEvent = watcher->lastEvent = metricsNow(); // Next attempt after another WATCHER_DEBOUNCE
+		return;
+	}
+	watcher->failed = false;
+	if (unlikely(!success)) { // ACK, trying again won't help
+		logErrorToConsole(watcher->connection.error);
 	} else {
-		fprintf(themeStream, "%s\n", theme);
-		fclose(themeStream);
-		sendMessageToChannel("Theme added! 8)");
+		metricsCount(METRIC_WATCHER_UPDATES);
+		char message[128];
+		snprintf(message, sizeof(message), "Watcher asked MPD to update %u director%s", updates, updates == 1 ? "y" : "ies");
+		logToConsole(message);
 	}
+	for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+		free(watcher->touched[i]);
+	}
+	watcher->touchedCount = 0;
+	watcher->firstEvent = watcher->lastEvent = 0;
 }
 
-static void getTheme(const char* theme) {
-	struct stat st = {0};
-	if (stat(themeFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		FILE *themeStream = fopen(themeFile, "r");
-		if (unlikely(!themeStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			return;
-		}
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		bool found = false;
-		if (theme == NULL) {
-			while ((read = getline(&line, &len, themeStream)) != -1) {
-				found = true;
-				line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-				sendMessageToChannel(line);
-			}
-		} else {
-			while ((read = getline(&line, &len, themeStream)) != -1) {
-				if (strcasestr(line, theme) != NULL) {
-					found = true;
-					line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-					sendMessageToChannel(line);
-				}
-			}
-		}
-		fclose(themeStream);
-		free(line);
-		if (!found) {
-			sendMessageToChannel("Couldn't find anything! :-(");
+static void watcherHandle(struct watcher* watcher, const struct inotify_event* event) {
+	if (event->mask & IN_Q_OVERFLOW) { // We lost track of what happened, rescan everything
+		metricsCount(METRIC_WATCHER_OVERFLOWS);
+		watcherAddTree(watcher, "", 0);
+		watcherTouch(watcher, "");
+		return;
+	}
+	if (event->wd < 0 || (unsigned int) event->wd >= watcher->pathsCapacity || watcher->paths[event->wd] == NULL) {
+		return; // Already removed with its tree
+	}
+	if (event->mask & IN_IGNORED) {
+		free(watcher->paths[event->wd]);
+		watcher->paths[event->wd] = NULL;
+		return;
+	}
+	if (event->len == 0 || event->name[0] == '.') {
+		return; // MPD skips hidden files too, that includes partial downloads of most tools
+	}
+	const char* directory = watcher->paths[event->wd];
+	char path[strlen(directory) + 1 + strlen(event->name) + 1];
+	snprintf(path, sizeof(path), "%s%s%s", directory, *directory ? "/" : "", event->name);
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watcherAddTree(watcher, path, 0); // Files could have got there before we started watching
+		} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			watcherRemoveTree(watcher, path);
 		}
-	} else {
-		sendMessageToChannel("No themes added yet! 8)");
 	}
+	watcherTouch(watcher, watcher->paths[event->wd] != NULL ? watcher->paths[event->wd] : "");
 }
 
-static void setTheme(const char* theme, const bool fixed) {
-	if (!fixed) {
-		struct stat st = {0};
-		if (stat(themeFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-			FILE *themeStream = fopen(themeFile, "r");
-			if (unlikely(!themeStream)) {
-				sendErrorToChannel(strerror(errno));
-				sendErrorToChannel("fopen() error");
-				return;
-			}
-			char* line = NULL;
-			size_t len = 0;
-			ssize_t read = -1;
-			bool found = false;
-			while ((read = getline(&line, &len, themeStream)) != -1) {
-				if (strcasestr(line, theme) != NULL) {
-					sendMessageToChannel("Tagging...");
-					found = true;
-					line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-					char* output = NULL;
-					if (likely(executeCommandWithOutput("mpc current -f %file% 2>&1", &output))) {
-						char command[19 + read + 3 + strlen(musicPath) + strlen(output) + 6 + 1];
-						snprintf(command, sizeof(command), "%s%s%s%s%s%s", "id3v2 -2 -c \"Theme:", line, "\" \"", musicPath, output, "\" 2>&1");
-						free(output);
-						if (likely(executeCommandWithErrorToChannel(command))) {
-							executeCommandWithErrorToChannel("mpc update --wait >/dev/null");
-							char message[15 + read + 1];
-							snprintf(message, sizeof(message), "%s%s", "Classified as: ", line);
-							sendMessageToChannel(message);
-						}
-					} else {
-						sendErrorToChannel("executeCommandWithOutput() error");
-					}
-					break;
-				}
+static void *watcherWorker(void *args) {
+	struct watcher* watcher = (struct watcher*) calloc(1, sizeof(struct watcher));
+	if (unlikely(!watcher)) {
+		logErrorToConsole("calloc() error");
+		return NULL;
+	}
+	watcher->connection.fd = -1;
+	watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (unlikely(watcher->fd == -1)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("inotify_init1() error");
+		free(watcher);
+		return NULL;
+	}
+	watcherAddTree(watcher, "", 0);
+	if (watcher->pathsCapacity == 0) { // musicPath isn't here, MPD is on another machine
+		close(watcher->fd);
+		free(watcher);
+		return NULL;
+	}
+
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (__atomic_load_n(&watcherIsWorking, __ATOMIC_RELAXED)) {
+		int timeout = WATCHER_POLL;
+		if (watcher->touchedCount != 0) {
+			const uint64_t now = metricsNow();
+			const uint64_t due = watcher->lastEvent + WATCHER_DEBOUNCE < watcher->firstEvent + WATCHER_MAX_DELAY ? watcher->lastEvent + WATCHER_DEBOUNCE : watcher->firstEvent + WATCHER_MAX_DELAY;
+			if (due <= now) {
+				watcherFlush(watcher);
+				continue;
 			}
-			fclose(themeStream);
-			free(line);
-			if (!found) {
-				sendMessageToChannel("Couldn't find anything! :-(");
+			if ((due - now) / 1000 < (uint64_t) timeout) {
+				timeout = (due - now) / 1000 + 1;
 			}
-		} else {
-			sendMessageToChannel("No themes added yet! 8)");
 		}
-	} else {
-		char* output = NULL;
-		if (likely(executeCommandWithOutput("mpc current -f %file% 2>&1", &output))) {
-			char command[19 + strlen(theme) + 3 + strlen(musicPath) + strlen(output) + 6 + 1];
-			snprintf(command, sizeof(command), "%s%s%s%s%s%s", "id3v2 -2 -c \"Theme:", theme, "\" \"", musicPath, output, "\" 2>&1");
-			free(output);
-			if (likely(executeCommandWithErrorToChannel(command))) {
-				executeCommandWithErrorToChannel("mpc update --wait >/dev/null");
-				char message[15 + strlen(theme) + 1];
-				snprintf(message, sizeof(message), "%s%s", "Classified as: ", theme);
-				sendMessageToChannel(message);
+		struct pollfd pollfds[2] = { { .fd = watcher->fd, .events = POLLIN }, { .fd = lifecycleWakeFd, .events = POLLIN } };
+		if (poll(pollfds, 2, timeout) <= 0 || pollfds[0].revents == 0) {
+			continue;
+		}
+		ssize_t length;
+		while ((length = read(watcher->fd, buffer, sizeof(buffer))) > 0) {
+			for (char* event = buffer; event < buffer + length; event += sizeof(struct inotify_event) + ((struct inotify_event*) event)->len) {
+				watcherHandle(watcher, (struct inotify_event*) event);
 			}
-		} else {
-			sendErrorToChannel("executeCommandWithOutput() error");
 		}
 	}
+
+	if (watcher->touchedCount != 0) { // Otherwise MPD finds out about the last uploads only with the next !update
+		watcherFlush(watcher);
+	}
+	mpdDisconnect(&watcher->connection);
+	close(watcher->fd);
+	for (unsigned int i = 0; i < watcher->pathsCapacity; ++i) {
+		free(watcher->paths[i]);
+	}
+	free(watcher->paths);
+	for (unsigned int i = 0; i < watcher->touchedCount; ++i) {
+		free(watcher->touched[i]);
+	}
+	free(watcher->touched);
+	free(watcher);
+	return NULL;
 }
 
-static void playTheme(const char* regex) {
-	struct stat st = {0};
-	if (stat(themeFile, &st) != -1 && st.st_size != 0) { // If file exists and is non-empty
-		FILE *themeStream = fopen(themeFile, "r");
-		if (unlikely(!themeStream)) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("fopen() error");
-			return;
+static void watcherWake() {
+	__atomic_store_n(&watcherIsWorking, false, __ATOMIC_RELAXED);
+}
+
+static void watcherStart() {
+	watcherIsWorking = true;
+	if (unlikely(!lifecycleThreadStart(&watcherThread, "Watcher", &watcherWorker, &watcherWake))) {
+		logErrorToConsole("pthread_create() error");
+		watcherIsWorking = false;
+	}
+}
+
+static void watcherStop() {
+	if (watcherThread != 0) {
+		watcherWake();
+		lifecycleThreadJoin(&watcherThread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+	}
+}
+
+static pthread_mutex_t metricsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metricsCond = PTHREAD_COND_INITIALIZER;
+static pthread_t metricsThread = 0;
+static bool metricsIsWorking = false;
+
+// Sums up all shards into a fresh one, caller frees
+static struct metricsShard* metricsCollect() {
+	struct metricsShard* total = (struct metricsShard*) calloc(1, sizeof(struct metricsShard));
+	if (unlikely(!total)) {
+		return NULL;
+	}
+	for (struct metricsShard* shard = __atomic_load_n(&metricsShards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+		for (unsigned int i = 0; i < METRIC_COUNTERS; ++i) {
+			total->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
 		}
-		char* line = NULL;
-		size_t len = 0;
-		ssize_t read = -1;
-		bool found = false;
-		while ((read = getline(&line, &len, themeStream)) != -1) {
-			if (strcasestr(line, regex) != NULL) {
-				char foundTheme[read + 1];
-				strncpy(foundTheme, line, sizeof(foundTheme));
-				foundTheme[strcspn(foundTheme, "\r\n")] = 0; // Make sure that there are no newlines
-				FILE *stream = popen("mpc -f %comment%:%file% listall 2>&1", "r");
-				if (unlikely(!stream)) {
-					sendErrorToChannel(strerror(errno));
-					sendErrorToChannel("popen() error");
-					fclose(themeStream);
-					free(line);
-					return;
-				}
-				executeCommandWithErrorToChannel("mpc clear >/dev/null");
-				while ((read = getline(&line, &len, stream)) != -1) {
-					if (strcasestr(line, foundTheme) != NULL) {
-						found = true;
-						char foundFile[read + 1];
-						getArgWithDelimiter(foundFile, line, 1, ":");
-						foundFile[strcspn(foundFile, "\r\n")] = 0; // Make sure that there are no newlines
-						//removeChar(foundFile, '\'');
-						char command[19 + read + 6 + 1];
-						snprintf(command, sizeof(command), "%s%s%s", "mpc add -f %file% \"", foundFile, "\" 2>&1");
-						if (likely(executeCommandWithErrorToChannel(command))) {
-							char message[7 + strlen(foundFile) + 1];
-							snprintf(message, sizeof(message), "%s%s", "Added: ", foundFile);
-							sendMessageToChannel(message);
-						}
-					}
-				}
-				pclose(stream);
-				break;
+		for (unsigned int command = 0; command < METRICS_COMMANDS; ++command) {
+			const uint64_t count = __atomic_load_n(&shard->commandCount[command], __ATOMIC_RELAXED);
+			if (count == 0) {
+				continue;
+			}
+			total->commandCount[command] += count;
+			total->commandSum[command] += __atomic_load_n(&shard->commandSum[command], __ATOMIC_RELAXED);
+			const uint64_t max = __atomic_load_n(&shard->commandMax[command], __ATOMIC_RELAXED);
+			if (max > total->commandMax[command]) {
+				total->commandMax[command] = max;
+			}
+			for (unsigned int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+				total->histogram[command][bucket] += __atomic_load_n(&shard->histogram[command][bucket], __ATOMIC_RELAXED);
 			}
 		}
-		fclose(themeStream);
-		free(line);
-		if (found) {
-			sendMessageToChannel("---");
-			executeCommandWithOutputToChannel("mpc play 2>&1");
-		} else {
-			sendMessageToChannel("Couldn't find anything! :-(");
-			sendMessageToChannel("---");
-			resetPlaylist();
-		}
-	} else {
-		sendMessageToChannel("No themes added yet! 8)");
 	}
+	return total;
 }
 
-static void delSong() {
-	char* output = NULL;
-	if (likely(executeCommandWithOutput("mpc current -f %file% 2>&1", &output))) {
-		char fileToDelete[strlen(musicPath) + strlen(output) + 1];
-		snprintf(fileToDelete, sizeof(fileToDelete), "%s%s", musicPath, output);
-		free(output);
-		executeCommandWithErrorToChannel("mpc clear >/dev/null");
-		if (unlikely(remove(fileToDelete))) {
-			sendErrorToChannel(strerror(errno));
-			sendErrorToChannel("remove() error");
+static uint64_t metricsPercentile(const struct metricsShard* total, const unsigned int command, const unsigned int percentile) {
+	uint64_t histogramCount = 0;
+	for (unsigned int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+		histogramCount += total->histogram[command][bucket];
+	}
+	const uint64_t target = (histogramCount * percentile + 99) / 100;
+	uint64_t seen = 0;
+	for (unsigned int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+		seen += total->histogram[command][bucket];
+		if (seen >= target && seen > 0) {
+			const uint64_t bound = metricsBucketUpperBound(bucket);
+			return bound < total->commandMax[command] ? bound : total->commandMax[command];
 		}
-		resetPlaylist();
-	} else {
-		sendErrorToChannel("executeCommandWithOutput() error");
 	}
+	return total->commandMax[command];
 }
 
-static inline void pokeID(const anyID toPoke, const char* pokeMessage) {
-	if (ts3Functions.requestClientPoke(myServerConnectionHandlerID, toPoke, pokeMessage, NULL) != ERROR_ok) {
-		sendErrorToChannel("requestClientPoke() error");
+static void metricsSendReport() {
+	struct metricsShard* total = metricsCollect();
+	if (unlikely(!total)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("calloc() error");
+		return;
+	}
+	bool anything = false;
+	for (unsigned int command = 0; command < METRICS_COMMANDS; ++command) {
+		const uint64_t count = total->commandCount[command];
+		if (count == 0) {
+			continue;
+		}
+		anything = true;
+		char message[256];
+		snprintf(message, sizeof(message), "%s: %" PRIu64 "x, avg %.1f ms, p50 %.1f ms, p99 %.1f ms, max %.1f ms", metricsCommandNames[command], count,
+			total->commandSum[command] / 1000.0 / count, metricsPercentile(total, command, 50) / 1000.0,
+			metricsPercentile(total, command, 99) / 1000.0, total->commandMax[command] / 1000.0);
+		sendMessageToChannel(message);
+	}
+	if (!anything) {
+		sendMessageToChannel("No commands recorded yet! 8)");
+	}
+	sendMessageToChannel("----------");
+	char message[512];
+	int len = 0;
+	for (unsigned int i = 0; i < METRIC_COUNTERS + METRIC_GAUGES; ++i) { // As many messages as it takes
+		char metric[128];
+		if (i < METRIC_COUNTERS) {
+			snprintf(metric, sizeof(metric), "%s: %" PRIu64, metricsCounterNames[i], total->counters[i]);
+		} else {
+			snprintf(metric, sizeof(metric), "%s: %" PRId64, metricsGaugeNames[i - METRIC_COUNTERS], __atomic_load_n(&metricsGauges[i - METRIC_COUNTERS], __ATOMIC_RELAXED));
+		}
+		if (len != 0 && len + 2 + strlen(metric) >= sizeof(message)) {
+			sendMessageToChannel(message);
+			len = 0;
+		}
+		len += snprintf(message + len, sizeof(message) - len, "%s%s", len ? ", " : "", metric);
+	}
+	sendMessageToChannel(message);
+	len = snprintf(message, sizeof(message), "%s", "Caches:");
+	for (unsigned int i = 0; i < sizeof(metricsCaches) / sizeof(metricsCaches[0]) && len < (int) sizeof(message); ++i) {
+		const uint64_t hits = total->counters[metricsCaches[i].hits];
+		const uint64_t lookups = hits + total->counters[metricsCaches[i].hits + 1];
+		len += snprintf(message + len, sizeof(message) - len, "%s %s %.1f%% (%" PRIu64 "/%" PRIu64 ")", i ? "," : "", metricsCaches[i].name, lookups ? 100.0 * hits / lookups : 0.0, hits, lookups);
+	}
+	if (__atomic_load_n(&warmupIsDone, __ATOMIC_ACQUIRE)) {
+		snprintf(message + len, len < (int) sizeof(message) ? sizeof(message) - len : 0, ", warm-up took %.1f ms", __atomic_load_n(&warmupDuration, __ATOMIC_RELAXED) / 1000.0);
+	} else if (warmupThread != 0) {
+		snprintf(message + len, len < (int) sizeof(message) ? sizeof(message) - len : 0, "%s", ", warm-up in progress");
 	}
+	sendMessageToChannel(message);
+	free(total);
 }
 
-static void pokeUser(const char* toPoke, const char* pokeMessage, const unsigned int howManyTimes) {
-	anyID *clients;
-	if (unlikely(ts3Functions.getClientList(myServerConnectionHandlerID, &clients) != ERROR_ok)) {
-		sendErrorToChannel("getClientList() error");
-		return;
+static void metricsWritePrometheus(FILE* stream, const struct metricsShard* total) {
+	for (unsigned int i = 0; i < METRIC_COUNTERS; ++i) {
+		fprintf(stream, "# TYPE architsmbot_%s counter\narchitsmbot_%s %" PRIu64 "\n", metricsCounterNames[i], metricsCounterNames[i], total->counters[i]);
 	}
-	bool found = false;
-	for (unsigned int i = 0; clients[i] != '\0'; ++i) {
-		char* clientName = NULL;
-		if (likely(ts3Functions.getClientVariableAsString(myServerConnectionHandlerID, clients[i], CLIENT_NICKNAME, &clientName)) == ERROR_ok) {
-			if (strcasecmp(toPoke, clientName) == 0) {
-				found = true;
-				char message[7 + strlen(clientName) + 1];
-				snprintf(message, sizeof(message), "%s%s", "Poked: ", clientName);
-				ts3Functions.freeMemory(clientName);
-				for (unsigned int pokeNum = howManyTimes; pokeNum > 0; --pokeNum) {
-					pokeID(clients[i], pokeMessage);
-				}
-				sendMessageToChannel(message);
-				break;
+	for (unsigned int i = 0; i < METRIC_GAUGES; ++i) {
+		fprintf(stream, "# TYPE architsmbot_%s gauge\narchitsmbot_%s %" PRId64 "\n", metricsGaugeNames[i], metricsGaugeNames[i], __atomic_load_n(&metricsGauges[i], __ATOMIC_RELAXED));
+	}
+	fprintf(stream, "# TYPE architsmbot_command_duration_seconds histogram\n");
+	for (unsigned int command = 0; command < METRICS_COMMANDS; ++command) {
+		if (total->commandCount[command] == 0) {
+			continue;
+		}
+		// Only power-of-two boundaries, so the bucket set stays stable and readable
+		uint64_t cumulative = 0;
+		for (unsigned int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket) {
+			cumulative += total->histogram[command][bucket];
+			if (bucket % METRICS_HISTOGRAM_SUB_BUCKETS == METRICS_HISTOGRAM_SUB_BUCKETS - 1) {
+				fprintf(stream, "architsmbot_command_duration_seconds_bucket{command=\"%s\",le=\"%.6f\"} %" PRIu64 "\n", metricsCommandNames[command], (metricsBucketUpperBound(bucket) + 1) / 1e6, cumulative);
 			}
-			ts3Functions.freeMemory(clientName);
-		} else {
-			sendErrorToChannel("getClientVariableAsString() error");
-			ts3Functions.freeMemory(clients);
-			return;
 		}
-	}
-	ts3Functions.freeMemory(clients);
-	if (!found) {
-		sendMessageToChannel("Couldn't find anybody! :-(");
+		fprintf(stream, "architsmbot_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", metricsCommandNames[command], cumulative);
+		fprintf(stream, "architsmbot_command_duration_seconds_sum{command=\"%s\"} %.6f\n", metricsCommandNames[command], total->commandSum[command] / 1e6);
+		fprintf(stream, "architsmbot_command_duration_seconds_count{command=\"%s\"} %" PRIu64 "\n", metricsCommandNames[command], total->commandCount[command]);
 	}
 }
 
-static void guessSong(const char* guess) {
-	FILE *stream = popen("mpc -f %artist% current 2>&1", "r");
-	if (unlikely(!stream)) {
-		sendErrorToChannel(strerror(errno));
-		sendErrorToChannel("popen() error");
+static void metricsDump() {
+	struct metricsShard* total = metricsCollect();
+	if (unlikely(!total)) {
+		logErrorToConsole("calloc() error");
 		return;
 	}
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read = -1;
-	bool found = false;
-	while ((read = getline(&line, &len, stream)) != -1) {
-		if (strcasestr(line, guess) != NULL) {
-			found = true;
-			line[strcspn(line, "\r\n")] = 0; // Make sure that there are no newlines
-			//removeChar(line, '\'');
-			char message[19 + read + 4 + 1];
-			snprintf(message, sizeof(message), "%s%s%s", "That's right! It's ", line, "! 8)");
-			sendMessageToChannel(message);
-			break;
-		}
+	char metricsFileTemp[strlen(metricsFile) + 4 + 1];
+	snprintf(metricsFileTemp, sizeof(metricsFileTemp), "%s%s", metricsFile, ".new");
+	FILE* stream = fopen(metricsFileTemp, "w");
+	if (unlikely(!stream)) {
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("fopen() error");
+		free(total);
+		return;
 	}
-	pclose(stream);
-	if (line != NULL) {
-		free(line);
+	metricsWritePrometheus(stream, total);
+	fclose(stream);
+	free(total);
+	if (unlikely(rename(metricsFileTemp, metricsFile))) { // Readers never see half-written file
+		logErrorToConsole(strerror(errno));
+		logErrorToConsole("rename() error");
 	}
-	if (!found) {
-		sendMessageToChannel("Nope, try again! 8)");
+}
+
+static void *metricsWorker(void *args) {
+	pthread_mutex_lock(&metricsMutex);
+	while (metricsIsWorking) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += METRICS_DUMP_INTERVAL;
+		while (metricsIsWorking && pthread_cond_timedwait(&metricsCond, &metricsMutex, &deadline) != ETIMEDOUT);
+		if (!metricsIsWorking) {
+			break; // Final one comes from ts3plugin_shutdown()
+		}
+		pthread_mutex_unlock(&metricsMutex);
+		metricsDump();
+		pthread_mutex_lock(&metricsMutex);
 	}
+	pthread_mutex_unlock(&metricsMutex);
+	return NULL;
 }
 
+static void metricsWake() {
+	pthread_mutex_lock(&metricsMutex);
+	metricsIsWorking = false;
+	pthread_cond_signal(&metricsCond);
+	pthread_mutex_unlock(&metricsMutex);
+}
 
+static void metricsStart() {
+	pthread_mutex_lock(&metricsMutex);
+	metricsIsWorking = true;
+	pthread_mutex_unlock(&metricsMutex);
+	if (unlikely(!lifecycleThreadStart(&metricsThread, "Metrics", &metricsWorker, &metricsWake))) {
+		logErrorToConsole("pthread_create() error");
+		metricsIsWorking = false;
+	}
+}
 
+// Only once no other thread of ours is left, threads that stay (TS3's) get new shards on their next count
+static void metricsFree() {
+	struct metricsShard* shard = __atomic_exchange_n(&metricsShards, NULL, __ATOMIC_ACQ_REL);
+	__atomic_add_fetch(&metricsGeneration, 1, __ATOMIC_RELEASE);
+	while (shard != NULL) {
+		struct metricsShard* next = shard->next;
+		free(shard);
+		shard = next;
+	}
+}
 
+// Final dump is up to the caller, once everything that could still count is gone
+static void metricsStop() {
+	if (metricsThread != 0) {
+		metricsWake();
+		lifecycleThreadJoin(&metricsThread, metricsNow() + LIFECYCLE_JOIN_TIMEOUT * 1000ULL);
+	}
+}
 
-static bool notifyWorkerIsRunning() {
-	if (notifyThread != 0) {
-		if (pthread_kill(notifyThread, 0) != ESRCH) {
-			return true;
-		} else {
-			notifyThread = 0; // So we won't try to send signal to invalid pthread next time
-		}
+static void traceSetEnabled(const bool enabled) {
+	if (enabled) {
+		__atomic_store_n(&traceStartedAt, traceNow(), __ATOMIC_RELAXED); // Older events are left out of the next dump
 	}
-	return false;
+	__atomic_store_n(&traceEnabled, enabled, __ATOMIC_RELAXED);
 }
 
-static void *notifyWorker(void *args) {
-	char* output = NULL;
-	while (executeCommandWithOutput("mpc current --wait 2>&1", &output) && notifyIsWorking) {
-		sendMessageToChannel_2("Current song: ", output);
-		free(output);
-		output = NULL;
+static void traceDump() {
+	char traceFileTemp[strlen(traceFile) + 4 + 1];
+	snprintf(traceFileTemp, sizeof(traceFileTemp), "%s%s", traceFile, ".new");
+	FILE* stream = fopen(traceFileTemp, "w");
+	if (unlikely(!stream)) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("fopen() error");
+		return;
 	}
-	if (output != NULL) {
-		free(output);
+	const pid_t pid = getpid();
+	const uint64_t startedAt = __atomic_load_n(&traceStartedAt, __ATOMIC_RELAXED);
+	unsigned long int written = 0;
+	fprintf(stream, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (struct traceRing* ring = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (uint64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head; ++i) {
+			const struct traceEvent event = ring->events[i & (TRACE_RING_SIZE - 1)];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - i >= TRACE_RING_SIZE) {
+				continue; // Owner thread wrapped around and is overwriting this slot
+			}
+			if (event.start < startedAt) {
+				continue;
+			}
+			fprintf(stream, "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", written ? "," : "",
+				event.category, event.name, event.start / 1000.0, event.duration / 1000.0, (int) pid, (int) ring->tid);
+			++written;
+		}
 	}
-	return NULL;
+	fprintf(stream, "\n]}\n");
+	fclose(stream);
+	if (unlikely(rename(traceFileTemp, traceFile))) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("rename() error");
+		return;
+	}
+	char message[16 + 20 + 10 + strlen(traceFile) + 1];
+	snprintf(message, sizeof(message), "%s%lu%s%s", "Trace saved: ", written, " events in ", traceFile);
+	sendMessageToChannel(message);
 }
 
-/*static bool pokeWorkerIsRunning() {
-	if (pokeThread != 0) {
-		if (pthread_kill(pokeThread, 0) != ESRCH) {
-			return true;
-		} else {
-			pokeThread = 0; // So we won't try to send signal to invalid pthread next time
+// Views of arguments of a command, words are split by spaces and joined back with single ones
+struct commandArgs {
+	const char* first; // Word right after the command
+	const char* rest; // Everything after the command
+	const char* afterFirst; // Everything after the first word
+};
+
+// All views share one arena allocation, false (with ENOMEM) if arena is full
+static bool commandArgsParse(const char* message, struct commandArgs* args) {
+	TRACE_SPAN("parse", __func__);
+	const size_t length = strlen(message);
+	char* first = (char*) arenaAlloc(2 * (length + 1));
+	if (unlikely(!first)) {
+		return false;
+	}
+	char* rest = first + length + 1;
+	size_t restLength = 0;
+	unsigned int word = 0;
+	args->afterFirst = NULL;
+	first[0] = '\0';
+	for (const char* p = message + strspn(message, " "); *p != '\0'; p += strspn(p, " ")) {
+		const size_t wordLength = strcspn(p, " ");
+		if (word == 1) {
+			memcpy(first, p, wordLength);
+			first[wordLength] = '\0';
+		} else if (word == 2) {
+			args->afterFirst = rest + restLength + 1;
 		}
+		if (word != 0) {
+			if (restLength != 0) {
+				rest[restLength++] = ' ';
+			}
+			memcpy(rest + restLength, p, wordLength);
+			restLength += wordLength;
+		}
+		p += wordLength;
+		++word;
 	}
-	return false;
+	rest[restLength] = '\0';
+	args->first = first;
+	args->rest = rest;
+	if (args->afterFirst == NULL) {
+		args->afterFirst = rest + restLength;
+	}
+	return true;
 }
 
-static void *pokeWorker(void *args) {
-	while (pokeIsWorking) {
-		if (pokeID(toPokeID, "")) {
-			sleep(1);
+// Whatever comes from the arena is freed by loopRunCommand() once we're done
+static void handleCommand(const anyID fromID, const char* fromName, const char* fromUniqueIdentifier, const char* message) {
+	struct commandArgs args;
+	if (unlikely(!commandArgsParse(message, &args))) {
+		sendErrorToChannel(strerror(errno));
+		sendErrorToChannel("arenaAlloc() error");
+		return;
+	}
+	if (strcasecmp(message, "!shh") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			silence = !silence;
+			sendMessageToChannel("( ͡° ͜ʖ ͡°)");
+		}
+	} else if (strncasecmp(message, "!addartist ", 11) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addArtist(args.rest, true);
+		}
+	} else if (strncasecmp(message, "!addartists ", 12) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addArtist(args.rest, false);
+		}
+	} else if (strncasecmp(message, "!addfile ", 9) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addFile(args.rest, true);
+		}
+	} else if (strncasecmp(message, "!addfiles ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addFile(args.rest, false);
+		}
+	} else if (strncasecmp(message, "!addsong ", 9) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addSong(args.rest, true);
+		}
+	} else if (strncasecmp(message, "!addsongs ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addSong(args.rest, false);
+		}
+	} else if (strncasecmp(message, "!addtheme ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addTheme(args.rest);
+		}
+	} else if (strncasecmp(message, "!addtree ", 9) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			addTree(args.rest);
+		}
+	} else if (strncasecmp(message, "!artist ", 8) == 0) {
+		getArtist(args.rest, true);
+	} else if (strcasecmp(message, "!artists") == 0) {
+		executeCommandWithOutputToChannel("mpc ls 2>&1");
+	} else if (strncasecmp(message, "!artists ", 9) == 0) {
+		getArtist(args.rest, false);
+	} else if (strcasecmp(message, "!cancel") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			laneCancel(false);
+		}
+	} else if (strcasecmp(message, "!cancel all") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			laneCancel(true);
+		}
+	} else if (strcasecmp(message, "!clear") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc clear 2>&1");
+		}
+	} else if (strcasecmp(message, "!consume") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc consume 2>&1");
+		}
+#ifdef ARCHI_DEBUG
+	} else if (strcasecmp(message, "!debug") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendErrorToChannel("Pompf");
+		}
+	} else if (strncasecmp(message, "!debug ", 7) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendErrorToChannel(args.first);
+		}
+#endif
+	} else if (strcasecmp(message, "!fav") == 0) {
+		addFav(fromUniqueIdentifier, true);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strcasecmp(message, "!fav?") == 0) {
+		addFav(fromUniqueIdentifier, false);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strcasecmp(message, "!favs") == 0) {
+		getFav(fromUniqueIdentifier);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strncasecmp(message, "!favs ", 6) == 0) {
+		getFav(args.rest);
+	} else if (strcasecmp(message, "!file") == 0) {
+		executeCommandWithOutputToChannel("mpc -f %file% current 2>&1");
+	} else if (strncasecmp(message, "!file ", 6) == 0) {
+		getFile(args.rest, true);
+	} else if (strcasecmp(message, "!files") == 0) {
+		executeCommandWithOutputToChannel("mpc -f %file% listall 2>&1");
+	} else if (strncasecmp(message, "!files ", 7) == 0) {
+		getFile(args.rest, false);
+	} else if (strcasecmp(message, "!fixfavs") == 0) {
+		fixFavs(fromUniqueIdentifier);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strncasecmp(message, "!fuzzy ", 7) == 0) {
+		getFuzzy(args.rest);
+	} else if (strncasecmp(message, "!guess ", 7) == 0) {
+		guessSong(args.rest);
+	} else if (strcasecmp(message, "!lastfav") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(fromUniqueIdentifier, LAST, false);
+			refreshFavSymlink(fromName, fromUniqueIdentifier);
+		}
+	} else if (strncasecmp(message, "!lastfav ", 9) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(args.rest, LAST, false);
+		}
+	} else if (strcasecmp(message, "!ls") == 0) {
+		listTree("");
+	} else if (strncasecmp(message, "!ls ", 4) == 0) {
+		listTree(args.rest);
+	} else if (strcasecmp(message, "!next") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc next 2>&1");
+		}
+	} else if (strcasecmp(message, "!nextfav") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(fromUniqueIdentifier, RANDOM, true);
+			refreshFavSymlink(fromName, fromUniqueIdentifier);
+		}
+	} else if (strncasecmp(message, "!nextfav ", 9) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(args.rest, RANDOM, true);
+		}
+	} else if (strcasecmp(message, "!notify") == 0) {
+		const bool on = !__atomic_load_n(&notifyIsWorking, __ATOMIC_ACQUIRE);
+		if (unlikely(!notifySwitch(on))) {
+			sendErrorToChannel("Notifier isn't running! :-(");
+		} else if (on) {
+			sendMessageToChannel("Notifier: ON! Title of every song will be displayed! 8)");
 		} else {
-			pokeIsWorking = false;
+			sendMessageToChannel("Notifier: OFF! Silence is golden! 8)");
+		}
+	} else if (strcasecmp(message, "!pause") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc toggle 2>&1");
+		}
+	} else if (strcasecmp(message, "!perf") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			metricsSendReport();
+		}
+	} else if (strcasecmp(message, "!play") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc play 2>&1");
+		}
+	} else if (strncasecmp(message, "!play ", 6) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playNum(args.rest);
+		}
+	} else if (strcasecmp(message, "!playfavs") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(fromUniqueIdentifier, ALL, false);
+		}
+	} else if (strncasecmp(message, "!playfavs ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(args.rest, ALL, false);
+		}
+	} else if (strncasecmp(message, "!playfile ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFile(args.rest);
+		}
+	} else if (strncasecmp(message, "!playsong ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playSong(args.rest);
+		}
+	} else if (strncasecmp(message, "!playtheme ", 11) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playTheme(args.rest);
+		}
+	} else if (strncasecmp(message, "!poke ", 6) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			pokeUser(args.first, args.afterFirst, 1);
+		}
+/*	} else if (strcasecmp(message, "!pokespam") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			if (pokeIsWorking) {
+				pokeIsWorking = false;
+				sendMessageToChannel("Stopped spamming! 8)");
+			}
+		}*/
+	} else if (strncasecmp(message, "!pokespam ", 10) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			pokeUser(args.first, args.afterFirst, 5000);
+/*			if (pokeIsWorking) {
+				pokeIsWorking = false;
+				sendMessageToChannel("Stopped spamming! 8)");
+			} else if (!pokeWorkerIsRunning()) {
+				pokeIsWorking = true;
+				toPokeID = getClientIDfromClientName(args.first);
+				if (unlikely(pthread_create(&pokeThread, NULL, &pokeWorker, (void*) NULL))) {
+					sendErrorToChannel("pthread_create() error");
+					return;
+				} else {
+					pthread_detach(pokeThread);
+					sendMessageToChannel("Started spamming! 8)");
+				}
+			} else {
+				sendMessageToChannel("Wait a moment! 8)");
+			}*/
 		}
+	} else if (strcasecmp(message, "!prev") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc prev 2>&1");
+		}
+	} else if (strcasecmp(message, "!random") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc random 2>&1");
+		}
+	} else if (strcasecmp(message, "!randomfav") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(fromUniqueIdentifier, RANDOM, false);
+			refreshFavSymlink(fromName, fromUniqueIdentifier);
+		}
+	} else if (strncasecmp(message, "!randomfav ", 11) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			playFav(args.rest, RANDOM, false);
+		}
+	} else if (strncasecmp(message, "!rankfav ", 9) == 0) {
+		rankFav(fromUniqueIdentifier, args.rest);
+	} else if (strcasecmp(message, "!repeat") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc repeat 2>&1");
+		}
+	} else if (strcasecmp(message, "!reset") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			resetPlaylist(false, false);
+		}
+	} else if (strncasecmp(message, "!reset ", 7) == 0) { // Options "keep" (current song) and "shuffle", in any order
+		if (isAccessGranted(fromID, rootGroup)) {
+			bool keepCurrent;
+			bool shuffle;
+			if (resetOptionsParse(args.rest, &keepCurrent, &shuffle)) {
+				resetPlaylist(keepCurrent, shuffle);
+			}
+		}
+	} else if (strcasecmp(message, "!restart") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendErrorToChannel("Empty placeholder! :-("); // TODO
+		}
+	} else if (strncasecmp(message, "!say ", 5) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendMessageToChannel(args.rest);
+		}
+	} else if (strcasecmp(message, "!shuffle") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc shuffle 2>&1");
+		}
+	} else if (strcasecmp(message, "!single") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc single 2>&1");
+		}
+	} else if (strcasecmp(message, "!song") == 0) {
+		executeCommandWithOutputToChannel("mpc -f \"Artist: %artist%\nAlbum: %album%\nTitle: %title%\nTheme: %comment%\nLength: %time%\" current 2>&1");
+	} else if (strncasecmp(message, "!song ", 6) == 0) {
+		getSong(args.rest, true);
+	} else if (strcasecmp(message, "!songs") == 0) {
+		executeCommandWithOutputToChannel("mpc listall 2>&1");
+	} else if (strncasecmp(message, "!songs ", 7) == 0) {
+		getSong(args.rest, false);
+	} else if (strcasecmp(message, "!stats") == 0) {
+		executeCommandWithOutputToChannel("mpc stats 2>&1");
+	} else if (strcasecmp(message, "!status") == 0) {
+		executeCommandWithOutputToChannel("mpc 2>&1");
+	} else if (strcasecmp(message, "!stop") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc stop 2>&1");
+		}
+	} else if (strcasecmp(message, "!theme") == 0) {
+		executeCommandWithOutputToChannel("mpc -f \"Theme: %comment%\" current 2>&1");
+	} else if (strncasecmp(message, "!theme ", 7) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			setTheme(args.rest, false);
+		}
+	} else if (strncasecmp(message, "!themefixed ", 12) == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			setTheme(args.rest, true);
+		}
+	} else if (strcasecmp(message, "!themes") == 0) {
+		getTheme(NULL);
+	} else if (strncasecmp(message, "!themes ", 8) == 0) {
+		getTheme(args.rest);
+	} else if (strcasecmp(message, "!trace") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendMessageToChannel(__atomic_load_n(&traceEnabled, __ATOMIC_RELAXED) ? "Tracing: ON! 8)" : "Tracing: OFF! 8)");
+		}
+	} else if (strcasecmp(message, "!trace on") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			traceSetEnabled(true);
+			sendMessageToChannel("Tracing: ON! Use !trace dump when you're done 8)");
+		}
+	} else if (strcasecmp(message, "!trace off") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			traceSetEnabled(false);
+			sendMessageToChannel("Tracing: OFF! 8)");
+		}
+	} else if (strcasecmp(message, "!trace dump") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			traceDump();
+		}
+	} else if (strcasecmp(message, "!unfav") == 0) {
+		delFav(fromUniqueIdentifier);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strcasecmp(message, "!update") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			sendMessageToChannel("Updating database...");
+			executeCommandWithErrorToChannel("mpc update --wait >/dev/null");
+			if (!laneCancelled()) { // Otherwise it was killed half way
+				sendMessageToChannel("Done! 8)");
+			}
+		}
+	} else if (strcasecmp(message, "!version") == 0) {
+		sendMessageToChannel("Archi's Music Bot V2.0");
+		char* mpcVersion[] = { "mpc", "version", NULL };
+		spawnWithOutputToChannel(mpcVersion, false);
+		char* pulseaudioVersion[] = { "pulseaudio", "--version", NULL };
+		spawnWithOutputToChannel(pulseaudioVersion, false);
+	} else if (strcasecmp(message, "!vol-") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc volume -10 2>&1");
+		}
+	} else if (strcasecmp(message, "!vol+") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			executeCommandWithOutputToChannel("mpc volume +10 2>&1");
+		}
+	} else if (strcasecmp(message, "!zipfavs") == 0) {
+		zipFav(fromUniqueIdentifier);
+		refreshFavSymlink(fromName, fromUniqueIdentifier);
+	} else if (strncasecmp(message, "!zipfavs ", 9) == 0) {
+		zipFav(args.rest);
+	} else if (strcasecmp(message, "!wypierdol") == 0) {
+		if (isAccessGranted(fromID, rootGroup)) {
+			delSong();
+		}
+	} else {
+		sendErrorToChannel("Unknown command! :-(");
 	}
-	toPokeID = -1;
-	return NULL;
-}*/
+}
 
 /*********************************** Required functions ************************************/
 /*
@@ -1638,6 +9995,20 @@ int ts3plugin_init() {
 		if (stat(favPath, &st) == -1) {
 			mkdir(favPath, 0700);
 		}
+
+		// Library from the last time, good enough until warm-up checks it with MPD
+		snprintf(libraryFile, sizeof(libraryFile), "%s%s", botPath, "library.bin");
+		libraryPublish(librarySnapshotLoad());
+
+		snprintf(metricsFile, sizeof(metricsFile), "%s%s", botPath, "metrics.prom");
+		snprintf(traceFile, sizeof(traceFile), "%s%s", botPath, "trace.json");
+		lifecycleStart();
+		lifecycleWatchdogStart();
+		metricsStart();
+		loopStart();
+		lanesStart();
+		notifyStart();
+		watcherStart();
 	} else {
 		sendErrorToChannel("FATAL ERROR: botPath too long, this is undefined behaviour and shouldn't happen!");
 		return 1;
@@ -1647,6 +10018,23 @@ int ts3plugin_init() {
 }
 
 void ts3plugin_shutdown() {
+	// Everybody is told at once, so they finish in parallel, then nothing of ours runs anymore
+	if (unlikely(!lifecycleStop())) {
+		logErrorToConsole("Not everything stopped in time, leaving caches alone");
+		return;
+	}
+	loopStop();
+	lanesStop();
+	notifyStop();
+	watcherStop();
+	warmupStop();
+	metricsStop();
+	metricsDump(); // With everything until the very end
+	cachesFree();
+	traceFree();
+	metricsFree();
+	arenasFree();
+
 	/* Free pluginID if we registered it */
 	/*if (pluginID) {
 		free(pluginID);
@@ -1681,53 +10069,65 @@ int ts3plugin_requestAutoload() {
 
 /* Clientlib */
 
-void ts3plugin_onConnectStatusChangeEvent(uint64 serverConnectionHandlerID, int newStatus, unsigned int errorNumber) {
-	if (newStatus == STATUS_CONNECTION_ESTABLISHED) {
-		// Set our serverConnectionHandlerID
-		myServerConnectionHandlerID = serverConnectionHandlerID;
+static void loopRunConnected(struct loopTask* task) {
+	const uint64 serverConnectionHandlerID = task->serverConnectionHandlerID;
+	// Set our serverConnectionHandlerID
+	__atomic_store_n(&myServerConnectionHandlerID, serverConnectionHandlerID, __ATOMIC_RELAXED); // Lanes read it too
 
-		// Set our ID
-		if (unlikely(ts3Functions.getClientID(serverConnectionHandlerID, &myID) != ERROR_ok)) {
-			sendErrorToChannel("getClientID() error");
-			return;
-		}
+	// Set our ID
+	if (unlikely(ts3Functions.getClientID(serverConnectionHandlerID, &myID) != ERROR_ok)) {
+		sendErrorToChannel("getClientID() error");
+		return;
+	}
 
-		// Set our current channel
-		uint64 toID;
-		if (unlikely(ts3Functions.getChannelOfClient(serverConnectionHandlerID, myID, &toID) != ERROR_ok)) {
-			sendErrorToChannel("getChannelOfClient() error");
-			return;
-		}
-		myChannelID = toID;
+	// Set our current channel
+	uint64 toID;
+	if (unlikely(ts3Functions.getChannelOfClient(serverConnectionHandlerID, myID, &toID) != ERROR_ok)) {
+		sendErrorToChannel("getChannelOfClient() error");
+		return;
+	}
+	myChannelID = toID;
 
-		// Say hello
-		sendMessageToChannel("Hello! 8)");
+	// Say hello
+	sendMessageToChannel("Hello! 8)");
 
-		// Try to set channel commander for self
-		if (unlikely(ts3Functions.setClientSelfVariableAsInt(serverConnectionHandlerID, CLIENT_IS_CHANNEL_COMMANDER, 1) != ERROR_ok)) {
-			sendErrorToChannel("setClientSelfVariableAsInt() error");
-			return;
-		}
-		if (unlikely(ts3Functions.flushClientSelfUpdates(serverConnectionHandlerID, NULL) != ERROR_ok)) {
-			sendErrorToChannel("flushClientSelfUpdates() error");
-			return;
-		}
+	// Try to set channel commander for self
+	if (unlikely(ts3Functions.setClientSelfVariableAsInt(serverConnectionHandlerID, CLIENT_IS_CHANNEL_COMMANDER, 1) != ERROR_ok)) {
+		sendErrorToChannel("setClientSelfVariableAsInt() error");
+		return;
+	}
+	if (unlikely(ts3Functions.flushClientSelfUpdates(serverConnectionHandlerID, NULL) != ERROR_ok)) {
+		sendErrorToChannel("flushClientSelfUpdates() error");
+		return;
+	}
 
-		// Check if we need to correct nickname
-		char* currentNickname;
-		if (unlikely(ts3Functions.getClientSelfVariableAsString(serverConnectionHandlerID, CLIENT_NICKNAME, &currentNickname) != ERROR_ok)) {
-			sendErrorToChannel("getClientSelfVariableAsString() error");
-			return;
-		} else {
-			if (strcmp(botNickname, currentNickname) == 0) {
-				requiresNickCorrection = false;
-			}
-			ts3Functions.freeMemory(currentNickname);
+	// Check if we need to correct nickname
+	char* currentNickname;
+	if (unlikely(ts3Functions.getClientSelfVariableAsString(serverConnectionHandlerID, CLIENT_NICKNAME, &currentNickname) != ERROR_ok)) {
+		sendErrorToChannel("getClientSelfVariableAsString() error");
+		return;
+	} else {
+		if (strcmp(botNickname, currentNickname) == 0) {
+			requiresNickCorrection = false;
 		}
+		ts3Functions.freeMemory(currentNickname);
+	}
+
+	// Check if we belong to rootGroup
+	if (!clientBelongsToServerGroup(myID, rootGroup)) {
+		sendErrorToChannel("WARNING: Bot does not belong to the rootGroup!");
+	}
+
+	// Fill caches in the background, commands take the slow path until then
+	warmupStart();
+}
 
-		// Check if we belong to rootGroup
-		if (!clientBelongsToServerGroup(myID, rootGroup)) {
-			sendErrorToChannel("WARNING: Bot does not belong to the rootGroup!");
+void ts3plugin_onConnectStatusChangeEvent(uint64 serverConnectionHandlerID, int newStatus, unsigned int errorNumber) {
+	if (newStatus == STATUS_CONNECTION_ESTABLISHED) {
+		struct loopTask* task = loopTaskNew(&loopRunConnected, NULL, NULL, NULL);
+		if (likely(task != NULL)) {
+			task->serverConnectionHandlerID = serverConnectionHandlerID;
+			loopPost(task);
 		}
 	}
 }
@@ -1759,7 +10159,8 @@ void ts3plugin_onConnectStatusChangeEvent(uint64 serverConnectionHandlerID, int
 //void ts3plugin_onClientMoveSubscriptionEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility) {
 //}
 
-void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, const char* timeoutMessage) {
+static void loopRunMoveTimeout(struct loopTask* task) {
+	const uint64 serverConnectionHandlerID = task->serverConnectionHandlerID;
 	if (unlikely(requiresNickCorrection)) {
 		if (unlikely(ts3Functions.setClientSelfVariableAsString(serverConnectionHandlerID, CLIENT_NICKNAME, botNickname) != ERROR_ok)) {
 			sendErrorToChannel("setClientSelfVariableAsString() error");
@@ -1773,6 +10174,14 @@ void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID, anyID
 	}
 }
 
+void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, const char* timeoutMessage) {
+	struct loopTask* task = loopTaskNew(&loopRunMoveTimeout, NULL, NULL, NULL);
+	if (likely(task != NULL)) {
+		task->serverConnectionHandlerID = serverConnectionHandlerID;
+		loopPost(task);
+	}
+}
+
 //void ts3plugin_onClientMoveMovedEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, anyID moverID, const char* moverName, const char* moverUniqueIdentifier, const char* moveMessage) {
 //}
 
@@ -1801,6 +10210,83 @@ void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID, anyID
 //void ts3plugin_onServerStopEvent(uint64 serverConnectionHandlerID, const char* shutdownMessage) {
 //}
 
+// Keep sorted, looked up with bsearch(), these only flip loop's own state or tell lanes something, so they run on it
+static const char* loopCommands[] = {
+	"!cancel", "!shh"
+};
+// Same, commands in neither of the lists below go to the query lane
+static const char* laneControlCommands[] = {
+	"!clear", "!consume", "!next", "!notify", "!pause", "!play", "!poke", "!prev", "!random", "!repeat", "!shuffle",
+	"!single", "!stop", "!trace", "!vol+", "!vol-", "unknown"
+};
+static const char* laneBulkCommands[] = {
+	"!addartists", "!addfiles", "!addsongs", "!addtheme", "!addtree", "!playfavs", "!playtheme", "!pokespam", "!reset",
+	"!theme", "!themefixed", "!update", "!wypierdol", "!zipfavs"
+};
+
+static commandLane laneOfCommand(const unsigned int command, const char* message) {
+	const char* name = metricsCommandNames[command];
+	if (bsearch(name, laneControlCommands, sizeof(laneControlCommands) / sizeof(laneControlCommands[0]), sizeof(const char*), metricsCompareCommand) != NULL) {
+		return LANE_CONTROL;
+	}
+	if (strcasecmp(message, "!theme") == 0) { // Only tells which one it is
+		return LANE_QUERY;
+	}
+	if (bsearch(name, laneBulkCommands, sizeof(laneBulkCommands) / sizeof(laneBulkCommands[0]), sizeof(const char*), metricsCompareCommand) != NULL) {
+		return LANE_BULK;
+	}
+	return LANE_QUERY;
+}
+
+// Latency counts from the moment TS3 gave us the message, time spent in queues included
+static void commandRun(struct loopTask* task) {
+	const unsigned int command = metricsCommandIndex(task->text[2]);
+	TRACE_SPAN("command", metricsCommandNames[command]);
+	const struct arenaMark mark = arenaMark();
+	deadlineStart(laneCurrent == &lanes[LANE_BULK] ? bulkCommandTimeout : commandTimeout);
+	handleCommand(task->clientID, task->text[0], task->text[1], task->text[2]);
+	deadlineEnd();
+	arenaRewind(mark);
+	metricsRecordCommand(command, metricsNow() - task->postedAt);
+}
+
+static void laneRunCommand(struct loopTask* job) {
+	if (!lifecycleIsStopping()) {
+		commandRun(job);
+	}
+	metricsGaugeAdd(METRIC_COMMANDS_IN_FLIGHT, -1);
+}
+
+static void loopRunCommand(struct loopTask* task) {
+	bool handedOff = false;
+	if (task->clientID != myID && !lifecycleIsStopping()) { // Don't reply when source is own client, nor when we're going away
+		const unsigned int command = metricsCommandIndex(task->text[2]);
+		if (silence && strcasecmp(task->text[2], "!shh") != 0) {
+			sendMessageToChannel("( ͡° ͜ʖ ͡°)");
+		} else if (bsearch(metricsCommandNames[command], loopCommands, sizeof(loopCommands) / sizeof(loopCommands[0]), sizeof(const char*), metricsCompareCommand) != NULL) {
+			commandRun(task);
+		} else {
+			struct loopTask* job = loopTaskNew(&laneRunCommand, task->text[0], task->text[1], task->text[2]);
+			if (unlikely(job == NULL)) {
+				sendErrorToChannel(strerror(errno));
+				sendErrorToChannel("calloc() error");
+			} else {
+				job->clientID = task->clientID;
+				job->postedAt = task->postedAt;
+				job->rootGranted = clientBelongsToServerGroup(task->clientID, rootGroup);
+				handedOff = lanePost(laneOfCommand(command, task->text[2]), job);
+				if (unlikely(!handedOff)) {
+					metricsCount(METRIC_JOBS_REJECTED);
+					sendMessageToChannel("Too much to do, try again later! :-(");
+				}
+			}
+		}
+	}
+	if (!handedOff) {
+		metricsGaugeAdd(METRIC_COMMANDS_IN_FLIGHT, -1);
+	}
+}
+
 int ts3plugin_onTextMessageEvent(uint64 serverConnectionHandlerID, anyID targetMode, anyID toID, anyID fromID, const char* fromName, const char* fromUniqueIdentifier, const char* message, int ffIgnored) {
 	if (ffIgnored) {
 		return 1; /* Client will ignore the message anyways, so return value here doesn't matter */
@@ -1812,370 +10298,13 @@ int ts3plugin_onTextMessageEvent(uint64 serverConnectionHandlerID, anyID targetM
 		}
 		return 1;
 	} else if (targetMode == TextMessageTarget_CHANNEL) {
-		if (fromID != myID) {  /* Don't reply when source is own client */
-			if (strstr(message, "!") == message) { // If message starts with specific char
-				if (strcasecmp(message, "!shh") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						silence = !silence;
-						sendMessageToChannel("( ͡° ͜ʖ ͡°)");
-					}
-				} else if (silence) {
-					sendMessageToChannel("( ͡° ͜ʖ ͡°)");
-				} else if (strncasecmp(message, "!addartist ", 11) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addArtist(messageSubstring, true);
-					}
-				} else if (strncasecmp(message, "!addartists ", 12) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addArtist(messageSubstring, false);
-					}
-				} else if (strncasecmp(message, "!addfile ", 9) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addFile(messageSubstring, true);
-					}
-				} else if (strncasecmp(message, "!addfiles ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addFile(messageSubstring, false);
-					}
-				} else if (strncasecmp(message, "!addsong ", 9) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addSong(messageSubstring, true);
-					}
-				} else if (strncasecmp(message, "!addsongs ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addSong(messageSubstring, false);
-					}
-				} else if (strncasecmp(message, "!addtheme ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						addTheme(messageSubstring);
-					}
-				} else if (strncasecmp(message, "!artist ", 8) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getArtist(messageSubstring, true);
-				} else if (strcasecmp(message, "!artists") == 0) {
-					executeCommandWithOutputToChannel("mpc ls 2>&1");
-				} else if (strncasecmp(message, "!artists ", 9) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getArtist(messageSubstring, false);
-				} else if (strcasecmp(message, "!clear") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc clear 2>&1");
-					}
-				} else if (strcasecmp(message, "!consume") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc consume 2>&1");
-					}
-#ifdef ARCHI_DEBUG
-				} else if (strcasecmp(message, "!debug") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						sendErrorToChannel("Pompf");
-					}
-				} else if (strncasecmp(message, "!debug ", 7) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, 1);
-						sendErrorToChannel(messageSubstring);
-					}
-#endif
-				} else if (strcasecmp(message, "!fav") == 0) {
-					addFav(fromUniqueIdentifier, true);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strcasecmp(message, "!fav?") == 0) {
-					addFav(fromUniqueIdentifier, false);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strcasecmp(message, "!favs") == 0) {
-					getFav(fromUniqueIdentifier);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strncasecmp(message, "!favs ", 6) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getFav(messageSubstring);
-				} else if (strcasecmp(message, "!file") == 0) {
-					executeCommandWithOutputToChannel("mpc -f %file% current 2>&1");
-				} else if (strncasecmp(message, "!file ", 6) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getFile(messageSubstring, true);
-				} else if (strcasecmp(message, "!files") == 0) {
-					executeCommandWithOutputToChannel("mpc -f %file% listall 2>&1");
-				} else if (strncasecmp(message, "!files ", 7) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getFile(messageSubstring, false);
-				} else if (strcasecmp(message, "!fixfavs") == 0) {
-					fixFavs(fromUniqueIdentifier);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strncasecmp(message, "!guess ", 7) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					guessSong(messageSubstring);
-				} else if (strcasecmp(message, "!lastfav") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						playFav(fromUniqueIdentifier, LAST, false);
-						refreshFavSymlink(fromName, fromUniqueIdentifier);
-					}
-				} else if (strncasecmp(message, "!lastfav ", 9) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playFav(messageSubstring, LAST, false);
-					}
-				} else if (strcasecmp(message, "!next") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc next 2>&1");
-					}
-				} else if (strcasecmp(message, "!nextfav") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						playFav(fromUniqueIdentifier, RANDOM, true);
-						refreshFavSymlink(fromName, fromUniqueIdentifier);
-					}
-				} else if (strncasecmp(message, "!nextfav ", 9) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playFav(messageSubstring, RANDOM, true);
-					}
-				} else if (strcasecmp(message, "!notify") == 0) {
-					if (notifyIsWorking) {
-						notifyIsWorking = false;
-						sendMessageToChannel("Notifier: OFF! Silence is golden! 8)");
-					} else {
-						notifyIsWorking = true;
-						if (!notifyWorkerIsRunning()) {
-							if (unlikely(pthread_create(&notifyThread, NULL, &notifyWorker, (void*) NULL))) {
-								sendErrorToChannel("pthread_create() error");
-								return 1;
-							} else {
-								pthread_detach(notifyThread);
-							}
-						}
-						sendMessageToChannel("Notifier: ON! Title of every song will be displayed! 8)");
-					}
-				} else if (strcasecmp(message, "!pause") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc toggle 2>&1");
-					}
-				} else if (strcasecmp(message, "!play") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc play 2>&1");
-					}
-				} else if (strncasecmp(message, "!play ", 6) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playNum(messageSubstring);
-					}
-				} else if (strcasecmp(message, "!playfavs") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						playFav(fromUniqueIdentifier, ALL, false);
-					}
-				} else if (strncasecmp(message, "!playfavs ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playFav(messageSubstring, ALL, false);
-					}
-				} else if (strncasecmp(message, "!playfile ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playFile(messageSubstring);
-					}
-				} else if (strncasecmp(message, "!playsong ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playSong(messageSubstring);
-					}
-				} else if (strncasecmp(message, "!playtheme ", 11) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playTheme(messageSubstring);
-					}
-				} else if (strncasecmp(message, "!poke ", 6) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char toPoke[strlen(message) + 1];
-						getArg(toPoke, message, 1);
-						char pokeMessage[strlen(message) + 1];
-						getArg(pokeMessage, message, -2);
-						pokeUser(toPoke, pokeMessage, 1);
-					}
-/*				} else if (strcasecmp(message, "!pokespam") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						if (pokeIsWorking) {
-							pokeIsWorking = false;
-							sendMessageToChannel("Stopped spamming! 8)");
-						}
-					}*/
-				} else if (strncasecmp(message, "!pokespam ", 10) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char toPoke[strlen(message) + 1];
-						getArg(toPoke, message, 1);
-						char pokeMessage[strlen(message) + 1];
-						getArg(pokeMessage, message, -2);
-						pokeUser(toPoke, pokeMessage, 5000);
-/*						char toPoke[strlen(message) + 1];
-						getArg(toPoke, message, 1);
-						char pokeMessage[strlen(message) + 1];
-						getArg(pokeMessage, message, -2);
-						if (pokeIsWorking) {
-							pokeIsWorking = false;
-							sendMessageToChannel("Stopped spamming! 8)");
-						} else if (!pokeWorkerIsRunning()) {
-							pokeIsWorking = true;
-							toPokeID = getClientIDfromClientName(toPoke);
-							if (unlikely(pthread_create(&pokeThread, NULL, &pokeWorker, (void*) NULL))) {
-								sendErrorToChannel("pthread_create() error");
-								return 1;
-							} else {
-								pthread_detach(pokeThread);
-								sendMessageToChannel("Started spamming! 8)");
-							}
-						} else {
-							sendMessageToChannel("Wait a moment! 8)");
-						}*/
-					}
-				} else if (strcasecmp(message, "!prev") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc prev 2>&1");
-					}
-				} else if (strcasecmp(message, "!random") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc random 2>&1");
-					}
-				} else if (strcasecmp(message, "!randomfav") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						playFav(fromUniqueIdentifier, RANDOM, false);
-						refreshFavSymlink(fromName, fromUniqueIdentifier);
-					}
-				} else if (strncasecmp(message, "!randomfav ", 11) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						playFav(messageSubstring, RANDOM, false);
-					}
-				} else if (strncasecmp(message, "!rankfav ", 9) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					rankFav(fromUniqueIdentifier, messageSubstring);
-				} else if (strcasecmp(message, "!repeat") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc repeat 2>&1");
-					}
-				} else if (strcasecmp(message, "!reset") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						resetPlaylist();
-					}
-				} else if (strcasecmp(message, "!restart") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						sendErrorToChannel("Empty placeholder! :-("); // TODO
-					}
-				} else if (strncasecmp(message, "!say ", 5) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						sendMessageToChannel(messageSubstring);
-					}
-				} else if (strcasecmp(message, "!shuffle") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc shuffle 2>&1");
-					}
-				} else if (strcasecmp(message, "!single") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc single 2>&1");
-					}
-				} else if (strcasecmp(message, "!song") == 0) {
-					executeCommandWithOutputToChannel("mpc -f \"Artist: %artist%\nAlbum: %album%\nTitle: %title%\nTheme: %comment%\nLength: %time%\" current 2>&1");
-				} else if (strncasecmp(message, "!song ", 6) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getSong(messageSubstring, true);
-				} else if (strcasecmp(message, "!songs") == 0) {
-					executeCommandWithOutputToChannel("mpc listall 2>&1");
-				} else if (strncasecmp(message, "!songs ", 7) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getSong(messageSubstring, false);
-				} else if (strcasecmp(message, "!stats") == 0) {
-					executeCommandWithOutputToChannel("mpc stats 2>&1");
-				} else if (strcasecmp(message, "!status") == 0) {
-					executeCommandWithOutputToChannel("mpc 2>&1");
-				} else if (strcasecmp(message, "!stop") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc stop 2>&1");
-					}
-				} else if (strcasecmp(message, "!theme") == 0) {
-					executeCommandWithOutputToChannel("mpc -f \"Theme: %comment%\" current 2>&1");
-				} else if (strncasecmp(message, "!theme ", 7) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						setTheme(messageSubstring, false);
-					}
-				} else if (strncasecmp(message, "!themefixed ", 12) == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						char messageSubstring[strlen(message) + 1];
-						getArg(messageSubstring, message, -1);
-						setTheme(messageSubstring, true);
-					}
-				} else if (strcasecmp(message, "!themes") == 0) {
-					getTheme(NULL);
-				} else if (strncasecmp(message, "!themes ", 8) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					getTheme(messageSubstring);
-				} else if (strcasecmp(message, "!unfav") == 0) {
-					delFav(fromUniqueIdentifier);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strcasecmp(message, "!update") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						sendMessageToChannel("Updating database...");
-						executeCommandWithErrorToChannel("mpc update --wait >/dev/null");
-						sendMessageToChannel("Done! 8)");
-					}
-				} else if (strcasecmp(message, "!version") == 0) {
-					sendMessageToChannel("Archi's Music Bot V2.0");
-					executeCommandWithOutputToChannel("mpc version 2>&1");
-					executeCommandWithOutputToChannel("pulseaudio --version 2>&1");
-				} else if (strcasecmp(message, "!vol-") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc volume -10 2>&1");
-					}
-				} else if (strcasecmp(message, "!vol+") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						executeCommandWithOutputToChannel("mpc volume +10 2>&1");
-					}
-				} else if (strcasecmp(message, "!zipfavs") == 0) {
-					zipFav(fromUniqueIdentifier);
-					refreshFavSymlink(fromName, fromUniqueIdentifier);
-				} else if (strncasecmp(message, "!zipfavs ", 9) == 0) {
-					char messageSubstring[strlen(message) + 1];
-					getArg(messageSubstring, message, -1);
-					zipFav(messageSubstring);
-				} else if (strcasecmp(message, "!wypierdol") == 0) {
-					if (isAccessGranted(fromID, rootGroup)) {
-						delSong();
-					}
-				} else {
-					sendErrorToChannel("Unknown command! :-(");
-				}
+		if (strstr(message, "!") == message) { // If message starts with specific char
+			struct loopTask* task = loopTaskNew(&loopRunCommand, fromName, fromUniqueIdentifier, message);
+			if (likely(task != NULL)) {
+				task->clientID = fromID;
+				task->urgent = true;
+				metricsGaugeAdd(METRIC_COMMANDS_IN_FLIGHT, 1);
+				loopPost(task);
 			}
 		}
 	}
@@ -2240,15 +10369,24 @@ int ts3plugin_onTextMessageEvent(uint64 serverConnectionHandlerID, anyID targetM
 //void ts3plugin_onClientBanFromServerEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, anyID kickerID, const char* kickerName, const char* kickerUniqueIdentifier, uint64 time, const char* kickMessage) {
 //}
 
+static void loopRunPoked(struct loopTask* task) {
+	if (task->clientID != myID) {
+		if (ts3Functions.requestClientPoke(task->serverConnectionHandlerID, task->clientID, "Don't poke me Senpai! :-(", NULL) != ERROR_ok) {
+			sendErrorToChannel("requestClientPoke() error");
+		}
+	}
+}
+
 int ts3plugin_onClientPokeEvent(uint64 serverConnectionHandlerID, anyID fromClientID, const char* pokerName, const char* pokerUniqueIdentity, const char* message, int ffIgnored) {
 	if (ffIgnored) {
 		return 1;
 	}
 
-	if (fromClientID != myID) {
-		if (ts3Functions.requestClientPoke(serverConnectionHandlerID, fromClientID, "Don't poke me Senpai! :-(", NULL) != ERROR_ok) {
-			sendErrorToChannel("requestClientPoke() error");
-		}
+	struct loopTask* task = loopTaskNew(&loopRunPoked, NULL, NULL, NULL);
+	if (likely(task != NULL)) {
+		task->serverConnectionHandlerID = serverConnectionHandlerID;
+		task->clientID = fromClientID;
+		loopPost(task);
 	}
 
 	return 1;
@@ -2404,11 +10542,29 @@ int ts3plugin_onClientPokeEvent(uint64 serverConnectionHandlerID, anyID fromClie
 //void ts3plugin_onMenuItemEvent(uint64 serverConnectionHandlerID, enum PluginMenuType type, int menuItemID, uint64 selectedItemID) {
 //}
 
-/* Called when client custom nickname changed */
-void ts3plugin_onClientDisplayNameChanged(uint64 serverConnectionHandlerID, anyID clientID, const char* displayName, const char* uniqueClientIdentifier) {
+static void loopRunDisplayNameChanged(struct loopTask* task) {
+	const anyID clientID = task->clientID;
+	const char* displayName = task->text[0];
 	if (unlikely(requiresNickCorrection && clientID == myID)) {
 		if (likely(strcmp(botNickname, displayName) == 0)) {
 			requiresNickCorrection = false;
 		}
 	}
+	pthread_mutex_lock(&clientsMutex);
+	for (unsigned int i = 0; i < clientsCacheCount; ++i) {
+		if (clientsCache[i].id == clientID) {
+			_strcpy(clientsCache[i].nickname, sizeof(clientsCache[i].nickname), displayName);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clientsMutex);
+}
+
+/* Called when client custom nickname changed */
+void ts3plugin_onClientDisplayNameChanged(uint64 serverConnectionHandlerID, anyID clientID, const char* displayName, const char* uniqueClientIdentifier) {
+	struct loopTask* task = loopTaskNew(&loopRunDisplayNameChanged, displayName, NULL, NULL);
+	if (likely(task != NULL)) {
+		task->clientID = clientID;
+		loopPost(task);
+	}
 }
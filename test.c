@@ -0,0 +1,856 @@
+/*
+    _                _      _  _____  ____   __  __  ____        _____
+   / \    _ __  ___ | |__  (_)|_   _|/ ___| |  \/  || __ )   ___|_   _|
+  / _ \  | '__|/ __|| '_ \ | |  | |  \___ \ | |\/| ||  _ \  / _ \ | |
+ / ___ \ | |  | (__ | | | || |  | |   ___) || |  | || |_) || (_) || |
+/_/   \_\|_|   \___||_| |_||_|  |_|  |____/ |_|  |_||____/  \___/ |_|
+
+Copyright 2015 Łukasz "JustArchi" Domeradzki
+Contact: JustArchi@JustArchi.net
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+ * Regression tests for ArchiTSMBot, built by test.sh
+ *
+ * plugin.c is included rather than linked, so its static functions can be called directly. Search keys, regexes,
+ * field queries and edit distance are checked on fixed fixtures, library snapshot and queue planning against mock
+ * MPD daemon (mpdmock.c) started on a socket inside a sandbox, with the plugin brought up the same way as in bench.c.
+ * Mock's library is deterministic, so whatever is picked from it is the same on every run.
+ *
+ * Usage: ./architsmbot_test [-m architsmbot_mpdmock] [-t tracks] [-v]
+ * Every failed check is printed, exit status is 1 if there was any.
+ */
+
+#include "plugin.c"
+
+#include <ftw.h>
+
+#define TEST_SERVER_CONNECTION_HANDLER_ID 1
+#define TEST_CHANNEL_ID 1
+#define TEST_BOT_ID 1
+#define TEST_USER_ID 2
+#define TEST_ROOT_GROUP "90521" // Must match rootGroup in plugin.c
+
+#define TEST_WARMUP_TIMEOUT 60 // Seconds to wait for plugin's cache warm-up
+#define TEST_MAX_MESSAGES 256 // Last ones sent to the channel, for checks
+#define TEST_MAX_QUEUE 256
+#define TEST_POOL 40 // Files transitions pick from
+#define TEST_TRANSITIONS 200
+
+/*********************************** Checks ************************************/
+
+static unsigned int testsRun = 0;
+static unsigned int testsFailed = 0;
+static bool testVerbose = false;
+
+#define CHECK(condition, ...) testCheck((condition), __LINE__, #condition, __VA_ARGS__)
+
+static bool testCheck(const bool passed, const unsigned int line, const char* condition, const char* format, ...) {
+	++testsRun;
+	if (!passed) {
+		++testsFailed;
+		fprintf(stderr, "FAILED at test.c:%u: %s\n  ", line, condition);
+		va_list args;
+		va_start(args, format);
+		vfprintf(stderr, format, args);
+		va_end(args);
+		fputc('\n', stderr);
+	}
+	return passed;
+}
+
+/*********************************** Stub TS3Functions ************************************/
+
+static char testPluginPath[PATH_MAX];
+static bool testWarmedUp = false;
+static pthread_mutex_t testMessagesMutex = PTHREAD_MUTEX_INITIALIZER;
+static char* testMessages[TEST_MAX_MESSAGES];
+static unsigned int testMessagesCount = 0;
+
+static unsigned int stubFreeMemory(void* pointer) {
+	free(pointer);
+	return ERROR_ok;
+}
+
+static unsigned int stubLogMessage(const char* logMessage, enum LogLevel severity, const char* channel, uint64 logID) {
+	if (testVerbose) {
+		fprintf(stderr, "  log: %s\n", logMessage);
+	}
+	if (strncmp(logMessage, "Warm-up done", 12) == 0) {
+		__atomic_store_n(&testWarmedUp, true, __ATOMIC_RELEASE);
+	}
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientID(uint64 serverConnectionHandlerID, anyID* result) {
+	*result = TEST_BOT_ID;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetChannelOfClient(uint64 serverConnectionHandlerID, anyID clientID, uint64* result) {
+	*result = TEST_CHANNEL_ID;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientList(uint64 serverConnectionHandlerID, anyID** result) {
+	anyID* clients = (anyID*) malloc(3 * sizeof(anyID));
+	if (!clients) {
+		return ERROR_undefined;
+	}
+	clients[0] = TEST_BOT_ID;
+	clients[1] = TEST_USER_ID;
+	clients[2] = 0;
+	*result = clients;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientVariableAsString(uint64 serverConnectionHandlerID, anyID clientID, size_t flag, char** result) {
+	if (flag == CLIENT_SERVERGROUPS) {
+		*result = strdup(TEST_ROOT_GROUP);
+	} else if (flag == CLIENT_NICKNAME) {
+		*result = strdup(clientID == TEST_BOT_ID ? "ArchiTSMBot" : "TestUser");
+	} else if (flag == CLIENT_UNIQUE_IDENTIFIER) {
+		*result = strdup(clientID == TEST_BOT_ID ? "" : "TestUserUniqueIdentifier000=");
+	} else {
+		*result = strdup("");
+	}
+	return *result ? ERROR_ok : ERROR_undefined;
+}
+
+static unsigned int stubGetClientVariableAsInt(uint64 serverConnectionHandlerID, anyID clientID, size_t flag, int* result) {
+	*result = 0;
+	return ERROR_ok;
+}
+
+static unsigned int stubGetClientSelfVariableAsString(uint64 serverConnectionHandlerID, size_t flag, char** result) {
+	return stubGetClientVariableAsString(serverConnectionHandlerID, TEST_BOT_ID, flag, result);
+}
+
+static unsigned int stubSetClientSelfVariableAsInt(uint64 serverConnectionHandlerID, size_t flag, int value) {
+	return ERROR_ok;
+}
+
+static unsigned int stubSetClientSelfVariableAsString(uint64 serverConnectionHandlerID, size_t flag, const char* value) {
+	return ERROR_ok;
+}
+
+static unsigned int stubFlushClientSelfUpdates(uint64 serverConnectionHandlerID, const char* returnCode) {
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestClientPoke(uint64 serverConnectionHandlerID, anyID clientID, const char* message, const char* returnCode) {
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestSendChannelTextMsg(uint64 serverConnectionHandlerID, const char* message, uint64 targetChannelID, const char* returnCode) {
+	if (testVerbose) {
+		fprintf(stderr, "  channel: %s\n", message);
+	}
+	pthread_mutex_lock(&testMessagesMutex);
+	if (testMessagesCount == TEST_MAX_MESSAGES) {
+		free(testMessages[0]);
+		memmove(testMessages, testMessages + 1, (TEST_MAX_MESSAGES - 1) * sizeof(char*));
+		--testMessagesCount;
+	}
+	testMessages[testMessagesCount] = strdup(message);
+	testMessagesCount += testMessages[testMessagesCount] != NULL;
+	pthread_mutex_unlock(&testMessagesMutex);
+	return ERROR_ok;
+}
+
+static unsigned int stubRequestSendPrivateTextMsg(uint64 serverConnectionHandlerID, const char* message, anyID targetClientID, const char* returnCode) {
+	return stubRequestSendChannelTextMsg(serverConnectionHandlerID, message, 0, returnCode);
+}
+
+static void stubGetPluginPath(char* path, size_t maxLen) {
+	snprintf(path, maxLen, "%s", testPluginPath);
+}
+
+static struct TS3Functions stubFunctions(void) {
+	struct TS3Functions funcs;
+	memset(&funcs, 0, sizeof(funcs));
+	funcs.freeMemory = stubFreeMemory;
+	funcs.logMessage = stubLogMessage;
+	funcs.getClientID = stubGetClientID;
+	funcs.getChannelOfClient = stubGetChannelOfClient;
+	funcs.getClientList = stubGetClientList;
+	funcs.getClientVariableAsString = stubGetClientVariableAsString;
+	funcs.getClientVariableAsInt = stubGetClientVariableAsInt;
+	funcs.getClientSelfVariableAsString = stubGetClientSelfVariableAsString;
+	funcs.setClientSelfVariableAsInt = stubSetClientSelfVariableAsInt;
+	funcs.setClientSelfVariableAsString = stubSetClientSelfVariableAsString;
+	funcs.flushClientSelfUpdates = stubFlushClientSelfUpdates;
+	funcs.requestClientPoke = stubRequestClientPoke;
+	funcs.requestSendChannelTextMsg = stubRequestSendChannelTextMsg;
+	funcs.requestSendPrivateTextMsg = stubRequestSendPrivateTextMsg;
+	funcs.getPluginPath = stubGetPluginPath;
+	return funcs;
+}
+
+// Messages sent so far go away, loop gets to send whatever it still has first
+static void testMessagesClear(void) {
+	loopDrain();
+	pthread_mutex_lock(&testMessagesMutex);
+	for (unsigned int i = 0; i < testMessagesCount; ++i) {
+		free(testMessages[i]);
+	}
+	testMessagesCount = 0;
+	pthread_mutex_unlock(&testMessagesMutex);
+}
+
+// How many messages sent since testMessagesClear() contain text
+static unsigned int testMessagesWith(const char* text) {
+	loopDrain();
+	unsigned int count = 0;
+	pthread_mutex_lock(&testMessagesMutex);
+	for (unsigned int i = 0; i < testMessagesCount; ++i) {
+		count += strstr(testMessages[i], text) != NULL;
+	}
+	pthread_mutex_unlock(&testMessagesMutex);
+	return count;
+}
+
+/*********************************** Search keys ************************************/
+
+static void testSearchKeys(void) {
+	static const struct {
+		const char* input;
+		const char* key;
+	} cases[] = {
+		{ "Kor", "kor" },
+		{ "ŁÓDŹ", "lodz" },
+		{ "Zażółć Gęślą Jaźń", "zazolc gesla jazn" },
+		{ "Straße", "strasse" },
+		{ "STRASSE", "strasse" },
+		{ "Ærøskøbing", "aeroskobing" },
+		{ "Œuvre", "oeuvre" },
+		{ "İstanbul", "istanbul" },
+		{ "ΆΛΦΑ", "αλφα" },
+		{ "ΟΔΥΣΣΕΥΣ", "οδυσσευσ" },
+		{ "οδυσσευς", "οδυσσευσ" },
+		{ "ЁЛКА Йод", "елка иод" },
+		{ "Ђорђе", "ђорђе" },
+		{ "Cafe\xcc\x81", "cafe" }, // Decomposed é, as on files coming from Macs
+		{ "Bad \xff byte", "bad \xff byte" }, // Not UTF-8, stays as it is
+		{ "Cut \xc5", "cut \xc5" },
+		{ "", "" },
+	};
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		char key[SEARCH_KEY_SIZE(strlen(cases[i].input))];
+		const size_t length = searchKey(key, cases[i].input);
+		CHECK(length == strlen(key) && strcmp(key, cases[i].key) == 0, "searchKey(\"%s\") is \"%s\", expected \"%s\"", cases[i].input, key, cases[i].key);
+	}
+}
+
+/*********************************** Regexes ************************************/
+
+// Through searchQuery, same as every command does it, so the literal prefilter and keys are part of it
+static void testRegexes(void) {
+	static const struct {
+		const char* pattern;
+		const char* text;
+		bool matches;
+	} cases[] = {
+		{ "/^kor/i", "KORN - Blind", true },
+		{ "/^kor/", "KORN - Blind", false },
+		{ "/^KOR/", "KORN - Blind", true },
+		{ "/b(l|r)ind$/i", "Korn - BLIND", true },
+		{ "/b(l|r)ind$/i", "Korn - Blinded", false },
+		{ "/^a{2,3}b/", "aab", true },
+		{ "/^a{2,3}b/", "aaab", true },
+		{ "/^a{2,3}b/", "ab", false },
+		{ "/^a{2,3}b/", "aaaab", false },
+		{ "/^a{2}$/", "aa", true },
+		{ "/^a{2,}$/", "aaaaaa", true },
+		{ "/^(ab)+c?$/", "ababab", true },
+		{ "/^(ab)+c?$/", "ababa", false },
+		{ "/\\d{4}/", "1997 - Album", true },
+		{ "/\\d{4}/", "97 - Album", false },
+		{ "/\\s-\\s/", "Kor - Title", true },
+		{ "/\\w+\\.mp3$/", "Kor/Album/01 - Title.mp3", true },
+		{ "/[ąę]/", "Zażółć gęślą", true },
+		{ "/[ąę]/", "Zazolc gesla", false },
+		{ "/[^a-z ]/", "only lowercase", false },
+		{ "/[^a-z ]/", "not Only", true },
+		{ "/łódź/i", "ŁÓDŹ Kaliska", true },
+		{ "/lodz/i", "Łódź", true },
+		{ "/ŁÓDŹ/", "Łódź", false },
+		{ "/^.{3}$/", "żół", true },
+		{ "/^.{3}$/", "żółw", false },
+		{ "/a.c/", "a€c", true },
+		{ "/straße/i", "STRASSE", true },
+		{ "/x|y/", "abc", false },
+		{ "/\\//", "Kor/Title", true },
+		{ "/^$/", "", true },
+	};
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct searchQuery query;
+		if (!CHECK(searchQueryInit(&query, cases[i].pattern) && query.regex != NULL, "%s doesn't compile", cases[i].pattern)) {
+			continue;
+		}
+		const bool matched = searchQueryMatch(&query, cases[i].text, strlen(cases[i].text), NULL, 0);
+		CHECK(matched == cases[i].matches, "%s %s \"%s\"", cases[i].pattern, matched ? "matches" : "doesn't match", cases[i].text);
+		searchQueryFree(&query);
+	}
+
+	static const char* invalid[] = { "/(/", "/a)/", "/[a/", "/a{2,1}/", "/a{1000}/", "/*a/", "/a\\/", NULL };
+	for (unsigned int i = 0; invalid[i]; ++i) {
+		struct searchQuery query;
+		testMessagesClear();
+		const bool compiled = searchQueryInit(&query, invalid[i]);
+		CHECK(!compiled && testMessagesWith("Invalid regex: ") == 1, "%s is accepted", invalid[i]);
+		if (compiled) {
+			searchQueryFree(&query);
+		}
+	}
+
+	// Every substring search is a plain one, even if there are slashes in it
+	struct searchQuery query;
+	if (CHECK(searchQueryInit(&query, "AC/DC") && query.regex == NULL, "AC/DC is taken for a regex")) {
+		CHECK(searchQueryMatch(&query, "Ac/Dc - Thunderstruck", 21, NULL, 0), "%s", "AC/DC doesn't find itself");
+		searchQueryFree(&query);
+	}
+}
+
+/*
+ * Lazy DFA on a pattern whose DFA has way more states than REGEX_MAX_DFA_STATES, so it's flushed many times over,
+ * against the obvious answer: 12th byte from the end has to be 'a'.
+ */
+static void testRegexFlush(void) {
+	const char* error = NULL;
+	struct regex* regex = regexNew("/a[ab]{11}$/", &error);
+	if (!CHECK(regex != NULL, "doesn't compile: %s", error ? error : "")) {
+		return;
+	}
+	uint64_t state = 0x2545f4914f6cdd1dULL;
+	unsigned int wrong = 0;
+	for (unsigned int i = 0; i < 2000; ++i) {
+		char text[64];
+		const size_t length = 12 + i % 50;
+		for (size_t j = 0; j < length; ++j) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			text[j] = state & 1 ? 'a' : 'b';
+		}
+		wrong += regexMatch(regex, text, length) != (text[length - 12] == 'a');
+	}
+	CHECK(wrong == 0, "%u of 2000 texts matched wrong", wrong);
+	regexFree(regex);
+}
+
+/*********************************** Field queries ************************************/
+
+static void testQueries(void) {
+	// Lines as mpc prints them with SEARCH_PLAN_FORMAT: file, artist, album, title, theme
+	static const char* lines[] = {
+		"Kor/1997 - Łódź/01 - Live in Łódź.mp3\tKor\t1997 - Łódź\tLive in Łódź\tchill",
+		"Kor/1999 - Metal/02 - Night River.mp3\tKor\t1999 - Metal\tNight River\t",
+		"Various/Hits/03 - Kor Cover.mp3\tVarious\tHits\tKor Cover\tparty",
+		"Untagged Artist/04 - Storm.mp3\t\t\t\t",
+	};
+	static const struct {
+		const char* query;
+		bool fielded;
+		const char* matches; // One character per line, '1' if it has to match
+	} cases[] = {
+		{ "kor", false, "1110" },
+		{ "kor/1997", false, "1000" },
+		{ "Live in", false, "1000" }, // Plain search, spaces and all
+		{ "artist:kor", true, "1100" },
+		{ "artist:KOR title:river", true, "0100" },
+		{ "artist:kor -title:live", true, "0100" },
+		{ "-artist:kor", true, "0011" },
+		{ "theme:chill", true, "1000" },
+		{ "title:\"night river\"", true, "0100" },
+		{ "title:\"river night\"", true, "0000" },
+		{ "album:lodz", true, "1000" },
+		{ "artist:untagged", true, "0001" },
+		{ "title:/^(night|kor) /i", true, "0110" },
+		{ "title:/ riv/i artist:kor", true, "0100" },
+		{ "kor -live", true, "0110" },
+		{ "path:/^kor\\//i -album:metal", true, "1000" },
+	};
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct searchPlan plan;
+		if (!CHECK(searchPlanInit(&plan, cases[i].query), "\"%s\" isn't accepted", cases[i].query)) {
+			continue;
+		}
+		CHECK(plan.fielded == cases[i].fielded, "\"%s\" is %sfielded", cases[i].query, plan.fielded ? "" : "not ");
+		for (unsigned int j = 0; j < sizeof(lines) / sizeof(lines[0]); ++j) {
+			const bool matched = searchPlanMatchLine(&plan, lines[j]);
+			CHECK(matched == (cases[i].matches[j] == '1'), "\"%s\" %s line %u", cases[i].query, matched ? "matches" : "doesn't match", j);
+		}
+		searchPlanFree(&plan);
+	}
+
+	struct searchPlan plan;
+	testMessagesClear();
+	CHECK(!searchPlanInit(&plan, "a:1 -b -c -d -e -f -g -h -i -j -k -l -m -n -o -p -q") && testMessagesWith("Too many search terms!") == 1, "%s", "17 terms are accepted");
+	if (CHECK(searchPlanInit(&plan, "a b c d e f g h i j k l m n o p q"), "%s", "17 plain words aren't accepted")) {
+		CHECK(!plan.fielded && plan.count == 1, "%s", "17 plain words aren't one plain search");
+		searchPlanFree(&plan);
+	}
+	testMessagesClear();
+	CHECK(!searchPlanInit(&plan, "artist:/(/"), "%s", "invalid regex in a term is accepted");
+}
+
+/*********************************** Fuzzy search ************************************/
+
+static unsigned int testDistance(const char* pattern, const char* text) {
+	uint64_t peq[256];
+	const unsigned int length = searchPatternInit(peq, pattern);
+	return searchDistance(peq, length, text, strlen(text));
+}
+
+static void testFuzzyDistance(void) {
+	static const struct {
+		const char* pattern;
+		const char* text;
+		unsigned int distance;
+	} cases[] = {
+		{ "abc", "xxabcxx", 0 },
+		{ "abd", "xxabcxx", 1 }, // Substitution
+		{ "abc", "xxacxx", 1 }, // Deletion
+		{ "abc", "xxabxcxx", 1 }, // Insertion
+		{ "abcd", "xxbadcxx", 2 }, // Transpositions are two edits
+		{ "kitten", "sitting", 2 }, // Best substring is "sittin"
+		{ "metallica", "the metalica collection", 1 },
+		{ "abc", "", 3 },
+		{ "0123456789012345678901234567890123456789012345678901234567890123", "0123456789012345678901234567890123456789012345678901234567890123", 0 }, // 64 bytes
+		{ "0123456789012345678901234567890123456789012345678901234567890123", "x123456789012345678901234567890123456789012345678901234567890123", 1 },
+	};
+	for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		const unsigned int distance = testDistance(cases[i].pattern, cases[i].text);
+		CHECK(distance == cases[i].distance, "\"%s\" in \"%s\" is %u edits away, expected %u", cases[i].pattern, cases[i].text, distance, cases[i].distance);
+	}
+	CHECK(searchClose("Metallica - Master of Puppets", "metalica"), "%s", "metalica isn't close to Metallica");
+	CHECK(searchClose("ŁÓDŹ Kaliska", "lodz kalisak"), "%s", "lodz kalisak isn't close to ŁÓDŹ Kaliska");
+	CHECK(!searchClose("Metallica", "mxt"), "%s", "short key is forgiven a typo");
+	CHECK(!searchClose("Megadeth", "metallica"), "%s", "metallica is close to Megadeth");
+}
+
+// Title of a song from the library with a typo has to find that song again, through the trigram index and without it
+static void testFuzzyLibrary(struct library* library) {
+	for (uint32_t pick = 1; pick < library->count; pick += library->count / 7 + 1) {
+		const char* fileKey = libraryString(library, library->records[pick].fileKey);
+		const char* title = strrchr(fileKey, '/') != NULL ? strrchr(fileKey, '/') + 1 : fileKey;
+		char key[48];
+		snprintf(key, sizeof(key), "%s", title);
+		const size_t length = strlen(key);
+		if (length < 8) {
+			continue;
+		}
+		char original[sizeof(key)];
+		memcpy(original, key, length + 1);
+		key[length / 2] = key[length / 2] == 'q' ? 'x' : 'q';
+		struct searchIndex* index = library->index;
+		for (unsigned int indexed = 0; indexed < 2; ++indexed) {
+			library->index = indexed ? index : NULL;
+			struct searchFuzzyResult matches[SEARCH_FUZZY_RESULTS];
+			const unsigned int count = libraryFuzzy(library, key, false, matches, SEARCH_FUZZY_RESULTS);
+			bool found = false;
+			for (unsigned int i = 0; i < count; ++i) {
+				found |= strstr(libraryString(library, library->records[matches[i].record].fileKey), original) != NULL;
+			}
+			CHECK(count > 0 && matches[0].distance <= 1 && found, "\"%s\" doesn't find \"%s\"%s", key, original, indexed ? " with index" : " without index");
+		}
+		library->index = index;
+	}
+}
+
+/*********************************** Library snapshot ************************************/
+
+static bool testReadFile(const char* path, char** data, size_t* size) {
+	FILE* stream = fopen(path, "r");
+	if (!stream) {
+		return false;
+	}
+	fseek(stream, 0, SEEK_END);
+	*size = ftell(stream);
+	fseek(stream, 0, SEEK_SET);
+	*data = (char*) malloc(*size + 1);
+	const bool read = *data != NULL && fread(*data, 1, *size, stream) == *size;
+	fclose(stream);
+	return read;
+}
+
+static bool testWriteFile(const char* path, const char* data, const size_t size) {
+	FILE* stream = fopen(path, "w");
+	if (!stream) {
+		return false;
+	}
+	const bool written = fwrite(data, 1, size, stream) == size;
+	return fclose(stream) == 0 && written;
+}
+
+// Whether snapshot made of data is taken, it must be the same library as expected if it is
+static bool testSnapshotLoads(const char* data, const size_t size, const struct library* expected) {
+	if (!testWriteFile(libraryFile, data, size)) {
+		return false;
+	}
+	struct library* loaded = librarySnapshotLoad();
+	if (loaded == NULL) {
+		return false;
+	}
+	bool same = loaded->count == expected->count && loaded->directoriesCount == expected->directoriesCount;
+	for (uint32_t i = 0; same && i < loaded->count; ++i) {
+		same = strcmp(libraryString(loaded, loaded->records[i].file), libraryString(expected, expected->records[i].file)) == 0
+			&& strcmp(libraryString(loaded, loaded->records[i].fileKey), libraryString(expected, expected->records[i].fileKey)) == 0;
+	}
+	CHECK(same, "%s", "snapshot loads as some other library");
+	libraryRelease(loaded);
+	return true;
+}
+
+static void testSnapshot(struct library* library) {
+	librarySave(library);
+	char* data = NULL;
+	size_t size = 0;
+	if (!CHECK(testReadFile(libraryFile, &data, &size) && size >= sizeof(struct librarySnapshotHeader), "%s isn't there", libraryFile)) {
+		free(data);
+		return;
+	}
+	CHECK(testSnapshotLoads(data, size, library), "%s", "snapshot that was just saved isn't taken");
+	const struct librarySnapshotHeader header = *(const struct librarySnapshotHeader*) data;
+	CHECK(header.indexBuckets == SEARCH_INDEX_BUCKETS, "%s", "snapshot is saved without search index");
+
+	char* corrupted = (char*) malloc(size + 1);
+	if (!corrupted) {
+		free(data);
+		return;
+	}
+	struct librarySnapshotHeader* corruptedHeader = (struct librarySnapshotHeader*) corrupted;
+	struct libraryRecord* records = (struct libraryRecord*) (corrupted + header.recordsOffset);
+	struct libraryDirectory* directories = (struct libraryDirectory*) (corrupted + header.directoriesOffset);
+	uint32_t* offsets = (uint32_t*) (corrupted + header.offsetsOffset);
+	uint32_t* postings = (uint32_t*) (corrupted + header.postingsOffset);
+	const char* names[] = { "magic", "version", "record size", "count", "truncated by a byte", "one byte too many",
+		"file outside strings", "key outside strings", "directory outside strings", "strings not NUL-terminated",
+		"posting past records", "bucket list going back", "last offset not postings count", "only a header", NULL };
+	for (unsigned int damage = 0; names[damage]; ++damage) {
+		memcpy(corrupted, data, size);
+		size_t corruptedSize = size;
+		switch (damage) {
+			case 0: corruptedHeader->magic[0] ^= 1; break;
+			case 1: ++corruptedHeader->version; break;
+			case 2: ++corruptedHeader->recordSize; break;
+			case 3: ++corruptedHeader->count; break;
+			case 4: --corruptedSize; break;
+			case 5: corrupted[corruptedSize++] = '\0'; break;
+			case 6: records[header.count / 2].file = header.stringsSize; break;
+			case 7: records[header.count - 1].fileKey = UINT32_MAX; break;
+			case 8: directories[header.directoriesCount - 1].path = header.stringsSize + 7; break;
+			case 9: corrupted[size - 1] = 'x'; break;
+			case 10: postings[header.postingsCount / 2] = header.count; break;
+			case 11: offsets[SEARCH_INDEX_BUCKETS / 2] = offsets[SEARCH_INDEX_BUCKETS / 2 + 1] + 1; break;
+			case 12: --offsets[SEARCH_INDEX_BUCKETS]; break;
+			case 13: corruptedSize = sizeof(struct librarySnapshotHeader); break;
+		}
+		CHECK(!testSnapshotLoads(corrupted, corruptedSize, library), "snapshot with %s damaged is taken", names[damage]);
+	}
+	CHECK(testSnapshotLoads(data, size, library), "%s", "snapshot isn't taken once it's fine again");
+	free(corrupted);
+	free(data);
+}
+
+/*********************************** Queue planning ************************************/
+
+struct testQueue {
+	char* files[TEST_MAX_QUEUE];
+	uint32_t ids[TEST_MAX_QUEUE];
+	uint32_t count;
+	long current;
+	uint32_t currentId;
+	bool playing;
+};
+
+static void testQueueFree(struct testQueue* queue) {
+	for (uint32_t i = 0; i < queue->count; ++i) {
+		free(queue->files[i]);
+	}
+	queue->count = 0;
+}
+
+// Runs command on its own connection, pairs it answers with go to queue (if it's not NULL), false on any error
+static bool testMpd(const char* command, struct testQueue* queue) {
+	struct mpdConnection connection;
+	if (!mpdConnect(&connection)) {
+		return false;
+	}
+	if (queue != NULL) {
+		memset(queue, 0, sizeof(*queue));
+		queue->current = -1;
+	}
+	bool sent = mpdSend(&connection, command);
+	char* key;
+	char* value;
+	int ret = -1;
+	while (sent && (ret = mpdReadPair(&connection, &key, &value)) == 1) {
+		if (queue == NULL) {
+			continue;
+		}
+		if (strcmp(key, "file") == 0 && queue->count < TEST_MAX_QUEUE) {
+			queue->files[queue->count++] = strdup(value);
+		} else if (strcmp(key, "Id") == 0 && queue->count > 0) {
+			queue->ids[queue->count - 1] = strtoul(value, NULL, 10);
+		} else if (strcmp(key, "song") == 0) {
+			queue->current = strtol(value, NULL, 10);
+		} else if (strcmp(key, "songid") == 0) {
+			queue->currentId = strtoul(value, NULL, 10);
+		} else if (strcmp(key, "state") == 0) {
+			queue->playing = strcmp(value, "play") == 0;
+		}
+	}
+	if (ret != 0 && testVerbose) {
+		fprintf(stderr, "  mpd: %s\n", connection.error);
+	}
+	mpdDisconnect(&connection);
+	return ret == 0;
+}
+
+static uint64_t testRandomState = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t testRandom(const uint32_t below) {
+	testRandomState ^= testRandomState << 13;
+	testRandomState ^= testRandomState >> 7;
+	testRandomState ^= testRandomState << 17;
+	return (uint32_t) (testRandomState % below);
+}
+
+/*
+ * Random transitions between queues made of the same few files, with duplicates, with and without the stored
+ * playlist, from every player state. After each one queue must be exactly what was asked for (duplicates once),
+ * and current song must still be there and playing if it.s still wanted, as the same queue entry.
+ */
+static void testPlaylistPlay(struct library* library) {
+	if (!CHECK(library->count >= TEST_POOL, "library has only %u songs", library->count)) {
+		return;
+	}
+	const char* pool[TEST_POOL];
+	for (uint32_t i = 0; i < TEST_POOL; ++i) {
+		pool[i] = libraryString(library, library->records[(uint64_t) i * library->count / TEST_POOL].file);
+	}
+	CHECK(testMpd("clear\n", NULL), "%s", "clear doesn't work");
+	for (unsigned int step = 0; step < TEST_TRANSITIONS; ++step) {
+		struct testQueue before;
+		switch (testRandom(4)) { // Player state it starts from
+			case 0: testMpd("stop\n", NULL); break;
+			case 1: testMpd("pause 1\n", NULL); break;
+			default: {
+				if (!testMpd("status\n", &before) || before.current == -1) {
+					testMpd("play 0\n", NULL);
+				}
+				break;
+			}
+		}
+		if (!CHECK(testMpd("command_list_begin\nstatus\nplaylistinfo\ncommand_list_end\n", &before), "%s", "status doesn't work")) {
+			return;
+		}
+		const char* files[TEST_POOL + 8];
+		uint32_t count = 1 + testRandom(step % 10 == 9 ? TEST_POOL : 12);
+		for (uint32_t i = 0; i < count; ++i) {
+			files[i] = pool[testRandom(TEST_POOL)];
+		}
+		if (testRandom(3) == 0 && before.current != -1 && before.current < (long) before.count) { // Current one is wanted
+			files[testRandom(count)] = libraryString(library, library->records[libraryFindFile(library, before.files[before.current])].file);
+		}
+		const bool named = testRandom(4) == 0;
+		testMessagesClear();
+		CHECK(playlistPlay(files, count, false, named ? "ArchiTSMBot test" : NULL), "%s", "MPD isn't reachable");
+		CHECK(testMessagesWith("[color=red]") == 0, "step %u sent an error", step);
+
+		// What it should be: files without duplicates, in their order, or in stored playlist's order if it was named
+		const char* expected[TEST_POOL + 8];
+		uint32_t expectedCount = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			bool seen = false;
+			for (uint32_t j = 0; j < expectedCount && !seen; ++j) {
+				seen = strcmp(expected[j], files[i]) == 0;
+			}
+			if (!seen) {
+				expected[expectedCount++] = files[i];
+			}
+		}
+		struct testQueue stored = {0};
+		if (named) {
+			if (!CHECK(testMpd("listplaylist \"ArchiTSMBot test\"\n", &stored), "%s", "stored playlist isn't there")) {
+				testQueueFree(&before);
+				return;
+			}
+			bool same = stored.count == expectedCount;
+			for (uint32_t i = 0; same && i < expectedCount; ++i) {
+				bool found = false;
+				for (uint32_t j = 0; j < stored.count && !found; ++j) {
+					found = strcmp(stored.files[j], expected[i]) == 0;
+				}
+				same = found;
+			}
+			CHECK(same, "step %u: stored playlist has %u files instead of the %u wanted", step, stored.count, expectedCount);
+			for (uint32_t i = 0; i < stored.count && i < expectedCount; ++i) {
+				expected[i] = stored.files[i];
+			}
+		}
+
+		struct testQueue after;
+		if (!CHECK(testMpd("command_list_begin\nstatus\nplaylistinfo\ncommand_list_end\n", &after), "%s", "status doesn't work")) {
+			testQueueFree(&stored);
+			testQueueFree(&before);
+			return;
+		}
+		bool same = after.count == expectedCount;
+		for (uint32_t i = 0; same && i < expectedCount; ++i) {
+			same = strcmp(after.files[i], expected[i]) == 0;
+		}
+		if (!CHECK(same, "step %u: queue has %u songs, %u expected", step, after.count, expectedCount) && testVerbose) {
+			for (uint32_t i = 0; i < after.count || i < expectedCount; ++i) {
+				fprintf(stderr, "  %-60s %s\n", i < after.count ? after.files[i] : "", i < expectedCount ? expected[i] : "");
+			}
+		}
+		CHECK(after.playing, "step %u: nothing is playing", step);
+		bool wanted = false;
+		for (uint32_t i = 0; i < expectedCount && before.current != -1; ++i) {
+			wanted |= strcmp(expected[i], before.files[before.current]) == 0;
+		}
+		if (wanted && !named) { // Paused or stopped one is resumed
+			CHECK(after.currentId == before.currentId, "step %u: current song was replaced", step);
+		} else if (!wanted) {
+			CHECK(after.current == 0, "step %u: playing song %ld instead of the first one", step, after.current);
+		}
+		testQueueFree(&after);
+		testQueueFree(&stored);
+		testQueueFree(&before);
+	}
+}
+
+/*********************************** Harness ************************************/
+
+// Starts mock MPD on a unix socket and waits until it accepts connections
+static pid_t startMock(const char* mock, const char* socketPath, const char* tracks) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	memcpy(addr.sun_path, socketPath, strlen(socketPath) + 1);
+	const pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		execl(mock, mock, "-S", socketPath, "-t", tracks, (char*) NULL);
+		perror("execl");
+		_exit(127);
+	}
+	for (unsigned int attempt = 0; attempt < 600; ++attempt) {
+		const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1) {
+			const bool connected = connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+			close(fd);
+			if (connected) {
+				return pid;
+			}
+		}
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			break;
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "Mock MPD did not come up\n");
+	kill(pid, SIGTERM);
+	return -1;
+}
+
+static int removeEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+	return remove(path);
+}
+
+static void usage(const char* self) {
+	fprintf(stderr, "Usage: %s [-m architsmbot_mpdmock] [-t tracks] [-v]\n", self);
+}
+
+int main(int argc, char* argv[]) {
+	const char* mock = "./architsmbot_mpdmock";
+	const char* tracks = "500";
+	int opt;
+	while ((opt = getopt(argc, argv, "m:t:vh")) != -1) {
+		switch (opt) {
+			case 'm':
+				mock = optarg;
+				break;
+			case 't':
+				tracks = optarg;
+				break;
+			case 'v':
+				testVerbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	char sandbox[] = "/tmp/architsmbot-test.XXXXXX";
+	if (!mkdtemp(sandbox)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char socketPath[PATH_MAX];
+	snprintf(socketPath, sizeof(socketPath), "%s/mpd.sock", sandbox);
+	const pid_t mockPid = startMock(mock, socketPath, tracks);
+	if (mockPid == -1) {
+		nftw(sandbox, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+	setenv("MPD_HOST", socketPath, 1);
+	snprintf(testPluginPath, sizeof(testPluginPath), "%s/", sandbox);
+
+	// Bring the plugin up the same way TS3 client does, pure parts don't need it, but messages go through its loop
+	ts3plugin_setFunctionPointers(stubFunctions());
+	if (ts3plugin_init()) {
+		fprintf(stderr, "ts3plugin_init() failed\n");
+		kill(mockPid, SIGTERM);
+		return 1;
+	}
+	ts3plugin_onConnectStatusChangeEvent(TEST_SERVER_CONNECTION_HANDLER_ID, STATUS_CONNECTION_ESTABLISHED, ERROR_ok);
+
+	testSearchKeys();
+	testRegexes();
+	testRegexFlush();
+	testQueries();
+	testFuzzyDistance();
+
+	for (unsigned int i = 0; i < TEST_WARMUP_TIMEOUT * 1000 && !__atomic_load_n(&testWarmedUp, __ATOMIC_ACQUIRE); ++i) {
+		usleep(1000);
+	}
+	struct library* library = libraryAcquire();
+	if (CHECK(library != NULL && library->index != NULL, "%s", "library isn't loaded and indexed after warm-up")) {
+		testFuzzyLibrary(library);
+		testSnapshot(library);
+		testPlaylistPlay(library);
+		libraryRelease(library);
+	}
+
+	testMessagesClear();
+	ts3plugin_shutdown();
+	kill(mockPid, SIGTERM);
+	waitpid(mockPid, NULL, 0);
+	nftw(sandbox, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+	printf("%u checks, %u failed\n", testsRun, testsFailed);
+	return testsFailed != 0;
+}
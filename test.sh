@@ -0,0 +1,24 @@
+#!/bin/bash
+set -eu
+
+# Builds regression tests and mock MPD daemon they run against, then runs them, see test.c for details
+TEST="architsmbot_test"
+MOCK="architsmbot_mpdmock"
+
+CFLAGS=(-O2 -g -std=gnu11 -pedantic -Wall -fno-omit-frame-pointer)
+LDFLAGS=(-Wl,--as-needed)
+SRCFLAGS=(-DLINUX -DPIC -DARCHITSMBOT_BENCH -I${TS3_SDK_INCLUDE:-../include} -pthread)
+LIBS=(-ldl)
+
+TARGET="$(readlink "$0" || true)"
+if [[ -z "$TARGET" ]]; then
+	TARGET="$0"
+fi
+
+cd "$(dirname "$TARGET")"
+
+# plugin.c is included by test.c, not linked
+gcc "${SRCFLAGS[@]}" "${CFLAGS[@]}" "${LDFLAGS[@]}" -o "$TEST" test.c "${LIBS[@]}"
+gcc "${CFLAGS[@]}" "${LDFLAGS[@]}" -o "$MOCK" mpdmock.c
+
+exec "./$TEST" -m "./$MOCK" "$@"